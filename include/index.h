@@ -58,6 +58,9 @@ const char index_html[] PROGMEM = R"rawliteral(
         <input type="submit" id="intervalButton" value="Update Interval">
       </form>
       <div id="intervalStatus" class="status"></div>
+      <div id="batteryLife" class="status"></div>
+      <div id="loraQueue" class="status"></div>
+      <div id="loraClass" class="status"></div>
       <hr>
       <h2>Update Gas Sensor Ro</h2>
       <form id="roForm">
@@ -195,6 +198,9 @@ const char index_html[] PROGMEM = R"rawliteral(
         document.getElementById('newRo').value = data.ro;
         document.getElementById('tempToggle').checked = data.useLiveTemp;
         document.getElementById('newDefaultTemp').value = data.defaultTemp;
+        document.getElementById('batteryLife').textContent = 'Battery life: ' + data.batteryDays + ' days (' + data.avgCurrent + ' mA average)';
+        document.getElementById('loraQueue').textContent = 'LoRa queue: ' + data.queueDepth + ' waiting, ' + data.queueDropped + ' dropped, ' + data.queueExpired + ' expired, ' + data.backlog + ' stored (' + data.backlogLost + ' lost)';
+        document.getElementById('loraClass').textContent = 'LoRa class ' + data.loraClass + ': ' + data.classATime + ' s in class A, ' + data.classCTime + ' s in class C (' + data.classSaved + ' mAh saved)';
         
         // Trigger change event to set initial UI state for temp form
         tempToggle.dispatchEvent(new Event('change'));
@@ -0,0 +1,125 @@
+/*
+  Payload codec of the node
+
+  GENERATED by tools/codec/gen_codec.py from tools/codec/schema.json, do not edit
+*/
+
+#ifndef _PAYLOAD_CODEC_H_
+#define _PAYLOAD_CODEC_H_
+/*One reading of the node. Each field is quantized to min + code * step and packed MSB first; the all-ones code of a numeric field means no value (NaN).
+  field           bits  resolution        range           deadband
+  oxygen            11  0.01   mg/L       0 .. 20.46      0.1
+  gas               13  0.1    ppm        0 .. 500        1
+  temperature       10  0.1    C          -10 .. 60       0.2
+  battery            8  0.5    %          0 .. 127        2
+  enclosureTemp     10  0.1    C          -20 .. 80       0.5
+  enclosureHum       8  0.5    %          0 .. 100        2
+  vusb               1  -                 0/1             any change
+  61 bits in 8 bytes, CayenneLPP: 26 bytes. Frames (time on air at SF7/SF10, 125 kHz):
+  port 11  READING    8 bytes,  56.6/ 370.7 ms   CayenneLPP fields:  26 bytes,  82.2/ 493.6 ms
+  port 9   STORED    12 bytes,  61.7/ 411.6 ms   CayenneLPP fields:  30 bytes,  87.3/ 534.5 ms
+  port 10  BATCH     14 bytes,  66.8/ 411.6 ms   CayenneLPP fields:  32 bytes,  92.4/ 575.5 ms
+  port 12  CHANGES    3 bytes,  51.5/ 329.7 ms   CayenneLPP fields:   4 bytes,  51.5/ 329.7 ms
+*/
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#define PAYLOAD_CODEC_BYTES  8  /*packed fields of one reading*/
+#define PAYLOAD_LPP_BYTES    26  /*the same fields in CayenneLPP*/
+#define PAYLOAD_PORT_READING  11  /*One reading*/
+#define PAYLOAD_PORT_STORED   9  /*A stored reading forwarded late*/
+#define PAYLOAD_PORT_BATCH    10  /*Samples taken every few seconds*/
+#define PAYLOAD_PORT_CHANGES  12  /*The fields past their deadband*/
+#define PAYLOAD_FIELD_OXYGEN         0x01
+#define PAYLOAD_FIELD_GAS            0x02
+#define PAYLOAD_FIELD_TEMPERATURE    0x04
+#define PAYLOAD_FIELD_BATTERY        0x08
+#define PAYLOAD_FIELD_ENCLOSURE_TEMP 0x10
+#define PAYLOAD_FIELD_ENCLOSURE_HUM  0x20
+#define PAYLOAD_FIELD_VUSB           0x40
+#define PAYLOAD_FIELDS_ALL           0x7F
+#define PAYLOAD_FIELD_COUNT          7
+
+/*resolution of the fields, in field order (1 for a bool)*/
+static const float payload_steps[PAYLOAD_FIELD_COUNT] = {0.01f, 0.1f, 0.1f, 0.5f, 0.1f, 0.5f, 1.0f};
+/*default deadbands, in field order (unused for a bool)*/
+static const float payload_deadbands[PAYLOAD_FIELD_COUNT] = {0.1f, 1.0f, 0.2f, 2.0f, 0.5f, 2.0f, 0.0f};
+
+struct payload_fields_t {
+   float oxygen; /*Dissolved oxygen [mg/L]*/
+   float gas; /*TGS2600 gas concentration [ppm]*/
+   float temperature; /*Water temperature [C]*/
+   float battery; /*Battery charge, above 100 while charging [%]*/
+   float enclosureTemp; /*Enclosure temperature [C]*/
+   float enclosureHum; /*Enclosure relative humidity [%]*/
+   bool  vusb; /*USB power present*/
+   };
+
+/*code of a value, all ones if it is NaN*/
+static inline uint32_t payload_quantize(float value, float min, float step, uint32_t max_code, uint8_t bits) {
+    if (isnan(value)) { return ((uint32_t)1 << bits) - 1; }
+    float code = roundf((value - min) / step);
+    if (code < 0) { return 0; }
+    return (code > max_code) ? max_code : (uint32_t)code;
+}
+
+/*writes the bits low bits of value at bit *pos, MSB first*/
+static inline void payload_put_bits(uint8_t* out, uint16_t* pos, uint32_t value, uint8_t bits) {
+    while (bits > 0) {
+        bits--;
+        if ((value >> bits) & 1) { out[*pos / 8] |= 0x80 >> (*pos % 8); }
+        (*pos)++;
+    }
+}
+
+/*packs the fields in mask (PAYLOAD_FIELD_...) in at most PAYLOAD_CODEC_BYTES bytes of out. Returns the bytes used*/
+static inline uint8_t payload_encode_mask(const payload_fields_t* fields, uint8_t mask, uint8_t* out) {
+    uint16_t pos = 0;
+    memset(out, 0, PAYLOAD_CODEC_BYTES);
+    if (mask & PAYLOAD_FIELD_OXYGEN) { payload_put_bits(out, &pos, payload_quantize(fields->oxygen, 0.0f, 0.01f, 2046, 11), 11); }
+    if (mask & PAYLOAD_FIELD_GAS) { payload_put_bits(out, &pos, payload_quantize(fields->gas, 0.0f, 0.1f, 5000, 13), 13); }
+    if (mask & PAYLOAD_FIELD_TEMPERATURE) { payload_put_bits(out, &pos, payload_quantize(fields->temperature, -10.0f, 0.1f, 700, 10), 10); }
+    if (mask & PAYLOAD_FIELD_BATTERY) { payload_put_bits(out, &pos, payload_quantize(fields->battery, 0.0f, 0.5f, 254, 8), 8); }
+    if (mask & PAYLOAD_FIELD_ENCLOSURE_TEMP) { payload_put_bits(out, &pos, payload_quantize(fields->enclosureTemp, -20.0f, 0.1f, 1000, 10), 10); }
+    if (mask & PAYLOAD_FIELD_ENCLOSURE_HUM) { payload_put_bits(out, &pos, payload_quantize(fields->enclosureHum, 0.0f, 0.5f, 200, 8), 8); }
+    if (mask & PAYLOAD_FIELD_VUSB) { payload_put_bits(out, &pos, fields->vusb ? 1 : 0, 1); }
+    return (pos + 7) / 8;
+}
+
+/*packs all the fields in PAYLOAD_CODEC_BYTES bytes of out. Returns PAYLOAD_CODEC_BYTES*/
+static inline uint8_t payload_encode(const payload_fields_t* fields, uint8_t* out) {
+    return payload_encode_mask(fields, PAYLOAD_FIELDS_ALL, out);
+}
+
+/*true if a value moved by its deadband or more from the reference, or one of them is NaN and not the other*/
+static inline bool payload_moved(float value, float reference, float deadband) {
+    if (isnan(value) || isnan(reference)) { return isnan(value) != isnan(reference); }
+    return fabsf(value - reference) >= deadband;
+}
+
+/*mask of the fields of now that moved past their deadband from ref. deadbands in field order, see payload_deadbands*/
+static inline uint8_t payload_changed(const payload_fields_t* now, const payload_fields_t* ref, const float* deadbands) {
+    uint8_t mask = 0;
+    if (payload_moved(now->oxygen, ref->oxygen, deadbands[0])) { mask |= PAYLOAD_FIELD_OXYGEN; }
+    if (payload_moved(now->gas, ref->gas, deadbands[1])) { mask |= PAYLOAD_FIELD_GAS; }
+    if (payload_moved(now->temperature, ref->temperature, deadbands[2])) { mask |= PAYLOAD_FIELD_TEMPERATURE; }
+    if (payload_moved(now->battery, ref->battery, deadbands[3])) { mask |= PAYLOAD_FIELD_BATTERY; }
+    if (payload_moved(now->enclosureTemp, ref->enclosureTemp, deadbands[4])) { mask |= PAYLOAD_FIELD_ENCLOSURE_TEMP; }
+    if (payload_moved(now->enclosureHum, ref->enclosureHum, deadbands[5])) { mask |= PAYLOAD_FIELD_ENCLOSURE_HUM; }
+    if (now->vusb != ref->vusb) { mask |= PAYLOAD_FIELD_VUSB; }
+    return mask;
+}
+
+/*copies the fields in mask from src to dst*/
+static inline void payload_merge(payload_fields_t* dst, const payload_fields_t* src, uint8_t mask) {
+    if (mask & PAYLOAD_FIELD_OXYGEN) { dst->oxygen = src->oxygen; }
+    if (mask & PAYLOAD_FIELD_GAS) { dst->gas = src->gas; }
+    if (mask & PAYLOAD_FIELD_TEMPERATURE) { dst->temperature = src->temperature; }
+    if (mask & PAYLOAD_FIELD_BATTERY) { dst->battery = src->battery; }
+    if (mask & PAYLOAD_FIELD_ENCLOSURE_TEMP) { dst->enclosureTemp = src->enclosureTemp; }
+    if (mask & PAYLOAD_FIELD_ENCLOSURE_HUM) { dst->enclosureHum = src->enclosureHum; }
+    if (mask & PAYLOAD_FIELD_VUSB) { dst->vusb = src->vusb; }
+}
+
+#endif
@@ -0,0 +1,89 @@
+/*
+  Non-blocking round robin acquisition of the ADS1115 channels
+
+  The MIT License (MIT)
+*/
+#include "AdcSweep.h"
+#include <Arduino.h>
+
+AdcSweep::AdcSweep(ADS1115& ads) : ads(ads), ready_pin(-1), channel(0), requested(false), requested_ms(0), sweep_count(0), error_count(0) {
+    for (uint8_t i = 0; i < ADC_SWEEP_CHANNELS; i++) {
+        values[i] = 0;
+        sweep_values[i] = 0;
+    }
+}
+
+void AdcSweep::begin(int ready_pin) {
+    this->ready_pin = ready_pin;
+    ads.setMode(1); /*single shot*/
+    if (ready_pin >= 0) {
+        /*Hi_thresh MSB 1 and Lo_thresh MSB 0: ALERT/RDY goes low at the end of each conversion*/
+        pinMode(ready_pin, INPUT_PULLUP);
+        ads.setComparatorThresholdHigh((int16_t)0x8000);
+        ads.setComparatorThresholdLow(0x0000);
+        ads.setComparatorQueConvert(0);
+    }
+    channel = 0;
+    requested = false;
+    sweep_count = 0;
+    error_count = 0;
+}
+
+void AdcSweep::poll(void) {
+    if (!requested) {
+        request();
+        return;
+    }
+    if (!ready()) {
+        if (millis() - requested_ms >= ADC_SWEEP_TIMEOUT_MS) {
+            error_count++;
+            request(); /*same channel*/
+        }
+        return;
+    }
+    sweep_values[channel] = ads.getValue();
+    if (++channel >= ADC_SWEEP_CHANNELS) {
+        for (uint8_t i = 0; i < ADC_SWEEP_CHANNELS; i++) { values[i] = sweep_values[i]; }
+        channel = 0;
+        sweep_count++;
+    }
+    request();
+}
+
+bool AdcSweep::sweep(void) {
+    uint32_t start_ms = millis();
+    uint32_t done = sweep_count;
+    /*a sweep already started would mix older values in: the next complete one is waited for*/
+    uint32_t target = done + (requested ? 2 : 1);
+    while ((int32_t)(sweep_count - target) < 0) {
+        if (millis() - start_ms >= 2 * ADC_SWEEP_CHANNELS * ADC_SWEEP_TIMEOUT_MS) { return false; }
+        poll();
+        delay(1);
+    }
+    return true;
+}
+
+int16_t AdcSweep::value(uint8_t channel) {
+    return (channel < ADC_SWEEP_CHANNELS) ? values[channel] : 0;
+}
+
+uint32_t AdcSweep::sweeps(void) {
+    return sweep_count;
+}
+
+uint32_t AdcSweep::errors(void) {
+    return error_count;
+}
+
+/*the bus is left alone until the conversion can be over*/
+bool AdcSweep::ready(void) {
+    if (millis() - requested_ms < ADC_SWEEP_CONVERSION_MS) { return false; }
+    if (ready_pin >= 0) { return digitalRead(ready_pin) == LOW; }
+    return !ads.isBusy();
+}
+
+void AdcSweep::request(void) {
+    ads.requestADC(channel);
+    requested = true;
+    requested_ms = millis();
+}
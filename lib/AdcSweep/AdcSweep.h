@@ -0,0 +1,55 @@
+/*
+  Non-blocking round robin acquisition of the ADS1115 channels
+
+  The MIT License (MIT)
+*/
+
+#ifndef _ADC_SWEEP_H_
+#define _ADC_SWEEP_H_
+/*Cycles through the four single-ended inputs with single-shot conversions, without waiting for them:
+   - poll() requests a conversion and returns. A later poll() collects it once it is ready and requests
+     the next channel right away, so the ADC converts while the loop serves the web server and the radio
+   - the end of a conversion is read on the ALERT/RDY pin when it is wired (the comparator is set up as
+     conversion ready), else from the status bit of the config register. Nothing is read from the bus
+     before ADC_SWEEP_CONVERSION_MS
+   - value() returns the last complete sweep, so all the channels come from the same sweep
+  A conversion that never ends (bus error) is requested again after ADC_SWEEP_TIMEOUT_MS and counted*/
+#include <stdint.h>
+#include <ADS1x15.h>
+
+#define ADC_SWEEP_CHANNELS        4
+#define ADC_SWEEP_CONVERSION_MS   7    /*128 SPS, the default data rate, less the oscillator tolerance*/
+#define ADC_SWEEP_TIMEOUT_MS      100
+
+class AdcSweep {
+   public:
+    AdcSweep(ADS1115& ads);
+    /*single-shot mode on the gain already set. ready_pin: ALERT/RDY input, -1 if it is not wired*/
+    void begin(int ready_pin = -1);
+    /*never blocks: collects the conversion if it is ready and requests the next channel. Call it from loop()*/
+    void poll(void);
+    /*runs poll() until a new sweep is complete, for the readings taken before loop() runs.
+      Returns false if it took more than ADC_SWEEP_CHANNELS timeouts*/
+    bool sweep(void);
+    /*raw value of a channel in the last complete sweep, 0 before the first one*/
+    int16_t value(uint8_t channel);
+    /*complete sweeps since begin*/
+    uint32_t sweeps(void);
+    /*conversions requested again after a timeout since begin*/
+    uint32_t errors(void);
+
+   private:
+    bool ready(void);
+    void request(void);
+    ADS1115& ads;
+    int ready_pin;
+    uint8_t channel;          /*channel converting, or asked next*/
+    bool requested;           /*a conversion of channel is running*/
+    uint32_t requested_ms;
+    int16_t values[ADC_SWEEP_CHANNELS];
+    int16_t sweep_values[ADC_SWEEP_CHANNELS]; /*sweep in progress*/
+    uint32_t sweep_count;
+    uint32_t error_count;
+};
+
+#endif
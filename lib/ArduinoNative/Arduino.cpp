@@ -0,0 +1,78 @@
+/*
+  Arduino core subset for the host
+
+  The MIT License (MIT)
+*/
+#include "Arduino.h"
+#include <stdarg.h>
+
+static unsigned long long clock_us = 0;
+static unsigned long random_state = 1;
+
+HardwareSerial Serial(0);
+
+unsigned long millis(void) { return (unsigned long)(clock_us / 1000); }
+unsigned long micros(void) { return (unsigned long)clock_us; }
+void delay(unsigned long ms) { clock_us += (unsigned long long)ms * 1000; }
+void delayMicroseconds(unsigned int us) { clock_us += us; }
+void yield(void) {}
+
+/*the linear congruential generator of the C standard*/
+void randomSeed(unsigned long seed) { random_state = seed; }
+long random(long max) {
+    if (max <= 0) { return 0; }
+    random_state = random_state * 1103515245UL + 12345UL;
+    return (long)((random_state / 65536UL) % 32768UL) % max;
+}
+long random(long min, long max) { return (max > min) ? min + random(max - min) : min; }
+
+void pinMode(uint8_t pin, uint8_t mode) { (void)pin; (void)mode; }
+void digitalWrite(uint8_t pin, uint8_t val) { (void)pin; (void)val; }
+int digitalRead(uint8_t pin) { (void)pin; return LOW; }
+
+size_t Print::write(const uint8_t* buffer, size_t size) {
+    size_t n = 0;
+    while ((n < size) && (write(buffer[n]) == 1)) { n++; }
+    return n;
+}
+
+size_t Print::print(long value, int base) {
+    if (base == 10) {
+        char text[24];
+        snprintf(text, sizeof(text), "%ld", value);
+        return write(text);
+    }
+    return print((unsigned long)value, base);
+}
+
+size_t Print::print(unsigned long value, int base) {
+    char text[8 * sizeof(long) + 1];
+    char* p = &text[sizeof(text) - 1];
+    if ((base < 2) || (base > 16)) { base = 10; }
+    *p = '\0';
+    do {
+        *--p = "0123456789ABCDEF"[value % base];
+        value /= base;
+    } while (value > 0);
+    return write(p);
+}
+
+size_t Print::print(double value, int digits) {
+    char text[48];
+    snprintf(text, sizeof(text), "%.*f", digits, value);
+    return write(text);
+}
+
+size_t Print::printf(const char* format, ...) {
+    char text[256];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    if (len < 0) { return 0; }
+    return write((const uint8_t*)text, ((size_t)len < sizeof(text)) ? (size_t)len : sizeof(text) - 1);
+}
+
+size_t HardwareSerial::write(uint8_t ch) { return (fputc(ch, stdout) == EOF) ? 0 : 1; }
+size_t HardwareSerial::write(const uint8_t* buffer, size_t size) { return fwrite(buffer, 1, size, stdout); }
+void HardwareSerial::flush(void) { fflush(stdout); }
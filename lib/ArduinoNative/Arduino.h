@@ -0,0 +1,117 @@
+/*
+  Arduino core subset for the host
+
+  The MIT License (MIT)
+*/
+
+#ifndef _ARDUINO_NATIVE_H_
+#define _ARDUINO_NATIVE_H_
+/*Only what the libraries under test use: the [env:native] tests build them on the host with this header in
+  place of the Arduino core. The clock is virtual: it starts at 0 and only delay() moves it forward, so a test
+  that waits for a 6 s receive window runs in no time and always sees the same timings. Serial prints to
+  stdout*/
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define PROGMEM
+#define F(string_literal) (string_literal)
+#define RTC_DATA_ATTR
+#define SERIAL_8N1      0x800001c
+#define HIGH            1
+#define LOW             0
+#define INPUT           0x01
+#define OUTPUT          0x03
+#define INPUT_PULLUP    0x05
+#define INPUT_PULLDOWN  0x09
+#ifndef constrain
+  #define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+#endif
+
+#if defined(__GLIBC__) && ((__GLIBC__ < 2) || ((__GLIBC__ == 2) && (__GLIBC_MINOR__ < 38)))
+/*BSD function the ESP32 and newer C libraries have*/
+inline size_t strlcpy(char* dst, const char* src, size_t size) {
+    size_t len = strlen(src);
+    if (size > 0) {
+        size_t n = (len < size - 1) ? len : size - 1;
+        memcpy(dst, src, n);
+        dst[n] = '\0';
+    }
+    return len;
+}
+#endif
+
+/*virtual clock*/
+unsigned long millis(void);
+unsigned long micros(void);
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void yield(void);
+/*pseudo random, same sequence on every run unless seeded*/
+long random(long max);
+long random(long min, long max);
+void randomSeed(unsigned long seed);
+/*pins read LOW and writes are ignored*/
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+
+class Print {
+   public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t ch) = 0;
+    virtual size_t write(const uint8_t* buffer, size_t size);
+    size_t write(const char* str) { return (str == NULL) ? 0 : write((const uint8_t*)str, strlen(str)); }
+    size_t write(const char* buffer, size_t size) { return write((const uint8_t*)buffer, size); }
+    size_t print(const char* str) { return write(str); }
+    size_t print(char ch) { return write((uint8_t)ch); }
+    size_t print(unsigned char value, int base = 10) { return print((unsigned long)value, base); }
+    size_t print(int value, int base = 10) { return print((long)value, base); }
+    size_t print(unsigned int value, int base = 10) { return print((unsigned long)value, base); }
+    size_t print(short value, int base = 10) { return print((long)value, base); }
+    size_t print(unsigned short value, int base = 10) { return print((unsigned long)value, base); }
+    size_t print(long value, int base = 10);
+    size_t print(unsigned long value, int base = 10);
+    size_t print(double value, int digits = 2);
+    size_t println(void) { return write("\r\n"); }
+    template <typename T> size_t println(T value) { return print(value) + println(); }
+    template <typename T> size_t println(T value, int format) { return print(value, format) + println(); }
+    size_t printf(const char* format, ...) __attribute__((format(printf, 2, 3)));
+    virtual void flush(void) {}
+};
+
+class Stream : public Print {
+   public:
+    virtual int available(void) = 0;
+    virtual int read(void) = 0;
+    virtual int peek(void) = 0;
+    void setTimeout(unsigned long timeout_ms) { (void)timeout_ms; }
+};
+
+/*console: writes go to stdout, nothing is ever received*/
+class HardwareSerial : public Stream {
+   public:
+    HardwareSerial(int uart_nr) { (void)uart_nr; }
+    void begin(unsigned long baud, uint32_t config = SERIAL_8N1, int8_t rx_pin = -1, int8_t tx_pin = -1) {
+        (void)baud; (void)config; (void)rx_pin; (void)tx_pin;
+    }
+    void end(void) {}
+    int available(void) { return 0; }
+    int read(void) { return -1; }
+    int peek(void) { return -1; }
+    size_t write(uint8_t ch);
+    size_t write(const uint8_t* buffer, size_t size);
+    using Print::write;
+    void flush(void);
+    operator bool() const { return true; }
+};
+
+extern HardwareSerial Serial;
+
+#endif
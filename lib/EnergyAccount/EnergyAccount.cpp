@@ -0,0 +1,68 @@
+/*
+  Energy accounting of the node
+
+  The MIT License (MIT)
+*/
+#include "EnergyAccount.h"
+
+#define MS_PER_HOUR 3600000.0
+
+EnergyAccount::EnergyAccount(void) {
+    for (uint8_t i = 0; i < ENERGY_STATES; i++) {
+        current_mA[i] = 0;
+        time_ms[i] = 0;
+        on[i] = false;
+    }
+    uptime_ms = 0;
+    last_ms = 0;
+}
+
+void EnergyAccount::setCurrent(_energy_state_t state, float mA) {
+    if (state < ENERGY_STATES) { current_mA[state] = mA; }
+}
+
+void EnergyAccount::setOn(_energy_state_t state, bool value, uint32_t now_ms) {
+    if (state >= ENERGY_STATES) { return; }
+    update(now_ms); /*the time before now belongs to the previous value*/
+    on[state] = value;
+}
+
+void EnergyAccount::update(uint32_t now_ms) {
+    uint32_t elapsed = now_ms - last_ms; /*wrap safe*/
+    last_ms = now_ms;
+    uptime_ms += elapsed;
+    for (uint8_t i = 0; i < ENERGY_STATES; i++) {
+        if (on[i]) { time_ms[i] += elapsed; }
+    }
+}
+
+void EnergyAccount::add(_energy_state_t state, uint32_t ms) {
+    if (state < ENERGY_STATES) { time_ms[state] += ms; }
+}
+
+void EnergyAccount::resume(uint32_t slept_ms) {
+    uptime_ms += slept_ms;
+    for (uint8_t i = 0; i < ENERGY_STATES; i++) {
+        if (on[i]) { time_ms[i] += slept_ms; }
+    }
+    last_ms = 0;
+}
+
+float EnergyAccount::charge_mAh(void) {
+    float charge = 0;
+    for (uint8_t i = 0; i < ENERGY_STATES; i++) {
+        charge += (float)(time_ms[i] / MS_PER_HOUR) * current_mA[i];
+    }
+    return charge;
+}
+
+float EnergyAccount::averageCurrent_mA(void) {
+    if (uptime_ms == 0) { return 0; }
+    return charge_mAh() / (float)(uptime_ms / MS_PER_HOUR);
+}
+
+float EnergyAccount::projectDays(float remaining_mAh) {
+    float average = averageCurrent_mA();
+    if ((average <= 0) || (remaining_mAh <= 0)) { return 0; }
+    return remaining_mAh / average / 24;
+}
@@ -0,0 +1,74 @@
+/*
+  Energy accounting of the node
+
+  The MIT License (MIT)
+*/
+
+#ifndef _ENERGY_ACCOUNT_H_
+#define _ENERGY_ACCOUNT_H_
+/*Integrates the time the node spends in each state and the current drawn in it:
+    charge [mAh] = sum(time in state [h] * current of state [mA])
+  Two kinds of states:
+   - continuous (ESP32 active, WiFi AP, LoRa class C listening, LoRa sleep): switched with setOn,
+     their time grows with update(now_ms)
+   - bursts (LoRa TX and RX windows): the measured time is added with add(state, ms)
+  The battery life is the remaining charge divided by the average current since it started,
+  deep sleep included when it is kept across it.
+  The account is trivially copyable, so it can be kept in RTC memory across a deep sleep: the continuous
+  states left on before it (ESP32 sleep, LoRa sleep) are counted for the sleep by resume(slept_ms).
+  The continuous LoRa states also run during the bursts: that overlap is counted twice, a few
+  mA during the time on air, so the projection errs on the short side*/
+#include <stdint.h>
+
+/*Currents in mA. The LoRa-E5 values come from LoRa-E5.h (measured), the ESP32-C3 ones from its datasheet*/
+#define ENERGY_ESP32_ACTIVE_mA   23.0  /*ESP32-C3 at 160 MHz, radio off*/
+#define ENERGY_WIFI_AP_mA        82.0  /*the radio listens all the time in AP mode (802.11 RX current)*/
+#define ENERGY_ESP32_SLEEP_mA    0.005 /*ESP32-C3 deep sleep, RTC timer running*/
+
+enum _energy_state_t {
+    ENERGY_LORA_TX = 0,   /*burst: time on air*/
+    ENERGY_LORA_RX,       /*burst: receive windows after an uplink*/
+    ENERGY_LORA_IDLE_RX,  /*continuous: class C listening*/
+    ENERGY_LORA_SLEEP,    /*continuous: class A between uplinks*/
+    ENERGY_ESP32_ACTIVE,  /*continuous*/
+    ENERGY_WIFI_AP,       /*continuous*/
+    ENERGY_ESP32_SLEEP,   /*continuous: deep sleep, counted by resume*/
+    ENERGY_STATES         /*number of states. DO NOT REMOVE*/
+};
+
+class EnergyAccount {
+   public:
+    EnergyAccount(void);
+    /*sets the current drawn in a state. The TX current changes with the power*/
+    void setCurrent(_energy_state_t state, float mA);
+    /*switches a continuous state on or off at now_ms*/
+    void setOn(_energy_state_t state, bool on, uint32_t now_ms);
+    /*adds the time of the continuous states that are on up to now_ms*/
+    void update(uint32_t now_ms);
+    /*adds ms spent in a state*/
+    void add(_energy_state_t state, uint32_t ms);
+    /*back from a deep sleep of slept_ms: adds it to the continuous states that are on, and restarts
+      the time base at 0, the millis() of the boot*/
+    void resume(uint32_t slept_ms);
+    /*charge used since the account started, in mAh*/
+    float charge_mAh(void);
+    /*average current since the account started, in mA. 0 before the first update*/
+    float averageCurrent_mA(void);
+    /**
+     *  \brief Projects the battery life at the average current
+     *
+     *  \param [in] remaining_mAh: charge left in the battery
+     *
+     *  \return Return days left, 0 if unknown
+     */
+    float projectDays(float remaining_mAh);
+
+   private:
+    float current_mA[ENERGY_STATES];
+    uint64_t time_ms[ENERGY_STATES];
+    bool on[ENERGY_STATES];
+    uint64_t uptime_ms;  /*time integrated by update*/
+    uint32_t last_ms;
+};
+
+#endif
@@ -0,0 +1,81 @@
+/*
+  LoRa-E5 time on air
+
+  The MIT License (MIT)
+  See LoRa-E5.h for the full license text.
+*/
+
+#ifndef _LORA_E5_AIRTIME_H_
+#define _LORA_E5_AIRTIME_H_
+/*Time on air of a LoRa packet, Semtech formula (SX1272/76 datasheet, AN1200.13):
+    Tsym      = 2^SF / BW
+    Tpreamble = (n_preamble + 4.25) * Tsym
+    n_payload = 8 + max(ceil((8*PL - 4*SF + 28 + 16*CRC - 20*IH) / (4*(SF - 2*DE))) * (CR + 4), 0)
+    ToA       = Tpreamble + n_payload * Tsym
+  with DE (low data rate optimization) on when Tsym >= 16 ms, as LoRaWAN does for SF11 and SF12 at 125 kHz.
+  The values are integer microseconds and exact: Tsym is a multiple of 4 us for SF7..SF12 at 125/250/500 kHz.
+  Everything is constexpr, so airtimes of fixed combinations are computed by the compiler:
+    static_assert(lorawan_airtime_us(10,SF7,BW125)==61696,"");
+  SF is the spreading factor (7..12), BW the bandwidth in kHz: _spreading_factor_t and _band_width_t
+  can be passed as they are. CR is the coding rate 4/(4+CR), 1..4*/
+#include <stdint.h>
+
+#define LORA_CR_4_5              1   /*coding rate used by LoRaWAN*/
+#define LORA_PREAMBLE_SYMBOLS    8   /*LoRaWAN preamble length*/
+#define LORAWAN_OVERHEAD_BYTES   13  /*MHDR(1) + FHDR without FOpts(7) + FPort(1) + MIC(4)*/
+#define LORA_FSK_BW_KHZ          50  /*BW50kbps: the FSK data rate of the EU-like band plans*/
+
+/*symbol time in us*/
+constexpr uint32_t lora_symbol_us(unsigned int sf, unsigned int bw_khz){
+    return ((uint32_t)1<<sf)*1000UL/bw_khz;
+}
+/*low data rate optimization, mandated when the symbol lasts 16 ms or more*/
+constexpr bool lora_low_dr_optimize(unsigned int sf, unsigned int bw_khz){
+    return lora_symbol_us(sf,bw_khz)>=16000UL;
+}
+/*ceil(num/den) of the payload formula, 0 when num is negative*/
+constexpr uint32_t lora_ceil_div(long num, long den){
+    return (num>0)? (uint32_t)((num+den-1)/den) : 0;
+}
+/*symbols after the preamble: header, payload and CRC*/
+constexpr uint32_t lora_payload_symbols(unsigned int length, unsigned int sf, unsigned int bw_khz,
+                                        unsigned int cr=LORA_CR_4_5, bool crc=true, bool implicit_header=false){
+    return 8+lora_ceil_div(8L*length-4L*sf+28+(crc? 16:0)-(implicit_header? 20:0),
+                           4L*(sf-(lora_low_dr_optimize(sf,bw_khz)? 2:0)))*(cr+4);
+}
+/*time on air in us of a LoRa packet carrying length bytes (PHY payload)*/
+constexpr uint32_t lora_airtime_us(unsigned int length, unsigned int sf, unsigned int bw_khz,
+                                   unsigned int cr=LORA_CR_4_5, unsigned int preamble=LORA_PREAMBLE_SYMBOLS,
+                                   bool crc=true, bool implicit_header=false){
+    return (4*preamble+17)*lora_symbol_us(sf,bw_khz)/4
+           +lora_payload_symbols(length,sf,bw_khz,cr,crc,implicit_header)*lora_symbol_us(sf,bw_khz);
+}
+/*time on air in us of a 50 kbps FSK packet: preamble(5) + sync word(3) + length(1) + payload + CRC(2), 20 us per bit*/
+constexpr uint32_t fsk_airtime_us(unsigned int length){
+    return (5+3+1+length+2)*8UL*20UL;
+}
+/*time on air in us of a LoRaWAN uplink carrying app_length bytes of application payload*/
+constexpr uint32_t lorawan_airtime_us(unsigned int app_length, unsigned int sf, unsigned int bw_khz){
+    return (bw_khz==LORA_FSK_BW_KHZ)? fsk_airtime_us(app_length+LORAWAN_OVERHEAD_BYTES)
+                                    : lora_airtime_us(app_length+LORAWAN_OVERHEAD_BYTES,sf,bw_khz);
+}
+/*useful bit rate in bps: (SF - 2*DE) bits per symbol * 4/(4+CR)*/
+constexpr uint32_t lora_bitrate_bps(unsigned int sf, unsigned int bw_khz, unsigned int cr=LORA_CR_4_5){
+    return (bw_khz==LORA_FSK_BW_KHZ)? 50000UL
+           : (uint32_t)(sf-(lora_low_dr_optimize(sf,bw_khz)? 2:0))*bw_khz*1000UL*4/(((uint32_t)1<<sf)*(4+cr));
+}
+
+/*published airtimes (LoRaWAN, CR 4/5, 8 symbols of preamble, explicit header, CRC on) checked at compile time.
+  Source: Semtech LoRa calculator / The Things Network airtime calculator, 10 bytes of application payload*/
+static_assert(lorawan_airtime_us(10,7,125)==61696,   "SF7/125: 61.7 ms");
+static_assert(lorawan_airtime_us(10,8,125)==113152,  "SF8/125: 113.2 ms");
+static_assert(lorawan_airtime_us(10,9,125)==205824,  "SF9/125: 205.8 ms");
+static_assert(lorawan_airtime_us(10,10,125)==370688, "SF10/125: 370.7 ms");
+static_assert(lorawan_airtime_us(10,11,125)==823296, "SF11/125: 823.3 ms");
+static_assert(lorawan_airtime_us(10,12,125)==1482752,"SF12/125: 1482.8 ms");
+static_assert(lorawan_airtime_us(10,7,250)==30848,   "SF7/250: 30.8 ms");
+static_assert(lorawan_airtime_us(0,12,125)==1155072, "SF12/125 empty frame: 1155.1 ms");
+static_assert(lorawan_airtime_us(0,7,125)==46336,    "SF7/125 empty frame: 46.3 ms");
+static_assert(lora_bitrate_bps(11,125)==439 && lora_bitrate_bps(7,125)==5468, "bit rates of the LoRaWAN tables: 440, 5470");
+
+#endif
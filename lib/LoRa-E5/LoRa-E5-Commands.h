@@ -0,0 +1,141 @@
+/*
+  LoRa-E5 AT command table
+
+  The MIT License (MIT)
+  See LoRa-E5.h for the full license text.
+*/
+
+#ifndef _LORA_E5_COMMANDS_H_
+#define _LORA_E5_COMMANDS_H_
+/*Fixed parts of the AT commands and of their expected responses. constexpr arrays go to .rodata,
+  which the ESP32 reads from flash: they use no RAM and are never formatted at runtime.
+  Commands with parameters are written piecewise to the serial port: prefix, value(s), AT_CMD_END.
+  The worst-case examples at the end size the few buffers the driver still needs*/
+
+/*size of a string including its null terminator. Usable to size arrays*/
+constexpr unsigned int at_strsize(const char* s){ return (*s=='\0')? 1 : 1+at_strsize(s+1); }
+constexpr unsigned int at_max(unsigned int a, unsigned int b){ return (a>b)? a : b; }
+
+/*--------------common pieces--------------------------*/
+static constexpr char AT_CMD_END[]            = "\r\n";
+static constexpr char AT_CMD_QUOTE_END[]      = "\"\r\n";
+static constexpr char AT_CMD_SEPARATOR[]      = ",";
+static constexpr char AT_CMD_DECIMAL[]        = ".";
+/*--------------module--------------------------------*/
+static constexpr char AT_CMD_PROBE[]          = "AT+\r\n";       /*answered with "+AT: OK", also wakes up the module*/
+static constexpr char AT_ACK_PROBE[]          = "AT";
+static constexpr char AT_ACK_WAKEUP[]         = "WAKEUP";
+static constexpr char AT_CMD_VER[]            = "AT+VER=?\r\n";
+static constexpr char AT_CMD_RESET[]          = "AT+RESET\r\n";
+static constexpr char AT_ACK_RESET[]          = "+RESET: OK";
+static constexpr char AT_CMD_FDEFAULT[]       = "AT+FDEFAULT=RISINGHF\r\n";
+static constexpr char AT_ACK_FDEFAULT[]       = "+FDEFAULT: OK";
+static constexpr char AT_CMD_UART_BR[]        = "AT+UART=BR, ";  /*+ baud rate. Acknowledged with the baud rate*/
+static constexpr char AT_CMD_LOWPOWER[]       = "AT+LOWPOWER\r\n";
+static constexpr char AT_CMD_LOWPOWER_TIME[]  = "AT+LOWPOWER=";  /*+ ms to wake up*/
+static constexpr char AT_ACK_LOWPOWER[]       = "+LOWPOWER: SLEEP";
+static constexpr char AT_CMD_AUTOON[]         = "AT+LOWPOWER=AUTOON\r\n";
+static constexpr char AT_ACK_AUTOON[]         = "AUTOON";
+static constexpr char AT_CMD_AUTOOFF[]        = "AT+LOWPOWER=AUTOOFF\r\n";
+static constexpr char AT_ACK_AUTOOFF[]        = "AUTOOFF";
+static constexpr char AT_CMD_LOG[]            = "AT+LOG=";       /*+ level name*/
+/*--------------identifiers and keys------------------*/
+static constexpr char AT_CMD_ID_DEVADDR[]     = "AT+ID=DevAddr"; /*+ AT_CMD_END to read, + ",\"<id>\"\r\n" to write*/
+static constexpr char AT_CMD_ID_DEVEUI[]      = "AT+ID=DevEui";
+static constexpr char AT_CMD_ID_APPEUI[]      = "AT+ID=AppEui";
+static constexpr char AT_CMD_ID_VALUE[]       = ",\"";
+static constexpr char AT_CMD_KEY_NWKSKEY[]    = "AT+KEY=NWKSKEY,\""; /*+ key + AT_CMD_QUOTE_END. Acknowledged with the key*/
+static constexpr char AT_CMD_KEY_APPSKEY[]    = "AT+KEY=APPSKEY,\"";
+static constexpr char AT_CMD_KEY_APPKEY[]     = "AT+KEY= APPKEY,\"";
+/*--------------LoRaWAN settings----------------------*/
+static constexpr char AT_CMD_MODE_QUERY[]     = "AT+MODE\r\n";
+static constexpr char AT_ACK_MODE[]           = "+MODE: ";
+static constexpr char AT_CMD_MODE_LWABP[]     = "AT+MODE=LWABP\r\n";
+static constexpr char AT_ACK_MODE_LWABP[]     = "+MODE: LWABP";
+static constexpr char AT_CMD_MODE_LWOTAA[]    = "AT+MODE=LWOTAA\r\n";
+static constexpr char AT_ACK_MODE_LWOTAA[]    = "+MODE: LWOTAA";
+static constexpr char AT_CMD_MODE_TEST[]      = "AT+MODE=TEST\r\n";
+static constexpr char AT_ACK_MODE_TEST[]      = "TEST";
+static constexpr char AT_CMD_DR_QUERY[]       = "AT+DR\r\n";
+static constexpr char AT_ACK_DR[]             = "+DR: ";
+static constexpr char AT_CMD_DR[]             = "AT+DR=";        /*+ data rate*/
+static constexpr char AT_ACK_DR_NUMBER[]      = "+DR: DR";       /*+ data rate*/
+static constexpr char AT_CMD_DR_SCHEME[]      = "AT+DR= ";       /*+ band name. Acknowledged with the band name*/
+static constexpr char AT_CMD_CLASS_QUERY[]    = "AT+CLASS\r\n";
+static constexpr char AT_ACK_CLASS[]          = "+CLASS: ";
+static constexpr char AT_CMD_CLASS_A[]        = "AT+CLASS=A\r\n";
+static constexpr char AT_ACK_CLASS_A[]        = "CLASS: A";
+static constexpr char AT_CMD_CLASS_C[]        = "AT+CLASS=C\r\n";
+static constexpr char AT_ACK_CLASS_C[]        = "CLASS: C";
+static constexpr char AT_CMD_PORT_QUERY[]     = "AT+PORT\r\n";
+static constexpr char AT_CMD_PORT[]           = "AT+PORT=";      /*+ port*/
+static constexpr char AT_ACK_PORT[]           = "+PORT: ";       /*+ port*/
+static constexpr char AT_CMD_POWER_QUERY[]    = "AT+POWER\r\n";
+static constexpr char AT_CMD_POWER[]          = "AT+POWER=";     /*+ dBm*/
+static constexpr char AT_ACK_POWER[]          = "+POWER: ";      /*+ dBm*/
+static constexpr char AT_CMD_ADR_QUERY[]      = "AT+ADR\r\n";
+static constexpr char AT_ACK_ADR[]            = "+ADR: ";
+static constexpr char AT_CMD_ADR_ON[]         = "AT+ADR=ON\r\n";
+static constexpr char AT_ACK_ADR_ON[]         = "+ADR: ON";
+static constexpr char AT_CMD_ADR_OFF[]        = "AT+ADR=OFF\r\n";
+static constexpr char AT_ACK_ADR_OFF[]        = "+ADR: OFF";
+static constexpr char AT_CMD_CH_QUERY[]       = "AT+CH\r\n";
+static constexpr char AT_CMD_CH[]             = "AT+CH=";        /*+ channel[,frequency[,DR[,DR max]]]*/
+static constexpr char AT_ACK_CH[]             = "+CH: ";         /*+ channel*/
+static constexpr char AT_ACK_CH_DR0[]         = ",DR:0\r\n";
+static constexpr char AT_CMD_REPT[]           = "AT+REPT=";      /*+ repetitions*/
+static constexpr char AT_ACK_REPT[]           = "+REPT=";
+static constexpr char AT_CMD_RETRY[]          = "AT+RETRY=";     /*+ retries*/
+static constexpr char AT_ACK_RETRY[]          = "+RETRY=";
+static constexpr char AT_CMD_RXWIN1_QUERY[]   = "AT+RXWIN1\r\n";
+static constexpr char AT_CMD_RXWIN1_ON[]      = "AT+RXWIN1=ON\r\n";
+static constexpr char AT_CMD_RXWIN1_OFF[]     = "AT+RXWIN1=OFF\r\n";
+static constexpr char AT_CMD_RXWIN1[]         = "AT+RXWIN1=";    /*+ channel,frequency*/
+static constexpr char AT_CMD_RXWIN2[]         = "AT+RXWIN2=";    /*+ frequency,DR or frequency,SF,BW*/
+static constexpr char AT_CMD_DELAY_RX1[]      = "AT+DELAY=RX1,"; /*+ ms*/
+static constexpr char AT_CMD_DELAY_RX2[]      = "AT+DELAY=RX2,";
+static constexpr char AT_CMD_DELAY_JRX1[]     = "AT+DELAY=JRX1,";
+static constexpr char AT_CMD_DELAY_JRX2[]     = "AT+DELAY=JRX2,";
+static constexpr char AT_CMD_JOIN[]           = "AT+JOIN\r\n";
+static constexpr char AT_ACK_JOIN_ANY[]       = "+JOIN: Network joined|+JOIN: Joined already";
+static constexpr char AT_ACK_JOIN_NEW[]       = "+JOIN: Network joined";
+static constexpr char AT_URC_JOIN_START[]     = "+JOIN: Start";              /*a join request goes on air*/
+static constexpr char AT_URC_NOT_JOINED[]     = "Please join network first"; /*answer to an uplink without session*/
+static constexpr char AT_CMD_LINK_CHECK[]     = "AT+LW=LCR\r\n";  /*link check request, sent with the next uplink*/
+static constexpr char AT_ACK_LINK_CHECK[]     = "+LW: LCR";
+/*--------------uplinks: prefix + payload + AT_CMD_QUOTE_END---------*/
+static constexpr char AT_CMD_MSG[]            = "AT+MSG=\"";
+static constexpr char AT_CMD_MSGHEX[]         = "AT+MSGHEX=\"";
+static constexpr char AT_CMD_CMSG[]           = "AT+CMSG=\"";
+static constexpr char AT_CMD_CMSGHEX[]        = "AT+CMSGHEX=\"";
+static constexpr char AT_CMD_PMSG[]           = "AT+PMSG=\"";
+static constexpr char AT_CMD_PMSGHEX[]        = "AT+PMSGHEX=\"";
+static constexpr char AT_CMD_TXLRSTR[]        = "AT+TXLRSTR=\"";
+static constexpr char AT_CMD_TXLRPKT[]        = "AT+TEST=TXLRPKT,\"";
+static constexpr char AT_ACK_DONE[]           = "Done";
+/*--------------P2P-----------------------------------*/
+static constexpr char AT_CMD_TEST_RFCFG[]     = "AT+TEST=RFCFG,"; /*+ frequency,SF,BW,tx preamble,rx preamble,power*/
+static constexpr char AT_CMD_TEST_RXLRPKT[]   = "AT+TEST=RXLRPKT\r\n";
+static constexpr char AT_ACK_TEST_RXLRPKT[]   = "RXLRPKT";
+/*--------------log levels, indexed by _debug_level---*/
+static constexpr char AT_LOG_LEVEL[][6]       = {"DEBUG","INFO","WARN","ERROR","FATAL","PANIC","QUIET"};
+
+/*--------------worst cases used to size the buffers--*/
+/*longest expected response: the App/session keys are acknowledged with the key itself*/
+static constexpr char AT_WORST_ACK_KEY[]      = "0123456789ABCDEF0123456789ABCDEF";
+#define AT_ACK_LENGTH_MAX  at_max(at_strsize(AT_ACK_JOIN_ANY),at_strsize(AT_WORST_ACK_KEY))
+/*longest responses read back from recv_buf. Longer ones (uplinks carrying a downlink, channel lists)
+  are still matched character by character and the downlinks are parsed by the line dispatcher:
+  only the copy kept in recv_buf is truncated*/
+static constexpr char AT_WORST_RESP_DR[]      = "+DR: DR15 (ADR DR15)\r\n+DR: US915HYBRID DR15 SF12 BW500K\r\n"
+                                                "+DR: US915HYBRID DR15 SF12 BW500K\r\n";
+static constexpr char AT_WORST_RESP_ID[]      = "+ID: DevEui, 2C:F7:F1:20:24:00:4A:5C\r\n";
+static constexpr char AT_WORST_RESP_CMSG[]    = "+CMSGHEX: Start\r\n+CMSGHEX: Wait ACK\r\n+CMSGHEX: ACK Received\r\n"
+                                                "+CMSGHEX: RXWIN1, RSSI -106, SNR -12.5\r\n+CMSGHEX: Done\r\n";
+#define RESP_LENGTH_MAX    at_max(at_strsize(AT_WORST_RESP_CMSG),at_max(at_strsize(AT_WORST_RESP_DR),at_strsize(AT_WORST_RESP_ID)))
+/*messages of COMMAND_PRINT_TIME_MEASURE*/
+static constexpr char AT_TIME_ACK_MSG[]       = "\r\nTime to Transmit message and Recieve ACK from TX message: ";
+static constexpr char AT_TIME_TOTAL_MSG[]     = "\r\nTotal Command Time + Time to get ACK response: ";
+static constexpr char AT_TIME_UNIT[]          = " ms.";
+
+#endif
@@ -0,0 +1,340 @@
+/*
+  LoRa-E5 module emulator
+
+  The MIT License (MIT)
+  See LoRa-E5.h for the full license text.
+*/
+#include "LoRa-E5-Emulator.h"
+#include "LoRa-E5-Airtime.h"
+#include "LoRa-E5-Link.h"
+#include <stdarg.h>
+
+static const char emu_hex_digits[] = "0123456789ABCDEF";
+
+LoRaE5Emulator::LoRaE5Emulator(int uart_nr)
+    : line_head(0), line_count(0), line_pos(0), last_due_ms(0), cmd_len(0), outcome_head(0), outcome_count(0),
+      host_baud(0), module_baud(EMU_BAUDRATE), next_baud(EMU_BAUDRATE), session(false), sleeping(false),
+      link_check(false), class_type('A'), data_rate(0), port(8), power(14), adr(true), downlink_pending(false),
+      downlink_port(0), downlink_rssi(-90), downlink_snr(7.5), stat_commands(0), stat_joins(0), stat_uplinks(0),
+      stat_airtime_ms(0), stat_link_checks(0) {
+    (void)uart_nr;
+    strcpy(mode, "LWOTAA");
+    strcpy(band, "EU868");
+    downlink_hex[0] = '\0';
+}
+
+void LoRaE5Emulator::begin(unsigned long baud, uint32_t config, int8_t rx_pin, int8_t tx_pin) {
+    (void)config; (void)rx_pin; (void)tx_pin;
+    host_baud = baud;
+    cmd_len = 0;
+}
+
+void LoRaE5Emulator::end(void) {
+    host_baud = 0;
+}
+
+/*only the head line is reported: the driver reads while available() is not 0*/
+int LoRaE5Emulator::available(void) {
+    if ((host_baud == 0) || (line_count == 0)) { return 0; }
+    if ((long)(millis() - due_ms[line_head]) < 0) { return 0; }
+    return (int)(strlen(lines[line_head]) - line_pos);
+}
+
+int LoRaE5Emulator::read(void) {
+    int ch;
+    if (available() == 0) { return -1; }
+    ch = (unsigned char)lines[line_head][line_pos++];
+    if (lines[line_head][line_pos] == '\0') {
+        line_head = (line_head + 1) % EMU_LINES;
+        line_count--;
+        line_pos = 0;
+    }
+    return ch;
+}
+
+int LoRaE5Emulator::peek(void) {
+    if (available() == 0) { return -1; }
+    return (unsigned char)lines[line_head][line_pos];
+}
+
+/*the host writes a whole command before reading: it is answered once its end arrives*/
+size_t LoRaE5Emulator::write(uint8_t ch) {
+    if (host_baud == 0) { return 0; }
+    if (host_baud != module_baud) { return 1; } /*garbage for the module*/
+    if (ch == 0xFF) { return 1; }               /*lowpower_auto wake up characters*/
+    if (ch == '\n') {
+        if ((cmd_len > 0) && (cmd[cmd_len - 1] == '\r')) { cmd_len--; }
+        cmd[cmd_len] = '\0';
+        cmd_len = 0;
+        command();
+    } else if (cmd_len < (sizeof(cmd) - 1)) {
+        cmd[cmd_len++] = (char)ch;
+    }
+    return 1;
+}
+
+void LoRaE5Emulator::flush(void) {}
+
+bool LoRaE5Emulator::expect(_emu_outcome_t outcome) {
+    if (outcome_count >= EMU_OUTCOMES) { return false; }
+    outcomes[(outcome_head + outcome_count) % EMU_OUTCOMES] = outcome;
+    outcome_count++;
+    return true;
+}
+
+void LoRaE5Emulator::downlink(unsigned char port_dl, const unsigned char* payload, unsigned char length, short rssi, float snr) {
+    unsigned char n = 0;
+    if (length > EMU_DOWNLINK_MAX) { length = EMU_DOWNLINK_MAX; }
+    for (unsigned char i = 0; i < length; i++) {
+        downlink_hex[n++] = emu_hex_digits[payload[i] >> 4];
+        downlink_hex[n++] = emu_hex_digits[payload[i] & 0x0F];
+    }
+    downlink_hex[n] = '\0';
+    downlink_port = port_dl;
+    downlink_rssi = rssi;
+    downlink_snr = snr;
+    downlink_pending = true;
+}
+
+void LoRaE5Emulator::radio(short rssi, float snr) {
+    downlink_rssi = rssi;
+    downlink_snr = snr;
+}
+
+bool LoRaE5Emulator::inject(const char* line, unsigned long delay_ms) {
+    return reply(delay_ms, "%s", line);
+}
+
+void LoRaE5Emulator::setJoined(bool joined) { session = joined; }
+bool LoRaE5Emulator::joined(void) { return session; }
+void LoRaE5Emulator::setModuleBaudRate(unsigned long baud) { module_baud = next_baud = baud; }
+unsigned long LoRaE5Emulator::commands(void) { return stat_commands; }
+unsigned long LoRaE5Emulator::joinRequests(void) { return stat_joins; }
+unsigned long LoRaE5Emulator::uplinks(void) { return stat_uplinks; }
+unsigned long LoRaE5Emulator::airtime_ms(void) { return stat_airtime_ms; }
+unsigned char LoRaE5Emulator::dataRate(void) { return data_rate; }
+unsigned long LoRaE5Emulator::linkChecks(void) { return stat_link_checks; }
+
+/*the line is due delay_ms after now, never before the previous one, plus its transfer time (10 bits per character)*/
+bool LoRaE5Emulator::reply(unsigned long delay_ms, const char* format, ...) {
+    va_list args;
+    unsigned char slot;
+    unsigned long due = millis() + delay_ms;
+    if (line_count >= EMU_LINES) { return false; }
+    slot = (line_head + line_count) % EMU_LINES;
+    va_start(args, format);
+    vsnprintf(lines[slot], EMU_LINE_LENGTH - 2, format, args);
+    va_end(args);
+    strcat(lines[slot], "\r\n");
+    if ((line_count > 0) && ((long)(last_due_ms - due) > 0)) { due = last_due_ms; }
+    if (host_baud > 0) { due += (strlen(lines[slot]) * 10000UL) / host_baud; }
+    due_ms[slot] = due;
+    last_due_ms = due;
+    line_count++;
+    return true;
+}
+
+_emu_outcome_t LoRaE5Emulator::next_outcome(void) {
+    _emu_outcome_t outcome;
+    if (outcome_count == 0) { return EMU_OK; }
+    outcome = outcomes[outcome_head];
+    outcome_head = (outcome_head + 1) % EMU_OUTCOMES;
+    outcome_count--;
+    return outcome;
+}
+
+/*same tables as LoRaE5Class::store_data_rate: US915 starts at SF10 and has 500 kHz data rates, AU915 has
+  them from DR6, the EU-like plans (EU868, AS923...) go from SF12 to SF7 at 125 kHz, then 250 kHz and FSK*/
+void LoRaE5Emulator::modulation(unsigned int* sf, unsigned int* bw_khz) {
+    unsigned int dr = data_rate;
+    *sf = 7;
+    *bw_khz = 125;
+    if (strncmp(band, "US915", 5) == 0) {
+        if (dr <= 3) { *sf = 10 - dr; }
+        else if (dr == 4) { *sf = 8; *bw_khz = 500; }
+        else if ((dr >= 8) && (dr <= 13)) { *sf = 20 - dr; *bw_khz = 500; }
+        return;
+    }
+    if (dr <= 5) { *sf = 12 - dr; }
+    else if (strcmp(band, "AU915") == 0) {
+        if (dr == 6) { *sf = 8; *bw_khz = 500; }
+        else if ((dr >= 8) && (dr <= 13)) { *sf = 20 - dr; *bw_khz = 500; }
+    }
+    else if (dr == 6) { *bw_khz = 250; }
+    else if (dr == 7) { *bw_khz = LORA_FSK_BW_KHZ; }
+}
+
+/*AT+NAME=VALUE or AT+NAME. Settings are echoed: "+NAME: VALUE"*/
+void LoRaE5Emulator::command(void) {
+    char name[16];
+    const char* value = NULL;
+    const char* p = cmd;
+    unsigned char n = 0;
+    if (strncmp(p, "AT", 2) != 0) { return; } /*the module ignores what is not a command*/
+    stat_commands++;
+    p += 2;
+    if (*p == '+') { p++; }
+    while ((*p != '\0') && (*p != '=') && (n < (sizeof(name) - 1))) { name[n++] = *p++; }
+    name[n] = '\0';
+    if (*p == '=') {
+        value = p + 1;
+        while (*value == ' ') { value++; }
+    }
+    if (sleeping) { /*the command wakes the module up*/
+        sleeping = false;
+        reply(EMU_REPLY_MS, "+LOWPOWER: WAKEUP");
+    }
+    if (n == 0) { reply(EMU_REPLY_MS, "+AT: OK"); }
+    else if (strcmp(name, "JOIN") == 0) { command_join(value); }
+    else if ((strcmp(name, "MSG") == 0) || (strcmp(name, "MSGHEX") == 0) || (strcmp(name, "CMSG") == 0) ||
+             (strcmp(name, "CMSGHEX") == 0)) { command_uplink(name, value); }
+    else if (strcmp(name, "DR") == 0) { command_dr(value); }
+    else if (strcmp(name, "VER") == 0) { reply(EMU_REPLY_MS, "+VER: 4.0.11"); }
+    else if (strcmp(name, "RESET") == 0) {
+        session = false; /*the session is kept in RAM*/
+        module_baud = next_baud;
+        reply(EMU_REPLY_MS, "+RESET: OK");
+    }
+    else if (strcmp(name, "UART") == 0) {
+        const char* comma = (value != NULL) ? strchr(value, ',') : NULL;
+        if (comma != NULL) { next_baud = strtoul(comma + 1, NULL, 10); }
+        reply(EMU_REPLY_MS, "+UART: BR, %lu", next_baud);
+    }
+    else if (strcmp(name, "LOWPOWER") == 0) {
+        if ((value != NULL) && ((strcmp(value, "AUTOON") == 0) || (strcmp(value, "AUTOOFF") == 0))) {
+            reply(EMU_REPLY_MS, "+LOWPOWER: %s", value);
+        } else {
+            reply(EMU_REPLY_MS, "+LOWPOWER: SLEEP");
+            if (value != NULL) { reply(strtoul(value, NULL, 10), "+LOWPOWER: WAKEUP"); }
+            else { sleeping = true; }
+        }
+    }
+    else if (strcmp(name, "LW") == 0) {
+        if ((value != NULL) && (strcmp(value, "LCR") == 0)) { link_check = true; }
+        reply(EMU_REPLY_MS, "+LW: %s", (value != NULL) ? value : "");
+    }
+    else if (strcmp(name, "ID") == 0) { reply(EMU_REPLY_MS, "+ID: %s, 26:0B:12:34", (value != NULL) ? value : "DevAddr"); }
+    else if (strcmp(name, "MODE") == 0) {
+        if (value != NULL) { strlcpy(mode, value, sizeof(mode)); }
+        reply(EMU_REPLY_MS, "+MODE: %s", mode);
+    }
+    else if (strcmp(name, "CLASS") == 0) {
+        if (value != NULL) { class_type = value[0]; }
+        reply(EMU_REPLY_MS, "+CLASS: %c", class_type);
+    }
+    else if (strcmp(name, "PORT") == 0) {
+        if (value != NULL) { port = (unsigned char)atoi(value); }
+        reply(EMU_REPLY_MS, "+PORT: %u", port);
+    }
+    else if (strcmp(name, "POWER") == 0) {
+        if (value != NULL) { power = (short)atoi(value); }
+        reply(EMU_REPLY_MS, "+POWER: %d", power);
+    }
+    else if (strcmp(name, "ADR") == 0) {
+        if (value != NULL) { adr = (strcmp(value, "ON") == 0); }
+        reply(EMU_REPLY_MS, "+ADR: %s", adr ? "ON" : "OFF");
+    }
+    else { reply(EMU_REPLY_MS, "+%s: %s", name, (value != NULL) ? value : "OK"); }
+}
+
+/*AT+DR=4 sets the data rate, AT+DR=EU868 the band plan (and DR0)*/
+void LoRaE5Emulator::command_dr(const char* value) {
+    unsigned int sf, bw_khz;
+    if (value != NULL) {
+        if ((value[0] >= '0') && (value[0] <= '9')) {
+            data_rate = (unsigned char)atoi(value);
+        } else {
+            strlcpy(band, value, sizeof(band));
+            data_rate = 0;
+            reply(EMU_REPLY_MS, "+DR: %s", band);
+            return;
+        }
+    }
+    modulation(&sf, &bw_khz);
+    reply(EMU_REPLY_MS, "+DR: DR%u", data_rate);
+    if (bw_khz == LORA_FSK_BW_KHZ) { reply(0, "+DR: %s DR%u FSK 50kbps", band, data_rate); }
+    else { reply(0, "+DR: %s DR%u SF%u BW%uK", band, data_rate, sf, bw_khz); }
+}
+
+void LoRaE5Emulator::command_join(const char* value) {
+    unsigned int sf, bw_khz;
+    unsigned long airtime;
+    _emu_outcome_t outcome;
+    bool force = (value != NULL) && (strcmp(value, "FORCE") == 0);
+    if (session && !force) {
+        reply(EMU_REPLY_MS, "+JOIN: Joined already");
+        return;
+    }
+    outcome = next_outcome();
+    if (outcome == EMU_SILENT) { return; }
+    if (outcome == EMU_BUSY) {
+        reply(EMU_REPLY_MS, "+JOIN: LoRaWAN modem is busy");
+        return;
+    }
+    modulation(&sf, &bw_khz);
+    airtime = lorawan_airtime_us(23 - LORAWAN_OVERHEAD_BYTES, sf, bw_khz) / 1000; /*join request: 23 bytes PHY payload*/
+    stat_joins++;
+    stat_airtime_ms += airtime;
+    session = false;
+    reply(EMU_REPLY_MS, "+JOIN: Start");
+    reply(0, "+JOIN: NORMAL, count 1, 0, DR%u", data_rate);
+    if (outcome == EMU_OK) {
+        session = true;
+        reply(airtime + EMU_JOIN_DELAY_MS, "+JOIN: Network joined");
+        reply(0, "+JOIN: NetID 000013 DevAddr 26:0B:12:34");
+    } else {
+        reply(airtime + EMU_JOIN_DELAY2_MS + EMU_RX_WINDOW_MS, "+JOIN: Join failed");
+    }
+    reply(0, "+JOIN: Done");
+}
+
+/*AT+MSG="text", AT+MSGHEX="hex", AT+CMSG and AT+CMSGHEX: confirmed ones wait for the ACK in RX1*/
+void LoRaE5Emulator::command_uplink(const char* name, const char* value) {
+    unsigned int length = 0;
+    unsigned int sf, bw_khz;
+    unsigned long airtime, window;
+    _emu_outcome_t outcome;
+    bool confirmed = (name[0] == 'C');
+    bool acked;
+    if (!session) {
+        reply(EMU_REPLY_MS, "+%s: Please join network first", name);
+        return;
+    }
+    outcome = next_outcome();
+    if (outcome == EMU_SILENT) { return; }
+    if (outcome == EMU_BUSY) {
+        reply(EMU_REPLY_MS, "+%s: LoRaWAN modem is busy", name);
+        return;
+    }
+    if ((value != NULL) && (value[0] == '"')) {
+        const char* end = strchr(value + 1, '"');
+        length = (end != NULL) ? (unsigned int)(end - value - 1) : 0;
+    }
+    if (strstr(name, "HEX") != NULL) { length /= 2; }
+    modulation(&sf, &bw_khz);
+    airtime = lorawan_airtime_us(length, sf, bw_khz) / 1000;
+    stat_uplinks++;
+    stat_airtime_ms += airtime;
+    acked = confirmed && (outcome == EMU_OK);
+    reply(EMU_REPLY_MS, "+%s: Start", name);
+    if (confirmed) { reply(0, "+%s: Wait ACK", name); }
+    if (acked || downlink_pending || link_check) { /*something arrives in RX1*/
+        window = airtime + EMU_RX1_DELAY_MS;
+        if (acked) { reply(window, "+%s: ACK Received", name); window = 0; }
+        if (link_check) { /*LinkCheckAns: margin above the demodulation floor of the uplink*/
+            reply(window, "+%s: Link %d, 1", name, (int)(downlink_snr - lora_snr_floor_db(sf)));
+            window = 0;
+            link_check = false;
+            stat_link_checks++;
+        }
+        if (downlink_pending) {
+            reply(window, "+%s: PORT: %u; RX: \"%s\"", name, downlink_port, downlink_hex);
+            window = 0;
+            downlink_pending = false;
+        }
+        reply(window, "+%s: RXWIN1, RSSI %d, SNR %.1f", name, downlink_rssi, downlink_snr);
+        reply(0, "+%s: Done", name);
+    } else {
+        reply(airtime + EMU_RX2_DELAY_MS + EMU_RX_WINDOW_MS, "+%s: Done", name); /*both windows were empty*/
+    }
+}
@@ -0,0 +1,124 @@
+/*
+  LoRa-E5 module emulator
+
+  The MIT License (MIT)
+  See LoRa-E5.h for the full license text.
+*/
+
+#ifndef _LORA_E5_EMULATOR_H_
+#define _LORA_E5_EMULATOR_H_
+/*Stream that stands in for the serial port of the module: with LORA_SERIAL_EMULATOR defined, SerialLoRa is
+  a LoRaE5Emulator and the driver runs without a module or a gateway. The AT commands are answered with
+  the lines of the LoRa-E5 AT command specification, released with their timing:
+   - the UART transfer at the baud rate the port was opened at
+   - the time on air of joins and uplinks (LoRa-E5-Airtime.h) and the receive windows after them
+  The outcome of the next joins and uplinks is scripted with expect(), the downlinks with downlink(), the
+  RSSI/SNR of the link with radio() and the unsolicited lines (class C) with inject(). As on the module,
+  AT+UART only takes effect after AT+RESET and a port opened at another baud rate gets no answer, which
+  exercises the baud rate probe*/
+#include <Arduino.h>
+
+#define EMU_LINES           16   /*answer lines waiting to be read*/
+#define EMU_DOWNLINK_MAX    64   /*bytes of a scripted downlink*/
+#define EMU_LINE_LENGTH     (40 + 2 * EMU_DOWNLINK_MAX) /*fits "+CMSGHEX: PORT: 255; RX: \"...\"\r\n" with the longest downlink*/
+#define EMU_CMD_LENGTH      600  /*longest command: AT+CMSGHEX with 242 bytes*/
+#define EMU_OUTCOMES        8    /*scripted outcomes waiting to be used*/
+#define EMU_REPLY_MS        2    /*time the module takes to process a command*/
+#define EMU_RX1_DELAY_MS    1000 /*RECEIVE_DELAY1*/
+#define EMU_RX2_DELAY_MS    2000 /*RECEIVE_DELAY2*/
+#define EMU_RX_WINDOW_MS    100  /*time the receiver stays on in a window without downlink*/
+#define EMU_JOIN_DELAY_MS   5000 /*JOIN_ACCEPT_DELAY1*/
+#define EMU_JOIN_DELAY2_MS  6000 /*JOIN_ACCEPT_DELAY2*/
+#define EMU_BAUDRATE        9600 /*baud rate of the module after a factory reset*/
+
+enum _emu_outcome_t {
+   EMU_OK=0,  /*join accepted, uplink sent (and acknowledged if it is confirmed)*/
+   EMU_FAIL,  /*join failed, confirmed uplink without ACK*/
+   EMU_BUSY,  /*"LoRaWAN modem is busy"*/
+   EMU_SILENT /*no answer: the timeout of the driver ends the command*/
+   };
+
+class LoRaE5Emulator : public Stream {
+   public:
+    LoRaE5Emulator(int uart_nr = 0);
+    /*same arguments as HardwareSerial::begin. Pins and format are ignored*/
+    void begin(unsigned long baud, uint32_t config = SERIAL_8N1, int8_t rx_pin = -1, int8_t tx_pin = -1);
+    void end(void);
+    /*Stream: the answer lines are readable once their time has come*/
+    int available(void);
+    int read(void);
+    int peek(void);
+    size_t write(uint8_t ch);
+    using Print::write;
+    void flush(void);
+    /*scripts the outcome of the next join or uplink. EMU_OK once the script is empty.
+      Returns false if EMU_OUTCOMES outcomes are already waiting*/
+    bool expect(_emu_outcome_t outcome);
+    /*downlink delivered in the RX1 window of the next uplink that gets one*/
+    void downlink(unsigned char port, const unsigned char* payload, unsigned char length, short rssi = -90, float snr = 7.5);
+    /*RSSI and SNR of what the node receives, also the link check margin: SNR above the floor of the SF*/
+    void radio(short rssi, float snr);
+    /*unsolicited line (without "\r\n") sent after delay_ms, e.g. a class C downlink*/
+    bool inject(const char* line, unsigned long delay_ms = 0);
+    /*the module holds a session: AT+JOIN answers "Joined already"*/
+    void setJoined(bool joined);
+    bool joined(void);
+    /*baud rate of the module, e.g. left at 115200 by a previous run*/
+    void setModuleBaudRate(unsigned long baud);
+    /*data rate set with AT+DR*/
+    unsigned char dataRate(void);
+    /*link checks answered*/
+    unsigned long linkChecks(void);
+    /*counters since construction*/
+    unsigned long commands(void);      /*AT commands received*/
+    unsigned long joinRequests(void);  /*join requests sent on air*/
+    unsigned long uplinks(void);       /*uplinks sent on air*/
+    unsigned long airtime_ms(void);    /*time on air of both*/
+
+   private:
+    void command(void); /*answers the command in cmd*/
+    void command_join(const char* value);
+    void command_uplink(const char* name, const char* value);
+    void command_dr(const char* value);
+    /*queues an answer line, at least delay_ms after the previous one*/
+    bool reply(unsigned long delay_ms, const char* format, ...);
+    _emu_outcome_t next_outcome(void);
+    /*SF and bandwidth (kHz, LORA_FSK_BW_KHZ for FSK) of the data rate in use in the band plan in use*/
+    void modulation(unsigned int* sf, unsigned int* bw_khz);
+    char lines[EMU_LINES][EMU_LINE_LENGTH];
+    unsigned long due_ms[EMU_LINES];  /*time each line can be read*/
+    unsigned char line_head;
+    unsigned char line_count;
+    unsigned char line_pos;           /*characters of the head line already read*/
+    unsigned long last_due_ms;        /*due time of the last queued line*/
+    char cmd[EMU_CMD_LENGTH];
+    unsigned int cmd_len;
+    _emu_outcome_t outcomes[EMU_OUTCOMES];
+    unsigned char outcome_head;
+    unsigned char outcome_count;
+    unsigned long host_baud;          /*0 while the port is closed*/
+    unsigned long module_baud;
+    unsigned long next_baud;          /*set by AT+UART, used after AT+RESET*/
+    bool session;
+    bool sleeping;                    /*AT+LOWPOWER: the next command is preceded by "WAKEUP"*/
+    bool link_check;                  /*AT+LW=LCR: answered with the next uplink*/
+    char mode[8];
+    char band[12];
+    char class_type;
+    unsigned char data_rate;
+    unsigned char port;
+    short power;
+    bool adr;
+    bool downlink_pending;
+    unsigned char downlink_port;
+    char downlink_hex[2 * EMU_DOWNLINK_MAX + 1];
+    short downlink_rssi;
+    float downlink_snr;
+    unsigned long stat_commands;
+    unsigned long stat_joins;
+    unsigned long stat_uplinks;
+    unsigned long stat_airtime_ms;
+    unsigned long stat_link_checks;
+};
+
+#endif
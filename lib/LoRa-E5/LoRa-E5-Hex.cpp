@@ -0,0 +1,59 @@
+/*
+  LoRa-E5 hex payload codec
+
+  The MIT License (MIT)
+  See LoRa-E5.h for the full license text.
+*/
+#include "LoRa-E5-Hex.h"
+
+#define XX 0xFF /*not a hex digit: ends the payload*/
+#define SP 0xFE /*space between bytes: skipped*/
+static const uint8_t hex_nibble[256] = {
+    XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,
+    XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,
+    SP,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,
+    0x00,0x01,0x02,0x03,0x04,0x05,0x06,0x07,0x08,0x09,XX,XX,XX,XX,XX,XX,
+    XX,0x0A,0x0B,0x0C,0x0D,0x0E,0x0F,XX,XX,XX,XX,XX,XX,XX,XX,XX,
+    XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,
+    XX,0x0A,0x0B,0x0C,0x0D,0x0E,0x0F,XX,XX,XX,XX,XX,XX,XX,XX,XX,
+    XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,
+    XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,
+    XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,
+    XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,
+    XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,
+    XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,
+    XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,
+    XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,
+    XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX,XX
+};
+#undef XX
+#undef SP
+
+short hexDecode(const char* src, const char* src_end, unsigned char* dst, short dst_len) {
+    short number=0;
+    uint8_t high, low;
+    if ((src==NULL)||(dst==NULL)){return 0;}
+    while ((src<src_end)&&(number<dst_len)){
+      high=hex_nibble[(uint8_t)*src];
+      if (high==0xFE){src++; continue;}/*skip the separators*/
+      if ((high>0x0F)||((src+1)>=src_end)){break;}/*closing quote, end of line or half a byte*/
+      low=hex_nibble[(uint8_t)*(src+1)];
+      if (low>0x0F){break;}
+      dst[number++]=(high<<4)|low;
+      src+=2;
+      }
+    return number;
+}
+
+/*the digits are grouped in chunks to reduce the calls to the port*/
+void hexEncode(Print& port, const unsigned char* buffer, unsigned int length) {
+    static const char hex_digits[16] = {'0','1','2','3','4','5','6','7','8','9','a','b','c','d','e','f'};
+    char chunk[HEX_CHUNK_LENGTH];
+    unsigned int n=0;
+    for (unsigned int i = 0; i < length; i++){
+      chunk[n++]=hex_digits[buffer[i]>>4];
+      chunk[n++]=hex_digits[buffer[i]&0x0F];
+      if (n>=sizeof(chunk)){port.write((const uint8_t*)chunk,n); n=0;}
+      }
+    if (n>0){port.write((const uint8_t*)chunk,n);}
+}
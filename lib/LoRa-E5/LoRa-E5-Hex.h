@@ -0,0 +1,42 @@
+/*
+  LoRa-E5 hex payload codec
+
+  The MIT License (MIT)
+  See LoRa-E5.h for the full license text.
+*/
+
+#ifndef _LORA_E5_HEX_H_
+#define _LORA_E5_HEX_H_
+/*Shared decoder for the payloads reported by the module in hex format:
+   LoRaWAN downlinks:  +MSG: PORT: 1; RX: "68656C6C6F"
+   MAC commands:       +MSG: MACCMD: "0305"
+   P2P (test mode):    +TEST: RX "68656C6C6F"
+  Each character is translated with a 256 entries table, so there are no comparison chains.
+  The uplink payloads are encoded the other way straight to the serial port by hexEncode.*/
+#include <Arduino.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define HEX_CHUNK_LENGTH 32    /*characters written at once to the port by hexEncode*/
+
+/**
+ *  \brief Decodes hex digit pairs into bytes
+ *
+ *  \param [in] *src: first hex digit (the character after the opening quote)
+ *  \param [in] *src_end: end of the received data. Characters from here on are never read
+ *  \param [out] *dst: caller supplied buffer for the decoded bytes
+ *  \param [in] dst_len: size of dst. Bytes beyond this size are not stored
+ *
+ *  \return Return the amount of bytes stored in dst. Decoding stops at the closing quote,
+ *          at any character that is not a hex digit or a space, at src_end or when dst is full
+ */
+short hexDecode(const char* src, const char* src_end, unsigned char* dst, short dst_len);
+/**
+ *  \brief Writes bytes to a port as lowercase hex digit pairs, HEX_CHUNK_LENGTH characters per write
+ *
+ *  \param [in] port: serial port or log the digits are written to
+ *  \param [in] *buffer, length: bytes to encode
+ */
+void hexEncode(Print& port, const unsigned char* buffer, unsigned int length);
+
+#endif
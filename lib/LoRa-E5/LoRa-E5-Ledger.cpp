@@ -0,0 +1,90 @@
+/*
+  LoRa-E5 airtime ledger
+
+  The MIT License (MIT)
+  See LoRa-E5.h for the full license text.
+*/
+#include "LoRa-E5-Ledger.h"
+
+LoRaE5Ledger::LoRaE5Ledger(void) {
+    window_init(hour, LEDGER_HOUR_MS);
+    window_init(day, LEDGER_DAY_MS);
+    last_ms = 0;
+}
+
+void LoRaE5Ledger::window_init(window_t& w, uint32_t length_ms) {
+    w.budget_ms = 0;
+    w.bucket_ms = length_ms / LEDGER_BUCKETS;
+    for (uint8_t i = 0; i < (LEDGER_BUCKETS + 1); i++) { w.used_ms[i] = 0; }
+    w.age_ms = 0;
+    w.current = 0;
+}
+
+void LoRaE5Ledger::setLimits(uint16_t duty_cycle_permille, uint32_t fair_use_ms) {
+    hour.budget_ms = (duty_cycle_permille >= 1000) ? 0 : (LEDGER_HOUR_MS / 1000) * duty_cycle_permille;
+    day.budget_ms = fair_use_ms;
+}
+
+/*moves to a new bucket every bucket_ms. The bucket entered is the oldest one: it is emptied*/
+void LoRaE5Ledger::window_advance(window_t& w, uint32_t elapsed_ms) {
+    uint8_t cleared = 0;
+    w.age_ms += elapsed_ms;
+    while ((w.age_ms >= w.bucket_ms) && (cleared < (LEDGER_BUCKETS + 1))) {
+        w.current = (w.current + 1) % (LEDGER_BUCKETS + 1);
+        w.used_ms[w.current] = 0;
+        w.age_ms -= w.bucket_ms;
+        cleared++;
+    }
+    if (w.age_ms >= w.bucket_ms) { w.age_ms %= w.bucket_ms; } /*the whole window has elapsed*/
+}
+
+uint32_t LoRaE5Ledger::window_used(const window_t& w) {
+    uint32_t used = 0;
+    for (uint8_t i = 0; i < (LEDGER_BUCKETS + 1); i++) { used += w.used_ms[i]; }
+    return used;
+}
+
+/*walks the buckets from the oldest one until enough airtime is freed*/
+uint32_t LoRaE5Ledger::window_delay(const window_t& w, uint32_t airtime_ms) {
+    uint32_t used = window_used(w);
+    uint32_t wait = w.bucket_ms - w.age_ms; /*until the oldest bucket is emptied*/
+    if ((w.budget_ms == 0) || (used + airtime_ms <= w.budget_ms)) { return 0; }
+    if (airtime_ms > w.budget_ms) { return LEDGER_NEVER; }
+    for (uint8_t k = 1; k <= (LEDGER_BUCKETS + 1); k++) {
+        used -= w.used_ms[(w.current + k) % (LEDGER_BUCKETS + 1)];
+        if (used + airtime_ms <= w.budget_ms) { break; }
+        wait += w.bucket_ms;
+    }
+    return wait;
+}
+
+void LoRaE5Ledger::update(uint32_t now_ms) {
+    uint32_t elapsed = now_ms - last_ms; /*wrap safe*/
+    window_advance(hour, elapsed);
+    window_advance(day, elapsed);
+    last_ms = now_ms;
+}
+
+void LoRaE5Ledger::charge(uint32_t now_ms, uint32_t airtime_ms) {
+    update(now_ms);
+    hour.used_ms[hour.current] += airtime_ms;
+    day.used_ms[day.current] += airtime_ms;
+}
+
+uint32_t LoRaE5Ledger::delay_ms(uint32_t now_ms, uint32_t airtime_ms) {
+    uint32_t wait_hour, wait_day;
+    update(now_ms);
+    wait_hour = window_delay(hour, airtime_ms);
+    wait_day = window_delay(day, airtime_ms);
+    return (wait_hour > wait_day) ? wait_hour : wait_day;
+}
+
+uint32_t LoRaE5Ledger::usedHour(uint32_t now_ms) {
+    update(now_ms);
+    return window_used(hour);
+}
+
+uint32_t LoRaE5Ledger::usedDay(uint32_t now_ms) {
+    update(now_ms);
+    return window_used(day);
+}
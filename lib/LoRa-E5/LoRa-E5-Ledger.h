@@ -0,0 +1,60 @@
+/*
+  LoRa-E5 airtime ledger
+
+  The MIT License (MIT)
+  See LoRa-E5.h for the full license text.
+*/
+
+#ifndef _LORA_E5_LEDGER_H_
+#define _LORA_E5_LEDGER_H_
+/*Airtime spent by the uplinks, over two sliding windows:
+   - duty cycle: the regulatory limit of the band, averaged over one hour (1% = 36 s per hour)
+   - fair use:   the daily airtime allowed by the network (The Things Network: 30 s per day)
+  Each window is split in LEDGER_BUCKETS buckets plus the one being filled, so a charge is kept
+  between one window and one window plus one bucket: the ledger may wait a bit longer than
+  needed, never less. delay_ms gives the earliest time an uplink of a given airtime fits both
+  budgets. Time is given by the caller (millis), elapsed times are wrap safe*/
+#include <stdint.h>
+
+#define LEDGER_BUCKETS        24
+#define LEDGER_NEVER          0xFFFFFFFFUL  /*the airtime is larger than the budget*/
+#define LEDGER_HOUR_MS        3600000UL
+#define LEDGER_DAY_MS         (24*LEDGER_HOUR_MS)
+
+class LoRaE5Ledger {
+   public:
+    LoRaE5Ledger(void);
+    /**
+     *  \brief Sets the budgets. 0 removes the limit
+     *
+     *  \param [in] duty_cycle_permille: airtime allowed per hour, in 1/1000
+     *  \param [in] fair_use_ms: airtime allowed per day, in ms
+     */
+    void setLimits(uint16_t duty_cycle_permille, uint32_t fair_use_ms);
+    /*adds an uplink of airtime_ms sent at now_ms*/
+    void charge(uint32_t now_ms, uint32_t airtime_ms);
+    /*ms to wait before an uplink of airtime_ms fits both budgets. 0: now. LEDGER_NEVER: it never fits*/
+    uint32_t delay_ms(uint32_t now_ms, uint32_t airtime_ms);
+    /*airtime charged in the last hour and in the last day, in ms*/
+    uint32_t usedHour(uint32_t now_ms);
+    uint32_t usedDay(uint32_t now_ms);
+
+   private:
+    struct window_t {
+        uint32_t budget_ms;                  /*0: no limit*/
+        uint32_t bucket_ms;                  /*window length / LEDGER_BUCKETS*/
+        uint32_t used_ms[LEDGER_BUCKETS+1];  /*airtime charged in each bucket*/
+        uint32_t age_ms;                     /*time since the current bucket started*/
+        uint8_t current;                     /*bucket being filled*/
+    };
+    void window_init(window_t& w, uint32_t length_ms);
+    void window_advance(window_t& w, uint32_t elapsed_ms);
+    uint32_t window_used(const window_t& w);
+    uint32_t window_delay(const window_t& w, uint32_t airtime_ms);
+    void update(uint32_t now_ms); /*advances both windows to now_ms*/
+    window_t hour;
+    window_t day;
+    uint32_t last_ms;
+};
+
+#endif
@@ -0,0 +1,64 @@
+/*
+  LoRa-E5 link quality estimate
+
+  The MIT License (MIT)
+  See LoRa-E5.h for the full license text.
+*/
+#include "LoRa-E5-Link.h"
+
+LoRaE5Link::LoRaE5Link(void) : snr_avg(0), rssi_avg(0), misses(0), has_sample(false) {}
+
+void LoRaE5Link::addSample(short rssi, float snr) {
+    if (!has_sample) { /*the first sample starts the average*/
+        snr_avg = snr;
+        rssi_avg = rssi;
+        has_sample = true;
+    } else {
+        snr_avg += (snr - snr_avg) / LORA_LINK_WEIGHT;
+        rssi_avg += (rssi - rssi_avg) / LORA_LINK_WEIGHT;
+    }
+    misses = 0; /*the link is back*/
+}
+
+void LoRaE5Link::addMargin(float margin_db, unsigned int sf) {
+    float snr = margin_db + lora_snr_floor_db(sf); /*the margin is counted from the floor of the SF used*/
+    if (!has_sample) {
+        snr_avg = snr;
+        has_sample = true;
+    } else {
+        snr_avg += (snr - snr_avg) / LORA_LINK_WEIGHT;
+    }
+    misses = 0;
+}
+
+void LoRaE5Link::addMiss(void) {
+    if (misses < 255) { misses++; }
+}
+
+bool LoRaE5Link::valid(void) {
+    return has_sample;
+}
+
+float LoRaE5Link::snr(void) {
+    return snr_avg;
+}
+
+short LoRaE5Link::rssi(void) {
+    return (short)rssi_avg;
+}
+
+float LoRaE5Link::margin(unsigned int sf) {
+    return snr_avg - lora_snr_floor_db(sf) - misses * LORA_LINK_MISS_DB;
+}
+
+unsigned int LoRaE5Link::selectSF(unsigned int current_sf, unsigned int sf_min, unsigned int sf_max) {
+    if (!has_sample) {
+        if (misses > 0) { current_sf += misses; } /*no estimate: fall back one SF per missed ack*/
+        return (current_sf < sf_min) ? sf_min : ((current_sf > sf_max) ? sf_max : current_sf);
+    }
+    for (unsigned int sf = sf_min; sf < sf_max; sf++) {
+        float needed = (sf < current_sf) ? LORA_LINK_MARGIN_DB + LORA_LINK_HYSTERESIS_DB : LORA_LINK_MARGIN_DB;
+        if (margin(sf) >= needed) { return sf; }
+    }
+    return sf_max; /*the slowest one is the last resort*/
+}
@@ -0,0 +1,58 @@
+/*
+  LoRa-E5 link quality estimate
+
+  The MIT License (MIT)
+  See LoRa-E5.h for the full license text.
+*/
+
+#ifndef _LORA_E5_LINK_H_
+#define _LORA_E5_LINK_H_
+/*Rolling estimate of the link built from the RSSI/SNR of the received downlinks and acks, and from the
+  margin of the link check answers. The SNR does not depend on the spreading factor, the demodulation
+  floor does: each SF step down gains 2.5 dB. The margin of SFx is the SNR above the floor of SFx.
+  selectSF picks the fastest SF that keeps LORA_LINK_MARGIN_DB. Moving to a faster SF also needs
+  LORA_LINK_HYSTERESIS_DB, so the choice does not flip on every sample. Each confirmed uplink that
+  was not acknowledged removes LORA_LINK_MISS_DB until a new sample arrives*/
+#include <stdint.h>
+
+#define LORA_LINK_MARGIN_DB      6.0   /*safety margin above the demodulation floor*/
+#define LORA_LINK_HYSTERESIS_DB  3.0   /*extra margin to move to a faster SF*/
+#define LORA_LINK_MISS_DB        2.5   /*one SF step per missed ack*/
+#define LORA_LINK_WEIGHT         4     /*EWMA: each sample counts 1/LORA_LINK_WEIGHT*/
+
+/*SNR in dB needed to demodulate a SF (SX126x datasheet): -7.5 at SF7 down to -20 at SF12*/
+constexpr float lora_snr_floor_db(unsigned int sf){ return -7.5f-2.5f*(float)(sf-7); }
+
+class LoRaE5Link {
+   public:
+    LoRaE5Link(void);
+    /*adds the RSSI [dBm] and SNR [dB] of a received packet*/
+    void addSample(short rssi, float snr);
+    /*adds a link check answer: demodulation margin [dB] of the last uplink, sent at sf*/
+    void addMargin(float margin_db, unsigned int sf);
+    /*a confirmed uplink got no ack*/
+    void addMiss(void);
+    /*true once a sample was added*/
+    bool valid(void);
+    float snr(void);
+    short rssi(void);
+    /*estimated margin [dB] at sf, missed acks included*/
+    float margin(unsigned int sf);
+    /**
+     *  \brief Picks the fastest spreading factor that holds the margin
+     *
+     *  \param [in] current_sf: SF in use, kept if there is no estimate yet
+     *  \param [in] sf_min, sf_max: allowed range (7..12)
+     *
+     *  \return Return the SF to use
+     */
+    unsigned int selectSF(unsigned int current_sf, unsigned int sf_min, unsigned int sf_max);
+
+   private:
+    float snr_avg;
+    float rssi_avg;
+    uint8_t misses;
+    bool has_sample;
+};
+
+#endif
@@ -0,0 +1,62 @@
+/*
+  LoRa-E5 deferred log
+
+  The MIT License (MIT)
+  See LoRa-E5.h for the full license text.
+*/
+#include "LoRa-E5-Log.h"
+
+#define LOG_MASK (LORA_LOG_BUFFER_LENGTH - 1)
+static_assert((LORA_LOG_BUFFER_LENGTH & LOG_MASK) == 0, "LORA_LOG_BUFFER_LENGTH must be a power of two");
+static_assert(LORA_LOG_BUFFER_LENGTH <= 32768, "the indexes are 16 bits wide");
+
+LoRaE5Log loraLog;
+
+LoRaE5Log::LoRaE5Log(void) : head(0), tail(0), dropped_bytes(0), dropped_reported(0) {}
+
+size_t LoRaE5Log::write(uint8_t ch) {
+    return write(&ch, 1);
+}
+
+size_t LoRaE5Log::write(const uint8_t* buffer, size_t size) {
+    uint16_t h = head.load(std::memory_order_relaxed);
+    uint16_t t = tail.load(std::memory_order_acquire);
+    size_t room = LOG_MASK - (uint16_t)(h - t); /*one slot is kept free*/
+    size_t n = (size < room) ? size : room;
+    for (size_t i = 0; i < n; i++) {
+        buf[(uint16_t)(h + i) & LOG_MASK] = buffer[i];
+    }
+    head.store((uint16_t)(h + n), std::memory_order_release); /*publish the bytes*/
+    if (n < size) {
+        dropped_bytes.store(dropped_bytes.load(std::memory_order_relaxed) + (size - n), std::memory_order_relaxed);
+    }
+    return size; /*dropped bytes are not an error for the caller*/
+}
+
+size_t LoRaE5Log::drain(Print& out, size_t max_bytes) {
+    uint16_t t = tail.load(std::memory_order_relaxed);
+    uint16_t h = head.load(std::memory_order_acquire);
+    size_t total = 0;
+    while ((t != h) && (total < max_bytes)) {
+        size_t index = t & LOG_MASK;
+        size_t len = (uint16_t)(h - t);
+        if (len > LORA_LOG_BUFFER_LENGTH - index) { len = LORA_LOG_BUFFER_LENGTH - index; } /*up to the end of buf*/
+        if (len > max_bytes - total) { len = max_bytes - total; }
+        out.write((const uint8_t*)&buf[index], len);
+        t = (uint16_t)(t + len);
+        total += len;
+        tail.store(t, std::memory_order_release); /*free the space*/
+    }
+    uint32_t dropped_now = dropped_bytes.load(std::memory_order_relaxed);
+    if ((t == h) && (dropped_now != dropped_reported)) {
+        out.print("\r\n[LoRa-E5 log: ");
+        out.print((unsigned long)(dropped_now - dropped_reported));
+        out.print(" bytes dropped]");
+        dropped_reported = dropped_now;
+    }
+    return total;
+}
+
+uint32_t LoRaE5Log::dropped(void) {
+    return dropped_bytes.load(std::memory_order_relaxed);
+}
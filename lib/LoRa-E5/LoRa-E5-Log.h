@@ -0,0 +1,53 @@
+/*
+  LoRa-E5 deferred log
+
+  The MIT License (MIT)
+  See LoRa-E5.h for the full license text.
+*/
+
+#ifndef _LORA_E5_LOG_H_
+#define _LORA_E5_LOG_H_
+/*Driver messages are copied into a ring buffer instead of being printed while a command is
+  in flight. The buffer is emptied to the user port by LoRaE5Class::poll when no command is
+  pending. One producer (the driver) and one consumer (drain): the indexes are only loaded and
+  stored, so no lock and no atomic read-modify-write is needed (the ESP32-C3 has none).
+  When the buffer is full the bytes are dropped and counted*/
+#include <Arduino.h>
+#include <atomic>
+
+#define LORA_LOG_BUFFER_LENGTH 512 /*must be a power of two, up to 32768*/
+
+class LoRaE5Log : public Print {
+   public:
+    LoRaE5Log(void);
+    size_t write(uint8_t ch);
+    size_t write(const uint8_t* buffer, size_t size);
+    /*prints every argument with the Print overload of its type*/
+    template <typename T> void log(T value) { print(value); }
+    template <typename T, typename... Rest> void log(T value, Rest... rest) {
+        print(value);
+        log(rest...);
+    }
+    /**
+     *  \brief Moves up to max_bytes of the buffered messages to out
+     *
+     *  \param [in] out: port the messages are written to
+     *  \param [in] max_bytes: limit, to keep the caller loop responsive
+     *
+     *  \return Return the number of bytes written
+     */
+    size_t drain(Print& out, size_t max_bytes);
+    /*bytes dropped since boot because the buffer was full*/
+    uint32_t dropped(void);
+
+   private:
+    std::atomic<uint16_t> head;     /*next byte to write. Only stored by the producer*/
+    std::atomic<uint16_t> tail;     /*next byte to read. Only stored by the consumer*/
+    std::atomic<uint32_t> dropped_bytes;  /*only stored by the producer*/
+    uint32_t dropped_reported;      /*dropped bytes already reported by drain*/
+    char buf[LORA_LOG_BUFFER_LENGTH];
+};
+
+extern LoRaE5Log loraLog;
+
+#endif
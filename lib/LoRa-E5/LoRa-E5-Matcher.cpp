@@ -0,0 +1,98 @@
+/*
+  LoRa-E5 streaming response matcher
+
+  The MIT License (MIT)
+  See LoRa-E5.h for the full license text.
+*/
+#include "LoRa-E5-Matcher.h"
+
+LoRaE5Matcher::LoRaE5Matcher(void) {
+    reset();
+}
+
+void LoRaE5Matcher::reset(void) {
+    states=1;/*only the root*/
+    patterns=0;
+    node_child[0]=0;
+    node_sibling[0]=0;
+    node_fail[0]=0;
+    node_out[0]=0;
+    restart();
+}
+
+void LoRaE5Matcher::restart(void) {
+    state=0;
+    found_mask=MATCHER_NONE;
+}
+
+uint8_t LoRaE5Matcher::next(uint8_t node, char ch) {
+    uint8_t child=node_child[node];
+    while (child!=0){
+      if (node_char[child]==ch){return child;}
+      child=node_sibling[child];
+      }
+    return 0;
+}
+
+int8_t LoRaE5Matcher::addPattern(const char* pattern) {
+    uint8_t node=0;
+    uint8_t child;
+    if ((pattern==NULL)||(*pattern=='\0')||(patterns>=MATCHER_MAX_PATTERNS)){return -1;}
+    for (const char* p=pattern; *p!='\0'; p++){
+      child=next(node,*p);
+      if (child==0){
+        if (states>=MATCHER_MAX_STATES){return -1;}/*no room left: the pattern is discarded*/
+        child=states++;
+        node_char[child]=*p;
+        node_child[child]=0;
+        node_out[child]=0;
+        node_fail[child]=0;
+        node_sibling[child]=node_child[node];/*insert as first child*/
+        node_child[node]=child;
+        }
+      node=child;
+      }
+    node_out[node]|=(1<<patterns);
+    return patterns++;
+}
+
+/*breadth first traversal: the failure link of a node only depends on shallower nodes*/
+void LoRaE5Matcher::build(void) {
+    uint8_t queue[MATCHER_MAX_STATES];
+    uint8_t head=0, tail=0;
+    uint8_t child, fail, target;
+    for (child=node_child[0]; child!=0; child=node_sibling[child]){
+      node_fail[child]=0;
+      queue[tail++]=child;
+      }
+    while (head<tail){
+      uint8_t node=queue[head++];
+      for (child=node_child[node]; child!=0; child=node_sibling[child]){
+        fail=node_fail[node];
+        target=next(fail,node_char[child]);
+        while ((fail!=0)&&(target==0)){
+          fail=node_fail[fail];
+          target=next(fail,node_char[child]);
+          }
+        node_fail[child]=target;
+        node_out[child]|=node_out[target];
+        queue[tail++]=child;
+        }
+      }
+    restart();
+}
+
+uint8_t LoRaE5Matcher::feed(char ch) {
+    uint8_t target=next(state,ch);
+    while ((state!=0)&&(target==0)){
+      state=node_fail[state];
+      target=next(state,ch);
+      }
+    state=target;
+    found_mask|=node_out[state];
+    return node_out[state];
+}
+
+uint8_t LoRaE5Matcher::found(void) {
+    return found_mask;
+}
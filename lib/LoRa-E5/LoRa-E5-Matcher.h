@@ -0,0 +1,61 @@
+/*
+  LoRa-E5 streaming response matcher
+
+  The MIT License (MIT)
+  See LoRa-E5.h for the full license text.
+*/
+
+#ifndef _LORA_E5_MATCHER_H_
+#define _LORA_E5_MATCHER_H_
+/*Small Aho-Corasick automaton used to look for the expected responses of an AT command
+  while the characters arrive from the module. Each received character is consumed once:
+  the total work is linear in the response length, instead of rescanning the whole
+  reception buffer with strstr after every character.
+  The trie is stored with first-child/next-sibling links to keep it in a few hundred bytes.*/
+#include <stdint.h>
+#include <stddef.h>
+
+#define MATCHER_MAX_PATTERNS 8    /*patterns reported as bits of an uint8_t mask*/
+#define MATCHER_MAX_STATES   64   /*sum of the patterns lengths + 1. Checked against the longest response in LoRa-E5.cpp*/
+#define MATCHER_NONE         0    /*no pattern ended with the last character*/
+
+class LoRaE5Matcher {
+   public:
+    LoRaE5Matcher(void);
+    /*Removes all the patterns*/
+    void reset(void);
+    /**
+     *  \brief Adds a pattern to look for. "build" must be called after adding all the patterns
+     *
+     *  \param [in] *pattern: null terminated string to look for
+     *
+     *  \return Return the id of the pattern (0 to MATCHER_MAX_PATTERNS-1), -1 if there is no room left
+     */
+    int8_t addPattern(const char* pattern);
+    /*Computes the failure links. Must be called once after the last addPattern*/
+    void build(void);
+    /*Goes back to the initial state keeping the patterns. Used before parsing a new response*/
+    void restart(void);
+    /**
+     *  \brief Consumes one received character
+     *
+     *  \return Return a mask with bit "id" set for every pattern ending at this character
+     */
+    uint8_t feed(char ch);
+    /*Returns a mask with all the patterns found since the last restart*/
+    uint8_t found(void);
+
+   private:
+    uint8_t next(uint8_t node, char ch); /*child of node labeled ch, 0 if there is none*/
+    uint8_t states;                          /*used states. State 0 is the root*/
+    uint8_t patterns;                        /*added patterns*/
+    uint8_t state;                           /*current state*/
+    uint8_t found_mask;                      /*patterns found since the last restart*/
+    char    node_char[MATCHER_MAX_STATES];   /*character that leads to each state*/
+    uint8_t node_child[MATCHER_MAX_STATES];  /*first child of each state, 0 if none*/
+    uint8_t node_sibling[MATCHER_MAX_STATES];/*next sibling of each state, 0 if none*/
+    uint8_t node_fail[MATCHER_MAX_STATES];   /*longest proper suffix that is also a prefix*/
+    uint8_t node_out[MATCHER_MAX_STATES];    /*patterns ending at each state, including its suffixes*/
+};
+
+#endif
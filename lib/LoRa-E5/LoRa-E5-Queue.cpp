@@ -0,0 +1,133 @@
+/*
+  LoRa-E5 uplink queue
+
+  The MIT License (MIT)
+  See LoRa-E5.h for the full license text.
+*/
+#include "LoRa-E5-Queue.h"
+#include <string.h>
+
+LoRaE5Queue::LoRaE5Queue(void) : report_head(0), report_count(0), arrivals(0), last_id(0), dropped_count(0), expired_count(0) {
+    for (uint8_t i = 0; i < LORA_QUEUE_SLOTS; i++) { slots[i].state = UPLINK_FREE; }
+}
+
+uint16_t LoRaE5Queue::push(const unsigned char* payload, unsigned char length, unsigned char port, bool confirmed,
+                           unsigned char priority, uint32_t max_age_ms, uint32_t now_ms,
+                           uplink_callback_t callback, void* ctx) {
+    int index = -1;
+    if ((length == 0) || (length > LORA_QUEUE_PAYLOAD_MAX)) {
+        dropped_count++;
+        return 0;
+    }
+    for (uint8_t i = 0; (i < LORA_QUEUE_SLOTS) && (index < 0); i++) {
+        if (slots[i].state == UPLINK_FREE) { index = i; }
+    }
+    if (index < 0) { /*full: the oldest of the lowest priority leaves if it is below the new one*/
+        for (uint8_t i = 0; i < LORA_QUEUE_SLOTS; i++) {
+            if (slots[i].state != UPLINK_QUEUED) { continue; }
+            if ((index < 0) || (slots[i].priority < slots[index].priority) ||
+                ((slots[i].priority == slots[index].priority) && ((int32_t)(slots[i].order - slots[index].order) < 0))) {
+                index = i;
+            }
+        }
+        if ((index < 0) || (slots[index].priority >= priority)) {
+            dropped_count++;
+            return 0;
+        }
+        drop(index);
+        dropped_count++;
+    }
+    _uplink_t& item = slots[index];
+    memcpy(item.payload, payload, length);
+    item.length = length;
+    item.port = port;
+    item.priority = priority;
+    item.confirmed = confirmed;
+    item.state = UPLINK_QUEUED;
+    if (++last_id == 0) { last_id = 1; }
+    item.id = last_id;
+    item.order = arrivals++;
+    item.queued_ms = now_ms;
+    item.max_age_ms = max_age_ms;
+    item.callback = callback;
+    item.ctx = ctx;
+    return item.id;
+}
+
+void LoRaE5Queue::expire(uint32_t now_ms) {
+    for (uint8_t i = 0; i < LORA_QUEUE_SLOTS; i++) {
+        if ((slots[i].state == UPLINK_QUEUED) && (slots[i].max_age_ms > 0) &&
+            ((now_ms - slots[i].queued_ms) >= slots[i].max_age_ms)) { /*wrap safe*/
+            drop(i);
+            expired_count++;
+        }
+    }
+}
+
+int LoRaE5Queue::next(void) {
+    int index = -1;
+    for (uint8_t i = 0; i < LORA_QUEUE_SLOTS; i++) {
+        if (slots[i].state != UPLINK_QUEUED) { continue; }
+        if ((index < 0) || (slots[i].priority > slots[index].priority) ||
+            ((slots[i].priority == slots[index].priority) && ((int32_t)(slots[i].order - slots[index].order) < 0))) {
+            index = i;
+        }
+    }
+    return index;
+}
+
+_uplink_t* LoRaE5Queue::slot(int index) {
+    return ((index >= 0) && (index < LORA_QUEUE_SLOTS)) ? &slots[index] : NULL;
+}
+
+void LoRaE5Queue::setState(int index, _uplink_state_t state) {
+    if ((index >= 0) && (index < LORA_QUEUE_SLOTS)) { slots[index].state = state; }
+}
+
+void LoRaE5Queue::release(int index) {
+    setState(index, UPLINK_FREE);
+}
+
+void LoRaE5Queue::drop(int index) {
+    if ((index < 0) || (index >= LORA_QUEUE_SLOTS) || (slots[index].state == UPLINK_FREE)) { return; }
+    report(index);
+    slots[index].state = UPLINK_FREE;
+}
+
+/*an owner without callback needs no report. The oldest report is lost if the list is full*/
+void LoRaE5Queue::report(int index) {
+    if (slots[index].callback == NULL) { return; }
+    if (report_count >= LORA_QUEUE_REPORTS) {
+        report_head = (report_head + 1) % LORA_QUEUE_REPORTS;
+        report_count--;
+    }
+    uint8_t tail = (report_head + report_count) % LORA_QUEUE_REPORTS;
+    report_callback[tail] = slots[index].callback;
+    report_ctx[tail] = slots[index].ctx;
+    report_count++;
+}
+
+bool LoRaE5Queue::popDropped(uplink_callback_t* callback, void** ctx) {
+    if (report_count == 0) { return false; }
+    *callback = report_callback[report_head];
+    *ctx = report_ctx[report_head];
+    report_head = (report_head + 1) % LORA_QUEUE_REPORTS;
+    report_count--;
+    return true;
+}
+
+unsigned int LoRaE5Queue::depth(void) {
+    unsigned int count = 0;
+    for (uint8_t i = 0; i < LORA_QUEUE_SLOTS; i++) {
+        if (slots[i].state != UPLINK_FREE) { count++; }
+    }
+    return count;
+}
+
+unsigned long LoRaE5Queue::dropped(void) {
+    return dropped_count;
+}
+
+unsigned long LoRaE5Queue::expired(void) {
+    return expired_count;
+}
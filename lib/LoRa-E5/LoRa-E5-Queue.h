@@ -0,0 +1,83 @@
+/*
+  LoRa-E5 uplink queue
+
+  The MIT License (MIT)
+  See LoRa-E5.h for the full license text.
+*/
+
+#ifndef _LORA_E5_QUEUE_H_
+#define _LORA_E5_QUEUE_H_
+/*Uplinks waiting for the radio, in LORA_QUEUE_SLOTS preallocated slots. The next one sent is the
+  highest priority, the oldest first among equals. An item older than its max age expires. When the
+  queue is full, a new item evicts the oldest of the lowest priority if that one is below its own
+  priority, else the new item is refused. The slot of an expired or evicted item is free right away,
+  its callback waits in a short list until the driver calls it (see LoRaE5Class::queueUplink)*/
+#include <stdint.h>
+
+#define LORA_QUEUE_SLOTS        8
+#define LORA_QUEUE_PAYLOAD_MAX  242  /*largest LoRaWAN application payload, see LoRaE5Class::getMaxPayload*/
+#define LORA_QUEUE_REPORTS      (2*LORA_QUEUE_SLOTS) /*dropped items whose owner was not told yet*/
+
+/*same signature as at_callback_t: time_ms is 0 if the uplink failed, expired or was evicted*/
+typedef void (*uplink_callback_t)(unsigned int time_ms, const char* response, void* ctx);
+
+enum _uplink_state_t {
+   UPLINK_FREE=0,
+   UPLINK_QUEUED,
+   UPLINK_SENDING   /*handed to the module*/
+   };
+
+struct _uplink_t {
+   unsigned char payload[LORA_QUEUE_PAYLOAD_MAX];
+   unsigned char length;
+   unsigned char port;
+   unsigned char priority;      /*higher first*/
+   bool confirmed;
+   _uplink_state_t state;
+   uint16_t id;                 /*never 0*/
+   uint32_t order;              /*arrival order*/
+   uint32_t queued_ms;
+   uint32_t max_age_ms;         /*0: never expires*/
+   uplink_callback_t callback;
+   void* ctx;
+   };
+
+class LoRaE5Queue {
+   public:
+    LoRaE5Queue(void);
+    /**
+     *  \brief Copies an uplink into a free slot, evicting a lower priority one if the queue is full
+     *
+     *  \return Return the id of the item, 0 if it was refused (queue full or payload too long)
+     */
+    uint16_t push(const unsigned char* payload, unsigned char length, unsigned char port, bool confirmed,
+                  unsigned char priority, uint32_t max_age_ms, uint32_t now_ms,
+                  uplink_callback_t callback, void* ctx);
+    /*drops the queued items older than their max age*/
+    void expire(uint32_t now_ms);
+    /*slot of the next item to send, -1 if none*/
+    int next(void);
+    _uplink_t* slot(int index);
+    void setState(int index, _uplink_state_t state);
+    void release(int index);   /*frees the slot*/
+    void drop(int index);      /*frees the slot, the owner is told through popDropped*/
+    /*callback of the oldest dropped item not reported yet. false if there is none*/
+    bool popDropped(uplink_callback_t* callback, void** ctx);
+    unsigned int depth(void);  /*queued and sending items*/
+    unsigned long dropped(void);  /*evicted or refused items since boot*/
+    unsigned long expired(void);  /*expired items since boot*/
+
+   private:
+    void report(int index);    /*adds the callback of a dropped item to the reports*/
+    _uplink_t slots[LORA_QUEUE_SLOTS];
+    uplink_callback_t report_callback[LORA_QUEUE_REPORTS];
+    void* report_ctx[LORA_QUEUE_REPORTS];
+    uint8_t report_head;
+    uint8_t report_count;
+    uint32_t arrivals;
+    uint16_t last_id;
+    unsigned long dropped_count;
+    unsigned long expired_count;
+};
+
+#endif
@@ -31,21 +31,77 @@
 /*COMMAND LIST AND EXAMPLES*/
 //https://files.seeedstudio.com/products/317990687/res/LoRa-E5%20AT%20Command%20Specification_V1.0%20.pdf
 #include "LoRa-E5.h"
-  #if (defined(ESP32)||defined(ESP32S3))
+#include "LoRa-E5-Hex.h"
+#ifdef LORA_NVS_PERSIST
+  #include <Preferences.h>
+#endif
+#ifdef LORA_LEDGER_RTC
+  #include <sys/time.h>
+  #include <type_traits>
+  static_assert(std::is_trivially_copyable<LoRaE5Ledger>::value,"the ledger is copied to RTC memory");
+  /*copy of the ledger kept in deep sleep, see ledger_charge*/
+  static RTC_DATA_ATTR uint8_t ledger_rtc[sizeof(LoRaE5Ledger)];
+  static RTC_DATA_ATTR bool ledger_rtc_valid=false;
+#endif
+  #ifdef LORA_SERIAL_GLOBAL
     //#define SerialLoRa_native Serial    //M5Stack ESP32 Camera Module Development Board
-     HardwareSerial SerialLoRa(0);    //M5Stack ESP32 Camera Module Development Board
+     UART_LoRa SerialLoRa(0);    //M5Stack ESP32 Camera Module Development Board
   #endif  
+/*the matcher holds the root, the timing patterns and every alternative of the longest expected response*/
+static_assert(1+(at_strsize("Wait ACK")-1)+(at_strsize("ACK Received")-1)+(AT_ACK_LENGTH_MAX-1)<=MATCHER_MAX_STATES,
+              "MATCHER_MAX_STATES is too small for the longest expected response");
 const char *physTypeStr[12] = {"EU434",        "EU868", "US915", "US915HYBRID", "US915OLD",
                                "AU915",        "AS923", "CN470","CN779", "KR920",
                                "CN470PREQUEL", "STE920"};
 
 LoRaE5Class::LoRaE5Class(void) {
     lowpower_auto=false; /*LowPower Autoonmode disabled by defaukt*/
+    serial_baud=0;
+    serial_last_ms=0;
     adaptative_DR=true; /*Adatpative data rate. is true by default in the module*/
 	txPower=14;//14 is default set up
 	freq_band=0;
 	uart_tx=0;
 	uart_rx=0;
+	at_state=AT_IDLE;
+	at_callback=NULL;
+	at_callback_ctx=NULL;
+	at_last_time=0;
+	line_len=0;
+	line_solicited=false;
+	downlink_pending=false;
+	downlink_unread=false;
+	downlink_handler=NULL;
+	downlink_handler_ctx=NULL;
+	rssi_last=-255;
+	snr_last=0;
+	FREQBAND_last=UNINIT;
+	store_modulation(SF12,BW125);/*DR0 of the EU-like band plans, the module default*/
+	ledger.setLimits(1000,LORA_FAIR_USE_MS_PER_DAY);/*the duty cycle is set with the band*/
+  #ifdef LORA_LEDGER_RTC
+	if (ledger_rtc_valid){memcpy(&ledger,ledger_rtc,sizeof(ledger));}/*woken up from deep sleep*/
+  #endif
+	radio_tx_ms=0;
+	radio_rx_ms=0;
+	uplink_airtime_ms=0;
+	uplink_confirmed=false;
+	uplink_acked=false;
+	link_uplinks=0;
+	link_check_asked=false;
+	link_hold=false;
+	link_dr=DR0;
+	dr_wanted=DR0;
+	dr_adr_wanted=true;
+	dr_adr_pending=false;
+	dr_pending=false;
+	join_state=JOIN_IDLE;
+	join_timeout_ms=DEFAULT_TIMEOUT;
+	join_failures=0;
+	join_wait_start=0;
+	join_wait_ms=0;
+	queue_sending=-1;
+	port_last=0;
+	for (unsigned char i=0; i<URC_TYPES; i++){urc_handler[i]=NULL; urc_handler_ctx[i]=NULL;}
 }
 /*SERIAL CUSTOM MODE
 link: https://forum.arduino.cc/t/third-serial-on-nano-33-ble-can-be-software/929047/10  */
@@ -53,16 +109,14 @@ void LoRaE5Class::endSerial(void){
       SerialLoRa.flush();
       delay(1);
       SerialLoRa.end();
+      serial_baud=0;
 }
 void LoRaE5Class::initSerial(_baudrate_bps_supported baud_rate){
 	/*proceed to init based if Tx and RX were provided during LoRa.init call*/
-	 #ifdef COMMAND_PRINT_TO_USER
-      SerialUSB.print("\r\nSerialLora baud rate set:");  // Serial.print(p_p_cmd, args);
-      SerialUSB.print(baud_rate); /*print the command*/
-	 #endif
+	 LORA_LOG_DEBUG("\r\nSerialLora baud rate set:",(unsigned long)baud_rate);
     baud_rate_set=baud_rate;	 
 	if((uart_tx==0)and(uart_rx==0)){
-    #if (defined(ESP32)||defined(ESP32S3))
+    #ifdef LORA_SERIAL_GLOBAL
     SerialLoRa.begin(baud_rate); //M5Stack ESP32 Camera Module Development Board 
      #else
      	   /*Init UART with default pins if were not provided*/	
@@ -72,57 +126,89 @@ void LoRaE5Class::initSerial(_baudrate_bps_supported baud_rate){
 	}
 	else{
 	/*Init UART with the pins provided*/	
-	  #if (defined(ESP32)||defined(ESP32S3))
+	  #ifdef LORA_SERIAL_GLOBAL
         SerialLoRa.begin(baud_rate, SERIAL_8N1, uart_rx, uart_tx); //M5Stack ESP32 Camera Module Development Board 
       #else
-        #ifdef PRINT_TO_USER 
-        Serial.print("\r\nIMPORTANT: RUNNING serial port used with LoRa communication as a SoftwareSerial");/*to print the obtained characters*/
-        #endif
+        LORA_LOG_INFO("\r\nIMPORTANT: RUNNING serial port used with LoRa communication as a SoftwareSerial");
         UART_LoRa SerialLoRa_aux(uart_tx,uart_rx);//you have to call the constructor in this way
         memcpy(&SerialLoRa,&SerialLoRa_aux, sizeof(SerialLoRa));
         SerialLoRa.begin(baud_rate,SERIAL_8N1);   /*For software LoRa serial*/  
       #endif  
 	}
+	serial_baud=baud_rate;
+	serial_last_ms=millis();
+}
+
+
+/*sends "AT" at the given baud rate. The module may have been left in lowpower_auto mode: the
+  command is preceded by the wake up characters and the port is closed afterwards*/
+bool LoRaE5Class::probe_baud_rate(_baudrate_bps_supported baud_rate){
+    bool mode=lowpower_auto;
+    bool ret;
+    lowpower_auto=true;
+    baud_rate_set=baud_rate;/*at_begin opens the port at baud_rate_set*/
+    ret=(at_send_check_response(AT_CMD_PROBE,AT_ACK_PROBE,DEFAULT_TIMEWAIT, NULL)>0);
+    lowpower_auto=mode;
+    return ret;
 }
 
+_baudrate_bps_supported LoRaE5Class::load_baud_rate(void){
+    unsigned int baud_rate=LORA_BAUDRATE_DEFAULT;
+  #ifdef LORA_NVS_PERSIST
+    Preferences nvs;
+    if (nvs.begin(LORA_NVS_NAMESPACE,true)){
+      baud_rate=nvs.getUInt(LORA_NVS_KEY_BAUD,LORA_BAUDRATE_DEFAULT);
+      nvs.end();
+      }
+  #endif
+    switch (baud_rate){/*discard values that are not supported*/
+      case BR_9600: case BR_38400: case BR_115200: return (_baudrate_bps_supported)baud_rate;
+      default: return LORA_BAUDRATE_DEFAULT;
+      }
+}
+
+void LoRaE5Class::store_baud_rate(_baudrate_bps_supported baud_rate){
+  #ifdef LORA_NVS_PERSIST
+    Preferences nvs;
+    if (!nvs.begin(LORA_NVS_NAMESPACE,false)){return;}
+    if (nvs.getUInt(LORA_NVS_KEY_BAUD,0)!=(unsigned int)baud_rate){nvs.putUInt(LORA_NVS_KEY_BAUD,baud_rate);}/*avoid flash writes*/
+    nvs.end();
+  #else
+    (void)baud_rate;
+  #endif
+}
 
 /*first call of init inside the class*/
 bool LoRaE5Class::init_first_call(void) { //For Hardware Serial
-     unsigned int cmd_time;
+	 const _baudrate_bps_supported probe_list[]={BR_9600,BR_38400,BR_115200};
+	 _baudrate_bps_supported cached=load_baud_rate();
 	 bool ret=false;
-	 initSerial(LORA_BAUDRATE_DEFAULT); //9600 is the default baud_rate115200
-	 //test the differents baud rates in order to perform an automatic detection
-      #ifdef PRINT_TO_USER 
-        Serial.print("\r\nTesting connection with the device");/*to print the obtained characters*/
-      #endif
-	  
-	  lowpower_auto=true; /*set in case the device was left in lowpower_auto mode*/
-	  if(lowpower_auto){endSerial();}/*keep the if  for compatibility.*/
-      if(at_send_check_response("AT+\r\n","AT",DEFAULT_TIMEWAIT, NULL)==0){
-           //endSerial(); 
-           //delay(100);
-		   initSerial(BR_38400);
-	       if(lowpower_auto){endSerial();}/*keep the if  for compatibility.*/		   
-	    if(at_send_check_response("AT+\r\n","AT",DEFAULT_TIMEWAIT, NULL)==0){
-         //  endSerial(); 
-         //  delay(100);
-	       initSerial(BR_115200); 
-		   if(lowpower_auto){endSerial();}/*keep the if for compatibility.*/
-		   if(at_send_check_response("AT+\r\n","AT",DEFAULT_TIMEWAIT, NULL)==0){
-		     ;;
-		   }else{ret=true;}
-	     }else{ret=true;}
-	 }else{ret=true;}
-	  #ifdef PRINT_TO_USER 
-	    if(ret==true){Serial.print("\r\n GROOVE WIO-LoRa-E5 Detected");}/*to print the obtained characters*/
-        if(ret==false){Serial.print("\r\nERROR: COULD NOT DETECT GROOVE WIO-LoRa-E5 module");}/*to print the obtained characters*/
-      #endif
-	  //endSerial();//end last inited serial
+	 //test the last working baud rate first, then the others in order to perform an automatic detection
+      LORA_LOG_INFO("\r\nTesting connection with the device");
+	  ret=probe_baud_rate(cached);
+	  for (unsigned char i=0; (i<sizeof(probe_list)/sizeof(probe_list[0]))&&(ret==false); i++){
+	    if (probe_list[i]!=cached){ret=probe_baud_rate(probe_list[i]);}
+	    }
+	  if(ret==true){LORA_LOG_INFO("\r\n GROOVE WIO-LoRa-E5 Detected at ",(unsigned long)baud_rate_set);}
+      if(ret==false){LORA_LOG_ERROR("\r\nERROR: COULD NOT DETECT GROOVE WIO-LoRa-E5 module");}
+	  initSerial(baud_rate_set);/*keep the port open at the last probed baud rate*/
 	  lowpower_auto=false;
 	 /*once the baud rate has been detected, work into that mode*/
 	 setDeviceLowPowerAutomode(false);//first thing to do is to set automode to false to avoid issues with this mode
      /*Wake Up the LoRa module*/
      setDeviceWakeUp();/*if the module is not in sleep state, this command does nothing*/
+	 #ifdef LORA_BAUDRATE_FAST
+	 /*switch once to the fast baud rate. The module keeps it after a reset, and so does the NVS*/
+	 if ((ret==true)&&(baud_rate_set!=LORA_BAUDRATE_FAST)){
+	    _baudrate_bps_supported detected=baud_rate_set;
+	    setDeviceBaudRate(LORA_BAUDRATE_FAST);
+	    if (!probe_baud_rate(LORA_BAUDRATE_FAST)){/*the module did not take it: go back to the detected one*/
+	      if (!probe_baud_rate(detected)){ret=false;}
+	      }
+	    initSerial(baud_rate_set);
+	    }
+	 #endif
+	 if (ret==true){store_baud_rate(baud_rate_set);}
 return ret;
 }
 /*Set up serial port, remove auto low power and wake up the device*/
@@ -139,150 +225,411 @@ void LoRaE5Class::init(uint8_t tx, uint8_t rx) {//for software serial
 
 unsigned int LoRaE5Class::readBuffer(char* buffer, unsigned int length, unsigned int timeout_ms){
 char ch;
-unsigned int index;
+unsigned int index=0;
 int startMillis;
-//clean reception buffer after starting with reception:
-strncpy(buffer," ",sizeof(recv_buf));//fill the content with white spaces
-strlcpy(buffer," ",1);//Manually indicates end of string
-#ifdef COMMAND_PRINT_TO_USER
- SerialUSB.println("\r\nReading serial buffer");  // Serial.print(p_p_cmd, args);
-#endif
+if (length==0){return 0;}
+buffer[0]='\0';//clean reception buffer after starting with reception
+LORA_LOG_DEBUG("\r\nReading serial buffer\r\n");
 //starting to read
 startMillis = millis();// Starts meassuring time after the command was sended
 delay(timeout_ms);//Sleep for this period until attempting to read
 // ((millis() - startMillis) < timeout_ms) {//commented: not used at the moment
-       while (SerialLoRa.available() > 0){ //check if they are characters to be read 
+       while ((SerialLoRa.available() > 0)&&(index<(length-1))){ //check if they are characters to be read. Keep room for the end of string
             ch = SerialLoRa.read();
             buffer[index++] = ch; //add the character
-            if (index>=length){break;}//protect a buffer overflow
             }
   //     }//commented: not used at the moment 
+buffer[index]='\0';//Manually indicates end of string
 return(index);//return the amount of bytes read    
 }
 
-/*function used to send command to lora modules*/
-unsigned int LoRaE5Class::at_send_check_response(char* p_cmd, char* p_ack, unsigned int timeout_ms,char* p_response){
-    #ifdef COMMAND_PRINT_TIME_MEASURE
-    cmd_time[0]=0;//init the string len
-    #endif 
-    int tx_and_rx_ACK_time=0;//time to transmit and recieve message
-    int ch;
-    int num = 0;
-    int i;
-    int index = 0;
-    int ret_val=0;//init with 0 as default return value
-    int startMillis;
-	/*init lora SPI if aoutomatic low power is on*/
-	if(lowpower_auto){initSerial(baud_rate_set);}
+/*function used to send command to lora modules. Blocking wrapper of at_send_async*/
+unsigned int LoRaE5Class::at_send_check_response(const char* p_cmd, const char* p_ack, unsigned int timeout_ms,char* p_response){
+    unsigned int ret_val=0;//init with 0 as default return value
+    at_wait();/*let a pending asynchronous command finish before issuing a new one*/
+    if(at_send_async(p_cmd,p_ack,timeout_ms,NULL,NULL)){ret_val=at_wait();}
+    /*if a buffer was provided, copy the response to the buffer */
+    if (not(p_response == NULL)) { strcpy(p_response, recv_buf);}  
+	/*end of code: return cmd elapsed time in ms or 0 if did not work */
+    return ret_val;
+}
+
+/*sends a command to the lora module and returns without waiting for the response*/
+bool LoRaE5Class::at_send_async(const char* p_cmd, const char* p_ack, unsigned int timeout_ms,
+                                at_callback_t callback, void* ctx){
+    if (!at_begin()){return false;}/*only one command can be in flight*/
+	/*Send the comand*/
+	if (!(p_cmd == NULL)){ at_put(p_cmd);} //sends command to Grove LoRa_E5 module
+    return at_expect(p_ack,timeout_ms,callback,ctx);
+}
+
+/*sends a command carrying a payload: prefix + payload + "\"\r\n". The payload is written
+  straight to the serial port, in hex format if requested, without building the command in RAM*/
+bool LoRaE5Class::at_send_payload(const char* p_prefix, const unsigned char* buffer, unsigned int length,
+                                  bool hex, const char* p_ack, unsigned int timeout_ms,
+                                  at_callback_t callback, void* ctx){
+    unsigned long wait=uplinkDelay(length);
+    if (wait>0){/*would break the duty cycle or the fair use budget*/
+      LORA_LOG_WARN("\r\nUplink refused by the airtime ledger, wait ",wait," ms");
+      return false;
+      }
+    if (!at_begin()){return false;}/*only one command can be in flight*/
+    uplink_airtime_ms=(unsigned int)getTransmissionTime(length)+1;/*rounded up*/
+    ledger_charge(uplink_airtime_ms);
+    radio_tx_ms+=uplink_airtime_ms;
+    uplink_confirmed=((p_prefix==AT_CMD_CMSG)||(p_prefix==AT_CMD_CMSGHEX));
+    at_put(p_prefix);
+    if (hex){hexEncode(SerialLoRa,buffer,length);}
+    else    {SerialLoRa.write(buffer,length);}
+    #if LORA_LOG_ON(LORA_LOG_LEVEL_DEBUG)
+      if (hex){hexEncode(loraLog,buffer,length);}
+      else    {loraLog.write(buffer,length);}
+    #endif
+    at_put(AT_CMD_QUOTE_END);
+    return at_expect(p_ack,timeout_ms,callback,ctx);
+}
+
+/*prepares the serial port and starts measuring the time of a new command*/
+bool LoRaE5Class::at_begin(void){
+    if (at_state==AT_PENDING){return false;}/*only one command can be in flight*/
+    at_index=0;
+    at_ack_time=0;
+	/*init lora SPI if aoutomatic low power is on. A port still open from the previous command is reused*/
+	if(lowpower_auto&&(serial_baud!=(unsigned long)baud_rate_set)){initSerial(baud_rate_set);}
     /*clean reception buffer after starting with reception:*/
-    strncpy(recv_buf," ",sizeof(recv_buf));//fill the content with white spaces
-    strlcpy(recv_buf," ",1);//Manually indicates end of string
-    /*clean the serial port before issuing the command*/
-    while (SerialLoRa.available() > 0){ ch = SerialLoRa.read();}//clean the read buffer
-    startMillis = millis();//DO NOT MOVE FROM HERE Starts meassuring time BEFORE the command was sended. 
+    recv_buf[0]='\0';
+    /*dispatch what is left in the serial port before issuing the command, it is not part of its response*/
+    while (SerialLoRa.available() > 0){ urc_feed(SerialLoRa.read(),false);}
+    at_start_ms = millis();//DO NOT MOVE FROM HERE Starts meassuring time BEFORE the command was sended. 
 	/*Send special character for compatibility with LOWPOWER=AUTOMODE at all times*/
 	if (lowpower_auto){SerialLoRa.write(0xff);SerialLoRa.write(0xff);SerialLoRa.write(0xff);SerialLoRa.write(0xff);};
-	/*Send the comand*/
-	if (!(p_cmd == NULL)){ SerialLoRa.print(p_cmd);} //sends command to Grove LoRa_E5 module
-	       /*---------*/
-    #ifdef COMMAND_PRINT_TO_USER
-    if (!(p_cmd == NULL)){
-      SerialUSB.print("\r\n--------Command sent:\r\n");  // Serial.print(p_p_cmd, args);
-      SerialUSB.print(p_cmd); /*print the command*/
-	  }
-    #endif
+    LORA_LOG_DEBUG("\r\n--------Command sent:\r\n");/*the pieces of the command follow, see at_put*/
+    return true;
+}
+
+/*waits for the pending command and starts a new one. Its pieces are written with at_put*/
+bool LoRaE5Class::at_open(void){
+    at_wait();
+    return at_begin();
+}
+
+void LoRaE5Class::at_put(const char* str){
+    SerialLoRa.print(str);
+    LORA_LOG_DEBUG(str);
+}
+
+void LoRaE5Class::at_put(long value){
+    SerialLoRa.print(value);
+    LORA_LOG_DEBUG(value);
+}
+
+void LoRaE5Class::at_put_freq(float frequency){
+    at_put((long)(short)frequency);
+    at_put(AT_CMD_DECIMAL);
+    at_put((long)(short(frequency * 10) % 10));
+}
+
+/*arms the matcher with the expected response of the command written with at_put and waits for it*/
+unsigned int LoRaE5Class::at_close(const char* p_ack, unsigned int timeout_ms){
+    at_expect(p_ack,timeout_ms,NULL,NULL);
+    return at_wait();
+}
+
+/*builds the expected response "<prefix><value><suffix>" of a command carrying a number*/
+static const char* at_ack_number(char* dst, unsigned int size, const char* prefix, long value, const char* suffix=""){
+    snprintf(dst,size,"%s%ld%s",prefix,value,suffix);
+    return dst;
+}
+
+/*arms the matcher with the expected response of the command that was just sent*/
+bool LoRaE5Class::at_expect(const char* p_ack, unsigned int timeout_ms, at_callback_t callback, void* ctx){
+    at_callback=callback;
+    at_callback_ctx=ctx;
+    at_timeout_ms=timeout_ms;
+    at_state=AT_PENDING;
     /*ensure a valid p_ack (pointer to command string expected response from the module) was provided*/
     if (p_ack == NULL) { 
-      #ifdef COMMAND_PRINT_TO_USER
-      SerialUSB.print("\r\nYou must specify the expected command response or use the \"AT_NO_ACK\" macro. Example: at_send_check_response(\"AT+*COMMAND CONTENT*\\r\\n\",AT_NO_ACK, 100,NULL)");
-      #endif
-      return ret_val;
-    }                 
-    /*Parse the response to the command. Also meassure the time to get the response*/
-    while ((millis() - startMillis) < timeout_ms) {
-       if (SerialLoRa.available() > 0){ //check if they are characters to be read 
+      LORA_LOG_ERROR("\r\nYou must specify the expected command response or use the \"AT_NO_ACK\" macro. Example: at_send_check_response(\"AT+*COMMAND CONTENT*\\r\\n\",AT_NO_ACK, 100,NULL)");
+      at_finish(0);
+      return true;
+    }
+    /*the alternatives are split in a copy. The matcher keeps its own copy of each pattern*/
+    char ack[AT_ACK_LENGTH_MAX];
+    strlcpy(ack,p_ack,sizeof(ack));
+    at_no_ack=(strcmp(ack,AT_NO_ACK)==0);
+    /*build the matcher: the timing patterns first, then every alternative of the expected response*/
+    at_matcher.reset();
+    at_matcher.addPattern("Wait ACK");     /*AT_MATCH_WAIT_ACK*/
+    at_matcher.addPattern("ACK Received"); /*AT_MATCH_ACK_RECEIVED*/
+    if (!at_no_ack){
+      char* p_alt=ack;
+      for (char* p=ack; ; p++){
+        if ((*p==AT_ACK_SEPARATOR)||(*p=='\0')){
+          bool last=(*p=='\0');
+          *p='\0';/*split "+JOIN: Network joined|+JOIN: Joined already"*/
+          at_matcher.addPattern(p_alt);
+          if (last){break;}
+          p_alt=p+1;
+          }
+        }
+      }
+    at_matcher.build();
+    return true;
+}
+
+void LoRaE5Class::poll(void){
+    at_poll();
+    /*the background commands are only sent between the user commands*/
+    if (at_state!=AT_PENDING){dr_step();}
+    if (at_state!=AT_PENDING){join_step();}
+    if (at_state!=AT_PENDING){queue_step();}
+}
+
+/*Reads everything the module sent. Characters are added to the response of the pending command
+  (if any) and assembled into lines for the unsolicited result codes dispatcher*/
+void LoRaE5Class::at_poll(void){
+    int ch;
+    bool solicited;
+    while (SerialLoRa.available() > 0){ //check if they are characters to be read 
            //we read one character at time because is the only way to get the ack tx time
             ch = SerialLoRa.read();
-            recv_buf[index++] = ch; //add the character
+            solicited=(at_state==AT_PENDING);
+            if (solicited){at_feed((char)ch);}/*can finish the command*/
+            urc_feed((char)ch,solicited);
+            serial_last_ms=millis();
+      }
+    if ((at_state==AT_PENDING)&&((millis() - at_start_ms) >= at_timeout_ms)){
+      /*If AT_NO_ACK mode is selected, the timeout is the expected way to end the command*/
+      if(at_no_ack){at_finish(at_elapsed());}
+      else         {at_finish(0);}
+      }
+    serial_idle();
+    #if (LORA_LOG_LEVEL<LORA_LOG_LEVEL_QUIET)
+    /*idle: print the log now, it cannot delay the response of a command*/
+    if (at_state!=AT_PENDING){loraLog.drain(LORA_LOG_OUTPUT,LORA_LOG_DRAIN_CHUNK);}
+    #endif
+}
+
+void LoRaE5Class::serial_idle(void){
+    if ((!lowpower_auto)||(serial_baud==0)||(at_state==AT_PENDING)){return;}
+    if ((millis()-serial_last_ms)>=LORA_LOWPOWER_IDLE_MS){endSerial();}
+}
+
+/*Parse the response to the pending command. Also meassure the time to get the response*/
+void LoRaE5Class::at_feed(char ch){
+            if (at_index<(sizeof(recv_buf)-1)){//protect a buffer overflow
+              recv_buf[at_index++] = ch; //add the character
+              recv_buf[at_index] = '\0';
+            }
+            /*the matcher consumes each character once, no need to rescan recv_buf*/
+            uint8_t match=at_matcher.feed(ch);
             //begin with times callculation
               /*Reception ACK wait time*/
-              if (tx_and_rx_ACK_time==0){
-                if (strstr(recv_buf, "Wait ACK") != NULL){ tx_and_rx_ACK_time=millis();}
+              if (at_ack_time==0){
+                if (match&AT_MATCH_WAIT_ACK){ at_ack_time=millis();}
               }
-              if(tx_and_rx_ACK_time>0){
-                if (strstr(recv_buf, "ACK Received") != NULL){
-                  tx_and_rx_ACK_time=millis() - tx_and_rx_ACK_time;
+              if(at_ack_time>0){
+                if (match&AT_MATCH_ACK_RECEIVED){
+                  at_ack_time=millis() - at_ack_time;
                   #ifdef COMMAND_PRINT_TIME_MEASURE
-                  sprintf(cmd_time+strlen(cmd_time),"\r\nTime to Transmit message and Recieve ACK from TX message: %i ms.",tx_and_rx_ACK_time);
+                  LORA_LOG_INFO(AT_TIME_ACK_MSG,(long)at_ack_time,AT_TIME_UNIT);
                   #endif 
-                  tx_and_rx_ACK_time=-1;//indicates the program to stop this parsing 
+                  at_ack_time=-1;//indicates the program to stop this parsing 
                 }
               }    
-        /*check if the command sended was acknowledged properly*/
-        if (strstr(recv_buf, p_ack) != NULL) {
-            ret_val= millis() - startMillis;//returns command execution time
-            break;/*goes outside of code*/
+        /*check if the command sended was acknowledged properly by any of the expected responses*/
+        if (match&AT_MATCH_RESPONSE) {
+            at_finish(at_elapsed());//returns command execution time
             }
-          }
-      else{/*If there are no characters to be read, delays 1 ms and tryes to read again*/
-           delay(1);
-           }  
-      }/*End of While parsing loop*/
-      if((strstr(AT_NO_ACK, p_ack) != NULL)){ret_val=millis() - startMillis;}//If this mode is selected, do not display     
-      #ifdef COMMAND_PRINT_TO_USER
-       SerialUSB.print("--------Command responses:\r\n");
-       SerialUSB.print(recv_buf);
-       SerialUSB.print("\r\n--------End of Commands responses");
-      #endif
-      #ifdef COMMAND_PRINT_TIME_MEASURE
-      /*add the time used to print*/
-       if (ret_val>0){sprintf(cmd_time+strlen(cmd_time),"\r\nTotal Command Time + Time to get ACK response: %i ms.",ret_val);}
-      /*print the accumulated message*/
-       if(strlen(cmd_time)>0){SerialUSB.print(cmd_time);}/*print if something was written*/
-      #endif
-      #ifdef COMMAND_PRINT_TO_USER
-       if(ret_val==0){SerialUSB.print("\r\n!!Command Failed!! Did not get the expected \"Ok\" or \"ACK\" response from E5 module after sending the command.");}
-      #endif
-    /*---------------------------------------*/
-    /*if a buffer was provided, copy the response to the buffer */
-    if (not(p_response == NULL)) { strcpy(p_response, recv_buf);}  
-	//closes serial before return if lowpower_auto is on to save power
-     if(lowpower_auto){endSerial();}
-	/*end of code: return cmd elapsed time in ms or 0 if did not work */
-    return ret_val;
+}
+
+/*Assembles the received characters into lines. A line is solicited if any of its characters
+  arrived while a command was pending*/
+void LoRaE5Class::urc_feed(char ch, bool solicited){
+    if (ch=='\r'){return;}
+    if (ch=='\n'){
+      line_buf[line_len]='\0';
+      if (line_len>0){urc_dispatch(line_buf,line_solicited);}
+      line_len=0;
+      line_solicited=false;
+      return;
+      }
+    line_solicited|=solicited;
+    if (line_len<(sizeof(line_buf)-1)){line_buf[line_len++]=ch;}/*longer lines are truncated*/
+}
+
+/*Parses a complete line once. Downlinks are parsed whether they are part of a command response
+  (+MSG/+CMSG) or not (class C). The rest of the lines only reach the handlers when unsolicited*/
+void LoRaE5Class::urc_dispatch(const char* line, bool solicited){
+    _urc_type_t type=URC_OTHER;
+    const char* ptr;
+    const char* end=line+strlen(line);
+    if ((ptr=strstr(line,"RX: \""))!=NULL){/*LoRaWAN: +MSG: PORT: 1; RX: "68656C6C6F"*/
+      type=URC_DOWNLINK;
+      downlink_deliver();/*a previous downlink without RSSI line is delivered first*/
+      const char* p_port=strstr(line,"PORT: ");
+      downlink.port=(p_port!=NULL)?atoi(p_port+6):0;
+      downlink.maccmd=false;
+      downlink.length=hexDecode(ptr+5,end,downlink.payload,sizeof(downlink.payload));
+      downlink.rssi=-255;
+      downlink.snr=0;
+      downlink_pending=true;/*delivered with the RSSI/SNR line that follows*/
+      }
+    else if ((ptr=strstr(line,"RX \""))!=NULL){/*P2P: +TEST: RX "68656C6C6F", after the LEN/RSSI line*/
+      type=URC_DOWNLINK;
+      downlink.port=0;
+      downlink.maccmd=false;
+      downlink.length=hexDecode(ptr+4,end,downlink.payload,sizeof(downlink.payload));
+      downlink.rssi=rssi_last;
+      downlink.snr=snr_last;
+      downlink_pending=true;
+      downlink_deliver();
+      }
+    else if ((ptr=strstr(line,MAC_COMMAND_FLAG " \""))!=NULL){/*+MSG: MACCMD: "0305"*/
+      type=URC_MACCMD;
+      downlink_deliver();
+      downlink.port=0;
+      downlink.maccmd=true;
+      downlink.length=hexDecode(ptr+9,end,downlink.payload,sizeof(downlink.payload));
+      downlink.rssi=rssi_last;
+      downlink.snr=snr_last;
+      downlink_pending=true;
+      downlink_deliver();
+      }
+    else if ((ptr=strstr(line,"RSSI"))!=NULL){/*+MSG: RXWIN1, RSSI -106, SNR 3.5 or +TEST: LEN:5, RSSI:-46, SNR:10*/
+      type=URC_RSSI;
+      rssi_last=atoi(ptr+5);
+      ptr=strstr(ptr,"SNR");
+      snr_last=(ptr!=NULL)?atof(ptr+4):0;
+      link.addSample(rssi_last,snr_last);
+      if (downlink_pending){
+        downlink.rssi=rssi_last;
+        downlink.snr=snr_last;
+        downlink_deliver();
+        }
+      }
+    else{
+      downlink_deliver();
+      if ((ptr=strstr(line,": Link "))!=NULL){link.addMargin(atof(ptr+7),SF_last);}/*+MSG: Link 20, 1: margin, gateways*/
+      if (strstr(line,AT_URC_JOIN_START)!=NULL){/*"Joined already" sends nothing, only a real request is charged*/
+        ledger_charge(lora_airtime_us(LORA_JOIN_REQUEST_BYTES,SF_last,BW_last)/1000+1);
+        }
+      if ((strstr(line,AT_URC_NOT_JOINED)!=NULL)&&(join_state==JOIN_JOINED)){/*the module lost the session*/
+        LORA_LOG_WARN("\r\nLoRa session lost, joining again\n");
+        join_failures=0;
+        join_retry(0);
+        }
+      if      (strncmp(line,"+JOIN",5)==0){type=URC_JOIN;}
+      else if ((strncmp(line,"+MSG",4)==0)||(strncmp(line,"+CMSG",5)==0)){type=URC_MSG;}
+      }
+    if ((!solicited)&&(urc_handler[type]!=NULL)){urc_handler[type](type,line,urc_handler_ctx[type]);}
+}
+
+/*hands the parsed downlink to the user*/
+void LoRaE5Class::downlink_deliver(void){
+    if (!downlink_pending){return;}
+    downlink_pending=false;
+    downlink_unread=true;
+    if (downlink_handler!=NULL){downlink_handler(&downlink,downlink_handler_ctx);}
+}
+
+void LoRaE5Class::onDownlink(downlink_callback_t callback, void* ctx){
+    downlink_handler=callback;
+    downlink_handler_ctx=ctx;
+}
+
+bool LoRaE5Class::onUrc(_urc_type_t type, urc_callback_t callback, void* ctx){
+    if (type>=URC_TYPES){return false;}
+    urc_handler[type]=callback;
+    urc_handler_ctx[type]=ctx;
+    return true;
+}
+
+/*ends the pending command, prints its results and calls the user callback*/
+void LoRaE5Class::at_finish(unsigned int ret_val){
+    at_callback_t callback=at_callback;
+    void* ctx=at_callback_ctx;
+    at_last_time=ret_val;
+    at_state=(ret_val>0)?AT_DONE:AT_FAILED;
+    if (uplink_airtime_ms>0){/*the module listened until the response or the timeout*/
+      unsigned int elapsed=at_elapsed();
+      if (elapsed>uplink_airtime_ms){radio_rx_ms+=elapsed-uplink_airtime_ms;}
+      uplink_airtime_ms=0;
+      }
+    if (uplink_confirmed){/*"ACK Received" was matched by at_feed*/
+      uplink_acked=(at_ack_time==-1);
+      if (!uplink_acked){link.addMiss();}
+      uplink_confirmed=false;
+      }
+    at_callback=NULL;
+    /*the time was taken above: the messages are only copied to the log, printing happens in poll*/
+    LORA_LOG_DEBUG("--------Command responses:\r\n",recv_buf,"\r\n--------End of Commands responses");
+    #ifdef COMMAND_PRINT_TIME_MEASURE
+     if (ret_val>0){LORA_LOG_INFO(AT_TIME_TOTAL_MSG,ret_val,AT_TIME_UNIT);}
+    #endif
+     if(ret_val==0){LORA_LOG_WARN("\r\n!!Command Failed!! Did not get the expected \"Ok\" or \"ACK\" response from E5 module after sending the command.");}
+	//closes serial once the idle window passes if lowpower_auto is on to save power
+    serial_last_ms=millis();
+    serial_idle();
+    /*the callback is called last so it can issue a new command*/
+    if (callback!=NULL){callback(ret_val,recv_buf,ctx);}
+}
+
+/*time since the pending command was sent. Never 0, that value means the command failed*/
+unsigned int LoRaE5Class::at_elapsed(void){
+    unsigned int elapsed=millis() - at_start_ms;
+    return (elapsed>0)?elapsed:1;
+}
+
+/*polls until the pending command finishes*/
+unsigned int LoRaE5Class::at_wait(void){
+    while (at_state==AT_PENDING){
+      at_poll();/*the caller reads recv_buf once the command finishes: nothing else can be sent*/
+      if (at_state==AT_PENDING){delay(1);}/*If there are no characters to be read, delays 1 ms and tryes to read again*/
+      }
+    return at_last_time;
+}
+
+bool LoRaE5Class::busy(void){
+    return (at_state==AT_PENDING);
+}
+
+_at_status_t LoRaE5Class::at_status(void){
+    return at_state;
+}
+
+unsigned int LoRaE5Class::at_latency(void){
+    return at_last_time;
 }
 
 
 unsigned int LoRaE5Class::getVersion(char *buffer, unsigned int timeout) {
-    return(at_send_check_response("AT+VER=?\r\n",AT_NO_ACK,timeout,buffer));
+    return(at_send_check_response(AT_CMD_VER,AT_NO_ACK,timeout,buffer));
 }
 
 unsigned int LoRaE5Class::getId(char *buffer,_deviceID id, unsigned int timeout) {
 	unsigned int time_cmd=0;
-    if(id==DevAddr){time_cmd=at_send_check_response("AT+ID=DevAddr\r\n",AT_NO_ACK,timeout,buffer);}
-    if(id==DevEui){time_cmd=at_send_check_response("AT+ID=DevEui\r\n",AT_NO_ACK,timeout,buffer);}
-	if(id==AppEui){time_cmd=at_send_check_response("AT+ID=AppEui\r\n",AT_NO_ACK,timeout,buffer);}
+	const char* p_cmd=(id==DevAddr)? AT_CMD_ID_DEVADDR : (id==DevEui)? AT_CMD_ID_DEVEUI : AT_CMD_ID_APPEUI;
+    if (!at_open()){return 0;}
+    at_put(p_cmd);
+    at_put(AT_CMD_END);
+    time_cmd=at_close(AT_NO_ACK,timeout);
+    if (buffer!=NULL){strcpy(buffer,recv_buf);}
     return(time_cmd);
 }
 
 unsigned int LoRaE5Class::setId(char *DevAddr, char *DevEUI, char *AppEUI) {
     unsigned int time_cmd=0;
-
-    if (DevAddr) {
-        memset(cmd, 0, 64);
-        sprintf(cmd, "AT+ID=DevAddr,\"%s\"\r\n", DevAddr);
-        time_cmd=+at_send_check_response(cmd,AT_NO_ACK,DEFAULT_TIMEWAIT*2,NULL);
-    }
-    if (DevEUI) {
-        memset(cmd, 0, 64);
-        sprintf(cmd, "AT+ID=DevEui,\"%s\"\r\n", DevEUI);
-        time_cmd=+at_send_check_response(cmd,AT_NO_ACK,DEFAULT_TIMEWAIT*2,NULL);
-    }
-    if (AppEUI) {
-        memset(cmd, 0, 64);
-        sprintf(cmd, "AT+ID=AppEui,\"%s\"\r\n", AppEUI);
-        time_cmd=+at_send_check_response(cmd,AT_NO_ACK,DEFAULT_TIMEWAIT*2,NULL);
-    }
+    const char* p_cmd[3]={AT_CMD_ID_DEVADDR,AT_CMD_ID_DEVEUI,AT_CMD_ID_APPEUI};
+    const char* p_id[3]={DevAddr,DevEUI,AppEUI};
+    for (unsigned char i=0; i<3; i++){
+      if ((p_id[i]==NULL)||!at_open()){continue;}
+      at_put(p_cmd[i]);
+      at_put(AT_CMD_ID_VALUE);
+      at_put(p_id[i]);
+      at_put(AT_CMD_QUOTE_END);
+      time_cmd+=at_close(AT_NO_ACK,DEFAULT_TIMEWAIT*2);
+      }
     return(time_cmd);
 }
 /*Set each of the keys used for communication
@@ -293,75 +640,33 @@ use the Application Key (AppKey) to derive the two session keys during the activ
 */
 unsigned int LoRaE5Class::setKey(char *NwkSKey, char *AppSKey, char *AppKey) {
     unsigned int time_cmd=0;
-	cmd[0]='\0';//reset the string position
-	cmd_resp_ack[0]='\0';//reset the string position
-    if (NwkSKey) {
-        sprintf(cmd, "AT+KEY=NWKSKEY,\"%s\"\r\n", NwkSKey);
-		sprintf(cmd_resp_ack,"%s", NwkSKey);
-        time_cmd=+at_send_check_response(cmd,cmd_resp_ack,DEFAULT_TIMEWAIT*2,NULL);
-    }
-
-    if (AppSKey) {
-        sprintf(cmd, "AT+KEY=APPSKEY,\"%s\"\r\n", AppSKey);
-		sprintf(cmd_resp_ack,"%s", AppSKey);
-        time_cmd=+at_send_check_response(cmd,cmd_resp_ack,DEFAULT_TIMEWAIT*2,NULL);
-    }
-
-    if (AppKey) {
-        sprintf(cmd, "AT+KEY= APPKEY,\"%s\"\r\n", AppKey);
-	    sprintf(cmd_resp_ack,"%s", AppKey);
-        time_cmd=+at_send_check_response(cmd,cmd_resp_ack,DEFAULT_TIMEWAIT*2,NULL);
-    }
+    const char* p_cmd[3]={AT_CMD_KEY_NWKSKEY,AT_CMD_KEY_APPSKEY,AT_CMD_KEY_APPKEY};
+    const char* p_key[3]={NwkSKey,AppSKey,AppKey};
+    for (unsigned char i=0; i<3; i++){
+      if ((p_key[i]==NULL)||!at_open()){continue;}
+      at_put(p_cmd[i]);
+      at_put(p_key[i]);
+      at_put(AT_CMD_QUOTE_END);
+      time_cmd+=at_close(p_key[i],DEFAULT_TIMEWAIT*2);/*the module answers with the key*/
+      }
     return(time_cmd);
 }
-void LoRaE5Class::SF_BW_to_bitrate_txhead_time(_spreading_factor_t SF, _band_width_t BW) {
-	unsigned char scale=4;
-  /*set scale value based on BW*/
-    if(BW==BW500){scale=4;}
-    if(BW==BW250){scale=2;}
-    if(BW==BW125){scale=1;}
-  /*Set value of return based on SF and BW*/
-    if(SF==SF12){//RX win: 0payload+43 ms aprox
-      bitRate=250*scale;
-      txHead_time=1155.1/scale;//RX WINDOW:1190 ms  dif with tx 35
-      }
-    if(SF==SF11){
-      bitRate=440*scale;
-      txHead_time=577.5/scale;//RX WINDOW:616 ms  dif with tx 39
-      }
-    if(SF==SF10){
-      bitRate=980*scale;
-      txHead_time=288.8/scale;//RX WINDOW:329 ms dif with tx 40
-      }
-    if(SF==SF9){
-      bitRate=1760*scale;
-      txHead_time=164.9/scale; //RX WINDOW:200 ms dif with tx 28.6
-      }
-    if(SF==SF8){
-      bitRate=3125*scale;
-      txHead_time=82.4/scale; //RX WINDOW:125 ms dif with tx 42.7
-      }     
-    if(SF==SF7){
-      bitRate=5470*scale;
-      txHead_time=46.3/scale;//RX WINDOW:88 ms dif with tx 41.7
-      }
-    /*especial case: 50 kbps with FSK modulation instead of LoRa*/  
-    if(BW==BW50kbps){
-      bitRate=50000;
-      txHead_time=0;/*We use 0 because I could not find tis value in the web.*/
-      }
+/*keeps the modulation in use and the values derived from it. See LoRa-E5-Airtime.h*/
+void LoRaE5Class::store_modulation(_spreading_factor_t SF, _band_width_t BW) {
+    if ((SF==SFX)||(BW==BWX)){return;}/*unknown: keep the last one*/
+    SF_last=SF;
+    BW_last=BW;
+    bitRate=lora_bitrate_bps(SF,BW);
+    txHead_time=lorawan_airtime_us(0,SF,BW)/1000.0;/*frame without application payload*/
 }
 unsigned int LoRaE5Class::getbitRate(unsigned int* pbitRate,float* ptxHead_time) {
     unsigned int time_cmd=0;
 	_band_width_t BW=BWX;
 	_spreading_factor_t SF=SFX;
-    cmd[0]='\0';//reset the string position
-    cmd_resp_ack[0]='\0';//reset the string position
-    char substr[20];//16 is max size, we use 20 just in case.
+    char substr[20]="";//16 is max size, we use 20 just in case.
     char* pstr;
     /*Send command to get bitRate*/
-    sprintf(cmd, "AT+DR\r\n");
-    time_cmd=+at_send_check_response(cmd,AT_NO_ACK,DEFAULT_TIMEWAIT,NULL);
+    time_cmd+=at_send_check_response(AT_CMD_DR_QUERY,AT_NO_ACK,DEFAULT_TIMEWAIT,NULL);
     /*Example of expected response to be contained in recv_buf
     +DR: DR0 (ADR DR3)
     +DR: US915 DR3 SF7 BW125K  //adaptative data rate
@@ -389,13 +694,14 @@ unsigned int LoRaE5Class::getbitRate(unsigned int* pbitRate,float* ptxHead_time)
 	if(strstr(substr,"50kbps")!= NULL){BW=BW50kbps;}
     /*Set value of SF*/
     if(strstr(substr,"SF12")!= NULL){SF=SF12;}
-    if(strstr(substr,"SF11")!= NULL){SF=SF12;}
-    if(strstr(substr,"SF10")!= NULL){SF=SF12;}
-    if(strstr(substr,"SF9")!= NULL){SF=SF12;}
-    if(strstr(substr,"SF8")!= NULL){SF=SF12;}
-    if(strstr(substr,"SF7")!= NULL){SF=SF12;}
+    if(strstr(substr,"SF11")!= NULL){SF=SF11;}
+    if(strstr(substr,"SF10")!= NULL){SF=SF10;}
+    if(strstr(substr,"SF9")!= NULL){SF=SF9;}
+    if(strstr(substr,"SF8")!= NULL){SF=SF8;}
+    if(strstr(substr,"SF7")!= NULL){SF=SF7;}
+	if(BW==BW50kbps){SF=SF7;}/*FSK has no SF: any valid one*/
 	/*after obtaining the SF and BW, set the bitRate and txHead_time clas variables */  
-	SF_BW_to_bitrate_txhead_time(SF,BW);  
+	store_modulation(SF,BW);  
     /*if pointers were provided, store the values     */
      if (!(pbitRate==NULL)){*pbitRate=bitRate;}//Stores the value if a pointer was provided
      if (!(ptxHead_time==NULL)){*ptxHead_time=txHead_time;}//Stores the value if a pointer was provided
@@ -404,15 +710,19 @@ unsigned int LoRaE5Class::getbitRate(unsigned int* pbitRate,float* ptxHead_time)
 }
 unsigned int LoRaE5Class::setFrequencyBand(_physical_type_t physicalType){
     unsigned int time_cmd=0;
-    cmd[0]='\0';//reset the string position
-    cmd_resp_ack[0]='\0';//reset the string position
-	if (physicalType>UNINIT){
-       sprintf(cmd, "AT+DR= %s\r\n", physTypeStr[physicalType]);
-       sprintf(cmd_resp_ack, "%s", physTypeStr[physicalType]);
-	   time_cmd=at_send_check_response(cmd,cmd_resp_ack,2*DEFAULT_TIMEWAIT,NULL);
+	if ((physicalType>UNINIT)&&(physicalType<(int)(sizeof(physTypeStr)/sizeof(physTypeStr[0])))&&at_open()){
+       at_put(AT_CMD_DR_SCHEME);
+       at_put(physTypeStr[physicalType]);
+       at_put(AT_CMD_END);
+	   time_cmd=at_close(physTypeStr[physicalType],2*DEFAULT_TIMEWAIT);
 	 }
 	 /*Stores frequency band if command was ok*/
-	if(time_cmd){ /*if command response ok, store the band set value*/
+	if(time_cmd){store_frequency_band(physicalType);} /*if command response ok, store the band set value*/
+
+return(time_cmd);
+}
+
+void LoRaE5Class::store_frequency_band(_physical_type_t physicalType){
 	  FREQBAND_last=physicalType;
       if (physicalType==EU434){freq_band=434;}
       if (physicalType==EU868){freq_band=868;}
@@ -424,9 +734,117 @@ unsigned int LoRaE5Class::setFrequencyBand(_physical_type_t physicalType){
       if (physicalType==CN470PREQUEL){freq_band=470;}  
       if (physicalType==KR920){freq_band=920;}
       if (physicalType==STE920){freq_band=920;}     
+      /*duty cycle over one hour, in 1/1000. 1000: no duty cycle (dwell time or listen before talk bands)*/
+      switch (physicalType){
+        case EU434: case EU868: case CN779: case AS923: case STE920: case RU864:
+          ledger.setLimits(10,LORA_FAIR_USE_MS_PER_DAY); break;
+        default:
+          ledger.setLimits(1000,LORA_FAIR_USE_MS_PER_DAY); break;
+        }
+}
+
+/*sends a query and returns the text that follows p_prefix in the response, NULL if it is not there*/
+const char* LoRaE5Class::at_query(const char* p_cmd, const char* p_prefix, const char* p_ack){
+    const char* p;
+    at_wait();/*let a pending asynchronous command finish before issuing a new one*/
+    if (!at_send_async(p_cmd,p_ack,DEFAULT_TIMEWAIT,NULL,NULL)){return NULL;}
+    if (at_wait()==0){return NULL;}
+    p=strstr(recv_buf,p_prefix);
+    return (p==NULL)? NULL : p+strlen(p_prefix);
+}
+
+/*FNV-1a of the settings that cannot be read back from the module. The band is included because
+  changing it resets the channel plan*/
+uint32_t LoRaE5Class::config_fingerprint(const _lora_config_t& config){
+    uint32_t hash=2166136261UL;
+    const unsigned char fields[]={(unsigned char)config.band,config.channel};
+    for (unsigned char i=0; i<sizeof(fields); i++){hash=(hash^fields[i])*16777619UL;}
+    if (config.app_key!=NULL){
+      for (const char* p=config.app_key; *p!='\0'; p++){hash=(hash^(unsigned char)*p)*16777619UL;}
       }
+    return hash;
+}
 
-return(time_cmd);	 
+/*true if the value at p (text after the prefix of a query response) is the word str*/
+static bool config_word_is(const char* p, const char* str){
+    size_t len=strlen(str);
+    return (p!=NULL)&&(strncmp(p,str,len)==0)&&((p[len]=='\r')||(p[len]==' ')||(p[len]=='\0'));
+}
+
+unsigned int LoRaE5Class::applyConfig(const _lora_config_t& config, _config_report_t* report){
+    const char* mode_str[]={"LWABP","LWOTAA","TEST"};
+    _config_report_t r={0,0,0,0};
+    unsigned long start=millis();
+    uint32_t fingerprint=config_fingerprint(config);
+    uint32_t fingerprint_stored=0;
+    const char* p;
+    const char* band_p=NULL;
+    bool band_same=false;
+    bool dr_same=false;
+    unsigned int query_ms=DEFAULT_TIMEWAIT;/*round trip of a query, used to estimate the time of a skipped setting*/
+    /*device mode: "+MODE: LWOTAA"*/
+    p=at_query(AT_CMD_MODE_QUERY,AT_ACK_MODE,AT_CMD_END);
+    if (p!=NULL){query_ms=at_latency();}
+    if ((config.mode<=TEST)&&config_word_is(p,mode_str[config.mode])){r.skipped++; r.saved_ms+=query_ms;}
+    else{setDeviceMode(config.mode); r.sent++;}
+    /*band and data rate: "+DR: DR4" followed by "+DR: AS923 DR4 SF8 BW125K"*/
+    p=at_query(AT_CMD_DR_QUERY,"+DR: DR"," BW| FSK");
+    if (p!=NULL){
+      dr_same=(atoi(p)==(int)config.data_rate);
+      band_p=strstr(p,AT_ACK_DR);
+      }
+    if ((band_p!=NULL)&&(config.band>UNINIT)&&(config.band<(int)(sizeof(physTypeStr)/sizeof(physTypeStr[0])))){
+      band_same=config_word_is(band_p+strlen(AT_ACK_DR),physTypeStr[config.band]);
+      }
+    if (band_same){store_frequency_band(config.band); r.skipped++; r.saved_ms+=query_ms;}
+    else{setFrequencyBand(config.band); r.sent++; dr_same=false;}/*a new band resets the data rate and the channels*/
+    if (dr_same){store_data_rate(config.data_rate,config.band); r.skipped++; r.saved_ms+=DEFAULT_TIMEWAIT;}/*AT+DR=x is sent without waiting for an ACK*/
+    else{setDataRate(config.data_rate,config.band); r.sent++;}
+    /*App key and channel, compared with the fingerprint of the last applied values*/
+  #ifdef LORA_NVS_PERSIST
+    Preferences nvs;
+    if (nvs.begin(LORA_NVS_NAMESPACE,true)){
+      fingerprint_stored=nvs.getUInt(LORA_NVS_KEY_CONFIG,0);
+      nvs.end();
+      }
+  #endif
+    if (band_same&&(fingerprint_stored==fingerprint)){
+      r.skipped+=(config.app_key!=NULL)? 2 : 1;
+      r.saved_ms+=DEFAULT_TIMEWAIT+((config.app_key!=NULL)? query_ms : 0);
+      }
+    else{
+      bool key_ok=true;
+      if (config.app_key!=NULL){key_ok=(setKey(NULL,NULL,(char*)config.app_key)>0); r.sent++;}
+      setChannel(config.channel); r.sent++;
+    #ifdef LORA_NVS_PERSIST
+      if (key_ok&&nvs.begin(LORA_NVS_NAMESPACE,false)){
+        nvs.putUInt(LORA_NVS_KEY_CONFIG,fingerprint);
+        nvs.end();
+        }
+    #else
+      (void)key_ok;
+    #endif
+      }
+    /*class: "+CLASS: C"*/
+    p=at_query(AT_CMD_CLASS_QUERY,AT_ACK_CLASS,AT_CMD_END);
+    if ((p!=NULL)&&(*p==((config.class_type==CLASS_C)? 'C' : 'A'))){r.skipped++; r.saved_ms+=query_ms;}
+    else{setClassType(config.class_type); r.sent++;}
+    /*port: "+PORT: 8"*/
+    p=at_query(AT_CMD_PORT_QUERY,AT_ACK_PORT,AT_CMD_END);
+    if ((p!=NULL)&&(atoi(p)==config.port)){port_last=config.port; r.skipped++; r.saved_ms+=query_ms;}
+    else{setPort(config.port); r.sent++;}
+    /*power: "+POWER: 14"*/
+    p=at_query(AT_CMD_POWER_QUERY,AT_ACK_POWER,AT_CMD_END);
+    if ((p!=NULL)&&(atoi(p)==config.power)){txPower=config.power; r.skipped++; r.saved_ms+=query_ms;}
+    else{setPower(config.power); r.sent++;}
+    /*adaptive data rate: "+ADR: ON"*/
+    p=at_query(AT_CMD_ADR_QUERY,AT_ACK_ADR,AT_CMD_END);
+    if (config_word_is(p,config.adr? "ON" : "OFF")){adaptative_DR=config.adr; r.skipped++; r.saved_ms+=query_ms;}
+    else{setAdaptiveDataRate(config.adr); r.sent++;}
+    r.time_ms=millis()-start;
+    LORA_LOG_INFO("\r\nConfiguration applied. Sent:",r.sent," Skipped:",r.skipped," Time[ms]:",r.time_ms," Saved[ms]:",r.saved_ms);
+    if (report!=NULL){*report=r;}
+    return r.time_ms;
 }
 							   
 
@@ -435,25 +853,43 @@ unsigned int LoRaE5Class::setDataRate(_data_rate_t dataRate,
     unsigned int time_cmd=0;
 
     if ((dataRate <= UNINIT)) {
-        #ifdef COMMAND_PRINT_TO_USER
-         SerialUSB.print("\r\n!!Unknown datarate\n");
-        #endif
+        LORA_LOG_ERROR("\r\n!!Unknown datarate\n");
         return 0;
     }
     // set frequency band first if was no set. If you change the frequency band, a rejoin will be requested to send messages in OOTA mode
-	if (freq_band==0){time_cmd=+setFrequencyBand(physicalType); }
+	if (freq_band==0){time_cmd+=setFrequencyBand(physicalType); }
     // then set data rate
-    cmd[0]='\0';//reset the string position
-    sprintf(cmd, "AT+DR=%d\r\n", dataRate);
-    time_cmd=+at_send_check_response(cmd,AT_NO_ACK,DEFAULT_TIMEWAIT,NULL);
+    if (!at_open()){return 0;}
+    at_put(AT_CMD_DR);
+    at_put((long)dataRate);
+    at_put(AT_CMD_END);
+    time_cmd+=at_close(AT_NO_ACK,DEFAULT_TIMEWAIT);
+    store_data_rate(dataRate,(physicalType>UNINIT)? physicalType : FREQBAND_last);
 
     return time_cmd;
 }
+/*modulation of a data rate in the LoRaWAN band plans (see the tables in LoRa-E5.h)*/
+void LoRaE5Class::store_data_rate(_data_rate_t dataRate, _physical_type_t physicalType){
+    int dr=(int)dataRate;
+    if ((physicalType==US915)||(physicalType==US915HYBRID)||(physicalType==US915OLD)){
+      if (dr<=3)                {store_modulation((_spreading_factor_t)(10-dr),BW125);}
+      else if (dr==4)           {store_modulation(SF8,BW500);}
+      else if ((dr>=8)&&(dr<=13)){store_modulation((_spreading_factor_t)(20-dr),BW500);}
+      return;
+      }
+    if (dr<=5)                  {store_modulation((_spreading_factor_t)(12-dr),BW125);}
+    else if (physicalType==AU915){
+      if (dr==6)                {store_modulation(SF8,BW500);}
+      else if ((dr>=8)&&(dr<=13)){store_modulation((_spreading_factor_t)(20-dr),BW500);}
+      }
+    else if (dr==6)             {store_modulation(SF7,BW250);}
+    else if (dr==7)             {store_modulation(SF7,BW50kbps);}
+}
 unsigned int LoRaE5Class::setSpreadFactor(_spreading_factor_t SF, _band_width_t BW,_physical_type_t physicalType){
 _data_rate_t DR=DRNONE; /*To ensure you are setting a supported DR*/
 unsigned int time_cmd=0;
      // set frequency band first if was no set. If you change the frequency band, a rejoin will be requested to send messages in OOTA mode
-	if (freq_band==0){time_cmd=+setFrequencyBand(physicalType); }
+	if (freq_band==0){time_cmd+=setFrequencyBand(physicalType); }
 	/*now set the spread factor*/
 if ((physicalType==CN470)or(physicalType==KR920)or
     (physicalType==CN470PREQUEL)){
@@ -497,20 +933,12 @@ if ((physicalType==EU868)or(physicalType==CN779)or
 }  
 
 if(DR!=DRNONE){
-    #ifdef COMMAND_PRINT_TO_USER
-     SerialUSB.print("\r\nSetting Data Rate according to Spread factor (SF), BandWidth (BW) and LoRaWAN Standard Band Plan selected");
-    #endif 
+    LORA_LOG_INFO("\r\nSetting Data Rate according to Spread factor (SF), BandWidth (BW) and LoRaWAN Standard Band Plan selected");
     time_cmd=setDataRate(DR,UNINIT); /*Set only DR.*/
-	if (time_cmd>0){
-		BW_last=BW;
-		SF_last=SF;
-	}
-	SF_BW_to_bitrate_txhead_time(SF,BW); /*update the variables values*/
+	if (time_cmd>0){store_modulation(SF,BW);} /*update the variables values*/
    }
 else{
-    #ifdef COMMAND_PRINT_TO_USER
-     SerialUSB.print("\r\n ERORR: The combination of Spread factor (SF) and BandWidth (BW) is not supported LoRaWAN Standard Band Plan.Therefore, no Data rate was seeted. Example: For EU868 there is ot Data Rate defined for a SF=12 and BW=500K");
-    #endif 
+    LORA_LOG_ERROR("\r\n ERORR: The combination of Spread factor (SF) and BandWidth (BW) is not supported LoRaWAN Standard Band Plan.Therefore, no Data rate was seeted. Example: For EU868 there is ot Data Rate defined for a SF=12 and BW=500K");
     time_cmd=0;
     }
 return(time_cmd);
@@ -518,76 +946,112 @@ return(time_cmd);
                                   
 unsigned int LoRaE5Class::setPower(short power) {
     unsigned int time_cmd=0;
-    cmd_resp_ack[0]='\0';
-    cmd[0]='\0';//reset the string position
-    sprintf(cmd, "AT+POWER=%d\r\n", power);
-    sprintf(cmd_resp_ack, "+POWER: %d", power);
-    time_cmd=at_send_check_response(cmd,cmd_resp_ack,DEFAULT_TIMEWAIT,NULL);// returns 0 if the command was not ACK by Gateway.
+    char ack[AT_ACK_LENGTH_MAX];
+    if (!at_open()){return 0;}
+    at_put(AT_CMD_POWER);
+    at_put((long)power);
+    at_put(AT_CMD_END);
+    time_cmd=at_close(at_ack_number(ack,sizeof(ack),AT_ACK_POWER,power),DEFAULT_TIMEWAIT);// returns 0 if the command was not ACK by Gateway.
     if (time_cmd>0){txPower=power;}//If command was ACK properly, we store the value
     return(time_cmd);
 }
 
 unsigned int LoRaE5Class::setPort(unsigned char port) {
     unsigned int time_cmd=0;
-    cmd_resp_ack[0]='\0';
-    cmd[0]='\0';//reset the string position
-    sprintf(cmd, "AT+PORT=%d\r\n", port);
-    sprintf(cmd_resp_ack, "+PORT: %d", port);
-    time_cmd=at_send_check_response(cmd,cmd_resp_ack,DEFAULT_TIMEWAIT,NULL);// returns 0 if the command was not ACK by Gateway.
+    char ack[AT_ACK_LENGTH_MAX];
+    if (!at_open()){return 0;}
+    at_put(AT_CMD_PORT);
+    at_put((long)port);
+    at_put(AT_CMD_END);
+    time_cmd=at_close(at_ack_number(ack,sizeof(ack),AT_ACK_PORT,port),DEFAULT_TIMEWAIT);// returns 0 if the command was not ACK by Gateway.
+    port_last=(time_cmd>0)?port:0;
     return(time_cmd);
 }
 
 unsigned int LoRaE5Class::setAdaptiveDataRate(bool command) {
     unsigned int time_cmd=0;
-    cmd_resp_ack[0]='\0';
-    cmd[0]='\0';//reset the string position
-    if (command){
-        sprintf(cmd,"AT+ADR=ON\r\n");
-        sprintf(cmd_resp_ack, "+ADR: ON");
-        }
-    else{
-        sprintf(cmd,"AT+ADR=OFF\r\n");
-        sprintf(cmd_resp_ack, "+ADR: OFF");
-        }
-    time_cmd=at_send_check_response(cmd,cmd_resp_ack,DEFAULT_TIMEWAIT,NULL);// returns 0 if the command was not ACK by Gateway.
+    if (command){time_cmd=at_send_check_response(AT_CMD_ADR_ON,AT_ACK_ADR_ON,DEFAULT_TIMEWAIT,NULL);}
+    else        {time_cmd=at_send_check_response(AT_CMD_ADR_OFF,AT_ACK_ADR_OFF,DEFAULT_TIMEWAIT,NULL);}
     /*If command was acknowledged, update the adaptative_DR variable */
 	if (time_cmd>0){adaptative_DR=command;}
 	return(time_cmd);
 }
 
+void LoRaE5Class::setDataRateBegin(_data_rate_t dataRate, bool adr){
+    dr_wanted=dataRate;
+    dr_adr_wanted=adr;
+    dr_adr_pending=true;
+    dr_pending=true;
+}
+
+bool LoRaE5Class::dataRatePending(void){
+    return dr_adr_pending||dr_pending;
+}
+
+void LoRaE5Class::dr_step(void){
+    char ack[AT_ACK_LENGTH_MAX];
+    if (queue_sending>=0){return;}/*between the port and the payload of an uplink*/
+    if (dr_adr_pending){
+      at_send_async(dr_adr_wanted? AT_CMD_ADR_ON : AT_CMD_ADR_OFF,dr_adr_wanted? AT_ACK_ADR_ON : AT_ACK_ADR_OFF,
+                    DEFAULT_TIMEWAIT,dr_adr_done,this);
+      return;
+      }
+    if ((!dr_pending)||(!at_begin())){return;}
+    at_put(AT_CMD_DR);
+    at_put((long)dr_wanted);
+    at_put(AT_CMD_END);
+    at_expect(at_ack_number(ack,sizeof(ack),AT_ACK_DR_NUMBER,dr_wanted),DEFAULT_TIMEWAIT,dr_done,this);
+}
+
+void LoRaE5Class::dr_adr_done(unsigned int time_ms, const char* response, void* ctx){
+    LoRaE5Class* lora=(LoRaE5Class*)ctx;
+    (void)response;
+    lora->dr_adr_pending=false;
+    if (time_ms>0){lora->adaptative_DR=lora->dr_adr_wanted; return;}
+    LORA_LOG_WARN("\r\nADR change not acknowledged, data rate unchanged");
+    lora->dr_pending=false;
+}
+
+void LoRaE5Class::dr_done(unsigned int time_ms, const char* response, void* ctx){
+    LoRaE5Class* lora=(LoRaE5Class*)ctx;
+    (void)response;
+    lora->dr_pending=false;
+    if (time_ms>0){lora->store_data_rate(lora->dr_wanted,lora->FREQBAND_last); return;}
+    LORA_LOG_WARN("\r\nData rate change not acknowledged");
+}
+
 unsigned int LoRaE5Class::getChannel(void) {
     unsigned int time_cmd=0;
-    cmd_resp_ack[0]='\0';
-    cmd[0]='\0';//reset the string position
-    sprintf(cmd,"AT+CH\r\n");
-    sprintf(cmd_resp_ack, "+ADR: ON");
-    time_cmd=at_send_check_response(cmd,"+CH:",DEFAULT_TIMEWAIT,NULL);// returns 0 if the command was not ACK by Gateway.
-    time_cmd=+at_send_check_response(cmd,cmd_resp_ack,DEFAULT_TIMEWAIT,NULL);// returns 0 if the command was not ACK by Gateway.
+    time_cmd=at_send_check_response(AT_CMD_CH_QUERY,AT_ACK_CH,DEFAULT_TIMEWAIT,NULL);// returns 0 if the command was not ACK by Gateway.
+    time_cmd+=at_send_check_response(AT_CMD_CH_QUERY,AT_ACK_ADR_ON,DEFAULT_TIMEWAIT,NULL);// returns 0 if the command was not ACK by Gateway.
     return(time_cmd);
 }
 unsigned int LoRaE5Class::setChannel(unsigned char channel) {
     unsigned int time_cmd=0;
-    cmd_resp_ack[0]='\0';
-    cmd[0]='\0';//reset the string position
-    sprintf(cmd, "AT+CH=%d\r\n", channel);
-    sprintf(cmd_resp_ack, "+CH: %d", channel); //"+CH: %d" //to know is ok
-    time_cmd=at_send_check_response(cmd,AT_NO_ACK,DEFAULT_TIMEWAIT,NULL);// returns 0 if the command was not ACK by Gateway.
+    if (!at_open()){return 0;}
+    at_put(AT_CMD_CH);
+    at_put((long)channel);
+    at_put(AT_CMD_END);
+    time_cmd=at_close(AT_NO_ACK,DEFAULT_TIMEWAIT);// returns 0 if the command was not ACK by Gateway.
     return(time_cmd);
 }
 unsigned int LoRaE5Class::setChannel(unsigned char channel, float frequency) {
     unsigned int time_cmd=0;
-    cmd_resp_ack[0]='\0';
-    cmd[0]='\0';//reset the string position
-    if (frequency == 0){
-        sprintf(cmd, "AT+CH=0,%d,0\r\n", channel);
-        sprintf(cmd_resp_ack, "+CH: %d,DR:0\r\n", channel);
+    char ack[AT_ACK_LENGTH_MAX];
+    if (!at_open()){return 0;}
+    at_put(AT_CMD_CH);
+    if (frequency == 0){/*AT+CH=0,<channel>,0*/
+        at_put("0,");
+        at_put((long)channel);
+        at_put(",0");
         }
     else{
-        sprintf(cmd, "AT+CH=%d,%d.%d\r\n", channel, (short)frequency,
-                short(frequency * 10) % 10);
-       sprintf(cmd_resp_ack, "+CH: %d,DR:0\r\n", channel);
+        at_put((long)channel);
+        at_put(AT_CMD_SEPARATOR);
+        at_put_freq(frequency);
       }
-    time_cmd=at_send_check_response(cmd,cmd_resp_ack,DEFAULT_TIMEWAIT,NULL);// returns 0 if the command was not ACK by Gateway.
+    at_put(AT_CMD_END);
+    time_cmd=at_close(at_ack_number(ack,sizeof(ack),AT_ACK_CH,channel,AT_ACK_CH_DR0),DEFAULT_TIMEWAIT);// returns 0 if the command was not ACK by Gateway.
     return(time_cmd);
 }
 
@@ -596,10 +1060,15 @@ unsigned int LoRaE5Class::setChannel(unsigned char channel, float frequency,
     unsigned int time_cmd=0;
     if (channel > 16) channel = 16;
 
-    memset(cmd, 0, 32);
-    sprintf(cmd, "AT+CH=%d,%d.%d,%d\r\n", channel, (short)frequency,
-            short(frequency * 10) % 10, dataRata);
-    time_cmd=at_send_check_response(cmd,AT_NO_ACK,DEFAULT_TIMEWAIT,NULL);// returns 0 if the command was not ACK by Gateway.
+    if (!at_open()){return 0;}
+    at_put(AT_CMD_CH);
+    at_put((long)channel);
+    at_put(AT_CMD_SEPARATOR);
+    at_put_freq(frequency);
+    at_put(AT_CMD_SEPARATOR);
+    at_put((long)dataRata);
+    at_put(AT_CMD_END);
+    time_cmd=at_close(AT_NO_ACK,DEFAULT_TIMEWAIT);// returns 0 if the command was not ACK by Gateway.
     if(time_cmd>0){freq_band=frequency;}
     return(time_cmd);
 }
@@ -611,300 +1080,245 @@ unsigned int LoRaE5Class::setChannel(unsigned char channel, float frequency,
 
     if (channel > 16) channel = 16;
 
-    memset(cmd, 0, 32);
-    sprintf(cmd, "AT+CH=%d,%d.%d,%d,%d\r\n", channel, (short)frequency,
-            short(frequency * 10) % 10, dataRataMin, dataRataMax);
-            
-    time_cmd=at_send_check_response(cmd,AT_NO_ACK,DEFAULT_TIMEWAIT,NULL);// returns 0 if the command was not ACK by Gateway.
+    if (!at_open()){return 0;}
+    at_put(AT_CMD_CH);
+    at_put((long)channel);
+    at_put(AT_CMD_SEPARATOR);
+    at_put_freq(frequency);
+    at_put(AT_CMD_SEPARATOR);
+    at_put((long)dataRataMin);
+    at_put(AT_CMD_SEPARATOR);
+    at_put((long)dataRataMax);
+    at_put(AT_CMD_END);
+    time_cmd=at_close(AT_NO_ACK,DEFAULT_TIMEWAIT);// returns 0 if the command was not ACK by Gateway.
     return time_cmd;
 }
 
 unsigned int LoRaE5Class::transferPacket(char *buffer, unsigned int timeout) {
+    at_wait();
+    if(!transferPacketAsync(buffer,timeout,NULL,NULL)){return 0;}
+    return at_wait();
+}
+
+bool LoRaE5Class::transferPacketAsync(char *buffer, unsigned int timeout,
+                                      at_callback_t callback, void *ctx) {
     unsigned char length = strlen(buffer);
-    int i;
-    unsigned int time_ret;
-    #ifdef COMMAND_PRINT_TO_USER
-     cmd[0]='\0';//reset the string
-     sprintf(cmd,"\r\nSending %i characters to a LoRa Gateway",(int)length);
-     SerialUSB.print(cmd);
-    #endif
-    cmd[0]='\0';//reset the string
-    sprintf(cmd,"AT+MSG=\"%s\"\r\n",buffer);
-    time_ret=at_send_check_response(cmd,"Done",timeout,NULL);
-    return time_ret;
+    if(busy()){return false;}
+    LORA_LOG_INFO("\r\nSending ",(int)length," characters to a LoRa Gateway");
+    return at_send_payload(AT_CMD_MSG,(const unsigned char*)buffer,strlen(buffer),false,AT_ACK_DONE,timeout,callback,ctx);
 }
 
 unsigned int LoRaE5Class::transferPacket(unsigned char *buffer, unsigned char length,
                                   unsigned int timeout) {
-    int i;
-    unsigned int time_ret;
-    #ifdef COMMAND_PRINT_TO_USER
-     cmd[0]='\0';//reset the string
-     sprintf(cmd,"\r\nSending %i bytes to a LoRa Gateway",(int)length);
-     SerialUSB.print(cmd);
-    #endif
-    cmd[0]='\0';//reset the string size
-    sprintf(cmd+strlen(cmd),"AT+MSGHEX=\"");//name of the command
-    for ( i = 0; i < length; i++) { sprintf(cmd+strlen(cmd), "%02x", buffer[i]);}//add the characters in hex format
-    sprintf(cmd+strlen(cmd),"\"\r\n");//end of command
-    time_ret=at_send_check_response(cmd,"Done",timeout,NULL);
-    return time_ret;
+    at_wait();
+    if(!transferPacketAsync(buffer,length,timeout,NULL,NULL)){return 0;}
+    return at_wait();
+}
+
+bool LoRaE5Class::transferPacketAsync(unsigned char *buffer, unsigned char length,
+                                      unsigned int timeout,
+                                      at_callback_t callback, void *ctx) {
+    if(busy()){return false;}
+    LORA_LOG_INFO("\r\nSending ",(int)length," bytes to a LoRa Gateway");
+    return at_send_payload(AT_CMD_MSGHEX,buffer,length,true,AT_ACK_DONE,timeout,callback,ctx);
 }
 
 unsigned int LoRaE5Class::transferPacketWithConfirmed(char *buffer,
                                                unsigned int timeout) {
+    at_wait();
+    if(!transferPacketWithConfirmedAsync(buffer,timeout,NULL,NULL)){return 0;}
+    return at_wait();
+}
+
+/*The module answers "Wait ACK" after the transmission and "Done" once the RX windows
+  were closed, so the RXWIN1 delay is part of the command timeout*/
+bool LoRaE5Class::transferPacketWithConfirmedAsync(char *buffer, unsigned int timeout,
+                                                   at_callback_t callback, void *ctx) {
     unsigned char length = strlen(buffer);
-    int i;
-    unsigned int time_ret;
-    #ifdef COMMAND_PRINT_TO_USER
-     cmd[0]='\0';//reset the string
-     sprintf(cmd,"\r\nSending %i characters to a LoRa Gateway and waits for ACK",(int)length);
-     SerialUSB.print(cmd);
-    #endif
-    cmd[0]='\0';//reset the string
-    sprintf(cmd,"AT+CMSG=\"%s\"\r\n",buffer);
-    time_ret=at_send_check_response(cmd,"Wait ACK",timeout,NULL);
-	/*wait to Open reception Window*/
-	time_ret=+RXWIN1_DELAY;
-	/*turn off module to optimize performance*/
-	delay(RXWIN1_DELAY);/**/
-	time_ret=+at_send_check_response(NULL,"Done",timeout,NULL);
-    return time_ret;
+    if(busy()){return false;}
+    LORA_LOG_INFO("\r\nSending ",(int)length," characters to a LoRa Gateway and waits for ACK");
+    return at_send_payload(AT_CMD_CMSG,(const unsigned char*)buffer,strlen(buffer),false,AT_ACK_DONE,2*timeout+RXWIN1_DELAY,callback,ctx);
 }
 
 unsigned int LoRaE5Class::transferPacketWithConfirmed(unsigned char *buffer,
                                                unsigned char length,
                                                unsigned int timeout) {
-    int i;
-    unsigned int time_ret;
-    #ifdef COMMAND_PRINT_TO_USER
-     cmd[0]='\0';//reset the string
-     sprintf(cmd,"\r\nSending %i bytes to a LoRa Gateway and waits for ACK",(int)length);
-     SerialUSB.print(cmd);
-    #endif
-    cmd[0]='\0';//reset the string size
-    sprintf(cmd+strlen(cmd),"AT+CMSGHEX=\"");//name of the command
-    for ( i = 0; i < length; i++) { sprintf(cmd+strlen(cmd), "%02x", buffer[i]);}//add the characters in hex format
-    sprintf(cmd+strlen(cmd),"\"\r\n");//end of command
-    time_ret=at_send_check_response(cmd,"Wait ACK",timeout,NULL);
-    /*wait to Open reception Window*/
-	time_ret=+RXWIN1_DELAY;
-	/*sleep the device if automode until new reception window*/
-	delay(RXWIN1_DELAY);
-	/*Awakes the device until new reception window*/
-	time_ret=+at_send_check_response(NULL,"Done",timeout,NULL);
-    return time_ret;
+    at_wait();
+    if(!transferPacketWithConfirmedAsync(buffer,length,timeout,NULL,NULL)){return 0;}
+    return at_wait();
+}
+
+bool LoRaE5Class::transferPacketWithConfirmedAsync(unsigned char *buffer, unsigned char length,
+                                                   unsigned int timeout,
+                                                   at_callback_t callback, void *ctx) {
+    if(busy()){return false;}
+    LORA_LOG_INFO("\r\nSending ",(int)length," bytes to a LoRa Gateway and waits for ACK");
+    return at_send_payload(AT_CMD_CMSGHEX,buffer,length,true,AT_ACK_DONE,2*timeout+RXWIN1_DELAY,callback,ctx);
 }
+/*starts at the fastest SF that holds the link margin and falls back one SF per missed ack.
+  The timeout grows with the time on air of each SF*/
 unsigned int LoRaE5Class::transferPacketWithConfirmed(unsigned char *buffer,
                                      unsigned char length,
 									 _spreading_factor_t SF_init,_spreading_factor_t SF_end,
                                      unsigned int timeout){
-    unsigned int time_ret=0;	
-    unsigned int time_ret_r=millis();	
-for (unsigned int i = (unsigned int)SF_init; i < ((unsigned int)SF_end+1); ++i){
-	       #ifdef COMMAND_PRINT_TO_USER
-            cmd[0]='\0';//reset the string
-            sprintf(cmd,"\r\nTransmiting packet with SF%i", i);
-            SerialUSB.print(cmd);
-           #endif
-		   delay(50);//delay for ensuring proper behaivour
-		   setSpreadFactor((_spreading_factor_t)i,BW_last,FREQBAND_last);//unsigned int LoRaE5Class::setSpreadFactor(_spreading_factor_t SF, _band_width_t BW,_physical_type_t physicalType){
-		   time_ret=transferPacketWithConfirmed(buffer, length,  1000+ (i-6)*timeout); 
-		   if (time_ret>0){break;}/*if time_ret>0 means that the message was ACK, so we break the RTX loop*/
-}
-time_ret_r=millis()-time_ret_r;
-return(time_ret_r);						 
-}
-short LoRaE5Class::receivePacket(char *buffer, short length, short *rssi,unsigned int delay) {
-    char *ptr;
-    short number = 0;
-    unsigned int time_ret;
-    //call to recieve packet during a time window time window
-    readBuffer(recv_buf,sizeof(recv_buf),delay);
-    //parse the packet content
-    ptr = strstr(recv_buf, "RSSI ");
-    if (ptr)
-        *rssi = atoi(ptr + 5);
-    else
-        *rssi = -255;
-
-    ptr = strstr(recv_buf, "RX: \"");
-    if (ptr) {
-        ptr += 5;
-        for (short i = 0;; i++) {
-            char temp[3]      = {0, 0};
-            unsigned char tmp = '?', result = 0;
-
-            temp[0] = *(ptr + i * 3);
-            temp[1] = *(ptr + i * 3 + 1);
-
-            for (unsigned char j = 0; j < 2; j++) {
-                if ((temp[j] >= '0') && (temp[j] <= '9'))
-                    tmp = temp[j] - '0';
-                else if ((temp[j] >= 'A') && (temp[j] <= 'F'))
-                    tmp = temp[j] - 'A' + 10;
-                else if ((temp[j] >= 'a') && (temp[j] <= 'f'))
-                    tmp = temp[j] - 'a' + 10;
-
-                result = result * 16 + tmp;
-            }
-
-            if (i < length) buffer[i] = result;
+    unsigned long start=millis();
+    for (unsigned int sf=link.selectSF(SF_last,SF_init,SF_end); sf<=(unsigned int)SF_end; sf++){
+      LORA_LOG_INFO("\r\nTransmiting packet with SF",sf);
+      if (sf!=(unsigned int)SF_last){setSpreadFactor((_spreading_factor_t)sf,BW_last,FREQBAND_last);}
+      uplink_acked=false;
+      transferPacketWithConfirmed(buffer,length,timeout+(unsigned int)getTransmissionTime(length));
+      if (uplink_acked){break;}/*the message was ACK, so we break the RTX loop*/
+      }
+    return(millis()-start);
+}
 
-            if (*(ptr + i * 3 + 3) == '\"' && *(ptr + i * 3 + 4) == '\r' &&
-                *(ptr + i * 3 + 5) == '\n') {
-                number = i + 1;
-                break;
-            }
-        }
-    }
+_spreading_factor_t LoRaE5Class::getLinkSpreadFactor(_spreading_factor_t SF_min, _spreading_factor_t SF_max){
+    return (_spreading_factor_t)link.selectSF(SF_last,SF_min,SF_max);
+}
 
-    ptr = strstr(recv_buf, "MACCMD: \"");
-    if (ptr) {
-        buffer[0] = 'M';
-        buffer[1] = 'A';
-        buffer[2] = 'C';
-        buffer[3] = 'C';
-        buffer[4] = 'M';
-        buffer[5] = 'D';
-        buffer[6] = ':';
-
-        ptr += 9;
-        for (short i = 0;; i++) {
-            char temp[3]      = {0};
-            unsigned char tmp = '?', result = 0;
-
-            temp[0] = *(ptr + i * 3);
-            temp[1] = *(ptr + i * 3 + 1);
-
-            for (unsigned char j = 0; j < 2; j++) {
-                if ((temp[j] >= '0') && (temp[j] <= '9'))
-                    tmp = temp[j] - '0';
-                else if ((temp[j] >= 'A') && (temp[j] <= 'F'))
-                    tmp = temp[j] - 'A' + 10;
-                else if ((temp[j] >= 'a') && (temp[j] <= 'f'))
-                    tmp = temp[j] - 'a' + 10;
-
-                result = result * 16 + tmp;
-            }
+float LoRaE5Class::getLinkSnr(void){
+    return link.snr();
+}
 
-            if ((i + 7) < length) buffer[i + 7] = result;
+short LoRaE5Class::getLinkRssi(void){
+    return link.rssi();
+}
 
-            if (*(ptr + i * 3 + 3) == '\"' && *(ptr + i * 3 + 4) == '\r' &&
-                *(ptr + i * 3 + 5) == '\n') {
-                number = i + 1 + 7;
-                break;
-            }
-        }
-    }
+float LoRaE5Class::getLinkMargin(void){
+    return link.margin(SF_last);
+}
 
-    return number;
+/*the answer arrives with the next uplink: +MSG: Link 20, 1*/
+unsigned int LoRaE5Class::requestLinkCheck(void){
+    return at_send_check_response(AT_CMD_LINK_CHECK,AT_ACK_LINK_CHECK,DEFAULT_TIMEWAIT,NULL);
+}
+/*waits up to "timeout" ms for a downlink parsed by the dispatcher and copies it to buffer*/
+short LoRaE5Class::receivePacket(char *buffer, short length, short *rssi,unsigned int timeout) {
+    short number = 0;
+    unsigned long startMillis=millis();
+    while ((!downlink_unread)&&((millis()-startMillis)<timeout)){
+      at_poll();
+      if (!downlink_unread){delay(1);}
+      }
+    if (!downlink_unread){*rssi=-255; return 0;}
+    downlink_unread=false;
+    *rssi=downlink.rssi;
+    if (downlink.maccmd){
+      if (length<=7){return 0;}
+      memcpy(buffer, MAC_COMMAND_FLAG, 7);/*"MACCMD:" prefix followed by the decoded command*/
+      number=7;
+      }
+    short copy=downlink.length;
+    if ((number+copy)>length){copy=length-number;}/*truncate to the buffer provided*/
+    memcpy(buffer+number,downlink.payload,copy);
+    return number+copy;
 }
 
 unsigned int LoRaE5Class::transferProprietaryPacket(char *buffer,
                                              unsigned int timeout) {
+    at_wait();
+    if(!transferProprietaryPacketAsync(buffer,timeout,NULL,NULL)){return 0;}
+    return at_wait();
+}
+
+bool LoRaE5Class::transferProprietaryPacketAsync(char *buffer, unsigned int timeout,
+                                                 at_callback_t callback, void *ctx) {
     unsigned char length = strlen(buffer);
-    int i;
-    unsigned int time_ret;
-    #ifdef COMMAND_PRINT_TO_USER
-     cmd[0]='\0';//reset the string
-     sprintf(cmd,"\r\nSending %i characters in LoRaWAN proprietary frames format to a LoRa Gateway",(int)length);
-     SerialUSB.print(cmd);
-    #endif
-    cmd[0]='\0';//reset the string
-    sprintf(cmd,"AT+PMSG=\"%s\"\r\n",buffer);
-    time_ret=at_send_check_response(cmd,"Done",timeout,NULL);
-    return time_ret; 
+    if(busy()){return false;}
+    LORA_LOG_INFO("\r\nSending ",(int)length," characters in LoRaWAN proprietary frames format to a LoRa Gateway");
+    return at_send_payload(AT_CMD_PMSG,(const unsigned char*)buffer,strlen(buffer),false,AT_ACK_DONE,timeout,callback,ctx);
 }
 
 unsigned int LoRaE5Class::transferProprietaryPacket(unsigned char *buffer,
                                              unsigned char length,
                                              unsigned int timeout) {
-    int i;
-    unsigned int time_ret;
-    #ifdef COMMAND_PRINT_TO_USER
-     cmd[0]='\0';//reset the string
-     sprintf(cmd,"\r\nSending %i bytes in LoRaWAN proprietary frames format to a LoRa Gateway",(int)length);
-     SerialUSB.print(cmd);
-    #endif
-    cmd[0]='\0';//reset the string size
-    sprintf(cmd+strlen(cmd),"AT+PMSGHEX=\"");//name of the command
-    for ( i = 0; i < length; i++) { sprintf(cmd+strlen(cmd), "%02x", buffer[i]);}//add the characters in hex format
-    sprintf(cmd+strlen(cmd),"\"\r\n");//end of command
-    time_ret=at_send_check_response(cmd,"Done",timeout,NULL);
-    return time_ret;
+    at_wait();
+    if(!transferProprietaryPacketAsync(buffer,length,timeout,NULL,NULL)){return 0;}
+    return at_wait();
+}
+
+bool LoRaE5Class::transferProprietaryPacketAsync(unsigned char *buffer, unsigned char length,
+                                                 unsigned int timeout,
+                                                 at_callback_t callback, void *ctx) {
+    if(busy()){return false;}
+    LORA_LOG_INFO("\r\nSending ",(int)length," bytes in LoRaWAN proprietary frames format to a LoRa Gateway");
+    return at_send_payload(AT_CMD_PMSGHEX,buffer,length,true,AT_ACK_DONE,timeout,callback,ctx);
 }
 
 unsigned int LoRaE5Class::setUnconfirmedMessageRepeatTime(unsigned char time) {
     unsigned int time_ret=0;
+    char ack[AT_ACK_LENGTH_MAX];
     //ensure a proper value
     if (time > 15)
         time = 15;
     else if (time == 0)
         time = 1;
 
-    cmd[0]='\0';
-    cmd_resp_ack[0]='\0';
-    sprintf(cmd, "AT+REPT=%d\r\n", time);
-    sprintf(cmd_resp_ack, "+REPT=%d\r\n", time);
-    time_ret=at_send_check_response(cmd,cmd_resp_ack,DEFAULT_TIMEWAIT,NULL);
+    if (!at_open()){return 0;}
+    at_put(AT_CMD_REPT);
+    at_put((long)time);
+    at_put(AT_CMD_END);
+    time_ret=at_close(at_ack_number(ack,sizeof(ack),AT_ACK_REPT,time,AT_CMD_END),DEFAULT_TIMEWAIT);
     return time_ret;
 }
 
 unsigned int LoRaE5Class::setConfirmedMessageRetryTime(unsigned char time) {
     unsigned int time_ret=0;
+    char ack[AT_ACK_LENGTH_MAX];
     if (time > 15)
         time = 15;
     else if (time == 0)
         time = 1;
-        
-    cmd[0]='\0';
-    cmd_resp_ack[0]='\0';
-    sprintf(cmd, "AT+RETRY=%d\r\n", time);
-    sprintf(cmd_resp_ack, "+RETRY=%d\r\n", time);
-    time_ret=at_send_check_response(cmd,cmd_resp_ack,DEFAULT_TIMEWAIT,NULL);
+
+    if (!at_open()){return 0;}
+    at_put(AT_CMD_RETRY);
+    at_put((long)time);
+    at_put(AT_CMD_END);
+    time_ret=at_close(at_ack_number(ack,sizeof(ack),AT_ACK_RETRY,time,AT_CMD_END),DEFAULT_TIMEWAIT);
     return time_ret;
 }
 
 unsigned int LoRaE5Class::getReceiveWindowFirst(void) {
     unsigned int time_ret=0;
-    cmd[0]='\0';
-    sprintf(cmd, "AT+RXWIN1TRY=%d\r\n", time);
-    time_ret=at_send_check_response(cmd,AT_NO_ACK,DEFAULT_TIMEWAIT,NULL);
+    time_ret=at_send_check_response(AT_CMD_RXWIN1_QUERY,AT_NO_ACK,DEFAULT_TIMEWAIT,NULL);
     return time_ret;
 }
 
 unsigned int LoRaE5Class::setReceiveWindowFirst(bool command) {
     unsigned int time_ret=0;
-    cmd[0]='\0';
     if (command)
-        sprintf(cmd, "AT+RXWIN1=ON");
+        time_ret=at_send_check_response(AT_CMD_RXWIN1_ON,AT_NO_ACK,DEFAULT_TIMEWAIT,NULL);
     else
-        sprintf(cmd, "AT+RXWIN1=OFF");
-    time_ret=at_send_check_response(cmd,AT_NO_ACK,DEFAULT_TIMEWAIT,NULL);
+        time_ret=at_send_check_response(AT_CMD_RXWIN1_OFF,AT_NO_ACK,DEFAULT_TIMEWAIT,NULL);
     return time_ret;
 }
 unsigned int LoRaE5Class::setReceiveWindowFirst(unsigned char channel,
                                          float frequency) {
      unsigned int time_ret=0;
     //    if(channel > 16) channel = 16;
-    cmd[0]='\0';
+    if (!at_open()){return 0;}
+    at_put(AT_CMD_RXWIN1);
+    at_put((long)channel);
+    at_put(AT_CMD_SEPARATOR);
     if (frequency == 0)
-        sprintf(cmd, "AT+RXWIN1=%d,0\r\n", channel);
+        at_put("0");
     else
-        sprintf(cmd, "AT+RXWIN1=%d,%d.%d\r\n", channel, (short)frequency,
-                short(frequency * 10) % 10);
-    time_ret=at_send_check_response(cmd,AT_NO_ACK,DEFAULT_TIMEWAIT,NULL);
+        at_put_freq(frequency);
+    at_put(AT_CMD_END);
+    time_ret=at_close(AT_NO_ACK,DEFAULT_TIMEWAIT);
     return time_ret;
 }
 
 unsigned int LoRaE5Class::setReceiveWindowSecond(float frequency,
                                           _data_rate_t dataRate) {
      unsigned int time_ret=0;
-    cmd[0]='\0';
-    sprintf(cmd, "AT+RXWIN2=%d.%d,%d\r\n", (short)frequency,
-            short(frequency * 10) % 10, dataRate);
-    time_ret=at_send_check_response(cmd,AT_NO_ACK,DEFAULT_TIMEWAIT,NULL);
+    if (!at_open()){return 0;}
+    at_put(AT_CMD_RXWIN2);
+    at_put_freq(frequency);
+    at_put(AT_CMD_SEPARATOR);
+    at_put((long)dataRate);
+    at_put(AT_CMD_END);
+    time_ret=at_close(AT_NO_ACK,DEFAULT_TIMEWAIT);
     return time_ret;
 }
 
@@ -912,50 +1326,52 @@ unsigned int LoRaE5Class::setReceiveWindowSecond(float frequency,
                                           _spreading_factor_t spreadingFactor,
                                           _band_width_t bandwidth) {
     unsigned int time_ret=0;
-    cmd[0]='\0';
-    sprintf(cmd, "AT+RXWIN2=%d.%d,%d,%d\r\n", (short)frequency,
-            short(frequency * 10) % 10, spreadingFactor, bandwidth);
-    time_ret=at_send_check_response(cmd,AT_NO_ACK,DEFAULT_TIMEWAIT,NULL);
+    if (!at_open()){return 0;}
+    at_put(AT_CMD_RXWIN2);
+    at_put_freq(frequency);
+    at_put(AT_CMD_SEPARATOR);
+    at_put((long)spreadingFactor);
+    at_put(AT_CMD_SEPARATOR);
+    at_put((long)bandwidth);
+    at_put(AT_CMD_END);
+    time_ret=at_close(AT_NO_ACK,DEFAULT_TIMEWAIT);
     return time_ret;
 }
 
 unsigned int LoRaE5Class::setReceiveWindowDelay(_window_delay_t command,
                                          unsigned short _delay) {
     unsigned int time_ret=0;
-    cmd[0]='\0';
+    const char* p_cmd;
     if (command == RECEIVE_DELAY1)
-        sprintf(cmd, "AT+DELAY=RX1,%d\r\n", _delay);
+        p_cmd=AT_CMD_DELAY_RX1;
     else if (command == RECEIVE_DELAY2)
-        sprintf(cmd, "AT+DELAY=RX2,%d\r\n", _delay);
+        p_cmd=AT_CMD_DELAY_RX2;
     else if (command == JOIN_ACCEPT_DELAY1)
-        sprintf(cmd, "AT+DELAY=JRX1,%d\r\n", _delay);
+        p_cmd=AT_CMD_DELAY_JRX1;
     else if (command == JOIN_ACCEPT_DELAY2)
-        sprintf(cmd, "AT+DELAY=JRX2,%d\r\n", _delay);
-        
-    time_ret=at_send_check_response(cmd,AT_NO_ACK,DEFAULT_TIMEWAIT,NULL);
+        p_cmd=AT_CMD_DELAY_JRX2;
+    else
+        return 0;
+    if (!at_open()){return 0;}
+    at_put(p_cmd);
+    at_put((long)_delay);
+    at_put(AT_CMD_END);
+    time_ret=at_close(AT_NO_ACK,DEFAULT_TIMEWAIT);
     return time_ret;
 }
 
 unsigned int LoRaE5Class::setClassType(_class_type_t type) {
     unsigned int time_cmd=0;
-    cmd[0]='\0';//reset the string position
-    cmd_resp_ack[0]='\0';//reset the string position
-    char class_X;
     if (type == CLASS_C){
-        class_X='C';
+        time_cmd=at_send_check_response(AT_CMD_CLASS_C,AT_ACK_CLASS_C,DEFAULT_TIMEWAIT,NULL);
         }
     else{ if (type == CLASS_A){
-           class_X='A';
+           time_cmd=at_send_check_response(AT_CMD_CLASS_A,AT_ACK_CLASS_A,DEFAULT_TIMEWAIT,NULL);
            }
-           else { 
-              #ifdef COMMAND_PRINT_TO_USER
-               SerialUSB.print( "\r\nInvalid value for setClassType");
-              #endif 
-             } 
-          }    
-    sprintf(cmd, "AT+CLASS=%c\r\n", class_X);
-    sprintf(cmd_resp_ack, "CLASS: %c", class_X);//must return the BW in ks
-    time_cmd=at_send_check_response(cmd,cmd_resp_ack,DEFAULT_TIMEWAIT,NULL);
+           else {
+              LORA_LOG_ERROR("\r\nInvalid value for setClassType");
+             }
+          }
     return(time_cmd);
 }
 
@@ -965,19 +1381,14 @@ unsigned int LoRaE5Class::setClassType(_class_type_t type) {
 unsigned int LoRaE5Class::setDeviceMode(_device_mode_t mode) {
     int timeout = 1000;
     unsigned int time_cmd=0;//Returned time to succesfully execute a command. 
-    cmd[0]='\0';//reset the string
     if (mode == LWABP){
-        sprintf(cmd,"AT+MODE=LWABP\r\n");
-        time_cmd=at_send_check_response(cmd,"+MODE: LWABP",timeout,NULL);
+        time_cmd=at_send_check_response(AT_CMD_MODE_LWABP,AT_ACK_MODE_LWABP,timeout,NULL);
       }
     else if (mode == LWOTAA){
-        sprintf(cmd,"AT+MODE=LWOTAA\r\n");
-        time_cmd=at_send_check_response(cmd,"+MODE: LWOTAA",timeout,NULL);
+        time_cmd=at_send_check_response(AT_CMD_MODE_LWOTAA,AT_ACK_MODE_LWOTAA,timeout,NULL);
        }
     else {
-              #ifdef COMMAND_PRINT_TO_USER
-                 SerialUSB.print("\r\nBad command to setDeviceMode.");   
-              #endif  
+              LORA_LOG_ERROR("\r\nBad command to setDeviceMode.");
     }
     return time_cmd;//Returned time to succesfully execute a command. 0 if the command was not ACK by Gateway.
 }
@@ -988,69 +1399,274 @@ unsigned int LoRaE5Class::setDeviceMode(_device_mode_t mode) {
 //  setDeviceMode should have been called before this.
 unsigned int LoRaE5Class::setOTAAJoin(_otaa_join_cmd_t command,
                                unsigned int timeout) {
-    unsigned int time_cmd=0;//Returned time to succesfully execute a command. 
+    at_wait();
+    if(!setOTAAJoinAsync(command,timeout,NULL,NULL)){return 0;}
+    return at_wait();//Returned time to succesfully execute a command. 0 if the command was not ACK by Gateway.
+}
+
+bool LoRaE5Class::setOTAAJoinAsync(_otaa_join_cmd_t command, unsigned int timeout,
+                                   at_callback_t callback, void *ctx) {
+    if(busy()){return false;}
+    /*the join request is charged by the dispatcher when the module reports it*/
     if (command == JOIN){
-        sprintf(cmd,"AT+JOIN\r\n");
-        time_cmd=at_send_check_response(cmd,"+JOIN: Network joined",timeout,NULL);
-        if (time_cmd == 0){
-            time_cmd=at_send_check_response(cmd,"+JOIN: Joined already",timeout,NULL);
-        }
+        return at_send_async(AT_CMD_JOIN,AT_ACK_JOIN_ANY,timeout,callback,ctx);
     }
     else if (command == FORCE){
-        sprintf(cmd,"AT+JOIN\r\n");
-        time_cmd=at_send_check_response(cmd,"+JOIN: Network joined",timeout,NULL);
+        return at_send_async(AT_CMD_JOIN,AT_ACK_JOIN_NEW,timeout,callback,ctx);
        }
     else {
-           #ifdef COMMAND_PRINT_TO_USER
-            SerialUSB.print("Bad command to setOTAAJoin\n");
-           #endif 
+           LORA_LOG_ERROR("Bad command to setOTAAJoin\n");
            }
-    return time_cmd;//Returned time to succesfully execute a command. 0 if the command was not ACK by Gateway.
+    return false;
+}
+
+void LoRaE5Class::joinBegin(unsigned int timeout){
+    join_timeout_ms=timeout;
+    join_failures=0;
+    join_retry(0);/*first attempt on the next poll*/
+}
+
+bool LoRaE5Class::joined(void){
+    return (join_state==JOIN_JOINED);
+}
+
+_join_state_t LoRaE5Class::joinState(void){
+    return join_state;
+}
+
+unsigned long LoRaE5Class::joinRetryIn(void){
+    unsigned long elapsed=millis()-join_wait_start;
+    if ((join_state!=JOIN_WAITING)||(elapsed>=join_wait_ms)){return 0;}
+    return join_wait_ms-elapsed;
+}
+
+unsigned int LoRaE5Class::joinFailures(void){
+    return join_failures;
+}
+
+void LoRaE5Class::join_retry(unsigned long wait_ms){
+    join_state=JOIN_WAITING;
+    join_wait_start=millis();
+    join_wait_ms=wait_ms;
+}
+
+void LoRaE5Class::join_step(void){
+    unsigned long wait;
+    if ((join_state!=JOIN_WAITING)||(joinRetryIn()>0)){return;}
+    /*the join request also has to fit in the duty cycle of the band*/
+    wait=ledger.delay_ms(ledger_now(),lora_airtime_us(LORA_JOIN_REQUEST_BYTES,SF_last,BW_last)/1000+1);
+    if (wait==LEDGER_NEVER){wait=LORA_JOIN_BACKOFF_MAX_MS;}
+    if (wait>0){join_retry(wait); return;}
+    /*JOIN: a session still held by the module is answered with "Joined already" without a request*/
+    if (setOTAAJoinAsync(JOIN,join_timeout_ms,join_done,this)){join_state=JOIN_PENDING;}
+}
+
+void LoRaE5Class::join_done(unsigned int time_ms, const char* response, void* ctx){
+    LoRaE5Class* lora=(LoRaE5Class*)ctx;
+    unsigned long wait;
+    if (time_ms>0){
+      lora->join_state=JOIN_JOINED;
+      lora->join_failures=0;
+      if (strstr(response,"Joined already")!=NULL){LORA_LOG_INFO("\r\nLoRa session reused\n");}
+      else                                        {LORA_LOG_INFO("\r\nLoRa network joined\n");}
+      return;
+      }
+    /*15 s, 30 s, 60 s... up to LORA_JOIN_BACKOFF_MAX_MS*/
+    wait=LORA_JOIN_BACKOFF_MIN_MS;
+    for (unsigned int i=0; (i<lora->join_failures)&&(wait<LORA_JOIN_BACKOFF_MAX_MS); i++){wait*=2;}
+    if (wait>LORA_JOIN_BACKOFF_MAX_MS){wait=LORA_JOIN_BACKOFF_MAX_MS;}
+    wait+=random(wait/4+1);/*jitter*/
+    lora->join_failures++;
+    LORA_LOG_WARN("\r\nLoRa join failed, next attempt in ",wait," ms");
+    lora->join_retry(wait);
+}
+
+uint16_t LoRaE5Class::queueUplink(const unsigned char* payload, unsigned char length, unsigned char port,
+                                  bool confirmed, unsigned char priority, unsigned long max_age_ms,
+                                  at_callback_t callback, void* ctx){
+    uint16_t id=queue.push(payload,length,port,confirmed,priority,max_age_ms,millis(),callback,ctx);
+    if (id==0){LORA_LOG_WARN("\r\nUplink refused by the queue, ",queue.depth()," queued");}
+    return id;
+}
+
+unsigned int LoRaE5Class::queueDepth(void){
+    return queue.depth();
+}
+
+unsigned long LoRaE5Class::queueDropped(void){
+    return queue.dropped();
+}
+
+unsigned long LoRaE5Class::queueExpired(void){
+    return queue.expired();
+}
+
+void LoRaE5Class::queue_step(void){
+    uplink_callback_t callback;
+    void* ctx;
+    int index;
+    _uplink_t* item;
+    unsigned long wait;
+    if (queue_sending>=0){return;}
+    queue.expire(millis());
+    while (queue.popDropped(&callback,&ctx)){
+      callback(0,"",ctx);
+      if (at_state==AT_PENDING){return;}/*the callback issued a command*/
+      }
+    if ((join_state==JOIN_WAITING)||(join_state==JOIN_PENDING)){return;}
+    index=queue.next();
+    if (index<0){return;}
+    item=queue.slot(index);
+    wait=uplinkDelay(item->length);
+    if (wait==LEDGER_NEVER){/*it will never fit in the airtime budget*/
+      LORA_LOG_WARN("\r\nQueued uplink too long for the airtime budget, dropped");
+      queue.drop(index);
+      return;
+      }
+    if (wait>0){return;}/*drained at the rate the duty cycle allows*/
+    queue_sending=index;
+    queue.setState(index,UPLINK_SENDING);
+    if (item->port!=port_last){/*the uplink itself is sent once the port is set*/
+      char ack[AT_ACK_LENGTH_MAX];
+      if (at_begin()){
+        at_put(AT_CMD_PORT);
+        at_put((long)item->port);
+        at_put(AT_CMD_END);
+        if (at_expect(at_ack_number(ack,sizeof(ack),AT_ACK_PORT,item->port),DEFAULT_TIMEWAIT,queue_port_done,this)){return;}
+        }
+      }
+    else if (link_step(item)){return;}
+    else if (at_send_payload(item->confirmed? AT_CMD_CMSGHEX : AT_CMD_MSGHEX,item->payload,item->length,true,AT_ACK_DONE,
+                             (unsigned int)getTransmissionTime(item->length)+LORA_QUEUE_TIMEOUT_MS,queue_done,this)){
+      return;
+      }
+    queue_sending=-1;/*not sent: tried again on the next poll*/
+    queue.setState(index,UPLINK_QUEUED);
+}
+
+void LoRaE5Class::queue_port_done(unsigned int time_ms, const char* response, void* ctx){
+    LoRaE5Class* lora=(LoRaE5Class*)ctx;
+    (void)response;
+    int index=lora->queue_sending;
+    _uplink_t* item=lora->queue.slot(index);
+    lora->queue_sending=-1;
+    if (item==NULL){return;}
+    if (time_ms>0){
+      lora->port_last=item->port;
+      lora->queue.setState(index,UPLINK_QUEUED);/*sent on the next poll*/
+      }
+    else{
+      lora->port_last=0;
+      lora->queue.drop(index);/*reported on the next poll*/
+      }
+}
+
+void LoRaE5Class::queue_done(unsigned int time_ms, const char* response, void* ctx){
+    LoRaE5Class* lora=(LoRaE5Class*)ctx;
+    int index=lora->queue_sending;
+    _uplink_t* item=lora->queue.slot(index);
+    uplink_callback_t callback;
+    void* item_ctx;
+    lora->queue_sending=-1;
+    lora->link_hold=false;
+    if (lora->link_check_asked){lora->link_check_asked=false; lora->link_uplinks=0;}
+    else{lora->link_uplinks++;}
+    if (item==NULL){return;}
+    callback=item->callback;
+    item_ctx=item->ctx;
+    if (item->confirmed&&!lora->uplink_acked){time_ms=0;}
+    lora->queue.release(index);/*the slot is free before the callback, it can queue again*/
+    if (callback!=NULL){callback(time_ms,response,item_ctx);}
+}
+
+/*with the ADR off the driver picks the data rate itself, one command per poll ahead of the uplink:
+   - AT+LW=LCR while there is no estimate, and every LORA_LINK_CHECK_EVERY uplinks. The answer comes
+     with the uplink and feeds the estimate
+   - AT+DR with the fastest SF that holds the link margin and still carries the payload
+  Only the 125 kHz data rates are picked. Returns true if a command was issued*/
+bool LoRaE5Class::link_step(const _uplink_t* item){
+    char ack[AT_ACK_LENGTH_MAX];
+    bool us=(FREQBAND_last==US915)||(FREQBAND_last==US915HYBRID)||(FREQBAND_last==US915OLD);/*DR0 is SF10, AU915 starts at SF12*/
+    unsigned int sf_max=(us||(FREQBAND_last==AS923))? SF10 : SF12;/*SF11-12 of AS923 exceed the dwell time*/
+    unsigned int sf;
+    if (adaptative_DR||(BW_last!=BW125)||(FREQBAND_last==UNINIT)){return false;}
+    if (!link_check_asked&&(!link.valid()||(link_uplinks>=LORA_LINK_CHECK_EVERY))){
+      return at_send_async(AT_CMD_LINK_CHECK,AT_ACK_LINK_CHECK,DEFAULT_TIMEWAIT,link_check_done,this);
+      }
+    if (link_hold){return false;}
+    sf=link.selectSF(SF_last,SF7,sf_max);
+    while ((sf>SF7)&&(item->length>max_payload((_spreading_factor_t)sf,BW125))){sf--;}
+    if (sf==(unsigned int)SF_last){return false;}
+    link_dr=(_data_rate_t)((us? 10 : 12)-sf);
+    LORA_LOG_INFO("\r\nLink margin ",link.margin(SF_last)," dB at SF",(int)SF_last,", uplink at SF",sf);
+    if (!at_begin()){return false;}
+    at_put(AT_CMD_DR);
+    at_put((long)link_dr);
+    at_put(AT_CMD_END);
+    return at_expect(at_ack_number(ack,sizeof(ack),AT_ACK_DR_NUMBER,link_dr),DEFAULT_TIMEWAIT,link_dr_done,this);
+}
+
+void LoRaE5Class::link_check_done(unsigned int time_ms, const char* response, void* ctx){
+    LoRaE5Class* lora=(LoRaE5Class*)ctx;
+    (void)response;
+    int index=lora->queue_sending;
+    lora->queue_sending=-1;
+    if (time_ms>0){lora->link_check_asked=true;}
+    else{lora->link_uplinks=0;}/*asked again after LORA_LINK_CHECK_EVERY uplinks*/
+    if (lora->queue.slot(index)!=NULL){lora->queue.setState(index,UPLINK_QUEUED);}/*sent on the next poll*/
+}
+
+void LoRaE5Class::link_dr_done(unsigned int time_ms, const char* response, void* ctx){
+    LoRaE5Class* lora=(LoRaE5Class*)ctx;
+    (void)response;
+    int index=lora->queue_sending;
+    lora->queue_sending=-1;
+    if (time_ms>0){lora->store_data_rate(lora->link_dr,lora->FREQBAND_last);}
+    else{lora->link_hold=true;}
+    if (lora->queue.slot(index)!=NULL){lora->queue.setState(index,UPLINK_QUEUED);}/*sent on the next poll*/
 }
 
 unsigned int LoRaE5Class::setDeviceBaudRate(_baudrate_bps_supported baud_rate ) {
     unsigned int time_cmd=0;//Returned time to succesfully execute a command. 
-    cmd[0]='\0';//reset the string position
-	cmd_resp_ack[0]='\0';//reset the string position
-    sprintf(cmd,"AT+UART=BR, %i\r\n",baud_rate);
-	sprintf(cmd_resp_ack,"%i",baud_rate);
+    char ack[AT_ACK_LENGTH_MAX];
 	bool mode=lowpower_auto;
 	lowpower_auto=true;//set temporaly to true in order to ensure a proper working with the device
-    time_cmd=at_send_check_response(cmd,cmd_resp_ack,DEFAULT_TIMEWAIT,NULL);
+    if (at_open()){
+      at_put(AT_CMD_UART_BR);
+      at_put((long)baud_rate);
+      at_put(AT_CMD_END);
+      time_cmd=at_close(at_ack_number(ack,sizeof(ack),"",baud_rate),DEFAULT_TIMEWAIT);
+      }
 	setDeviceReset();
     lowpower_auto=mode;//return to original value
 	SerialLoRa.end();//end before initing a serial port
 	initSerial(baud_rate);
+	if (time_cmd>0){store_baud_rate(baud_rate);}/*probed first on the next boot*/
     return(time_cmd);
 }
 unsigned int LoRaE5Class::setDeviceLowPower(unsigned int time_to_wakeup_ms) {
     unsigned int time_cmd=0;//Returned time to succesfully execute a command. 
-    cmd[0]='\0';//reset the string position
-	if (time_to_wakeup_ms==0){sprintf(cmd,"AT+LOWPOWER\r\n");}
-	else                   {sprintf(cmd,"AT+LOWPOWER=%i\r\n",time_to_wakeup_ms);}
-    time_cmd=at_send_check_response(cmd,"+LOWPOWER: SLEEP",DEFAULT_TIMEWAIT,NULL);
+    if (!at_open()){return 0;}
+	if (time_to_wakeup_ms==0){at_put(AT_CMD_LOWPOWER);}
+	else                   {at_put(AT_CMD_LOWPOWER_TIME); at_put((long)time_to_wakeup_ms); at_put(AT_CMD_END);}
+    time_cmd=at_close(AT_ACK_LOWPOWER,DEFAULT_TIMEWAIT);
     return(time_cmd);
 }
 unsigned int LoRaE5Class::setDeviceLowPowerAutomode(bool mode) {
     unsigned int time_cmd=0;//Returned time to succesfully execute a command. 
-    cmd[0]='\0';//reset the string position
-	if (mode){sprintf(cmd,"AT+LOWPOWER=AUTOON\r\n");}
-	else     {sprintf(cmd,"AT+LOWPOWER=AUTOOFF\r\n");}
-	if (mode){time_cmd=at_send_check_response(cmd,"AUTOON",DEFAULT_TIMEWAIT,NULL);}
+	if (mode){time_cmd=at_send_check_response(AT_CMD_AUTOON,AT_ACK_AUTOON,DEFAULT_TIMEWAIT,NULL);}
 	else     {lowpower_auto=true;
-		      time_cmd=at_send_check_response(cmd,"AUTOOFF",DEFAULT_TIMEWAIT,NULL);
+		      time_cmd=at_send_check_response(AT_CMD_AUTOOFF,AT_ACK_AUTOOFF,DEFAULT_TIMEWAIT,NULL);
 			  lowpower_auto=false;}
 	if (time_cmd>0){lowpower_auto=mode;}
-	if(lowpower_auto){endSerial();}
+	if(lowpower_auto){serial_idle();}
 	             else{initSerial(baud_rate_set);}
 	/*Turn off serial for saving power*/
     return(time_cmd);
 }
 unsigned int LoRaE5Class::setDeviceWakeUp(void) {
     unsigned int time_cmd=0;//Returned time to succesfully execute a command. 
-    cmd[0]='\0';//reset the string position
-    sprintf(cmd,"AT+\r\n");
-    time_cmd=at_send_check_response(cmd,"WAKEUP",DEFAULT_TIMEWAIT,NULL);
+    time_cmd=at_send_check_response(AT_CMD_PROBE,AT_ACK_WAKEUP,DEFAULT_TIMEWAIT,NULL);
     return(time_cmd);
 }
 //
@@ -1058,9 +1674,7 @@ unsigned int LoRaE5Class::setDeviceWakeUp(void) {
 //
 unsigned int LoRaE5Class::setDeviceReset(void) {
     unsigned int time_cmd;
-    cmd[0]='\0';//reset the string position
-    sprintf(cmd,"AT+RESET\r\n");
-    time_cmd=at_send_check_response(cmd,"+RESET: OK",DEFAULT_TIMEWAIT,NULL);
+    time_cmd=at_send_check_response(AT_CMD_RESET,AT_ACK_RESET,DEFAULT_TIMEWAIT,NULL);
    /*delay 2000 msec after reset to ensure that the next command set will be responded*/
 	delay(2000);
     return(time_cmd);
@@ -1070,10 +1684,8 @@ unsigned int LoRaE5Class::setDeviceReset(void) {
 //  Factory reset the module.
 //
 unsigned int LoRaE5Class::setDeviceDefault(void) {
-    cmd[0]='\0';//reset the string position
     unsigned int time_cmd;
-    sprintf(cmd,"AT+FDEFAULT=RISINGHF\r\n");
-    time_cmd=at_send_check_response(cmd,"+FDEFAULT: OK",DEFAULT_TIMEWAIT,NULL);
+    time_cmd=at_send_check_response(AT_CMD_FDEFAULT,AT_ACK_FDEFAULT,DEFAULT_TIMEWAIT,NULL);
     return(time_cmd);
 }
 
@@ -1083,125 +1695,126 @@ unsigned int LoRaE5Class::initP2PMode(unsigned short frequency,
                                unsigned char txPreamble,
                                unsigned char rxPreamble, short power) {
     unsigned int time_cmd=0;//Returned time to succesfully execute a command.  
+    const long rfcfg[6]={frequency,spreadingFactor,bandwidth,txPreamble,rxPreamble,power};
     //set device in test mode
-    cmd[0]='\0';//reset the string position
-    sprintf(cmd, "AT+MODE=TEST\r\n");
-    time_cmd=+at_send_check_response(cmd,"TEST",DEFAULT_TIMEWAIT,NULL);
+    time_cmd+=at_send_check_response(AT_CMD_MODE_TEST,AT_ACK_MODE_TEST,DEFAULT_TIMEWAIT,NULL);
     //set device test mode configuration
-    cmd[0]='\0';//reset the string position
-    sprintf(cmd, "AT+TEST=RFCFG,%d,%d,%d,%d,%d,%d\r\n", frequency,
-            spreadingFactor, bandwidth, txPreamble, rxPreamble, power);
-    time_cmd=+at_send_check_response(cmd,AT_NO_ACK,DEFAULT_TIMEWAIT,NULL);
+    if (at_open()){
+      at_put(AT_CMD_TEST_RFCFG);
+      for (unsigned char i=0; i<6; i++){
+        if (i>0){at_put(AT_CMD_SEPARATOR);}
+        at_put(rfcfg[i]);
+        }
+      at_put(AT_CMD_END);
+      time_cmd+=at_close(AT_NO_ACK,DEFAULT_TIMEWAIT);
+      }
     //allow the reception of messages
-    cmd[0]='\0';//reset the string position
-    sprintf(cmd, "AT+TEST=RXLRPKT\r\n");
-    time_cmd=+at_send_check_response(cmd,"RXLRPKT",DEFAULT_TIMEWAIT,NULL);
+    time_cmd+=at_send_check_response(AT_CMD_TEST_RXLRPKT,AT_ACK_TEST_RXLRPKT,DEFAULT_TIMEWAIT,NULL);
     return(time_cmd);
 }
 
 unsigned int LoRaE5Class::transferPacketP2PMode(char *buffer) {
-    unsigned int time_ret;
+    at_wait();
+    if(!transferPacketP2PModeAsync(buffer,NULL,NULL)){return 0;}
+    return at_wait();
+}
+
+bool LoRaE5Class::transferPacketP2PModeAsync(char *buffer, at_callback_t callback, void *ctx) {
     unsigned char length=strlen(buffer);
-    #ifdef COMMAND_PRINT_TO_USER
-     cmd[0]='\0';//reset the string
-     sprintf(cmd,"\r\nSending %i characters to a another LoRa End Node",(int)length);
-     SerialUSB.print(cmd);
-    #endif
-    cmd[0]='\0';//reset the string
-    sprintf(cmd,"AT+TXLRSTR=\"%s\"\r\n",buffer);
-    time_ret=at_send_check_response(cmd,"Done",DEFAULT_TIMEWAIT,NULL);
-    return time_ret;
+    if(busy()){return false;}
+    LORA_LOG_INFO("\r\nSending ",(int)length," characters to a another LoRa End Node");
+    return at_send_payload(AT_CMD_TXLRSTR,(const unsigned char*)buffer,strlen(buffer),false,AT_ACK_DONE,DEFAULT_TIMEWAIT,callback,ctx);
 }
 
 unsigned int LoRaE5Class::transferPacketP2PMode(unsigned char *buffer,
                                          unsigned char length) {
-    int i;
-    unsigned int time_ret;
-    #ifdef COMMAND_PRINT_TO_USER
-     cmd[0]='\0';//reset the string
-     sprintf(cmd,"\r\nSending %i bytes to a another LoRa End Node",(int)length);
-     SerialUSB.print(cmd);
-    #endif
-    cmd[0]='\0';//reset the string size
-    sprintf(cmd+strlen(cmd),"AT+TEST=TXLRPKT,\"");//name of the command
-    for ( i = 0; i < length; i++) { sprintf(cmd+strlen(cmd), "%02x", buffer[i]);}//add the characters in hex format
-    sprintf(cmd+strlen(cmd),"\"\r\n");//end of command
-    time_ret=at_send_check_response(cmd,"Done",DEFAULT_TIMEWAIT,NULL);
-    return time_ret;    
+    at_wait();
+    if(!transferPacketP2PModeAsync(buffer,length,NULL,NULL)){return 0;}
+    return at_wait();
+}
+
+bool LoRaE5Class::transferPacketP2PModeAsync(unsigned char *buffer, unsigned char length,
+                                             at_callback_t callback, void *ctx) {
+    if(busy()){return false;}
+    LORA_LOG_INFO("\r\nSending ",(int)length," bytes to a another LoRa End Node");
+    return at_send_payload(AT_CMD_TXLRPKT,buffer,length,true,AT_ACK_DONE,DEFAULT_TIMEWAIT,callback,ctx);
 }
 
 short LoRaE5Class::receivePacketP2PMode(unsigned char *buffer, short length,
                                          short *rssi, unsigned int timeout) {
-    char *ptr;
-    short number;
-    unsigned int time_ret=0;
-    char ch;
-    //clean reception buffer after starting with reception:
-    strncpy(recv_buf," ",sizeof(recv_buf));//fill the content with white spaces
-    strlcpy(recv_buf," ",1);//Manually indicates end of string
-    /*clean the serial port before issuing the command*/
-    while (SerialLoRa.available() > 0){ ch = SerialLoRa.read();}//clean the read buffer
-    /*parse the content of the rx message to get information*/
-    ptr = strstr(recv_buf, "LEN");
-    if (ptr)
-        number = atoi(ptr + 4);
-    else
-        number = 0;
-
-    if (number <= 0) return 0;
-
-    ptr = strstr(recv_buf, "RSSI:");
-    if (ptr)
-        *rssi = atoi(ptr + 5);
-    else
-        *rssi = -255;
-
-    ptr = strstr(recv_buf, "RX \"");
-    if (ptr) {
-        ptr += 4;
-        for (short i = 0; i < number; i++) {
-            char temp[3]      = {0};
-            unsigned char tmp = '?', result = 0;
-
-            temp[0] = *(ptr + i * 2);
-            temp[1] = *(ptr + i * 2 + 1);
-
-            for (unsigned char j = 0; j < 2; j++) {
-                if ((temp[j] >= '0') && (temp[j] <= '9'))
-                    tmp = temp[j] - '0';
-                else if ((temp[j] >= 'A') && (temp[j] <= 'F'))
-                    tmp = temp[j] - 'A' + 10;
-                else if ((temp[j] >= 'a') && (temp[j] <= 'f'))
-                    tmp = temp[j] - 'a' + 10;
-
-                result = result * 16 + tmp;
-            }
-
-            if (i < length) buffer[i] = result;
-        }
-    }
-
-    return number;
+    return receivePacket((char*)buffer,length,rssi,timeout);/*the dispatcher parses both formats*/
 }
 /*return transmition time in ms*/
 float LoRaE5Class::getTransmissionTime(unsigned int payload_size){
-  return(txHead_time+((float)(payload_size)*8*1000/bitRate));
+  return(lorawan_airtime_us(payload_size,SF_last,BW_last)/1000.0);
+  }
+unsigned char LoRaE5Class::getMaxPayload(void){
+  return max_payload(SF_last,BW_last);
+  }
+unsigned char LoRaE5Class::max_payload(_spreading_factor_t SF, _band_width_t BW){
+  if ((SF==SFX)||(BW==BWX)){return 51;}
+  if ((FREQBAND_last==US915)||(FREQBAND_last==US915HYBRID)||(FREQBAND_last==US915OLD)||(FREQBAND_last==AS923)){
+    if (BW!=BW125){return 242;}
+    switch (SF){/*DR0 and DR1 of AS923 are not usable with the dwell time*/
+      case SF7: return 242;
+      case SF8: return 125;
+      case SF9: return 53;
+      default:  return 11;
+      }
+    }
+  if (BW!=BW125){return 222;}/*SF7 at 250/500 kHz and FSK*/
+  if (SF>=SF10){return 51;}
+  return (SF==SF9)? 115 : 222;
+  }
+unsigned long LoRaE5Class::uplinkDelay(unsigned int payload_size){
+  return ledger.delay_ms(ledger_now(),(uint32_t)getTransmissionTime(payload_size)+1);
+  }
+unsigned long LoRaE5Class::airtimeUsedHour(void){
+  return ledger.usedHour(ledger_now());
+  }
+unsigned long LoRaE5Class::airtimeUsedDay(void){
+  return ledger.usedDay(ledger_now());
+  }
+uint32_t LoRaE5Class::ledger_now(void){
+  #ifdef LORA_LEDGER_RTC
+    struct timeval tv;
+    gettimeofday(&tv,NULL);
+    return (uint32_t)((uint64_t)tv.tv_sec*1000ULL+tv.tv_usec/1000);
+  #else
+    return millis();
+  #endif
+  }
+void LoRaE5Class::ledger_charge(uint32_t airtime_ms){
+  ledger.charge(ledger_now(),airtime_ms);
+  #ifdef LORA_LEDGER_RTC
+    memcpy(ledger_rtc,&ledger,sizeof(ledger));
+    ledger_rtc_valid=true;
+  #endif
+  }
+/********************************************************************************/  
+float LoRaE5Class::getTxCurrent(void){
+  static const short power_dBm[]={0,2,4,6,8,10,12,14,16,20};
+  static const float current_mA[]={TXPOWER_00dBm_mA,TXPOWER_02dBm_mA,TXPOWER_04dBm_mA,TXPOWER_06dBm_mA,TXPOWER_08dBm_mA,
+                                   TXPOWER_10dBm_mA,TXPOWER_12dBm_mA,TXPOWER_14dBm_mA,TXPOWER_16dBm_mA,TXPOWER_20dBm_mA};
+  const unsigned char last=sizeof(power_dBm)/sizeof(power_dBm[0])-1;
+  if (txPower<=power_dBm[0])   {return current_mA[0];}
+  if (txPower>=power_dBm[last]){return current_mA[last];}
+  unsigned char i=1;
+  while (txPower>power_dBm[i]){i++;}
+  /*linear between the two closest measures*/
+  return current_mA[i-1]+(current_mA[i]-current_mA[i-1])*(txPower-power_dBm[i-1])/(power_dBm[i]-power_dBm[i-1]);
+  }
+unsigned long LoRaE5Class::radioTxTime(void){
+  return radio_tx_ms;
+  }
+unsigned long LoRaE5Class::radioRxTime(void){
+  return radio_rx_ms;
   }
 /********************************************************************************/  
 float LoRaE5Class::getTransmissionPower(unsigned int payload_size, float tx_period_s){
   float tx_power_consumption,tx_time,rx_time;
   /*Get the power used*/
-  if (freq_band>800){
-    if (txPower==16)              {tx_power_consumption=TXPOWER_16dBm_mA;}
-	if (txPower==14)              {tx_power_consumption=TXPOWER_14dBm_mA;}
-	if (txPower==12)              {tx_power_consumption=TXPOWER_12dBm_mA;}
-	if (txPower==10)              {tx_power_consumption=TXPOWER_10dBm_mA;}
-	if (txPower== 8)              {tx_power_consumption=TXPOWER_08dBm_mA;}
-	if (txPower== 6)              {tx_power_consumption=TXPOWER_06dBm_mA;}
-	if (txPower== 4)              {tx_power_consumption=TXPOWER_04dBm_mA;}
-	if (txPower== 2)              {tx_power_consumption=TXPOWER_02dBm_mA;}
-	if (txPower== 0)              {tx_power_consumption=TXPOWER_00dBm_mA;}
-    }
+    tx_power_consumption=getTxCurrent();
     /*Get the Tx time in ms*/
      tx_time=getTransmissionTime(payload_size);
 	 /*Stimate rx timein ms*/
@@ -1212,18 +1825,13 @@ float LoRaE5Class::getTransmissionPower(unsigned int payload_size, float tx_peri
   }
 
 unsigned int LoRaE5Class::Debug(_debug_level value){
-   unsigned int time_cmd;
-   char val[8];
-   if (value==lora_DEBUG){sprintf(val,"DEBUG");}
-   if (value==lora_INFO){sprintf(val,"INFO");}
-   if (value==lora_WARN){sprintf(val,"WARN");}
-   if (value==lora_FATAL){sprintf(val,"FATAL");}
-   if (value==lora_PANIC){sprintf(val,"PANIC");}
-   if (value==lora_QUIET){sprintf(val,"QUIET");}
-   //***********
-   cmd[0]='\0';//reset the string position
-   sprintf(cmd, "AT+LOG=%s\r\n",val);
-   time_cmd=+at_send_check_response(cmd,AT_NO_ACK,DEFAULT_TIMEWAIT,NULL);
+   unsigned int time_cmd=0;
+   if ((value<lora_DEBUG)||(value>lora_QUIET)){return 0;}
+   if (!at_open()){return 0;}
+   at_put(AT_CMD_LOG);
+   at_put(AT_LOG_LEVEL[value]);
+   at_put(AT_CMD_END);
+   time_cmd+=at_close(AT_NO_ACK,DEFAULT_TIMEWAIT);
    return(time_cmd);
 }         
 
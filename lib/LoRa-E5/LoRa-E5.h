@@ -28,11 +28,23 @@
 #define _LORA-E5_H_
 /*COMMAND LIST AND EXAMPLES*/
 //https://files.seeedstudio.com/products/317990687/res/LoRa-E5%20AT%20Command%20Specification_V1.0%20.pdf
+/*--------------LOG LEVEL ---------------------------**/
+/*Driver messages at or above this level are printed to the user port (LORA_LOG_OUTPUT); the rest are not
+  compiled. Values follow _debug_level. DEBUG adds every command sent and response received.
+  Messages are buffered and printed by poll() when no command is pending, see LoRa-E5-Log.h */
+#define LORA_LOG_LEVEL_DEBUG  0
+#define LORA_LOG_LEVEL_INFO   1
+#define LORA_LOG_LEVEL_WARN   2
+#define LORA_LOG_LEVEL_ERROR  3
+#define LORA_LOG_LEVEL_FATAL  4
+#define LORA_LOG_LEVEL_PANIC  5
+#define LORA_LOG_LEVEL_QUIET  6
+#ifndef LORA_LOG_LEVEL
+  #define LORA_LOG_LEVEL      LORA_LOG_LEVEL_INFO
+#endif
+#define LORA_LOG_OUTPUT       Serial
+#define LORA_LOG_DRAIN_CHUNK  64  /*bytes printed per poll() call*/
 /*--------------PRINT TIME --------------------------**/
-/*Define to print to the USER into UART terminal the commands messages sent and response received */
-/*--------------PRINT TIME --------------------------**/
-/*Define to print to the USER into UART terminal the commands messages sent and response received */
-#define COMMAND_PRINT_TO_USER
 /*Define to print the result of times measures
 Important Note: This time is measured using because of this, this is only an estimation
 Regarding Transmition time: it was tested and it cannot be measured properly using this method
@@ -41,23 +53,58 @@ is included, if you subtract the times of two transmissions with different paylo
 of the transmission times. In this way, you can compare the times changes due to the payload size and know what to spect*/
 //#define COMMAND_PRINT_TIME_MEASURE
 
-/*defines dependensies to avoid a CRASH of the program*/
-#ifdef COMMAND_PRINT_TIME_MEASURE
-  #ifndef COMMAND_PRINT_TO_USER
-    #define COMMAND_PRINT_TO_USER
-  #endif
-#endif  
+/*defines dependensies: the time measures are INFO messages*/
+#if defined(COMMAND_PRINT_TIME_MEASURE)&&(LORA_LOG_LEVEL>LORA_LOG_LEVEL_INFO)
+  #undef  LORA_LOG_LEVEL
+  #define LORA_LOG_LEVEL LORA_LOG_LEVEL_INFO
+#endif
+#define LORA_LOG_ON(level) (LORA_LOG_LEVEL<=(level)) /*usable in #if*/
+#if LORA_LOG_ON(LORA_LOG_LEVEL_DEBUG)
+  #define LORA_LOG_DEBUG(...) loraLog.log(__VA_ARGS__)
+#else
+  #define LORA_LOG_DEBUG(...) ((void)0)
+#endif
+#if LORA_LOG_ON(LORA_LOG_LEVEL_INFO)
+  #define LORA_LOG_INFO(...)  loraLog.log(__VA_ARGS__)
+#else
+  #define LORA_LOG_INFO(...)  ((void)0)
+#endif
+#if LORA_LOG_ON(LORA_LOG_LEVEL_WARN)
+  #define LORA_LOG_WARN(...)  loraLog.log(__VA_ARGS__)
+#else
+  #define LORA_LOG_WARN(...)  ((void)0)
+#endif
+#if LORA_LOG_ON(LORA_LOG_LEVEL_ERROR)
+  #define LORA_LOG_ERROR(...) loraLog.log(__VA_ARGS__)
+#else
+  #define LORA_LOG_ERROR(...) ((void)0)
+#endif
 /*SERIAL PORT DEFINITION BASED ON PLATFORM**/
 #include <Arduino.h>
-#ifdef COMMAND_PRINT_TO_USER
- #define SerialUSB  Serial
-#endif 
+#include "LoRa-E5-Matcher.h"
+#include "LoRa-E5-Commands.h"
+#include "LoRa-E5-Log.h"
+#include "LoRa-E5-Airtime.h"
+#include "LoRa-E5-Ledger.h"
+#include "LoRa-E5-Link.h"
+#include "LoRa-E5-Queue.h"
+/*SerialLoRa is a global opened with the ESP32 arguments on the ESP32, and with the emulator on any host
+  (the native test environment included)*/
+#if (defined(ESP32)||defined(ESP32S3)||defined(LORA_SERIAL_EMULATOR))
+  #define LORA_SERIAL_GLOBAL
+#endif
 /*If you are not using Custom Serial, make this define */
-  #if (defined(ESP32)||defined(ESP32S3))
+  #ifdef LORA_SERIAL_GLOBAL
     //#define SerialLoRa_native Serial    //M5Stack ESP32 Camera Module Development Board
     // HardwareSerial SerialLoRa(0);    //M5Stack ESP32 Camera Module Development Board
-    
-    //#define UART_LoRa         HardwareSerial
+    /*Build with -DLORA_SERIAL_EMULATOR to run without a module: SerialLoRa answers like one, see LoRa-E5-Emulator.h*/
+    #ifdef LORA_SERIAL_EMULATOR
+      #include "LoRa-E5-Emulator.h"
+      #define UART_LoRa         LoRaE5Emulator
+    #else
+      #define UART_LoRa         HardwareSerial
+    #endif
+    extern UART_LoRa SerialLoRa;
   #else
     #define SerialLoRa_native Serial1    //For SAMD Variant and XIAO NRF
     #define UART_LoRa         UART
@@ -68,10 +115,16 @@ of the transmission times. In this way, you can compare the times changes due to
 #define DEFAULT_TIMEWAIT     100  //DO NOT CHANGE: milliseconds to wait after issuing command via serial and not getting an specific response
 
 #define AT_NO_ACK "NO_ACK"  //For not checking the command response in order to send a command error
+#define AT_ACK_SEPARATOR '|' //Separates alternative expected responses. Example: "+JOIN: Network joined|+JOIN: Joined already"
+/*Patterns reported by the response matcher of the pending command*/
+#define AT_MATCH_WAIT_ACK      (1<<0) //"Wait ACK": transmission done, waiting for the gateway ACK
+#define AT_MATCH_ACK_RECEIVED  (1<<1) //"ACK Received": gateway ACK received
+#define AT_MATCH_RESPONSE      0xFC   //any of the expected responses of the command
 /*PARAMETERS FIDEX*/
 //*******************************//
-#define BUFFER_LENGTH_MAX 512   //reception buffer size. Commands response can be up to 400 bytes according to data sheet examples
 #define MAC_COMMAND_FLAG "MACCMD:"
+#define LINE_LENGTH_MAX     160 //longest line kept by the dispatcher. Fits a 64 bytes downlink in hex format
+#define DOWNLINK_LENGTH_MAX 64  //longest downlink payload kept by the dispatcher
 #define kLOCAL_BUFF_MAX  64
 #define RXWIN1_DELAY  1000  //DO NOT CHANGE: milliseconds to wait after a transmition is being made in order to open RXWIN1 for reception
 #define RXWIN2_DELAY  2000  //DO NOT CHANGE: milliseconds to wait after a transmition is being made in order to open RXWIN1 for reception
@@ -82,6 +135,42 @@ enum _deviceID{
    AppEui};
 /*All this values listed are the supported by the module*/   
 #define LORA_BAUDRATE_DEFAULT BR_9600  
+/*Baud rate the module is switched to once it has been detected. A 51 bytes AT+MSGHEX command takes
+  ~130ms on the wire at 9600 and ~11ms at 115200. Comment to keep working at the detected baud rate*/
+#define LORA_BAUDRATE_FAST    BR_115200
+/*In lowpower_auto mode the serial port is kept open for this many ms after the last command or received
+  character, and closed by "poll" once they pass. The commands of a burst (see applyConfig) share the
+  open port. 0 closes it right after each command. The module itself still needs its 4 wake up
+  characters before every command: it goes back to sleep after each answer*/
+#define LORA_LOWPOWER_IDLE_MS 200
+/*Keeps the last working baud rate (probed first on the next boot) and the applied configuration in NVS*/
+#if (defined(ESP32)||defined(ESP32S3))
+  #define LORA_NVS_PERSIST
+  #define LORA_NVS_NAMESPACE  "lora-e5"
+  #define LORA_NVS_KEY_BAUD   "baud"
+  #define LORA_NVS_KEY_CONFIG "cfg"  /*fingerprint of the settings that cannot be read back, see applyConfig*/
+#endif
+/*Daily uplink airtime allowed by the network, on top of the duty cycle of the band. The Things Network
+  fair use policy is 30 s per day. 0 removes the limit. See LoRa-E5-Ledger.h*/
+#define LORA_FAIR_USE_MS_PER_DAY 30000
+/*The ledger is copied to RTC memory after every charge and timed with the RTC clock (the one of time(NULL),
+  which keeps counting in deep sleep), so the airtime spent before a deep sleep still counts after it.
+  Setting the clock (settimeofday, SNTP) moves the windows with it. Elsewhere it is timed with millis*/
+#if (defined(ESP32)||defined(ESP32S3))
+  #define LORA_LEDGER_RTC
+#endif
+#define LORA_JOIN_REQUEST_BYTES  23  /*PHY payload of a join request*/
+/*Background join, see joinBegin. After the n-th failed attempt the next one waits
+  LORA_JOIN_BACKOFF_MIN_MS*2^(n-1), at most LORA_JOIN_BACKOFF_MAX_MS, plus up to a quarter of that at
+  random: the nodes restarted by the same power cut do not keep joining at the same time*/
+#define LORA_JOIN_BACKOFF_MIN_MS 15000
+#define LORA_JOIN_BACKOFF_MAX_MS 1800000
+/*Time the queued uplinks wait for "Done", on top of their time on air: the receive windows and the
+  retries of a confirmed uplink. See queueUplink*/
+#define LORA_QUEUE_TIMEOUT_MS    6000
+/*With the ADR off, the queue picks the data rate of each uplink from the link estimate (LoRa-E5-Link.h).
+  A link check is requested with the first uplink, then every LORA_LINK_CHECK_EVERY uplinks*/
+#define LORA_LINK_CHECK_EVERY    16
 
 enum _baudrate_bps_supported{
       BR_9600=9600, /*9600 default value*/
@@ -101,6 +190,8 @@ enum _debug_level{
    lora_FATAL,
    lora_PANIC,
    lora_QUIET};
+static_assert((lora_DEBUG==LORA_LOG_LEVEL_DEBUG)&&(lora_ERROR==LORA_LOG_LEVEL_ERROR)&&(lora_QUIET==LORA_LOG_LEVEL_QUIET),
+              "LORA_LOG_LEVEL_* must follow _debug_level");
 enum _class_type_t { CLASS_A = 0, CLASS_C };
 enum _physical_type_t {
     UNINIT = -1,
@@ -244,8 +335,73 @@ source: https://forum.seeedstudio.com/t/lora-e5-fw-bug-tx-eu868-85ma-too-high-co
 #define    TXPOWER_10dBm_mA 68.3 //meassured 68.3 mA at 868 Mhz
 #define    TXPOWER_12dBm_mA 77.3 //meassured 77.3 mA at 868 Mhz
 #define    TXPOWER_14dBm_mA 86.8 //meassured 86.8 mA at 868 Mhz
-#define    TXPOWER_16dBm_mA 86.8 //Module says that 16 dBm were set up properlty, meassured 86.8 mA at 868 Mhz. Not checked if the effective TX 
+#define    TXPOWER_16dBm_mA 86.8 //Module says that 16 dBm were set up properlty, meassured 86.8 mA at 868 Mhz. Not checked if the effective TX
+#define    TXPOWER_20dBm_mA 92.0 //NOT MEASURED. datasheet value at 868 Mhz
+
+/*State of the asynchronous AT command engine (see at_send_async and poll)*/
+enum _at_status_t {
+   AT_IDLE=0,  /*no command was issued yet*/
+   AT_PENDING, /*command sent, waiting for the expected response or the timeout*/
+   AT_DONE,    /*expected response received (or timeout reached when using AT_NO_ACK)*/
+   AT_FAILED   /*timeout reached without getting the expected response*/
+   };
+/*State of the background join, see joinBegin*/
+enum _join_state_t {
+   JOIN_IDLE=0,  /*joinBegin was not called*/
+   JOIN_WAITING, /*waiting for the next attempt: backoff or airtime ledger*/
+   JOIN_PENDING, /*AT+JOIN sent, waiting for the answer*/
+   JOIN_JOINED   /*the module holds a session*/
+   };
+/*Completion callback of an asynchronous AT command.
+  time_ms:  command execution time in ms, 0 if the command failed
+  response: content of the reception buffer. Only valid during the callback
+  ctx:      user pointer provided when the command was issued*/
+typedef void (*at_callback_t)(unsigned int time_ms, const char* response, void* ctx);
 
+/*Downlink parsed by the dispatcher from "RX:" (LoRaWAN), "MACCMD:" or "+TEST: RX" (P2P) lines*/
+struct _downlink_t {
+   unsigned char port;                          /*FPort. 0 for MAC commands and P2P packets*/
+   bool maccmd;                                 /*true if the payload is a MAC command*/
+   unsigned char length;                        /*bytes stored in payload*/
+   unsigned char payload[DOWNLINK_LENGTH_MAX];  /*decoded payload*/
+   short rssi;                                  /*-255 if the module did not report it*/
+   float snr;
+   };
+/*Kind of line reported by the module, used to route the unsolicited result codes*/
+enum _urc_type_t {
+   URC_DOWNLINK=0, /*+MSG: PORT: 1; RX: "..." or +TEST: RX "..."*/
+   URC_RSSI,       /*+MSG: RXWIN1, RSSI -106, SNR 3*/
+   URC_MACCMD,     /*+MSG: MACCMD: "..."*/
+   URC_JOIN,       /*+JOIN: ...*/
+   URC_MSG,        /*any other +MSG/+CMSG line*/
+   URC_OTHER,      /*anything else*/
+   URC_TYPES
+   };
+/*Called once per downlink, the structure is only valid during the callback*/
+typedef void (*downlink_callback_t)(const _downlink_t* downlink, void* ctx);
+/*Called for every unsolicited line of the registered type*/
+typedef void (*urc_callback_t)(_urc_type_t type, const char* line, void* ctx);
+
+
+/*Desired configuration of the module, see applyConfig*/
+struct _lora_config_t {
+   _device_mode_t mode;
+   _physical_type_t band;
+   _data_rate_t data_rate;
+   const char* app_key;       /*OTAA App key in hex. NULL to leave it untouched*/
+   _class_type_t class_type;
+   unsigned char port;
+   short power;               /*[dBm]*/
+   unsigned char channel;
+   bool adr;
+   };
+/*What applyConfig did*/
+struct _config_report_t {
+   unsigned char sent;        /*settings sent because the module had a different value*/
+   unsigned char skipped;     /*settings not sent because the module already had them*/
+   unsigned int time_ms;      /*time spent reading and writing the configuration*/
+   unsigned int saved_ms;     /*estimated time of the commands that were not sent*/
+   };
 
 /****************************************************************************
  ******************LORA CLASS DEFINITION*************************************
@@ -294,7 +450,46 @@ class LoRaE5Class {
       * What is does?: Sends command "AT+ID\r\n\" to module
       * Will end execution if recieves "+ID: AppEui" or 1000 has passed
      */
-  unsigned int at_send_check_response(char*p_cmd, char *p_ack, unsigned int timeout_ms,char*p_response);
+  unsigned int at_send_check_response(const char* p_cmd, const char* p_ack, unsigned int timeout_ms,char*p_response);
+    /**
+      * \Sends a command without waiting for its response. The response is parsed by "poll",
+      *  that must be called periodically (e.g. from loop()). Only one command can be in flight.
+      *
+      * \param [in] *p_cmd: pointer to command to send (NULL to only wait for p_ack)
+      * \param [in] *p_ack: pointer to Expected response. Alternatives can be separated with AT_ACK_SEPARATOR
+      * \param [in] timeout_ms: timeout to expect
+      * \param [in] callback: function called once the command finished (can be NULL)
+      * \param [in] *ctx: user pointer passed to the callback
+      *
+      * \return true if the command was sent, false if another command is still pending
+     */
+  bool at_send_async(const char* p_cmd, const char* p_ack, unsigned int timeout_ms,
+                     at_callback_t callback=NULL, void* ctx=NULL);
+    /**
+      * \Parses the characters received from the module for the pending command.
+      *  Never blocks. Must be called periodically while "busy" returns true.
+      *  When no command is pending it also prints a chunk of the buffered log messages and sends the
+      *  next attempt of the background join (see joinBegin), so it must also be called while joining.
+      */
+  void poll(void);
+    /*Returns true while an asynchronous command is waiting for its response*/
+  bool busy(void);
+    /*Returns the state of the last asynchronous command*/
+  _at_status_t at_status(void);
+    /*Returns the execution time in ms of the last finished command, 0 if it failed*/
+  unsigned int at_latency(void);
+    /**
+      * \Registers the function called once per downlink. Downlinks are parsed by "poll"
+      *  whether they arrive inside a command response or unsolicited (class C)
+      */
+  void onDownlink(downlink_callback_t callback, void* ctx=NULL);
+    /**
+      * \Registers the function called for the unsolicited lines of a given type. Lines that are
+      *  part of the response of a pending command are not reported
+      *
+      * \return false if the type is not valid
+      */
+  bool onUrc(_urc_type_t type, urc_callback_t callback, void* ctx=NULL);
     /**
      *  \brief Read the version from device
      *
@@ -357,6 +552,19 @@ class LoRaE5Class {
      */
 unsigned int setFrequencyBand(_physical_type_t physicalType);
 
+    /**
+     *  \brief Brings the module to the desired configuration sending only the settings that differ.
+     *  Mode, band, data rate, class, port, power and ADR are read back from the module. The App key
+     *  and the channel cannot be read back: they are sent when the fingerprint stored in NVS the last
+     *  time they were applied does not match (always on platforms without NVS)
+     *
+     *  \param [in] config The desired configuration
+     *  \param [out] *report Optional. Settings sent/skipped and time spent
+     *
+     *  \return Return the time spent in ms
+     */
+    unsigned int applyConfig(const _lora_config_t& config, _config_report_t* report=NULL);
+
    /**
      *  \brief Set the data rate
      *
@@ -385,6 +593,17 @@ unsigned int setFrequencyBand(_physical_type_t physicalType);
      *  \return Return null.
      */
     unsigned int setAdaptiveDataRate(bool command);
+    /**
+     *  \brief Changes the ADR and the data rate in the background: "poll" sends AT+ADR, then AT+DR, between
+     *          the other commands and ahead of the queued uplinks, one command per call. A failed command
+     *          ends the change. Calling it again before the end replaces the change
+     *
+     *  \param [in] dataRate: data rate in the band plan in use, the first one used when the ADR is on
+     *  \param [in] adr: adaptive data rate on or off
+     */
+    void setDataRateBegin(_data_rate_t dataRate, bool adr);
+    /*Returns true until the change of setDataRateBegin is applied or failed*/
+    bool dataRatePending(void);
 
     /**
      *  \brief Set the output power
@@ -467,6 +686,17 @@ unsigned int setFrequencyBand(_physical_type_t physicalType);
      */
     unsigned int transferPacket(unsigned char *buffer, unsigned char length,
                         unsigned int timeout = DEFAULT_TIMEOUT);
+    /**
+     *  \brief Asynchronous versions of transferPacket. Return immediately, the result
+     *          is reported to the callback once "poll" parses the "Done" response.
+     *
+     *  \return Return bool. True : command sent, false : another command is pending
+     */
+    bool transferPacketAsync(char *buffer, unsigned int timeout = DEFAULT_TIMEOUT,
+                             at_callback_t callback = NULL, void *ctx = NULL);
+    bool transferPacketAsync(unsigned char *buffer, unsigned char length,
+                             unsigned int timeout = DEFAULT_TIMEOUT,
+                             at_callback_t callback = NULL, void *ctx = NULL);
     /**
      *  \brief Transfer the packet data
      *
@@ -489,21 +719,46 @@ unsigned int setFrequencyBand(_physical_type_t physicalType);
     unsigned int transferPacketWithConfirmed(unsigned char *buffer,
                                      unsigned char length,
                                      unsigned int timeout = DEFAULT_TIMEOUT);
+    /**
+     *  \brief Asynchronous versions of transferPacketWithConfirmed. The RXWIN1 delay
+     *          is added to the timeout instead of being waited with delay().
+     *
+     *  \return Return bool. True : command sent, false : another command is pending
+     */
+    bool transferPacketWithConfirmedAsync(char *buffer,
+                                          unsigned int timeout = DEFAULT_TIMEOUT,
+                                          at_callback_t callback = NULL, void *ctx = NULL);
+    bool transferPacketWithConfirmedAsync(unsigned char *buffer, unsigned char length,
+                                          unsigned int timeout = DEFAULT_TIMEOUT,
+                                          at_callback_t callback = NULL, void *ctx = NULL);
   /**
-     *  \brief Transfer the data
+     *  \brief Transfer the data with confirmation, starting at the fastest SF in [SF_init, SF_end] that holds
+     *         the link margin (see getLinkSpreadFactor) and falling back to a slower SF only when the ACK is missed.
+     *         Meant to be used with the adaptative data rate off
      *
      *  \param [in] *buffer The transfer data cache
      *  \param [in] length The length of data cache
-     *  \param [in] timeout The over time of transfer
+     *  \param [in] SF_init, SF_end: allowed range, fastest first. Example: SF7, SF12
+     *  \param [in] timeout The over time of transfer, the time on air of each SF is added
      *
-     *  \return Return bool. Ture : Confirmed ACK, false : Confirmed NOT ACK
+     *  \return Return the time spent in ms
      */
     unsigned int transferPacketWithConfirmed(unsigned char *buffer,
                                      unsigned char length,
 									 _spreading_factor_t SF_init,_spreading_factor_t SF_end,
                                      unsigned int timeout = DEFAULT_TIMEOUT);
+    /*Returns the fastest SF in [SF_min, SF_max] that keeps LORA_LINK_MARGIN_DB, from the rolling estimate built
+      with the RSSI/SNR of the downlinks and acks and the link check answers. See LoRa-E5-Link.h*/
+    _spreading_factor_t getLinkSpreadFactor(_spreading_factor_t SF_min=SF7, _spreading_factor_t SF_max=SF12);
+    /*Returns the averaged SNR [dB] / RSSI [dBm] of the received packets*/
+    float getLinkSnr(void);
+    short getLinkRssi(void);
+    /*Returns the estimated margin [dB] above the demodulation floor of the SF in use*/
+    float getLinkMargin(void);
+    /*Asks the network for a link check with the next uplink. The answer updates the link estimate*/
+    unsigned int requestLinkCheck(void);
     /**
-     *  \brief Receive the data
+     *  \brief Receive the data. Waits up to timeout ms for a downlink parsed by "poll"
      *
      *  \param [in] *buffer The receive data cache
      *  \param [in] length The length of data cache
@@ -534,6 +789,12 @@ unsigned int setFrequencyBand(_physical_type_t physicalType);
      */
     unsigned int transferProprietaryPacket(unsigned char *buffer, unsigned char length,
                                    unsigned int timeout = DEFAULT_TIMEOUT);
+    /*Asynchronous versions of transferProprietaryPacket. See transferPacketAsync*/
+    bool transferProprietaryPacketAsync(char *buffer, unsigned int timeout = DEFAULT_TIMEOUT,
+                                        at_callback_t callback = NULL, void *ctx = NULL);
+    bool transferProprietaryPacketAsync(unsigned char *buffer, unsigned char length,
+                                        unsigned int timeout = DEFAULT_TIMEOUT,
+                                        at_callback_t callback = NULL, void *ctx = NULL);
 
     /**
      *  \brief Set device mode
@@ -554,6 +815,56 @@ unsigned int setFrequencyBand(_physical_type_t physicalType);
      */
     unsigned int setOTAAJoin(_otaa_join_cmd_t command,
                      unsigned int timeout = DEFAULT_TIMEOUT);
+    /**
+     *  \brief Asynchronous version of setOTAAJoin. JOIN succeeds on "Network joined"
+     *          and "Joined already", FORCE only on "Network joined".
+     *
+     *  \return Return bool. True : command sent, false : another command is pending
+     */
+    bool setOTAAJoinAsync(_otaa_join_cmd_t command, unsigned int timeout = DEFAULT_TIMEOUT,
+                          at_callback_t callback = NULL, void *ctx = NULL);
+    /**
+     *  \brief Starts the background join: "poll" sends AT+JOIN while the application keeps running.
+     *          A session the module still holds (warm restart of the host) is reused: the module
+     *          answers "+JOIN: Joined already" and nothing is sent on air. Failed attempts back off
+     *          exponentially with jitter (LORA_JOIN_BACKOFF_MIN_MS) and every attempt waits for the
+     *          airtime ledger. A "Please join network first" answer to an uplink starts it again.
+     *          Calling it again restarts from the first attempt
+     *
+     *  \param [in] timeout: time given to each attempt
+     */
+    void joinBegin(unsigned int timeout = DEFAULT_TIMEOUT);
+    /*Returns true while the module holds a session*/
+    bool joined(void);
+    /*Returns the state of the background join*/
+    _join_state_t joinState(void);
+    /*Returns the ms left before the next join attempt, 0 if none is waiting*/
+    unsigned long joinRetryIn(void);
+    /*Returns the failed join attempts since joinBegin or since the last join*/
+    unsigned int joinFailures(void);
+    /**
+     *  \brief Queues an uplink (see LoRa-E5-Queue.h). "poll" sends the queued uplinks one at a time,
+     *          highest priority first, once the module is free, the background join (if started) is
+     *          done and the airtime ledger allows it. AT+PORT is sent first when the port changes.
+     *          The callback is called once per item: with the execution time once "Done" is received
+     *          (and the ACK, if confirmed), or with 0 if it failed, expired or was evicted
+     *
+     *  \param [in] payload, length: copied into the queue, up to LORA_QUEUE_PAYLOAD_MAX bytes
+     *  \param [in] port: FPort, 1 to 223
+     *  \param [in] confirmed: waits for an ACK
+     *  \param [in] priority: higher first
+     *  \param [in] max_age_ms: the item expires if it is not sent by then. 0 never expires
+     *
+     *  \return Return the id of the item, 0 if it was refused
+     */
+    uint16_t queueUplink(const unsigned char* payload, unsigned char length, unsigned char port,
+                         bool confirmed = false, unsigned char priority = 0, unsigned long max_age_ms = 0,
+                         at_callback_t callback = NULL, void* ctx = NULL);
+    /*Returns the uplinks waiting in the queue, the one being sent included*/
+    unsigned int queueDepth(void);
+    /*Returns the uplinks evicted or refused by the queue / expired in it since boot*/
+    unsigned long queueDropped(void);
+    unsigned long queueExpired(void);
 
     /**
      *  \brief Set message unconfirmed repeat time
@@ -707,6 +1018,10 @@ unsigned int setFrequencyBand(_physical_type_t physicalType);
      *  \return Return bool. Ture : transfer done, false : transfer failed
      */
     unsigned int transferPacketP2PMode(unsigned char *buffer, unsigned char length);
+    /*Asynchronous versions of transferPacketP2PMode. See transferPacketAsync*/
+    bool transferPacketP2PModeAsync(char *buffer, at_callback_t callback = NULL, void *ctx = NULL);
+    bool transferPacketP2PModeAsync(unsigned char *buffer, unsigned char length,
+                                    at_callback_t callback = NULL, void *ctx = NULL);
     /**
      *  \brief Receive the data
      *
@@ -719,12 +1034,20 @@ unsigned int setFrequencyBand(_physical_type_t physicalType);
      */
     short receivePacketP2PMode(unsigned char *buffer, short length, short *rssi,
                                unsigned int timeout = DEFAULT_TIMEOUT);
-        /* \brief Returns a very accurate Estimation of packet Transmition time expresed in mseconds
+        /* \brief Returns the time on air of a LoRaWAN uplink in mseconds, computed with the Semtech formula
+     *         for the SF and BW in use (see LoRa-E5-Airtime.h). Use lorawan_airtime_us for fixed combinations
      *  \param [in]  payload size (data to transmit) in bytes
      *
-     *  \return Return time in seconds to perform the packet transmition
+     *  \return Return time in mseconds to perform the packet transmition
      */
     float getTransmissionTime(unsigned int payload_size);
+        /* \brief Returns the largest application payload of the data rate in use (LoRaWAN Regional Parameters).
+     *         AS923 is taken with the 400 ms uplink dwell time, the other plans without it. MAC commands sent in
+     *         FOpts are not counted: the module sends them in an empty frame when they do not fit
+     *
+     *  \return Return bytes, 51 (the DR0 value of most plans) while the data rate is unknown
+     */
+    unsigned char getMaxPayload(void);
         /* \brief Returns a very accurate Estimation of packet Transmition current used to transmit that packet
 		       and 
      *  \param [in]  payload size (data to transmit) in bytes
@@ -733,6 +1056,23 @@ unsigned int setFrequencyBand(_physical_type_t physicalType);
      *  \return Return power expressed in mAh expected for a voltage input of 3.3V.
      */
     float getTransmissionPower(unsigned int payload_size, float tx_period_s=3600); 
+        /* \brief Every uplink is charged its time on air in the airtime ledger, which holds the duty cycle
+     *         of the band and the LORA_FAIR_USE_MS_PER_DAY budget. Uplinks that do not fit are refused
+     *  \param [in]  payload size (data to transmit) in bytes
+     *
+     *  \return Return ms to wait before the uplink fits: 0 to send now, LEDGER_NEVER if it never does
+     */
+    unsigned long uplinkDelay(unsigned int payload_size);
+    /*Returns the uplink airtime in ms charged in the last hour / the last day*/
+    unsigned long airtimeUsedHour(void);
+    unsigned long airtimeUsedDay(void);
+    /*Returns the current in mA drawn while transmitting at the power in use. The measured values
+      (TXPOWER_xxdBm_mA) are interpolated for the odd powers, the same table is used in every band*/
+    float getTxCurrent(void);
+    /*Returns the time in ms spent by the module transmitting uplinks (their time on air) and listening to the
+      receive windows after them (measured: execution time of the uplink command minus its time on air), since boot*/
+    unsigned long radioTxTime(void);
+    unsigned long radioRxTime(void);
     
     /**
      *  \brief LoRaWAN raw data
@@ -741,37 +1081,121 @@ unsigned int setFrequencyBand(_physical_type_t physicalType);
      */
     unsigned int Debug(_debug_level value);
 	
-    /*Returns the last adquired bitRate by the last call of "getbitRate" */
+    /*Returns the bitRate of the SF and BW in use, set by "getbitRate" or "setSpreadFactor" */
     unsigned int readbitRate(void);
-    /*Returns the last adquired txHead_time (time used to transmit LoRa message Header in ms) by the last call of "getbitRate" */
+    /*Returns the txHead_time (time on air of a frame without application payload, in ms) of the SF and BW in use */
     float        readtxHead_time(void);
    /*variables declarations*/ 
    private:
-    void SF_BW_to_bitrate_txhead_time(_spreading_factor_t SF, _band_width_t BW);/*stimate time to tx based on selected parameters*/
+    void store_modulation(_spreading_factor_t SF, _band_width_t BW);/*SF_last, BW_last and the values derived from them*/
+    void store_data_rate(_data_rate_t dataRate, _physical_type_t physicalType);/*store_modulation of a data rate*/
 	bool init_first_call(void);/*Function only to be called by first LoRa Init*/
+    bool probe_baud_rate(_baudrate_bps_supported baud_rate); /*true if the module answers at this baud rate*/
+    _baudrate_bps_supported load_baud_rate(void); /*last working baud rate, LORA_BAUDRATE_DEFAULT if unknown*/
+    void store_baud_rate(_baudrate_bps_supported baud_rate); /*remembers the working baud rate*/
+    void store_frequency_band(_physical_type_t physicalType); /*keeps freq_band in sync with the module*/
+    const char* at_query(const char* p_cmd, const char* p_prefix, const char* p_ack); /*value after p_prefix*/
+    uint32_t config_fingerprint(const _lora_config_t& config); /*hash of the settings not read back*/
     void initSerial(_baudrate_bps_supported baud_rate); /*allows an easy init of the serial port*/
 	void endSerial(void); /*allows an easy "end" of the serial port*/
+    unsigned int at_wait(void); /*polls until the pending command finishes. Returns its execution time*/
+    bool at_begin(void); /*prepares the serial port for a new command. false if a command is pending*/
+    bool at_expect(const char* p_ack, unsigned int timeout_ms, at_callback_t callback, void* ctx); /*waits for p_ack*/
+    bool at_open(void); /*waits for the pending command and starts a new one, written piecewise with at_put*/
+    void at_put(const char* str); /*writes a piece of the command*/
+    void at_put(long value); /*writes a decimal number*/
+    void at_put_freq(float frequency); /*writes a frequency in MHz with one decimal: 868.1*/
+    unsigned int at_close(const char* p_ack, unsigned int timeout_ms); /*waits for the response. Returns the execution time*/
+    bool at_send_payload(const char* p_prefix, const unsigned char* buffer, unsigned int length, bool hex,
+                         const char* p_ack, unsigned int timeout_ms, at_callback_t callback, void* ctx);
+    void at_finish(unsigned int time_ms); /*ends the pending command and calls its callback*/
+    void at_feed(char ch); /*adds a character to the response of the pending command*/
+    unsigned int at_elapsed(void); /*ms since the pending command was sent, at least 1*/
+    void urc_feed(char ch, bool solicited); /*assembles the received characters into lines*/
+    void urc_dispatch(const char* line, bool solicited); /*parses a line and calls its handler*/
+    void downlink_deliver(void); /*reports the parsed downlink, if any*/
+    void at_poll(void); /*reads the module. poll without the background tasks, used while waiting for a command*/
+    void serial_idle(void); /*lowpower_auto: closes the serial port after LORA_LOWPOWER_IDLE_MS without traffic*/
+    void join_step(void); /*sends the next join attempt once it is due*/
+    void join_retry(unsigned long wait_ms); /*schedules the next join attempt*/
+    static void join_done(unsigned int time_ms, const char* response, void* ctx); /*result of AT+JOIN*/
+    void dr_step(void); /*sends the next command of setDataRateBegin*/
+    static void dr_adr_done(unsigned int time_ms, const char* response, void* ctx); /*result of its AT+ADR*/
+    static void dr_done(unsigned int time_ms, const char* response, void* ctx); /*result of its AT+DR*/
+    void queue_step(void); /*reports the dropped uplinks and sends the next one*/
+    static void queue_done(unsigned int time_ms, const char* response, void* ctx); /*result of a queued uplink*/
+    static void queue_port_done(unsigned int time_ms, const char* response, void* ctx); /*result of its AT+PORT*/
+    bool link_step(const _uplink_t* item); /*link check request and data rate ahead of a queued uplink*/
+    static void link_check_done(unsigned int time_ms, const char* response, void* ctx); /*result of AT+LW=LCR*/
+    static void link_dr_done(unsigned int time_ms, const char* response, void* ctx); /*result of its AT+DR*/
+    unsigned char max_payload(_spreading_factor_t SF, _band_width_t BW); /*see getMaxPayload*/
     uint8_t uart_tx, uart_rx ;   /*Uart Tx and RX pins for communication with LoRa_WIO*/
     bool lowpower_auto; /*LowPower Autoonmode enable*/
     bool adaptative_DR; /*Adatpative data rate. is true by default in the module*/
     _baudrate_bps_supported baud_rate_set;/*last baud rate set*/
-	unsigned int bitRate; /*[bitsps]set only by "getbitRate" function. Must be called before reading this variable */
-    float txHead_time;   /*[miliseconds]set only by "getbitRate" function. Must be called before reading this variable*/
+    unsigned long serial_baud;    /*baud rate the serial port is open at, 0 if closed*/
+    unsigned long serial_last_ms; /*time of the last serial traffic, see LORA_LOWPOWER_IDLE_MS*/
+	unsigned int bitRate; /*[bitsps]of SF_last and BW_last. Updated by "getbitRate" and "setSpreadFactor"*/
+    float txHead_time;   /*[miliseconds]time on air of a frame without application payload. Updated with bitRate*/
     float freq_band;    /*[MHz]set only by "setDataRate" or "SetSpreadFactor" function. Must be called before reading this variable*/
     short txPower;    /*[dBm]set only by "setPower" or "SetSpreadFactor". function Must be called before reading this variable*/
     _spreading_factor_t SF_last;/* Last set Spread Factor*/
 	_band_width_t BW_last;/* Last set Spread Factor*/
 	_physical_type_t FREQBAND_last;/* Last set Spread Factor*/
+    LoRaE5Ledger ledger; /*airtime spent by the uplinks*/
+    uint32_t ledger_now(void); /*time base of the ledger in ms, see LORA_LEDGER_RTC*/
+    void ledger_charge(uint32_t airtime_ms); /*charges an uplink or join request sent now and keeps the ledger*/
+    unsigned long radio_tx_ms;  /*see radioTxTime*/
+    unsigned long radio_rx_ms;  /*see radioRxTime*/
+    unsigned int uplink_airtime_ms; /*time on air of the pending uplink, 0 if the pending command is not an uplink*/
+    bool uplink_confirmed;      /*the pending uplink waits for an ACK*/
+    bool uplink_acked;          /*the last confirmed uplink got its ACK*/
+    LoRaE5Link link;            /*link quality estimate*/
+    unsigned int link_uplinks;  /*queued uplinks sent since the last link check request*/
+    bool link_check_asked;      /*AT+LW=LCR was acknowledged, the next uplink carries it*/
+    bool link_hold;             /*an AT+DR of link_step failed: the next uplink keeps the data rate in use*/
+    _data_rate_t link_dr;       /*data rate asked by the pending AT+DR*/
+    _data_rate_t dr_wanted;         /*see setDataRateBegin*/
+    bool dr_adr_wanted;
+    bool dr_adr_pending;            /*AT+ADR not sent yet*/
+    bool dr_pending;                /*AT+DR not sent yet*/
+    _join_state_t join_state;       /*see joinBegin*/
+    unsigned int join_timeout_ms;   /*timeout of each join attempt*/
+    unsigned int join_failures;     /*failed attempts in a row*/
+    unsigned long join_wait_start;  /*time when the wait for the next attempt started*/
+    unsigned long join_wait_ms;     /*length of that wait*/
+    LoRaE5Queue queue;              /*uplinks waiting for the radio*/
+    int queue_sending;              /*slot of the item handed to the module, -1 if none*/
+    unsigned char port_last;        /*port set in the module, 0 if unknown*/
 	
 	
-    char recv_buf[BUFFER_LENGTH_MAX];//reception buffer. Commands response can be up to 400 bytes according to data sheet examples
-    char cmd[556];//store command to send
-    char cmd_resp_ack[64];//store command response ACK to compare with string recieved and thus verify if the command worked. 
-    #ifdef COMMAND_PRINT_TIME_MEASURE
-    char cmd_time[128];//store commands time response
-    #endif
+    char recv_buf[RESP_LENGTH_MAX];//reception buffer, sized for the responses that are read back. See LoRa-E5-Commands.h
+    /*asynchronous command engine state*/
+    _at_status_t at_state;       /*state of the last issued command*/
+    at_callback_t at_callback;   /*callback of the pending command*/
+    void* at_callback_ctx;       /*user pointer of the pending command*/
+    unsigned long at_start_ms;   /*time when the pending command was sent*/
+    unsigned int at_timeout_ms;  /*timeout of the pending command*/
+    unsigned int at_index;       /*characters stored in recv_buf for the pending command*/
+    LoRaE5Matcher at_matcher;    /*looks for the expected responses while the characters arrive*/
+    bool at_no_ack;              /*pending command was issued with AT_NO_ACK*/
+    long at_ack_time;            /*time between "Wait ACK" and "ACK Received". 0: not started, -1: done*/
+    unsigned int at_last_time;   /*execution time of the last finished command*/
+    /*unsolicited result codes dispatcher state*/
+    char line_buf[LINE_LENGTH_MAX];  /*line being assembled*/
+    unsigned int line_len;           /*characters stored in line_buf*/
+    bool line_solicited;             /*some character of the line arrived while a command was pending*/
+    _downlink_t downlink;            /*last parsed downlink*/
+    bool downlink_pending;           /*downlink parsed, waiting for its RSSI line*/
+    bool downlink_unread;            /*downlink not read yet by receivePacket*/
+    short rssi_last;                 /*last RSSI reported by the module*/
+    float snr_last;                  /*last SNR reported by the module*/
+    downlink_callback_t downlink_handler;
+    void* downlink_handler_ctx;
+    urc_callback_t urc_handler[URC_TYPES];
+    void* urc_handler_ctx[URC_TYPES];
 	/*define LoRa port*/
-	#if !(defined(ESP32)||defined(ESP32S3))	
+	#ifndef LORA_SERIAL_GLOBAL
     UART_LoRa SerialLoRa;//memory allocate the serial lora inside the class. Used to allow a construction of the class outside
     #endif
 };
@@ -0,0 +1,129 @@
+/*
+  Store-and-forward log of the readings that did not reach the network
+
+  The MIT License (MIT)
+*/
+#include "ReadingLog.h"
+#include <Arduino.h>
+#include <LittleFS.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define READING_LOG_MAGIC 0x524C4F47 /*"RLOG": the RTC memory holds a read position*/
+
+RTC_DATA_ATTR static uint32_t rtc_magic = 0;
+RTC_DATA_ATTR static uint32_t rtc_page = 0;
+RTC_DATA_ATTR static uint16_t rtc_index = 0;
+
+ReadingLog::ReadingLog(void) : ready(false), first_page(0), last_page(0), read_index(0), last_count(0), lost_count(0) {}
+
+bool ReadingLog::begin(void) {
+    bool found = false;
+    if (!LittleFS.begin(true)) { return false; }
+    if (!LittleFS.exists(READING_LOG_DIR) && !LittleFS.mkdir(READING_LOG_DIR)) { return false; }
+    File dir = LittleFS.open(READING_LOG_DIR);
+    if (!dir) { return false; }
+    for (File file = dir.openNextFile(); file; file = dir.openNextFile()) {
+        const char* name = strrchr(file.name(), '/'); /*full path on the older cores*/
+        uint32_t page = strtoul(name ? name + 1 : file.name(), NULL, 10);
+        size_t size = file.size();
+        file.close();
+        if (!found || (page < first_page)) { first_page = page; }
+        if (!found || (page >= last_page)) {
+            last_page = page;
+            /*a page cut short is closed: the next record starts a new one*/
+            last_count = (size % READING_LOG_RECORD_SIZE) ? READING_LOG_PAGE_RECORDS : size / READING_LOG_RECORD_SIZE;
+        }
+        found = true;
+    }
+    dir.close();
+    read_index = ((rtc_magic == READING_LOG_MAGIC) && (rtc_page == first_page)) ? rtc_index : 0;
+    if (found && (first_page == last_page) && (read_index > last_count)) { read_index = last_count; }
+    ready = true;
+    return true;
+}
+
+bool ReadingLog::append(const uint8_t* record) {
+    char name[32];
+    if (!ready) { return false; }
+    if (last_count >= READING_LOG_PAGE_RECORDS) {
+        last_page++;
+        last_count = 0;
+        if (last_page - first_page >= READING_LOG_PAGES) { /*full: the oldest page makes room*/
+            lost_count += READING_LOG_PAGE_RECORDS - read_index;
+            remove_first();
+        }
+    }
+    path(last_page, name);
+    File file = LittleFS.open(name, FILE_APPEND);
+    if (!file) { return false; }
+    size_t written = file.write(record, READING_LOG_RECORD_SIZE);
+    file.close();
+    if (written != READING_LOG_RECORD_SIZE) {
+        last_count = READING_LOG_PAGE_RECORDS; /*the page may be cut short, no record is added to it*/
+        return false;
+    }
+    last_count++;
+    return true;
+}
+
+bool ReadingLog::peek(uint8_t* record) {
+    char name[32];
+    while (count() > 0) {
+        path(first_page, name);
+        File file = LittleFS.open(name, FILE_READ);
+        if (file) {
+            bool read = file.seek(read_index * READING_LOG_RECORD_SIZE) &&
+                        (file.read(record, READING_LOG_RECORD_SIZE) == READING_LOG_RECORD_SIZE);
+            file.close();
+            if (read) { return true; }
+        }
+        remove_first(); /*missing or cut short: the rest of the page is skipped*/
+    }
+    return false;
+}
+
+void ReadingLog::pop(void) {
+    if (count() == 0) { return; }
+    read_index++;
+    if (read_index >= ((first_page == last_page) ? last_count : READING_LOG_PAGE_RECORDS)) {
+        remove_first();
+    } else {
+        save_cursor();
+    }
+}
+
+unsigned long ReadingLog::count(void) {
+    if (!ready) { return 0; }
+    if (first_page == last_page) { return last_count - read_index; }
+    return (READING_LOG_PAGE_RECORDS - read_index) +
+           (unsigned long)(last_page - first_page - 1) * READING_LOG_PAGE_RECORDS + last_count;
+}
+
+unsigned long ReadingLog::lost(void) {
+    return lost_count;
+}
+
+void ReadingLog::path(uint32_t page, char* buffer) {
+    sprintf(buffer, READING_LOG_DIR "/%08lu", (unsigned long)page);
+}
+
+void ReadingLog::remove_first(void) {
+    char name[32];
+    path(first_page, name);
+    LittleFS.remove(name);
+    if (first_page == last_page) { /*empty: the next record starts a new page*/
+        last_page++;
+        last_count = 0;
+    }
+    first_page++;
+    read_index = 0;
+    save_cursor();
+}
+
+void ReadingLog::save_cursor(void) {
+    rtc_magic = READING_LOG_MAGIC;
+    rtc_page = first_page;
+    rtc_index = read_index;
+}
@@ -0,0 +1,54 @@
+/*
+  Store-and-forward log of the readings that did not reach the network
+
+  The MIT License (MIT)
+*/
+
+#ifndef _READING_LOG_H_
+#define _READING_LOG_H_
+/*Append-only ring of fixed size records in LittleFS, oldest first out. The records are written to page
+  files of READING_LOG_PAGE_RECORDS records named after an increasing page number:
+   - a page is never rewritten: a new page gets a new name, so the file system places it on other blocks
+     and spreads the erases over the partition
+   - a page is deleted once all its records are forwarded, or when READING_LOG_PAGES pages exist and a
+     new one is needed (the oldest readings are lost and counted)
+  The read position is only kept in RTC memory: it survives the deep sleep, after a power loss the
+  forwarding starts again at the beginning of the oldest page (up to one page sent twice).
+  A page cut short by a power loss is closed, the next record starts a new page*/
+#include <stdint.h>
+
+#define READING_LOG_DIR           "/rlog"
+#define READING_LOG_RECORD_SIZE   16
+#define READING_LOG_PAGE_RECORDS  64   /*1 KB pages*/
+#define READING_LOG_PAGES         128  /*8192 records, 11 days of readings every 2 min*/
+
+class ReadingLog {
+   public:
+    ReadingLog(void);
+    /*mounts LittleFS (formatted if it cannot be mounted) and finds the pages left by the previous runs.
+      Returns false if the file system is not available, the log then stays empty*/
+    bool begin(void);
+    /*adds a record of READING_LOG_RECORD_SIZE bytes at the end. false if it could not be written*/
+    bool append(const uint8_t* record);
+    /*copies the oldest record not forwarded yet. false if the log is empty*/
+    bool peek(uint8_t* record);
+    /*the record returned by peek was forwarded*/
+    void pop(void);
+    /*records waiting to be forwarded*/
+    unsigned long count(void);
+    /*records deleted by the rotation before being forwarded, since boot*/
+    unsigned long lost(void);
+
+   private:
+    void path(uint32_t page, char* buffer);
+    void remove_first(void); /*deletes the oldest page*/
+    void save_cursor(void);  /*keeps the read position in RTC memory*/
+    bool ready;
+    uint32_t first_page;     /*oldest page, read at read_index*/
+    uint32_t last_page;      /*page the records are appended to*/
+    uint16_t read_index;
+    uint16_t last_count;     /*records in the last page*/
+    unsigned long lost_count;
+};
+
+#endif
@@ -10,6 +10,13 @@
 // - OLED display for IP address and sensor data.
 // - LoRa-E5 module for long-range communication.
 // - Periodically sends sensor data via LoRa.
+// - On battery, deep sleeps between readings; web server and OLED only run with VUSB.
+// - Readings that miss the network are stored in flash and forwarded once the link is back.
+// - Samples every 30 s and sends them in batches sized to the data rate in use.
+// - Reports by exception: only the fields past their deadband, with a full reading every hour.
+// - Interval, Ro, temperature, data rate and deadbands can be changed with LoRa downlink commands.
+// - LoRa class A by default, class C only for a bounded window after VUSB or a downlink asks for it.
+// - ADS1115 channels converted round robin in the background, the loop never waits for a conversion.
 //
 // Libraries:
 // - WiFiManager by tzapu: https://github.com/tzapu/WiFiManager
@@ -26,11 +33,17 @@
 #include <Adafruit_GFX.h>
 #include <Adafruit_SSD1306.h>
 #include <ADS1x15.h>
+#include <AdcSweep.h>
 #include <Preferences.h>
-#include <CayenneLPP.h>
 #include <DHT20.h>
+#include <EnergyAccount.h>
+#include <ReadingLog.h>
 #include "index.h" // Include the HTML content for the web server
+#include "payload_codec.h" // Generated by tools/codec/gen_codec.py
 #include <LoRa-E5.h>
+#include <esp_sleep.h>
+#include <time.h>
+#include <type_traits>
 
 
 // --- Pin Definitions ---
@@ -38,6 +51,7 @@
 #define WIO_RX_PIN 20
 #define WIO_TX_PIN 21
 #define VUSB_SENSE_PIN 3
+#define VUSB_SENSE_THRESHOLD 1700 // ADC reading above which USB power is present
 #define RECEIVE_WINDOW 1000 // Timeout for receiving packets in milliseconds
 
 // --- ADS1115 Pin Definitions ---
@@ -45,6 +59,7 @@
 #define ADC_GAS_PIN 1
 #define ADC_BATT_PIN 2
 #define ADC_OXYGEN_PIN 3
+#define ADC_READY_PIN -1 // ALERT/RDY of the ADS1115, -1 if not wired: the status register is polled
 
 // --- OLED Display Configuration ---
 #define SCREEN_WIDTH 128 // OLED display width, in pixels
@@ -65,23 +80,35 @@ Adafruit_SSD1306 display(SCREEN_WIDTH, SCREEN_HEIGHT, &Wire, OLED_RESET);
 // --- Object Instantiation ---
 WebServer server(80);
 ADS1115 ADS(0x48);
+AdcSweep adcSweep(ADS); // Converts the channels round robin from loop(), see processGasData()
 
 // --- LoRa Message Status Handling ---
 enum LoraWebStatus { IDLE, SENDING, ACK_SUCCESS, ACK_FAILED };
 LoraWebStatus loraWebStatus = IDLE;
-String messageToSend = "";
-extern HardwareSerial SerialLoRa;
+unsigned int loraWebPending = 0; // Web messages in the uplink queue
 const unsigned long loraTimeout = 6000; // Timeout for ACK in milliseconds
-bool loraJoined = false;
+
+// --- LoRa Uplink Queue ---
+// Web messages and sensor reports share the uplink queue of the driver, drained by lora.poll()
+#define WEB_PRIORITY 2                 // A message typed by a user goes first
+#define WEB_MAX_AGE_MS 600000          // Given up after 10 min in the queue
+#define SENSOR_PRIORITY 1              // A reading is replaced by the next one, so it expires after one interval
+#define COMMAND_PRIORITY 2             // The ack of downlink commands goes before the next reading
+#define BACKLOG_PRIORITY 0             // Stored readings only use the airtime left by the others
 
 
 /************************LORA SET UP*******************************************************************/
 #define LoRa_APPKEY              "19aee7bedec56509a9c66a44b7956b6f" /*Custom key for this App*/
 #define LoRa_FREQ_standard       AS923                                     /*International frequency band. see*/
 #define LoRa_DR                  DR4                                       /*DR5=5.2kbps //data rate. see at https://www.thethingsnetwork.org/docs/lorawan/regional-parameters/  */
-#define LoRa_DEVICE_CLASS        CLASS_C                                   /*CLASS_A for power restriction/low power nodes. Class C for other device applications */
+#define LoRa_DEVICE_CLASS        CLASS_A                                   /*class at start up. Class C is only used in the windows of the power policy, see serviceClassPolicy*/
 #define LoRa_PORT_BYTES          8                                         /*node Port for binary values to send, allowing the app to know it is recieving bytes*/
 #define LoRa_PORT_STRING         7                                         /*Node Port for string messages to send, allowing the app to know it is recieving characters/text */
+#define LoRa_PORT_READING        PAYLOAD_PORT_READING                      /*node Port for one reading, see tools/codec/schema.json*/
+#define LoRa_PORT_BACKLOG        PAYLOAD_PORT_STORED                       /*node Port for stored readings forwarded late, see packReading*/
+#define LoRa_PORT_BATCH          PAYLOAD_PORT_BATCH                        /*node Port for batches of samples, see sendBatchLora*/
+#define LoRa_PORT_CHANGES        PAYLOAD_PORT_CHANGES                      /*node Port for the fields that changed, see sendSensorDataLora*/
+#define LoRa_PORT_COMMAND        20                                        /*node Port for the downlink commands and their acks, see applyCommands*/
 #define LoRa_POWER               14                                        /*Node Tx (Transmition) power*/
 #define LoRa_CHANNEL             0                                         /*Node selected Tx channel. Default is 0, we use 2 to show only to show how to set up*/
 #define LoRa_ADR_FLAG            true                                      /*ADR(Adaptative Dara Rate) status flag (True or False). Use False if your Node is moving*/
@@ -91,16 +118,25 @@ bool loraJoined = false;
 #define PAYLOAD_FIRST_TX         10  /*bytes to send into first packet*/
 #define Tx_and_ACK_RX_timeout 6000 /*6000 for SF12,4000 for SF11,3000 for SF11, 2000 for SF9/8/, 1500 for SF7. All examples consering 50 bytes payload and BW125*/
 /*******************************************************************/
+uint8_t loraDataRate = LoRa_DR;                /*set by the downlink commands, kept in preferences*/
+bool loraAdr = LoRa_ADR_FLAG;
 /*Set up the LoRa module with the desired configuration */
-void LoRa_setup(void) {
-    lora.setDeviceMode(LWOTAA); /*LWOTAA or LWABP. We use LWOTAA in this example*/
-    lora.setDataRate((_data_rate_t)LoRa_DR, (_physical_type_t)LoRa_FREQ_standard);
-    lora.setKey(NULL, NULL, LoRa_APPKEY);               /*Only App key is seeted when using OOTA*/
-    lora.setClassType((_class_type_t)LoRa_DEVICE_CLASS); /*set device class*/
-    lora.setPort(LoRa_PORT_BYTES);                       /*set the default port for transmiting data*/
-    lora.setPower(LoRa_POWER);                           /*sets the Tx power*/
-    lora.setChannel(LoRa_CHANNEL);                       /*selects the channel*/
-    lora.setAdaptiveDataRate(LoRa_ADR_FLAG);             /*Enables adaptative data rate*/
+void LoRa_setup(_class_type_t classType) {
+    _lora_config_t config;
+    _config_report_t report;
+    config.mode = LWOTAA;                                  /*LWOTAA or LWABP. We use LWOTAA in this example*/
+    config.band = (_physical_type_t)LoRa_FREQ_standard;
+    config.data_rate = (_data_rate_t)loraDataRate;
+    config.app_key = LoRa_APPKEY;                          /*Only App key is seeted when using OOTA*/
+    config.class_type = classType;                         /*set device class*/
+    config.port = LoRa_PORT_BYTES;                         /*set the default port for transmiting data*/
+    config.power = LoRa_POWER;                             /*sets the Tx power*/
+    config.channel = LoRa_CHANNEL;                         /*selects the channel*/
+    config.adr = loraAdr;                                  /*Enables adaptative data rate*/
+    /*only the settings the module does not have yet are sent*/
+    lora.applyConfig(config, &report);
+    Serial.printf("LoRa setup: %u sent, %u skipped, %u ms (~%u ms saved)\n",
+                  report.sent, report.skipped, report.time_ms, report.saved_ms);
 }
 
 #define AP_DEFAULT_NAME "XIAO-ESP32C3-AP" // Access Point name
@@ -110,6 +146,69 @@ void LoRa_setup(void) {
 #define DEFAULT_OLED_TITLE "Petra DO Sensor"
 #define DEFAULT_RO 30000.0 // Default Ro value for gas sensor
 #define DEFAULT_WATER_TEMP 25.0 // Default water temperature if not using live reading
+#define BATTERY_CAPACITY_MAH 3000.0 // Capacity of the battery pack, used for the battery life projection
+
+// --- Deep-Sleep Cycle ---
+// Without VUSB the node wakes every sensor interval, samples, uplinks with the LoRa-E5 in class A and
+// deep sleeps again. The E5 sleeps in between and keeps its session, so the join is reused.
+#define SLEEP_CYCLE_ENABLED true      // false keeps the node awake on battery too
+#define SLEEP_CYCLE_BUDGET_MS 20000   // Longest wake-to-sleep time, the uplink is given up past it
+#define SLEEP_CYCLE_MIN_MS 1000       // Shortest deep sleep
+#define SLEEP_CYCLE_BACKLOG 3         // Stored readings forwarded per wake at most, after the live one
+
+// --- Batched Uplinks ---
+// A sample is taken every SAMPLE_INTERVAL and the samples are sent together on LoRa_PORT_BATCH, as many per
+// frame as the data rate in use allows. The sensor interval becomes the longest a sample waits for its frame.
+// In the sleep cycle the node wakes every SAMPLE_INTERVAL and only starts the LoRa-E5 when a frame is due.
+#define BATCH_ENABLED true            // false sends one reading per sensor interval
+#define SAMPLE_INTERVAL (30 * 1000)   // Sampling period when batching
+#define BATCH_HEADER_BYTES 4          // Age of the first sample [s] (u32)
+#define BATCH_SAMPLE_BYTES (2 + PAYLOAD_CODEC_BYTES) // Delta to the first sample [s] (u16) + the packed fields
+#define BATCH_MAX_SAMPLES ((LORA_QUEUE_PAYLOAD_MAX - BATCH_HEADER_BYTES) / BATCH_SAMPLE_BYTES)
+
+// --- Report by Exception ---
+// A reading is only sent when a field moved past its deadband (tools/codec/schema.json) from the value last
+// reported, and then only with the fields that moved, on LoRa_PORT_CHANGES. A full reading still goes out every
+// HEARTBEAT_INTERVAL, so a stable tank is told apart from a silent node. When batching, the reported samples
+// are batched in full.
+#define REPORT_BY_EXCEPTION true      // false reports every reading
+#define HEARTBEAT_INTERVAL (60 * 60 * 1000) // Longest time without a full reading
+
+// --- Downlink Commands ---
+// The settings of the web page, the data rate and the reporting are changed from the network server with a
+// downlink on LoRa_PORT_COMMAND: a sequence number (u8), then one or more commands, big endian:
+//   0x01 sensor interval [s] (u16, >= 90)
+//   0x02 gas sensor Ro [ohm] (u32, > 0)
+//   0x03 default water temperature [0.1 C] (u16, 0 to 400)
+//   0x04 use the live water temperature (u8, 0 or 1)
+//   0x05 data rate (u8, DR0 to DR15) and ADR (u8, 0 or 1). With the ADR off the driver starts at that data rate and
+//        follows the link estimate from there, see LORA_LINK_CHECK_EVERY
+//   0x06 deadband: field (u8, order of tools/codec/schema.json) and width in steps of the field (u16)
+//   0x07 heartbeat [min] (u16, >= 1)
+//   0x08 class C window [min] (u16, 0 to CLASS_C_WINDOW_MAX_MIN), see LoRa Class Policy
+// The commands are applied in order and kept in preferences, as the web page does. The ones before a failed
+// command stay applied. The node acks on the same port, ahead of its next reading: the sequence number (u8),
+// a CMD_ status (u8) and the index of the failed command (u8). A lost ack is sent again on the next wake.
+#define CMD_INTERVAL 0x01
+#define CMD_RO 0x02
+#define CMD_DEFAULT_TEMP 0x03
+#define CMD_LIVE_TEMP 0x04
+#define CMD_DATA_RATE 0x05
+#define CMD_DEADBAND 0x06
+#define CMD_HEARTBEAT 0x07
+#define CMD_CLASS_C 0x08              // Class C window [min] (u16, 0 closes it, up to CLASS_C_WINDOW_MAX_MIN), not kept
+#define CMD_OK 0                      // All the commands were applied
+#define CMD_UNKNOWN 1                 // Unknown command code
+#define CMD_TRUNCATED 2               // The downlink ends in the middle of the command
+#define CMD_RANGE 3                   // Value out of range, the setting is unchanged
+
+// --- LoRa Class Policy ---
+// The E5 runs in class A and sleeps between uplinks (SLEEPPOWER_mA). It only listens in class C (RXPOWER_mA) for
+// CLASS_C_WINDOW_MS after VUSB is plugged in, or for the window asked by a CMD_CLASS_C downlink, then goes back to
+// class A. On battery the sleep cycle does not stay awake for a window: it is cut at SLEEP_CYCLE_BUDGET_MS, and the
+// E5 is back in class A before every deep sleep. The time in each class is reported.
+#define CLASS_C_WINDOW_MS (10 * 60 * 1000) // Window opened by VUSB
+#define CLASS_C_WINDOW_MAX_MIN 240    // Longest window a command can open [min]
 
 // --- Preference Keys ---
 #define AP_NAME_KEY "ap_name"
@@ -120,15 +219,10 @@ void LoRa_setup(void) {
 #define USE_LIVE_TEMP_KEY "use_live_temp"
 #define DEFAULT_TEMP_KEY "default_temp"
 #define DISPLAY_INTERVAL_KEY "display_interval"
-
-// Define channels for each sensor to differentiate them in the payload
-#define DISSOLVED_OXYGEN_CHANNEL        1
-#define AIR_QUALITY_CHANNEL             2
-#define TEMPERATURE_CHANNEL             3
-#define BATTERY_CHANNEL                 4
-#define ENCLOSURE_TEMPERATURE_CHANNEL   5
-#define ENCLOSURE_HUMIDITY_CHANNEL      6
-#define VUSB_SENSE_CHANNEL              7
+#define DATA_RATE_KEY "lora_dr"
+#define ADR_KEY "lora_adr"
+#define DEADBANDS_KEY "deadbands"
+#define HEARTBEAT_KEY "heartbeat"
 
 // --- Global Variables ---
 unsigned long previousSensorMillis = 0;
@@ -143,6 +237,47 @@ char buffer[128];
 bool useWiFiManager; // Set to true to use WiFi Manager, false for Soft AP mode
 Preferences preferences;
 DHT20 DHT;
+EnergyAccount energy;
+float batteryLifeDays = 0; // Projected battery life, updated with the display
+// Store-and-forward: a reading the queue reports as not sent goes to the flash log
+struct PendingReading {
+    bool used;
+    uint8_t count; // 1, or the samples of a batch
+    uint8_t records[BATCH_MAX_SAMPLES][READING_LOG_RECORD_SIZE];
+};
+PendingReading pendingReadings[LORA_QUEUE_SLOTS]; // Readings in the uplink queue
+ReadingLog readingLog;
+bool loraLinkUp = false;      // An uplink was acknowledged since the last failure
+bool backlogInFlight = false; // A stored reading is in the uplink queue
+float reportDeadbands[PAYLOAD_FIELD_COUNT]; // In field order, payload_deadbands unless changed by a command
+unsigned long heartbeatInterval = HEARTBEAT_INTERVAL;
+_class_type_t loraClass = CLASS_A; // Class set by startLora
+bool loraConfigChanged = false;    // The data rate was changed by a command, handed to the driver by serviceCommands
+bool commandAckQueued = false;     // The ack is in the uplink queue
+bool classCWindow = false;         // A class C window is open
+unsigned long classCStartMs = 0;
+unsigned long classCLengthMs = 0;
+unsigned long classSinceMs = 0;    // millis() of the last class time update
+bool vusbWasPresent = false;       // A rising edge of VUSB opens a class C window
+// Kept in RTC memory across deep sleep
+RTC_DATA_ATTR uint32_t sleepCycles = 0;       // Cycles since power on
+RTC_DATA_ATTR uint32_t lastAwakeMs = 0;       // Measured wake-to-sleep time of the previous cycle
+RTC_DATA_ATTR uint32_t maxAwakeMs = 0;        // Longest one since power on
+RTC_DATA_ATTR uint32_t budgetOverruns = 0;    // Cycles that reached SLEEP_CYCLE_BUDGET_MS
+RTC_DATA_ATTR uint8_t batchRecords[BATCH_MAX_SAMPLES][READING_LOG_RECORD_SIZE]; // Samples not sent yet
+RTC_DATA_ATTR uint8_t batchCount = 0;
+RTC_DATA_ATTR uint8_t batchLimit = 0;         // Samples per frame at the data rate in use, 0 until the LoRa-E5 is set up
+RTC_DATA_ATTR payload_fields_t reportedFields; // Values last reported, the deadbands are measured from them
+RTC_DATA_ATTR uint32_t reportedTime = 0;      // Time of the last full reading [s]
+RTC_DATA_ATTR bool reportedValid = false;     // false until the first full reading
+RTC_DATA_ATTR uint8_t commandAck[3];          // Ack of the last downlink commands: sequence, status, failed command
+RTC_DATA_ATTR bool commandAckPending = false; // Not sent yet
+RTC_DATA_ATTR uint64_t classATimeMs = 0;      // Time the E5 spent in class A since power on, deep sleep included
+RTC_DATA_ATTR uint64_t classCTimeMs = 0;      // Time it spent listening in class C
+RTC_DATA_ATTR uint8_t energyRtc[sizeof(EnergyAccount)]; // Copy of the energy account at the last deep sleep
+RTC_DATA_ATTR uint32_t energySleepMs = 0;     // Length of that sleep
+RTC_DATA_ATTR bool energyRtcValid = false;    // energyRtc holds an account
+static_assert(std::is_trivially_copyable<EnergyAccount>::value, "the energy account is copied to RTC memory");
 
 // --- Function Prototypes ---
 void handleRoot();
@@ -155,8 +290,46 @@ void handleSetTempToggle();
 void handleSetDefaultTemp();
 void handleGetSettings();
 void displaySensorData(float gasPPM, float oxygen, float temperature, float batteryPercentage, float enclosureTemp, float enclosureHum);
-void sendSensorDataLora(float gasPPM, float oxygen, float temperature, float batteryPercentage, float enclosureTemp, float enclosureHum);
-void processLoraSend();
+bool sendSensorDataLora(const payload_fields_t* fields, uint8_t mask);
+bool queueReading(float gasPPM, float oxygen, float temperature, float batteryPercentage, float enclosureTemp, float enclosureHum);
+bool batchDue();
+bool sendBatchLora();
+unsigned long samplePeriod();
+void startLora(_class_type_t classType);
+bool vusbPresent();
+void runSleepCycle();
+void enterSleep(unsigned long sleepMs);
+void restoreEnergy();
+void setupEnergy();
+void updateEnergy(float batteryPercentage);
+void onLoraWebSendDone(unsigned int time_ms, const char* response, void* ctx);
+void onLoraSensorSendDone(unsigned int time_ms, const char* response, void* ctx);
+void onLoraBacklogSendDone(unsigned int time_ms, const char* response, void* ctx);
+payload_fields_t makeFields(float gasPPM, float oxygen, float temperature, float batteryPercentage, float enclosureTemp, float enclosureHum);
+uint8_t reportFields(const payload_fields_t* fields);
+void packReading(uint8_t* record, const payload_fields_t* fields);
+bool forwardBacklog();
+uint32_t recordTime(const uint8_t* record);
+void storePendingReadings();
+PendingReading* freePendingReading();
+void onLoraDownlink(const _downlink_t* downlink, void* ctx);
+void onLoraCommandAckDone(unsigned int time_ms, const char* response, void* ctx);
+uint8_t applyCommands(const uint8_t* data, uint8_t length, uint8_t* failed);
+void serviceCommands();
+bool setSensorInterval(long seconds);
+bool setGasRo(float ro);
+bool setDefaultTemperature(float temp);
+void setLiveTemperature(bool useLive);
+bool setLoraDataRate(uint8_t dataRate, bool adr);
+bool setDeadband(uint8_t field, float deadband);
+bool setHeartbeat(unsigned long minutes);
+void openClassCWindow(unsigned long ms);
+bool classCWindowOpen();
+void serviceClassPolicy();
+void accountClassTime();
+void setLoraClass(_class_type_t classType);
+void leaveClassC();
+void onLoraUnsolicited(_urc_type_t type, const char* line, void* ctx);
 float processGasData();
 float processOxygenData(double temperature);
 float processWaterTempData();
@@ -166,12 +339,16 @@ float readDO(float voltage_mv, double temperature_c);
 
 void setup() {
     Serial.begin(115200);
-    while (!Serial);
     Wire.begin(); 
+    restoreEnergy(); // The battery projection counts the deep sleeps and the wakes on battery
 
     pinMode(VUSB_SENSE_PIN, INPUT_PULLDOWN);
-
-    delay(10000);
+    // On battery nothing waits for the serial monitor, the wake-to-sleep time is the budget
+    bool sleepCycle = SLEEP_CYCLE_ENABLED && !vusbPresent();
+    if (!sleepCycle) {
+        while (!Serial);
+        delay(10000);
+    }
 
     String apName;
     String apPassword;
@@ -186,14 +363,25 @@ void setup() {
     gasSensorRo = preferences.getFloat(RO_KEY, DEFAULT_RO);
     useLiveTemperature = preferences.getBool(USE_LIVE_TEMP_KEY, true);
     defaultWaterTemperature = preferences.getFloat(DEFAULT_TEMP_KEY, DEFAULT_WATER_TEMP);
+    loraDataRate = preferences.getUChar(DATA_RATE_KEY, LoRa_DR);
+    loraAdr = preferences.getBool(ADR_KEY, LoRa_ADR_FLAG);
+    heartbeatInterval = preferences.getUInt(HEARTBEAT_KEY, HEARTBEAT_INTERVAL);
+    if (preferences.getBytes(DEADBANDS_KEY, reportDeadbands, sizeof(reportDeadbands)) != sizeof(reportDeadbands)) {
+        memcpy(reportDeadbands, payload_deadbands, sizeof(reportDeadbands)); // Never set, or the schema changed
+    }
     preferences.end();
+
+    if (readingLog.begin()) {
+        Serial.println(String(readingLog.count()) + " stored readings to forward.");
+    } else {
+        Serial.println("LittleFS not available, readings that miss the network are lost.");
+    }
     
-    lora.init(WIO_TX_PIN, WIO_RX_PIN);
-    LoRa_setup(); // Set up LoRa module with desired configuration
-    while (lora.setOTAAJoin(JOIN, 10000) == 0) {
-        // Retry join
+    if (sleepCycle) {
+        runSleepCycle(); // Does not return
     }
-    loraJoined = true;
+    // Class A until serviceClassPolicy() opens a class C window
+    startLora((_class_type_t)LoRa_DEVICE_CLASS);
     if (!display.begin(SSD1306_SWITCHCAPVCC, 0x3C)) {
         Serial.println(F("SSD1306 allocation failed"));
         for (;;);
@@ -212,6 +400,8 @@ void setup() {
     display.println("Starting I2C bus...");
     display.display();
     ADS.begin();
+    ADS.setGain(ADS1X15_GAIN_2048MV);
+    adcSweep.begin(ADC_READY_PIN);
 
     // --- WiFiManager Setup ---
     useWiFiManager = false; // Set to false to hardcode WiFi credentials and use Soft AP
@@ -233,6 +423,7 @@ void setup() {
       display.println("Starting Personal Hotspot...");
       display.display();
       WiFi.softAP(AP_DEFAULT_NAME, AP_DEFAULT_PASSWORD);
+      energy.setOn(ENERGY_WIFI_AP, true, millis());
       display.println("Personal Hotspot started!");
       display.println("SSID: " + String(AP_DEFAULT_NAME));
       res = true;
@@ -258,7 +449,8 @@ void setup() {
     display.clearDisplay();
     display.setCursor(0, 0);
 
-    // Initial sensor read
+    // Initial sensor read, from a full sweep
+    adcSweep.sweep();
     float liveTemperature = processWaterTempData();
     float tempForDO = useLiveTemperature ? liveTemperature : defaultWaterTemperature;
     float gasPPM = processGasData();
@@ -268,22 +460,20 @@ void setup() {
     float enclosureHumidity = DHT.getHumidity();
     float enclosureTemperature = DHT.getTemperature();
     displaySensorData(gasPPM, oxygen, liveTemperature, batteryPercentage, enclosureTemperature, enclosureHumidity);
-    sendSensorDataLora(gasPPM, oxygen, liveTemperature, batteryPercentage, enclosureTemperature, enclosureHumidity);
+    queueReading(gasPPM, oxygen, liveTemperature, batteryPercentage, enclosureTemperature, enclosureHumidity); // Sent once the join completes
 }
 
 void loop() {
+    lora.poll(); // Parse the response of the pending LoRa command, if any
+    serviceCommands();
+    serviceClassPolicy();
+    forwardBacklog();
     server.handleClient();
-    processLoraSend(); // Check if we need to send a LoRa message
-    ADS.setGain(ADS1X15_GAIN_2048MV);
-    if (!loraJoined) {
-        while (lora.setOTAAJoin(JOIN, 10000) == 0) {
-            // Retry join
-        }
-        loraJoined = true;
-    }
+    adcSweep.poll(); // Collects the conversion if it is done and starts the next channel
 
     unsigned long currentMillis = millis();
-    if (currentMillis - previousSensorMillis >= sendInterval) {
+    // The reading is queued, lora.poll() sends it when the modem, the join and the airtime budget allow it
+    if (currentMillis - previousSensorMillis >= samplePeriod()) {
         previousSensorMillis = currentMillis;
 
         float gasPPM = processGasData();
@@ -296,7 +486,7 @@ void loop() {
         float enclosureTemp = DHT.getTemperature();
         float enclosureHum = DHT.getHumidity();
 
-        sendSensorDataLora(gasPPM, oxygen, liveTemperature, batteryPercentage, enclosureTemp, enclosureHum);
+        queueReading(gasPPM, oxygen, liveTemperature, batteryPercentage, enclosureTemp, enclosureHum);
     }
 
     if (currentMillis - previousDisplayMillis >= displayInterval) {
@@ -310,6 +500,7 @@ void loop() {
       if (DHT.read() == 0) {
         Serial.println("DHT read successful");
       }
+      updateEnergy(batteryPercentage);
       float enclosureTemp = DHT.getTemperature();
       float enclosureHum = DHT.getHumidity();
       Serial.println("enclosure Temp: " + String(enclosureTemp));
@@ -318,28 +509,19 @@ void loop() {
 
       Serial.println("VUSB Sense: " + String(analogRead(VUSB_SENSE_PIN)));
 
-      if (analogRead(VUSB_SENSE_PIN) > 1700) {
+      if (vusbPresent()) {
           Serial.println("VUSB is connected");
       } else {
           Serial.println("VUSB is not connected");
-      }
-    }
-
-    if (SerialLoRa.available()) {
-      Serial.println("Data received from LoRa module:");
-      String packet = SerialLoRa.readStringUntil('\n'); // Read until newline
-      if (packet.startsWith("+MSG: FPENDING")){
-       // receive and parse the packet
-       // +MSG: PORT: 1; RX: "68656C6C6F"
-       String RawData = SerialLoRa.readStringUntil('\n');
-       String data = RawData.substring(RawData.indexOf('"') + 1, RawData.lastIndexOf('"'));
-
-       Serial.println("Received packet -----------------");
-       Serial.print("Packet from LoRa: ");
-       Serial.println(data);
-       Serial.println("End of packet -------------------");
-      } else {
-        Serial.println(packet); // Read and print any other data
+          if (SLEEP_CYCLE_ENABLED && !lora.busy()) {
+              // Unplugged: the display and the soft AP go off, the next reading is taken by the sleep cycle
+              display.ssd1306_command(SSD1306_DISPLAYOFF);
+              leaveClassC();
+              lora.setDeviceLowPower();
+              storePendingReadings();
+              unsigned long elapsed = currentMillis - previousSensorMillis;
+              enterSleep(elapsed < samplePeriod() ? samplePeriod() - elapsed : 0);
+          }
       }
     }
 
@@ -351,53 +533,544 @@ void loop() {
 }
 
 
+// --- Energy Functions ---
+// Takes back the account kept across the deep sleep and counts the sleep in it: the ESP32 and the E5 slept for
+// energySleepMs. After a power on or a reset it starts again
+void restoreEnergy() {
+    if (energyRtcValid && esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_TIMER) {
+        memcpy(&energy, energyRtc, sizeof(energy));
+        energy.resume(energySleepMs);
+    }
+    energyRtcValid = false;
+    energy.setCurrent(ENERGY_ESP32_SLEEP, ENERGY_ESP32_SLEEP_mA);
+    energy.setOn(ENERGY_ESP32_SLEEP, false, 0);
+    energy.setOn(ENERGY_ESP32_ACTIVE, true, 0); // Awake since the boot. The E5 sleeps until startLora
+}
+
+void setupEnergy() {
+    energy.setCurrent(ENERGY_LORA_TX, lora.getTxCurrent());
+    energy.setCurrent(ENERGY_LORA_RX, RXPOWER_mA);
+    energy.setCurrent(ENERGY_LORA_IDLE_RX, RXPOWER_mA);
+    energy.setCurrent(ENERGY_LORA_SLEEP, SLEEPPOWER_mA);
+    energy.setCurrent(ENERGY_ESP32_ACTIVE, ENERGY_ESP32_ACTIVE_mA);
+    energy.setCurrent(ENERGY_WIFI_AP, ENERGY_WIFI_AP_mA);
+    energy.setOn(ENERGY_ESP32_ACTIVE, true, millis());
+    // Class C listens between uplinks, class A sleeps
+    energy.setOn(loraClass == CLASS_C ? ENERGY_LORA_IDLE_RX : ENERGY_LORA_SLEEP, true, millis());
+}
+
+// Adds the radio time measured by the driver since the last call and projects the battery life
+void updateEnergy(float batteryPercentage) {
+    static unsigned long lastTxTime = 0;
+    static unsigned long lastRxTime = 0;
+    unsigned long txTime = lora.radioTxTime();
+    unsigned long rxTime = lora.radioRxTime();
+    energy.setCurrent(ENERGY_LORA_TX, lora.getTxCurrent());
+    energy.add(ENERGY_LORA_TX, txTime - lastTxTime);
+    energy.add(ENERGY_LORA_RX, rxTime - lastRxTime);
+    lastTxTime = txTime;
+    lastRxTime = rxTime;
+    energy.update(millis());
+    float remaining = BATTERY_CAPACITY_MAH * constrain(batteryPercentage, 0.0f, 100.0f) / 100.0f;
+    batteryLifeDays = energy.projectDays(remaining);
+}
+
+// --- Power Functions ---
+bool vusbPresent() {
+    return analogRead(VUSB_SENSE_PIN) > VUSB_SENSE_THRESHOLD;
+}
+
+// One wake of the deep-sleep cycle: sample, uplink once joined, put the E5 to sleep and deep sleep. When batching,
+// the wakes that only add a sample to the batch leave the E5 asleep.
+// millis() counts from the wake up, so it is the measured wake-to-sleep time.
+void runSleepCycle() {
+    sleepCycles++;
+    Serial.printf("Sleep cycle %u, previous one awake %u ms (max %u ms, %u over budget)\n",
+                  sleepCycles, lastAwakeMs, maxAwakeMs, budgetOverruns);
+    ADS.begin();
+    ADS.setGain(ADS1X15_GAIN_2048MV);
+    adcSweep.begin(ADC_READY_PIN);
+    adcSweep.sweep(); // Nothing else to do before the readings
+
+    float liveTemperature = processWaterTempData();
+    float tempForDO = useLiveTemperature ? liveTemperature : defaultWaterTemperature;
+    float gasPPM = processGasData();
+    float oxygen = processOxygenData(tempForDO);
+    float batteryPercentage = processBatteryPercentage();
+    DHT.read();
+    float enclosureTemp = DHT.getTemperature();
+    float enclosureHum = DHT.getHumidity();
+
+    payload_fields_t fields = makeFields(gasPPM, oxygen, liveTemperature, batteryPercentage, enclosureTemp, enclosureHum);
+    uint8_t mask = reportFields(&fields);
+    if (BATCH_ENABLED && mask != 0) {
+        packReading(batchRecords[batchCount++], &fields);
+    }
+    if (BATCH_ENABLED ? !batchDue() : mask == 0) {
+        Serial.println("Nothing to send: " + String(batchCount) + " of " + String(batchLimit) + " samples batched.");
+        updateEnergy(batteryPercentage);
+        lastAwakeMs = millis();
+        enterSleep(lastAwakeMs < samplePeriod() ? samplePeriod() - lastAwakeMs : 0);
+    }
+    startLora(CLASS_A);
+    // The join (reused in most cycles) and the uplink both run from lora.poll(). Once the live reading is
+    // acknowledged, a few stored ones follow
+    if (BATCH_ENABLED) {
+        sendBatchLora();
+    } else {
+        sendSensorDataLora(&fields, mask);
+    }
+    // A class C window asked by a downlink only lasts for the rest of the budget
+    unsigned int forwarded = 0;
+    while (millis() < SLEEP_CYCLE_BUDGET_MS) {
+        lora.poll();
+        serviceCommands(); // A downlink received after the uplink is acked in the same wake
+        serviceClassPolicy();
+        if (!lora.busy() && lora.queueDepth() == 0 && !classCWindowOpen()) {
+            if (forwarded >= SLEEP_CYCLE_BACKLOG || !forwardBacklog()) {
+                break; // Uplinks finished, or dropped by the airtime budget
+            }
+            forwarded++;
+        }
+        delay(1);
+    }
+    if (millis() >= SLEEP_CYCLE_BUDGET_MS) {
+        if (classCWindowOpen() && !lora.busy() && lora.queueDepth() == 0) {
+            Serial.println("Class C window cut at the sleep cycle budget.");
+        } else {
+            budgetOverruns++;
+            Serial.println("Sleep cycle budget reached, " + String(lora.joined() ? "uplink" : "join") + " not finished.");
+        }
+    }
+    leaveClassC();
+    lora.setDeviceLowPower(); // Waits for a pending command first, woken by the next AT command
+    storePendingReadings(); // The queue is in RAM, lost with the deep sleep
+    updateEnergy(batteryPercentage);
+    Serial.println("Battery: " + String(batteryLifeDays, 1) + " days at " + String(energy.averageCurrent_mA(), 3) + " mA.");
+
+    lastAwakeMs = millis();
+    if (lastAwakeMs > maxAwakeMs) {
+        maxAwakeMs = lastAwakeMs;
+    }
+    // The period is kept: the time awake is taken from the sleep
+    enterSleep(lastAwakeMs < samplePeriod() ? samplePeriod() - lastAwakeMs : 0);
+}
+
+// Deep sleeps. The boot after it starts again from setup()
+void enterSleep(unsigned long sleepMs) {
+    if (sleepMs < SLEEP_CYCLE_MIN_MS) {
+        sleepMs = SLEEP_CYCLE_MIN_MS;
+    }
+    accountClassTime();
+    classATimeMs += sleepMs; // The E5 sleeps in class A with the node
+    // Only the ESP32 in deep sleep and the E5 asleep draw current until the wake, restoreEnergy counts them
+    energy.setOn(ENERGY_ESP32_ACTIVE, false, millis());
+    energy.setOn(ENERGY_WIFI_AP, false, millis());
+    energy.setOn(ENERGY_LORA_IDLE_RX, false, millis());
+    energy.setOn(ENERGY_LORA_SLEEP, true, millis());
+    energy.setOn(ENERGY_ESP32_SLEEP, true, millis());
+    memcpy(energyRtc, &energy, sizeof(energy));
+    energySleepMs = sleepMs;
+    energyRtcValid = true;
+    Serial.println("Deep sleep for " + String(sleepMs) + " ms.");
+    Serial.flush();
+    esp_sleep_enable_timer_wakeup((uint64_t)sleepMs * 1000ULL);
+    esp_deep_sleep_start();
+}
+
 // --- LoRa Functions ---
-void processLoraSend() {
-    if (loraWebStatus == SENDING) {
-        if (!messageToSend.isEmpty()) {
-            Serial.print("Sending LoRa message from web: ");
-            Serial.println(messageToSend);
-            
-            bool sentOk = lora.transferPacket((unsigned char*)(messageToSend.c_str()), messageToSend.length(), Tx_and_ACK_RX_timeout);
-
-            if (sentOk) { 
-                loraWebStatus = ACK_SUCCESS;
-                Serial.println("LoRa message sent!");
-            } else {
-                loraWebStatus = ACK_FAILED;
-                Serial.println("LoRa message failed to send.");
+// Starts the driver on the module and joins in the background from lora.poll(), sensing does not wait for it
+void startLora(_class_type_t classType) {
+    loraClass = classType;
+    lora.init(WIO_TX_PIN, WIO_RX_PIN);
+    // Downlinks and unsolicited module lines are parsed by lora.poll()
+    lora.onDownlink(onLoraDownlink);
+    lora.onUrc(URC_JOIN, onLoraUnsolicited);
+    lora.onUrc(URC_MSG, onLoraUnsolicited);
+    lora.onUrc(URC_OTHER, onLoraUnsolicited);
+    // Set up LoRa module with desired configuration
+    LoRa_setup(classType);
+    setupEnergy();
+    lora.joinBegin(10000);
+}
+
+// Called once per queued web message: sent, failed, expired or evicted. The status shows the last one
+void onLoraWebSendDone(unsigned int time_ms, const char* response, void* ctx) {
+    if (loraWebPending > 0) {
+        loraWebPending--;
+    }
+    if (time_ms > 0) { 
+        Serial.println("LoRa message sent in " + String(time_ms) + " ms!");
+    } else {
+        Serial.println("LoRa message failed to send.");
+    }
+    if (loraWebPending == 0) {
+        loraWebStatus = (time_ms > 0) ? ACK_SUCCESS : ACK_FAILED;
+    }
+}
+
+void onLoraSensorSendDone(unsigned int time_ms, const char* response, void* ctx) {
+    PendingReading* pending = (PendingReading*)ctx;
+    if (time_ms == 0) {
+        Serial.println("LoRa packet failed to send or expired in the queue."); // A lost session is detected and rejoined by the driver
+        loraLinkUp = false;
+        if (pending != NULL) {
+            for (uint8_t i = 0; i < pending->count; i++) {
+                readingLog.append(pending->records[i]);
+            }
+            Serial.println("Reading stored, " + String(readingLog.count()) + " to forward.");
+        }
+    } else {
+        Serial.println("LoRa packet sent in " + String(time_ms) + " ms.");
+        loraLinkUp = true;
+    }
+    if (pending != NULL) {
+        pending->used = false;
+    }
+}
+
+void onLoraBacklogSendDone(unsigned int time_ms, const char* response, void* ctx) {
+    backlogInFlight = false;
+    if (time_ms == 0) {
+        loraLinkUp = false; // Kept in the log, tried again after the next acknowledged reading
+        return;
+    }
+    loraLinkUp = true;
+    readingLog.pop();
+    Serial.println("Stored reading forwarded, " + String(readingLog.count()) + " left.");
+}
+
+// Queues the oldest stored reading once the link is back, one at a time and only when the queue is empty
+// and the airtime budget allows it. Returns true if one was queued
+bool forwardBacklog() {
+    uint8_t record[READING_LOG_RECORD_SIZE];
+    const uint8_t length = 4 + PAYLOAD_CODEC_BYTES; // Age and packed fields, the rest of the record is not sent
+    if (backlogInFlight || !loraLinkUp || !lora.joined() || lora.queueDepth() > 0) {
+        return false;
+    }
+    if (lora.uplinkDelay(length) > 0 || !readingLog.peek(record)) {
+        return false;
+    }
+    // The time the reading was taken becomes its age, 0xFFFFFFFF if a power loss reset the clock since
+    uint32_t taken = recordTime(record);
+    uint32_t now = (uint32_t)time(NULL);
+    uint32_t age = (taken <= now) ? now - taken : 0xFFFFFFFF;
+    record[0] = age >> 24;
+    record[1] = age >> 16;
+    record[2] = age >> 8;
+    record[3] = age;
+    if (lora.queueUplink(record, length, LoRa_PORT_BACKLOG, true, BACKLOG_PRIORITY, 0, onLoraBacklogSendDone) == 0) {
+        return false;
+    }
+    backlogInFlight = true;
+    return true;
+}
+
+// Moves the readings still in the uplink queue to the log, before a deep sleep
+void storePendingReadings() {
+    for (uint8_t i = 0; i < LORA_QUEUE_SLOTS; i++) {
+        if (pendingReadings[i].used) {
+            for (uint8_t j = 0; j < pendingReadings[i].count; j++) {
+                readingLog.append(pendingReadings[i].records[j]);
             }
-            messageToSend = ""; // Clear message after attempting to send
+            pendingReadings[i].used = false;
+        }
+    }
+}
+
+// Time a packed reading was taken [s]
+uint32_t recordTime(const uint8_t* record) {
+    return ((uint32_t)record[0] << 24) | ((uint32_t)record[1] << 16) | ((uint32_t)record[2] << 8) | record[3];
+}
+
+// Reading record of the log and the batch: time [s] (u32 big endian, age on LoRa_PORT_BACKLOG), then the
+// fields packed by payload_encode (tools/codec/schema.json). The rest of the record is zero
+static_assert(4 + PAYLOAD_CODEC_BYTES <= READING_LOG_RECORD_SIZE, "the packed fields do not fit a ReadingLog record");
+void packReading(uint8_t* record, const payload_fields_t* fields) {
+    uint32_t taken = (uint32_t)time(NULL); // Seconds since power on, kept across deep sleep
+    memset(record, 0, READING_LOG_RECORD_SIZE);
+    record[0] = taken >> 24;
+    record[1] = taken >> 16;
+    record[2] = taken >> 8;
+    record[3] = taken;
+    payload_encode(fields, &record[4]);
+}
+
+payload_fields_t makeFields(float gasPPM, float oxygen, float temperature, float batteryPercentage, float enclosureTemp, float enclosureHum) {
+    payload_fields_t fields;
+    fields.oxygen = oxygen;
+    fields.gas = gasPPM;
+    fields.temperature = temperature;
+    fields.battery = batteryPercentage;
+    fields.enclosureTemp = enclosureTemp;
+    fields.enclosureHum = enclosureHum;
+    fields.vusb = vusbPresent();
+    return fields;
+}
+
+// Fields of a reading worth reporting (PAYLOAD_FIELD_...): all of them for the first reading and once
+// heartbeatInterval passed since the last full one, else the ones past their deadband, 0 for none.
+// The fields returned become the reference of the next reading
+uint8_t reportFields(const payload_fields_t* fields) {
+    uint32_t now = (uint32_t)time(NULL);
+    uint8_t mask;
+    if (!REPORT_BY_EXCEPTION || !reportedValid || now - reportedTime >= heartbeatInterval / 1000) {
+        mask = PAYLOAD_FIELDS_ALL;
+        reportedTime = now;
+        reportedValid = true;
+    } else {
+        mask = payload_changed(fields, &reportedFields, reportDeadbands);
+    }
+    payload_merge(&reportedFields, fields, mask);
+    return mask;
+}
+
+void onLoraDownlink(const _downlink_t* downlink, void* ctx) {
+    Serial.println("Received packet -----------------");
+    Serial.printf("Port: %u, RSSI: %d, SNR: %.1f\n", downlink->port, downlink->rssi, downlink->snr);
+    Serial.print("Packet from LoRa: ");
+    for (uint8_t i = 0; i < downlink->length; i++) {
+        Serial.printf("%02X", downlink->payload[i]);
+    }
+    Serial.println();
+    Serial.println("End of packet -------------------");
+    if (downlink->port == LoRa_PORT_COMMAND && !downlink->maccmd && downlink->length > 0) {
+        commandAck[0] = downlink->payload[0];
+        commandAck[1] = applyCommands(&downlink->payload[1], downlink->length - 1, &commandAck[2]);
+        commandAckPending = true; // Queued by serviceCommands(), outside of lora.poll()
+        Serial.printf("Downlink commands %u: status %u at command %u.\n", commandAck[0], commandAck[1], commandAck[2]);
+    }
+}
+
+void onLoraCommandAckDone(unsigned int time_ms, const char* response, void* ctx) {
+    commandAckQueued = false;
+    if (time_ms > 0) {
+        commandAckPending = false;
+    }
+}
+
+// Applies the commands of a downlink (after its sequence number), see Downlink Commands.
+// Returns CMD_OK, or the error of the command at index *failed
+uint8_t applyCommands(const uint8_t* data, uint8_t length, uint8_t* failed) {
+    uint8_t pos = 0;
+    for (*failed = 0; pos < length; (*failed)++) {
+        uint8_t command = data[pos++];
+        uint8_t size;
+        switch (command) {
+            case CMD_INTERVAL: size = 2; break;
+            case CMD_RO: size = 4; break;
+            case CMD_DEFAULT_TEMP: size = 2; break;
+            case CMD_LIVE_TEMP: size = 1; break;
+            case CMD_DATA_RATE: size = 2; break;
+            case CMD_DEADBAND: size = 3; break;
+            case CMD_HEARTBEAT: size = 2; break;
+            case CMD_CLASS_C: size = 2; break;
+            default: return CMD_UNKNOWN;
+        }
+        if (pos + size > length) {
+            return CMD_TRUNCATED;
+        }
+        const uint8_t* arg = &data[pos];
+        pos += size;
+        uint16_t word = ((uint16_t)arg[0] << 8) | arg[1];
+        bool applied = false;
+        switch (command) {
+            case CMD_INTERVAL: applied = setSensorInterval(word); break;
+            case CMD_RO:
+                applied = setGasRo(((uint32_t)arg[0] << 24) | ((uint32_t)arg[1] << 16) | ((uint32_t)arg[2] << 8) | arg[3]);
+                break;
+            case CMD_DEFAULT_TEMP: applied = setDefaultTemperature(word / 10.0); break;
+            case CMD_LIVE_TEMP:
+                applied = arg[0] <= 1;
+                if (applied) {
+                    setLiveTemperature(arg[0] == 1);
+                }
+                break;
+            case CMD_DATA_RATE: applied = arg[1] <= 1 && setLoraDataRate(arg[0], arg[1] == 1); break;
+            case CMD_DEADBAND:
+                applied = arg[0] < PAYLOAD_FIELD_COUNT &&
+                          setDeadband(arg[0], (((uint16_t)arg[1] << 8) | arg[2]) * payload_steps[arg[0]]);
+                break;
+            case CMD_HEARTBEAT: applied = setHeartbeat(word); break;
+            case CMD_CLASS_C:
+                applied = word <= CLASS_C_WINDOW_MAX_MIN;
+                if (applied) {
+                    openClassCWindow((unsigned long)word * 60 * 1000);
+                }
+                break;
+        }
+        if (!applied) {
+            return CMD_RANGE;
+        }
+    }
+    return CMD_OK;
+}
+
+// Does what the downlink commands leave to the loop: hands the new data rate to the driver, then queues the ack,
+// which goes out at that data rate
+void serviceCommands() {
+    if (loraConfigChanged) {
+        loraConfigChanged = false;
+        lora.setDataRateBegin((_data_rate_t)loraDataRate, loraAdr); // Sent by lora.poll(), ahead of the next uplink
+    }
+    if (commandAckPending && !commandAckQueued && lora.joined()) {
+        commandAckQueued = lora.queueUplink(commandAck, sizeof(commandAck), LoRa_PORT_COMMAND, false, COMMAND_PRIORITY,
+                                            0, onLoraCommandAckDone) != 0;
+    }
+}
+
+void onLoraUnsolicited(_urc_type_t type, const char* line, void* ctx) {
+    Serial.println("Data received from LoRa module:");
+    Serial.println(line); // Print any other data
+}
+
+// Sends the fields in mask: the full reading on LoRa_PORT_READING, or the mask byte followed by the fields
+// in it on LoRa_PORT_CHANGES. The log keeps the full reading. Returns false if the uplink queue refused the packet
+bool sendSensorDataLora(const payload_fields_t* fields, uint8_t mask) {
+    uint8_t record[READING_LOG_RECORD_SIZE];
+    uint8_t frame[1 + PAYLOAD_CODEC_BYTES];
+    uint8_t length;
+    uint8_t port;
+    packReading(record, fields);
+    if (mask == PAYLOAD_FIELDS_ALL) {
+        memcpy(frame, &record[4], PAYLOAD_CODEC_BYTES);
+        length = PAYLOAD_CODEC_BYTES;
+        port = LoRa_PORT_READING;
+    } else {
+        frame[0] = mask;
+        length = 1 + payload_encode_mask(fields, mask, &frame[1]);
+        port = LoRa_PORT_CHANGES;
+    }
+
+    Serial.printf("Sending LoRa packet, fields 0x%02X:\n", mask);
+    Serial.print("Gas PPM: "); Serial.println(fields->gas);
+    Serial.print("Oxygen: "); Serial.println(fields->oxygen);
+    Serial.print("Temperature: "); Serial.println(fields->temperature);
+    Serial.print("Battery: "); Serial.println(fields->battery);
+    Serial.print("Enclosure Temp: "); Serial.println(fields->enclosureTemp);
+    Serial.print("Enclosure Hum: "); Serial.println(fields->enclosureHum);
+    Serial.printf("%u bytes, %.1f ms on air (CayenneLPP: %u bytes, %.1f ms)\n",
+                  length, lora.getTransmissionTime(length),
+                  PAYLOAD_LPP_BYTES, lora.getTransmissionTime(PAYLOAD_LPP_BYTES));
+
+    // Kept until the queue reports it, stored if it is not acknowledged. Without a free slot it could not be
+    // stored on a failure, so it goes to the log now
+    PendingReading* pending = freePendingReading();
+    if (pending == NULL) {
+        Serial.println("No slot to keep the packet until it is acknowledged, packet stored.");
+        readingLog.append(record);
+        return false;
+    }
+    pending->count = 1;
+    memcpy(pending->records[0], record, READING_LOG_RECORD_SIZE);
+
+    // Confirmed, so a gateway outage is noticed. Expires when the next reading is due
+    if (lora.queueUplink(frame, length, port, true, SENSOR_PRIORITY,
+                         sendInterval, onLoraSensorSendDone, pending) == 0) {
+        Serial.println("LoRa queue full, packet stored.");
+        readingLog.append(record);
+        return false;
+    }
+    pending->used = true;
+    return true;
+}
+
+// Slot of pendingReadings to keep a reading in until the queue reports it, NULL if they are all in use
+PendingReading* freePendingReading() {
+    for (uint8_t i = 0; i < LORA_QUEUE_SLOTS; i++) {
+        if (!pendingReadings[i].used) {
+            return &pendingReadings[i];
         }
     }
+    return NULL;
+}
+
+// Time between two readings
+unsigned long samplePeriod() {
+    return BATCH_ENABLED ? SAMPLE_INTERVAL : sendInterval;
+}
+
+// Batches the reading, or sends it alone when batching is off. A reading with no field past its deadband is
+// left out. Returns false if a frame was refused by the queue
+bool queueReading(float gasPPM, float oxygen, float temperature, float batteryPercentage, float enclosureTemp, float enclosureHum) {
+    payload_fields_t fields = makeFields(gasPPM, oxygen, temperature, batteryPercentage, enclosureTemp, enclosureHum);
+    uint8_t mask = reportFields(&fields);
+    if (mask == 0) {
+        Serial.println("No field past its deadband, reading not sent.");
+    } else if (!BATCH_ENABLED) {
+        return sendSensorDataLora(&fields, mask);
+    } else {
+        packReading(batchRecords[batchCount++], &fields);
+    }
+    return (BATCH_ENABLED && batchDue()) ? sendBatchLora() : true;
 }
 
-void sendSensorDataLora(float gasPPM, float oxygen, float temperature, float batteryPercentage, float enclosureTemp, float enclosureHum) {
-    CayenneLPP lpp(51);
-    lpp.addAnalogInput(DISSOLVED_OXYGEN_CHANNEL, oxygen);
-    lpp.addAnalogInput(AIR_QUALITY_CHANNEL, gasPPM);
-    lpp.addTemperature(TEMPERATURE_CHANNEL, temperature);
-    lpp.addAnalogInput(BATTERY_CHANNEL, batteryPercentage);
-    lpp.addTemperature(ENCLOSURE_TEMPERATURE_CHANNEL, enclosureTemp);
-    lpp.addRelativeHumidity(ENCLOSURE_HUMIDITY_CHANNEL, enclosureHum);
-    lpp.addDigitalInput(VUSB_SENSE_CHANNEL, (analogRead(VUSB_SENSE_PIN) > 1700));
+// A frame is due when the batch holds batchLimit samples, or its first sample would wait past the sensor interval
+bool batchDue() {
+    if (batchCount == 0) {
+        return false;
+    }
+    if (batchLimit == 0 || batchCount >= batchLimit || batchCount >= BATCH_MAX_SAMPLES) {
+        return true; // Before the first setup of the E5 the limit is not known, the first sample goes alone
+    }
+    uint32_t waited = (uint32_t)time(NULL) - recordTime(batchRecords[0]);
+    return (unsigned long)waited * 1000 + samplePeriod() > (unsigned long)sendInterval;
+}
 
-    Serial.println("Sending LoRa packet:");
-    Serial.print("Gas PPM: "); Serial.println(gasPPM);
-    Serial.print("Oxygen: "); Serial.println(oxygen);
-    Serial.print("Temperature: "); Serial.println(temperature);
-    Serial.print("Battery: "); Serial.println(batteryPercentage);
-    Serial.print("Enclosure Temp: "); Serial.println(enclosureTemp);
-    Serial.print("Enclosure Hum: "); Serial.println(enclosureHum);
+// Queues one frame with up to batchLimit samples, big endian:
+// age of the first sample [s] (u32), then per sample: delta to the first one [s] (u16) and the packed fields.
+// The samples left over (data rate slowed down by ADR) stay in the batch.
+// Returns false if the queue refused the frame, its samples are then stored
+bool sendBatchLora() {
+    uint8_t frame[BATCH_HEADER_BYTES + BATCH_MAX_SAMPLES * BATCH_SAMPLE_BYTES];
+    int limit = ((int)lora.getMaxPayload() - BATCH_HEADER_BYTES) / BATCH_SAMPLE_BYTES;
+    batchLimit = constrain(limit, 1, (int)BATCH_MAX_SAMPLES);
+    uint8_t count = batchCount < batchLimit ? batchCount : batchLimit;
+    if (count == 0) {
+        return true;
+    }
 
-    uint8_t* payload_buffer = lpp.getBuffer();
-    uint8_t payload_size = lpp.getSize();
-    unsigned int time_ret = lora.transferPacket(payload_buffer, payload_size, Tx_and_ACK_RX_timeout);
-    if (time_ret == 0) {
-        Serial.println("LoRa packet failed to send.");
-        loraJoined = false;
+    uint32_t first = recordTime(batchRecords[0]);
+    uint32_t age = (uint32_t)time(NULL) - first;
+    frame[0] = age >> 24;
+    frame[1] = age >> 16;
+    frame[2] = age >> 8;
+    frame[3] = age;
+    for (uint8_t i = 0; i < count; i++) {
+        uint8_t* sample = &frame[BATCH_HEADER_BYTES + i * BATCH_SAMPLE_BYTES];
+        uint32_t delta = recordTime(batchRecords[i]) - first;
+        if (delta > 0xFFFF) {
+            delta = 0xFFFF;
+        }
+        sample[0] = delta >> 8;
+        sample[1] = delta & 0xFF;
+        memcpy(&sample[2], &batchRecords[i][4], PAYLOAD_CODEC_BYTES);
     }
 
+    // Kept until the queue reports it, as sendSensorDataLora does
+    PendingReading* pending = freePendingReading();
+    if (pending != NULL) {
+        pending->count = count;
+        memcpy(pending->records, batchRecords, count * READING_LOG_RECORD_SIZE);
+    }
+    uint8_t length = BATCH_HEADER_BYTES + count * BATCH_SAMPLE_BYTES;
+    Serial.printf("Sending LoRa batch of %u samples, %u bytes, %.1f ms on air (CayenneLPP: %u frames of %u bytes, %.1f ms)\n",
+                  count, length, lora.getTransmissionTime(length),
+                  count, PAYLOAD_LPP_BYTES, count * lora.getTransmissionTime(PAYLOAD_LPP_BYTES));
+    bool queued = pending != NULL && lora.queueUplink(frame, length, LoRa_PORT_BATCH, true, SENSOR_PRIORITY,
+                                                      sendInterval, onLoraSensorSendDone, pending) != 0;
+    if (!queued) {
+        Serial.println(pending == NULL ? "No slot to keep the batch until it is acknowledged, batch stored."
+                                       : "LoRa queue full, batch stored.");
+        for (uint8_t i = 0; i < count; i++) {
+            readingLog.append(batchRecords[i]);
+        }
+    } else {
+        pending->used = true;
+    }
+    batchCount -= count;
+    memmove(batchRecords, batchRecords[count], batchCount * READING_LOG_RECORD_SIZE);
+    return queued;
 }
 
 // --- Web Server Handlers ---
@@ -407,12 +1080,17 @@ void handleRoot() {
 
 void handleSend() {
     if (server.hasArg("message")) {
-        if (loraWebStatus == IDLE || loraWebStatus == ACK_SUCCESS || loraWebStatus == ACK_FAILED) {
-            messageToSend = server.arg("message");
+        String message = server.arg("message");
+        // Confirmed on the string port. Refused only if the queue is full of web messages or the message is too long
+        if (message.length() <= LORA_QUEUE_PAYLOAD_MAX &&
+            lora.queueUplink((const unsigned char*)message.c_str(), message.length(), LoRa_PORT_STRING, true,
+                             WEB_PRIORITY, WEB_MAX_AGE_MS, onLoraWebSendDone) != 0) {
+            Serial.println("LoRa message from web queued: " + message);
+            loraWebPending++;
             loraWebStatus = SENDING;
             server.send(200, "text/plain", "Message queued for sending.");
         } else {
-            server.send(503, "text/plain", "Server busy sending previous message.");
+            server.send(503, "text/plain", "LoRa queue full or message too long.");
         }
     } else {
         server.send(400, "text/plain", "400: Invalid Request");
@@ -463,11 +1141,7 @@ void handleSetTitle() {
 void handleSetInterval() {
     if (server.hasArg("interval")) {
         long newInterval = server.arg("interval").toInt();
-        if (newInterval >= 90) {
-            sendInterval = newInterval * 1000; // Convert seconds to milliseconds
-            preferences.begin("my-app", false);
-            preferences.putUInt(SENSOR_INTERVAL_KEY, sendInterval);
-            preferences.end();
+        if (setSensorInterval(newInterval)) {
             server.send(200, "text/plain", "Interval updated to " + String(newInterval) + "s.");
         } else {
             server.send(400, "text/plain", "Invalid interval. Must be >= 90s.");
@@ -480,11 +1154,7 @@ void handleSetInterval() {
 void handleSetRo() {
     if (server.hasArg("ro")) {
         float newRo = server.arg("ro").toFloat();
-        if (newRo > 0) {
-            gasSensorRo = newRo;
-            preferences.begin("my-app", false);
-            preferences.putFloat(RO_KEY, gasSensorRo);
-            preferences.end();
+        if (setGasRo(newRo)) {
             server.send(200, "text/plain", "Ro updated to " + String(gasSensorRo, 0));
         } else {
             server.send(400, "text/plain", "Invalid Ro. Must be > 0.");
@@ -496,10 +1166,7 @@ void handleSetRo() {
 
 void handleSetTempToggle() {
     if (server.hasArg("useLive")) {
-        useLiveTemperature = (server.arg("useLive") == "true");
-        preferences.begin("my-app", false);
-        preferences.putBool(USE_LIVE_TEMP_KEY, useLiveTemperature);
-        preferences.end();
+        setLiveTemperature(server.arg("useLive") == "true");
         server.send(200, "text/plain", "Temperature mode updated.");
     } else {
         server.send(400, "text/plain", "400: Invalid Request");
@@ -509,11 +1176,7 @@ void handleSetTempToggle() {
 void handleSetDefaultTemp() {
     if (server.hasArg("defaultTemp")) {
         float temp = server.arg("defaultTemp").toFloat();
-        if (temp >= 0 && temp <= 40) {
-            defaultWaterTemperature = temp;
-            preferences.begin("my-app", false);
-            preferences.putFloat(DEFAULT_TEMP_KEY, defaultWaterTemperature);
-            preferences.end();
+        if (setDefaultTemperature(temp)) {
             server.send(200, "text/plain", "Default temp updated to " + String(temp, 1) + "C.");
         } else {
             server.send(400, "text/plain", "Invalid temp. Must be 0-40C.");
@@ -523,13 +1186,171 @@ void handleSetDefaultTemp() {
     }
 }
 
+// --- LoRa Class Policy ---
+// Opens a class C window of ms from now, 0 closes the open one. The class is switched by serviceClassPolicy()
+void openClassCWindow(unsigned long ms) {
+    classCWindow = ms > 0;
+    classCStartMs = millis();
+    classCLengthMs = ms;
+}
+
+bool classCWindowOpen() {
+    if (classCWindow && millis() - classCStartMs >= classCLengthMs) {
+        classCWindow = false;
+    }
+    return classCWindow;
+}
+
+// Opens a window when VUSB is plugged in, and switches the E5 to the class the window asks for once the driver
+// is idle (setClassType waits for the answer)
+void serviceClassPolicy() {
+    bool vusb = vusbPresent();
+    if (vusb && !vusbWasPresent) {
+        openClassCWindow(CLASS_C_WINDOW_MS);
+    }
+    vusbWasPresent = vusb;
+
+    _class_type_t wanted = classCWindowOpen() ? CLASS_C : CLASS_A;
+    if (wanted == loraClass || lora.busy()) {
+        return;
+    }
+    setLoraClass(wanted);
+}
+
+// Switches the E5 to a class and accounts for it. Waits for the command in flight, if any
+void setLoraClass(_class_type_t classType) {
+    accountClassTime();
+    lora.setClassType(classType);
+    energy.setOn(loraClass == CLASS_C ? ENERGY_LORA_IDLE_RX : ENERGY_LORA_SLEEP, false, millis());
+    energy.setOn(classType == CLASS_C ? ENERGY_LORA_IDLE_RX : ENERGY_LORA_SLEEP, true, millis());
+    loraClass = classType;
+    Serial.printf("LoRa class %s. Class A for %lu s, class C for %lu s, %.2f mAh saved against class C only.\n",
+                  classType == CLASS_C ? "C" : "A", (unsigned long)(classATimeMs / 1000), (unsigned long)(classCTimeMs / 1000),
+                  classATimeMs * (RXPOWER_mA - SLEEPPOWER_mA) / 3600000.0);
+}
+
+// Closes the window before a deep sleep: the E5 would keep listening in class C while the node sleeps
+void leaveClassC() {
+    openClassCWindow(0);
+    if (loraClass != CLASS_A) {
+        setLoraClass(CLASS_A);
+    }
+}
+
+// Adds the time since the last call to the class in use
+void accountClassTime() {
+    unsigned long now = millis();
+    if (loraClass == CLASS_C) {
+        classCTimeMs += now - classSinceMs;
+    } else {
+        classATimeMs += now - classSinceMs;
+    }
+    classSinceMs = now;
+}
+
+// --- Settings ---
+// Shared by the web handlers and the downlink commands: the value is checked, applied and kept in preferences.
+// They return false for a value out of range
+bool setSensorInterval(long seconds) {
+    if (seconds < 90) {
+        return false;
+    }
+    sendInterval = seconds * 1000; // Convert seconds to milliseconds
+    preferences.begin("my-app", false);
+    preferences.putUInt(SENSOR_INTERVAL_KEY, sendInterval);
+    preferences.end();
+    return true;
+}
+
+bool setGasRo(float ro) {
+    if (!(ro > 0)) {
+        return false;
+    }
+    gasSensorRo = ro;
+    preferences.begin("my-app", false);
+    preferences.putFloat(RO_KEY, gasSensorRo);
+    preferences.end();
+    return true;
+}
+
+bool setDefaultTemperature(float temp) {
+    if (!(temp >= 0 && temp <= 40)) {
+        return false;
+    }
+    defaultWaterTemperature = temp;
+    preferences.begin("my-app", false);
+    preferences.putFloat(DEFAULT_TEMP_KEY, defaultWaterTemperature);
+    preferences.end();
+    return true;
+}
+
+void setLiveTemperature(bool useLive) {
+    useLiveTemperature = useLive;
+    preferences.begin("my-app", false);
+    preferences.putBool(USE_LIVE_TEMP_KEY, useLiveTemperature);
+    preferences.end();
+}
+
+// Sent to the module by serviceCommands(), or by the next startLora() in the sleep cycle
+bool setLoraDataRate(uint8_t dataRate, bool adr) {
+    if (dataRate > DR15) {
+        return false;
+    }
+    loraDataRate = dataRate;
+    loraAdr = adr;
+    loraConfigChanged = true;
+    preferences.begin("my-app", false);
+    preferences.putUChar(DATA_RATE_KEY, loraDataRate);
+    preferences.putBool(ADR_KEY, loraAdr);
+    preferences.end();
+    return true;
+}
+
+// Deadband of a field in the order of tools/codec/schema.json, in the unit of the field
+bool setDeadband(uint8_t field, float deadband) {
+    if (field >= PAYLOAD_FIELD_COUNT || !(deadband >= 0)) {
+        return false;
+    }
+    reportDeadbands[field] = deadband;
+    preferences.begin("my-app", false);
+    preferences.putBytes(DEADBANDS_KEY, reportDeadbands, sizeof(reportDeadbands));
+    preferences.end();
+    return true;
+}
+
+bool setHeartbeat(unsigned long minutes) {
+    if (minutes < 1) {
+        return false;
+    }
+    heartbeatInterval = minutes * 60 * 1000;
+    preferences.begin("my-app", false);
+    preferences.putUInt(HEARTBEAT_KEY, heartbeatInterval);
+    preferences.end();
+    return true;
+}
+
 void handleGetSettings() {
     String json = "{";
     json += "\"title\":\"" + oledTitle + "\",";
     json += "\"interval\":" + String(sendInterval / 1000) + ",";
     json += "\"ro\":" + String(gasSensorRo) + ",";
     json += "\"useLiveTemp\":" + String(useLiveTemperature ? "true" : "false") + ",";
-    json += "\"defaultTemp\":" + String(defaultWaterTemperature);
+    json += "\"defaultTemp\":" + String(defaultWaterTemperature) + ",";
+    json += "\"avgCurrent\":" + String(energy.averageCurrent_mA(), 2) + ",";
+    json += "\"batteryDays\":" + String(batteryLifeDays, 1) + ",";
+    json += "\"queueDepth\":" + String(lora.queueDepth()) + ",";
+    json += "\"queueDropped\":" + String(lora.queueDropped()) + ",";
+    json += "\"queueExpired\":" + String(lora.queueExpired()) + ",";
+    json += "\"backlog\":" + String(readingLog.count()) + ",";
+    json += "\"backlogLost\":" + String(readingLog.lost()) + ",";
+    json += "\"dataRate\":" + String(loraDataRate) + ",";
+    json += "\"adr\":" + String(loraAdr ? "true" : "false") + ",";
+    json += "\"heartbeat\":" + String(heartbeatInterval / 60000) + ",";
+    accountClassTime();
+    json += "\"loraClass\":\"" + String(loraClass == CLASS_C ? "C" : "A") + "\",";
+    json += "\"classATime\":" + String((unsigned long)(classATimeMs / 1000)) + ",";
+    json += "\"classCTime\":" + String((unsigned long)(classCTimeMs / 1000)) + ",";
+    json += "\"classSaved\":" + String(classATimeMs * (RXPOWER_mA - SLEEPPOWER_mA) / 3600000.0, 2);
     json += "}";
     server.send(200, "application/json", json);
 }
@@ -577,20 +1398,26 @@ void displaySensorData(float gasPPM, float oxygen, float temperature, float batt
     display.println();
 
     // vusb is connected display that mains power is active, else display batt percentage
-    if (analogRead(VUSB_SENSE_PIN) > 1700) {
-        display.print("Power: Mains");
+    if (vusbPresent()) {
+        display.println("Power: Mains");
     } else {
         display.print("Battery: ");
         display.print(batteryPercentage, 1);
         display.println(" %");
     }
+    display.print("Life: ");
+    display.print(batteryLifeDays, 1);
+    display.print(" d @ ");
+    display.print(energy.averageCurrent_mA(), 1);
+    display.println(" mA");
 
     display.display();
 }
 
 // --- Sensor Data Processing Functions ---
+// The ADS1115 values come from the last sweep of adcSweep, at most one sweep (4 conversions) old
 float processGasData() {
-    int16_t gasValue = ADS.readADC(ADC_GAS_PIN);
+    int16_t gasValue = adcSweep.value(ADC_GAS_PIN);
     float voltage = ADS.toVoltage(1) * gasValue;
     Serial.println("Gas sensor voltage: " + String(voltage, 3) + " V");
 
@@ -602,7 +1429,7 @@ float processGasData() {
 }
 
 float processWaterTempData(){
-    int16_t temperatureValue = ADS.readADC(ADC_TEMP_PIN); // Read temperature sensor value
+    int16_t temperatureValue = adcSweep.value(ADC_TEMP_PIN); // Read temperature sensor value
     float temperatureVoltage = ADS.toVoltage(1) * temperatureValue;
     double temperatureResistance = (double)((3.3) / temperatureVoltage - 1.0) * 10000.0;
     double temperature = (1.0 / (1.0 / (Tn + KELVIN_CONVERSION) + log(temperatureResistance / R0) / BETA)) - KELVIN_CONVERSION;
@@ -614,7 +1441,7 @@ float processWaterTempData(){
 
 
 float processOxygenData(double temperature) {
-    int16_t oxygenValue = ADS.readADC(ADC_OXYGEN_PIN);
+    int16_t oxygenValue = adcSweep.value(ADC_OXYGEN_PIN);
     float oxygenVoltage = ADS.toVoltage(1) * oxygenValue;
     Serial.println("Oxygen sensor voltage: " + String(oxygenVoltage, 3) + " V");
 
@@ -625,7 +1452,7 @@ float processOxygenData(double temperature) {
 }
 
 float processBatteryPercentage(){
-    int16_t battValue = ADS.readADC(ADC_BATT_PIN);
+    int16_t battValue = adcSweep.value(ADC_BATT_PIN);
     float batteryVoltage = ADS.toVoltage(1) * battValue * 2; // multiplied by 2 because it goes through a voltage divider first
     Serial.println("Battery voltage: " + String(batteryVoltage, 3) + " V");
 
@@ -0,0 +1,233 @@
+/*
+  Tests of the LoRa-E5 driver against the module emulator (pio test -e native)
+
+  The driver talks to SerialLoRa, a LoRaE5Emulator in this environment. The clock of lib/ArduinoNative is
+  virtual: the receive windows and the join backoff pass in no time and the timings are the same on every run.
+  The tests share the driver and the emulator and run in order: init, join, then uplinks on the session
+*/
+#include <Arduino.h>
+#include <unity.h>
+#include "LoRa-E5.h"
+
+struct uplink_result_t {
+    bool done;
+    unsigned int time_ms;
+};
+
+static _downlink_t received;
+static unsigned int downlinks = 0;
+
+static void on_uplink(unsigned int time_ms, const char* response, void* ctx) {
+    uplink_result_t* result = (uplink_result_t*)ctx;
+    (void)response;
+    result->done = true;
+    result->time_ms = time_ms;
+}
+
+static void on_downlink(const _downlink_t* downlink, void* ctx) {
+    (void)ctx;
+    received = *downlink;
+    downlinks++;
+}
+
+/*runs the driver as loop() would, until done is set or limit_ms pass. Returns the time it took*/
+static unsigned long run_until(const bool* done, unsigned long limit_ms) {
+    unsigned long start = millis();
+    while (!*done && (millis() - start < limit_ms)) {
+        lora.poll();
+        delay(1);
+    }
+    return millis() - start;
+}
+
+/*queues an uplink of length bytes and waits for its callback*/
+static uplink_result_t send(unsigned char length, bool confirmed) {
+    unsigned char payload[LORA_QUEUE_PAYLOAD_MAX];
+    uplink_result_t result = {false, 0};
+    for (unsigned char i = 0; i < length; i++) { payload[i] = i; }
+    TEST_ASSERT_NOT_EQUAL(0, lora.queueUplink(payload, length, 8, confirmed, 0, 0, on_uplink, &result));
+    run_until(&result.done, 600000UL);
+    TEST_ASSERT_TRUE(result.done);
+    return result;
+}
+
+void setUp(void) {}
+void tearDown(void) {}
+
+/*the module was left at 115200 by a previous run: the driver probes and finds it*/
+void test_init_detects_the_module(void) {
+    SerialLoRa.setModuleBaudRate(115200);
+    lora.init();
+    TEST_ASSERT_GREATER_THAN(0, SerialLoRa.commands());
+    lora.onDownlink(on_downlink);
+}
+
+/*the first join request is not answered by the network, the second one after the backoff is*/
+void test_join_retries_after_a_failed_attempt(void) {
+    unsigned long joins = SerialLoRa.joinRequests();
+    bool joined = false;
+    SerialLoRa.expect(EMU_FAIL);
+    lora.joinBegin(10000);
+    while (!joined && (millis() < 300000UL)) {
+        lora.poll();
+        delay(1);
+        joined = lora.joined();
+    }
+    TEST_ASSERT_TRUE(joined);
+    TEST_ASSERT_EQUAL(JOIN_JOINED, lora.joinState());
+    TEST_ASSERT_EQUAL(2, SerialLoRa.joinRequests() - joins);
+}
+
+void test_confirmed_uplink_is_acknowledged(void) {
+    unsigned long uplinks = SerialLoRa.uplinks();
+    uplink_result_t result = send(10, true);
+    TEST_ASSERT_GREATER_THAN(0, result.time_ms);
+    TEST_ASSERT_EQUAL(1, SerialLoRa.uplinks() - uplinks);
+}
+
+/*"Done" without "ACK Received": the callback reports a failure*/
+void test_confirmed_uplink_without_ack_fails(void) {
+    SerialLoRa.expect(EMU_FAIL);
+    uplink_result_t result = send(10, true);
+    TEST_ASSERT_EQUAL(0, result.time_ms);
+}
+
+/*no answer at all: the uplink ends with the timeout of the queue*/
+void test_silent_module_times_out(void) {
+    unsigned long start;
+    uplink_result_t result;
+    SerialLoRa.expect(EMU_SILENT);
+    start = millis();
+    result = send(10, false);
+    TEST_ASSERT_EQUAL(0, result.time_ms);
+    TEST_ASSERT_GREATER_OR_EQUAL(LORA_QUEUE_TIMEOUT_MS, millis() - start);
+    TEST_ASSERT_FALSE(lora.busy());
+}
+
+void test_downlink_is_delivered(void) {
+    const unsigned char payload[] = {0x01, 0x02, 0xAB};
+    unsigned int count = downlinks;
+    SerialLoRa.downlink(20, payload, sizeof(payload), -97, 4.5);
+    TEST_ASSERT_GREATER_THAN(0, send(4, false).time_ms);
+    TEST_ASSERT_EQUAL(count + 1, downlinks);
+    TEST_ASSERT_EQUAL(20, received.port);
+    TEST_ASSERT_FALSE(received.maccmd);
+    TEST_ASSERT_EQUAL(sizeof(payload), received.length);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(payload, received.payload, sizeof(payload));
+    TEST_ASSERT_EQUAL(-97, received.rssi);
+}
+
+/*the RX line of the longest downlink fits the lines of the emulator and of the dispatcher*/
+void test_longest_downlink_is_delivered(void) {
+    unsigned char payload[EMU_DOWNLINK_MAX];
+    unsigned int count = downlinks;
+    for (unsigned int i = 0; i < sizeof(payload); i++) { payload[i] = (unsigned char)(0xFF - i); }
+    SerialLoRa.downlink(21, payload, sizeof(payload));
+    TEST_ASSERT_GREATER_THAN(0, send(4, false).time_ms);
+    TEST_ASSERT_EQUAL(count + 1, downlinks);
+    TEST_ASSERT_EQUAL(21, received.port);
+    TEST_ASSERT_EQUAL(sizeof(payload), received.length);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(payload, received.payload, sizeof(payload));
+}
+
+/*the emulator and the driver agree on the modulation of a data rate, so on the time on air*/
+static void check_data_rate(_physical_type_t band, _data_rate_t data_rate, _spreading_factor_t sf, _band_width_t bw) {
+    unsigned long airtime = SerialLoRa.airtime_ms();
+    TEST_ASSERT_GREATER_THAN(0, lora.setFrequencyBand(band));
+    lora.setDataRate(data_rate, band);
+    TEST_ASSERT_GREATER_THAN(0, lora.getbitRate(NULL, NULL)); /*parses the SF and BW of the "+DR:" answer*/
+    TEST_ASSERT_EQUAL(lora_bitrate_bps(sf, bw), lora.readbitRate());
+    TEST_ASSERT_GREATER_THAN(0, send(10, false).time_ms);
+    TEST_ASSERT_EQUAL((unsigned long)lora.getTransmissionTime(10), SerialLoRa.airtime_ms() - airtime);
+}
+
+void test_as923_data_rates(void) {
+    check_data_rate(AS923, DR2, SF10, BW125);
+    check_data_rate(AS923, DR6, SF7, BW250);
+}
+
+void test_us915_data_rates(void) {
+    check_data_rate(US915, DR0, SF10, BW125);
+    check_data_rate(US915, DR4, SF8, BW500);
+}
+
+/*ADR off: the RSSI/SNR of the downlinks above show a good link, so the next uplink moves from SF10 to SF7
+  with an AT+DR sent from the queue. A weak link brings it back to a slower SF, and a link check goes with one
+  uplink in LORA_LINK_CHECK_EVERY*/
+void test_data_rate_follows_the_link_with_adr_off(void) {
+    unsigned long checks = SerialLoRa.linkChecks();
+    int sent = 0;
+    TEST_ASSERT_GREATER_THAN(0, lora.setFrequencyBand(AS923));
+    lora.setDataRate(DR2, AS923);
+    TEST_ASSERT_GREATER_THAN(0, lora.setAdaptiveDataRate(false));
+    SerialLoRa.radio(-80, 9.0);
+    TEST_ASSERT_GREATER_THAN(0, send(10, false).time_ms);
+    TEST_ASSERT_EQUAL(DR5, SerialLoRa.dataRate());
+    TEST_ASSERT_EQUAL(lora_bitrate_bps(SF7, BW125), lora.readbitRate());
+    /*the SNR only comes with what the node receives: confirmed uplinks bring it back with their ACK*/
+    SerialLoRa.radio(-120, -12.0);
+    for (int i = 0; i < 8; i++) { TEST_ASSERT_GREATER_THAN(0, send(10, true).time_ms); }
+    TEST_ASSERT_EQUAL(DR2, SerialLoRa.dataRate()); /*SF10, the slowest one AS923 allows with the dwell time*/
+    TEST_ASSERT_EQUAL(lora_bitrate_bps(SF10, BW125), lora.readbitRate());
+    while ((SerialLoRa.linkChecks() == checks) && (sent <= LORA_LINK_CHECK_EVERY)) {
+        TEST_ASSERT_GREATER_THAN(0, send(10, false).time_ms);
+        sent++;
+    }
+    TEST_ASSERT_EQUAL(checks + 1, SerialLoRa.linkChecks());
+    TEST_ASSERT_LESS_OR_EQUAL(LORA_LINK_CHECK_EVERY, sent);
+}
+
+/*a data rate change asked while an uplink waits in the queue goes out first, without blocking the caller*/
+void test_data_rate_change_in_the_background(void) {
+    unsigned char payload[10] = {0};
+    uplink_result_t result = {false, 0};
+    unsigned long airtime;
+    unsigned long start = millis();
+    TEST_ASSERT_NOT_EQUAL(0, lora.queueUplink(payload, sizeof(payload), 8, false, 0, 0, on_uplink, &result));
+    lora.setDataRateBegin(DR3, true);
+    TEST_ASSERT_EQUAL(start, millis()); /*nothing was sent yet*/
+    TEST_ASSERT_TRUE(lora.dataRatePending());
+    airtime = SerialLoRa.airtime_ms();
+    run_until(&result.done, 600000UL);
+    TEST_ASSERT_TRUE(result.done);
+    TEST_ASSERT_FALSE(lora.dataRatePending());
+    TEST_ASSERT_EQUAL(DR3, SerialLoRa.dataRate());
+    TEST_ASSERT_EQUAL(lora_bitrate_bps(SF9, BW125), lora.readbitRate()); /*AS923*/
+    TEST_ASSERT_EQUAL((unsigned long)lora.getTransmissionTime(sizeof(payload)), SerialLoRa.airtime_ms() - airtime);
+}
+
+/*AU915 numbers its 125 kHz data rates from SF12 like EU868, not from SF10 like US915: the SF picked from the
+  link goes out as the data rate of that SF, and the next uplink needs no AT+DR*/
+void test_au915_link_data_rate_maps_back(void) {
+    unsigned long commands;
+    TEST_ASSERT_GREATER_THAN(0, lora.setFrequencyBand(AU915));
+    lora.setDataRate(DR0, AU915);
+    TEST_ASSERT_GREATER_THAN(0, lora.setAdaptiveDataRate(false));
+    SerialLoRa.radio(-80, 9.0);
+    /*one step per uplink from SF12, the ACKs bring back the SNR*/
+    for (int i = 0; i < 5; i++) { TEST_ASSERT_GREATER_THAN(0, send(10, true).time_ms); }
+    TEST_ASSERT_EQUAL(DR5, SerialLoRa.dataRate());
+    TEST_ASSERT_GREATER_THAN(0, lora.getbitRate(NULL, NULL));
+    TEST_ASSERT_EQUAL(lora_bitrate_bps(SF7, BW125), lora.readbitRate());
+    commands = SerialLoRa.commands();
+    TEST_ASSERT_GREATER_THAN(0, send(10, false).time_ms);
+    TEST_ASSERT_EQUAL(commands + 1, SerialLoRa.commands()); /*only the uplink*/
+}
+
+int main(int argc, char** argv) {
+    (void)argc; (void)argv;
+    UNITY_BEGIN();
+    RUN_TEST(test_init_detects_the_module);
+    RUN_TEST(test_join_retries_after_a_failed_attempt);
+    RUN_TEST(test_confirmed_uplink_is_acknowledged);
+    RUN_TEST(test_confirmed_uplink_without_ack_fails);
+    RUN_TEST(test_silent_module_times_out);
+    RUN_TEST(test_downlink_is_delivered);
+    RUN_TEST(test_longest_downlink_is_delivered);
+    RUN_TEST(test_as923_data_rates);
+    RUN_TEST(test_us915_data_rates);
+    RUN_TEST(test_data_rate_follows_the_link_with_adr_off);
+    RUN_TEST(test_data_rate_change_in_the_background);
+    RUN_TEST(test_au915_link_data_rate_maps_back);
+    return UNITY_END();
+}
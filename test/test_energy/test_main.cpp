@@ -0,0 +1,102 @@
+/*
+  Tests of the energy account (pio test -e native)
+
+  The node keeps the account in RTC memory across its deep sleeps: these tests copy it the way main.cpp does
+  and check that the sleep is counted at the sleep currents, and that the wakes restart the time base
+*/
+#include <Arduino.h>
+#include <unity.h>
+#include <string.h>
+#include "EnergyAccount.h"
+
+#define HOUR_MS 3600000UL
+
+void setUp(void) {}
+void tearDown(void) {}
+
+void test_continuous_state_counts_while_on(void) {
+    EnergyAccount energy;
+    energy.setCurrent(ENERGY_ESP32_ACTIVE, 10.0);
+    energy.setOn(ENERGY_ESP32_ACTIVE, true, 0);
+    energy.update(HOUR_MS);
+    energy.setOn(ENERGY_ESP32_ACTIVE, false, HOUR_MS);
+    energy.update(2 * HOUR_MS);
+    TEST_ASSERT_FLOAT_WITHIN(0.001, 10.0, energy.charge_mAh());
+    TEST_ASSERT_FLOAT_WITHIN(0.001, 5.0, energy.averageCurrent_mA());
+}
+
+void test_bursts_add_to_the_charge(void) {
+    EnergyAccount energy;
+    energy.setCurrent(ENERGY_LORA_TX, 36.0);
+    energy.add(ENERGY_LORA_TX, HOUR_MS / 36);
+    TEST_ASSERT_FLOAT_WITHIN(0.001, 1.0, energy.charge_mAh());
+}
+
+void test_resume_counts_the_sleep_in_the_states_left_on(void) {
+    EnergyAccount energy;
+    energy.setCurrent(ENERGY_ESP32_ACTIVE, 23.0);
+    energy.setCurrent(ENERGY_ESP32_SLEEP, 0.005);
+    energy.setCurrent(ENERGY_LORA_SLEEP, 0.02);
+    energy.setOn(ENERGY_ESP32_ACTIVE, true, 0);
+    energy.setOn(ENERGY_ESP32_ACTIVE, false, 1000);
+    energy.setOn(ENERGY_ESP32_SLEEP, true, 1000);
+    energy.setOn(ENERGY_LORA_SLEEP, true, 1000);
+    energy.resume(10 * HOUR_MS);
+    float expected = 23.0 * 1000 / HOUR_MS + 10 * (0.005 + 0.02);
+    TEST_ASSERT_FLOAT_WITHIN(0.0001, expected, energy.charge_mAh());
+    TEST_ASSERT_FLOAT_WITHIN(0.0001, expected / (10 + 1000.0 / HOUR_MS), energy.averageCurrent_mA());
+}
+
+void test_resume_restarts_the_time_base(void) {
+    EnergyAccount energy;
+    energy.setCurrent(ENERGY_ESP32_ACTIVE, 10.0);
+    energy.setOn(ENERGY_ESP32_ACTIVE, true, 0);
+    energy.update(5000); /*millis() before the sleep*/
+    energy.resume(HOUR_MS);
+    /*millis() starts again from 0 at the wake: 2000 ms awake, not a wrap from 5000*/
+    energy.update(2000);
+    TEST_ASSERT_FLOAT_WITHIN(0.0001, 10.0 * (5000 + HOUR_MS + 2000) / HOUR_MS, energy.charge_mAh());
+}
+
+void test_copy_kept_across_sleep_cycles(void) {
+    static uint8_t rtc[sizeof(EnergyAccount)];
+    EnergyAccount energy;
+    energy.setCurrent(ENERGY_ESP32_ACTIVE, 23.0);
+    energy.setCurrent(ENERGY_ESP32_SLEEP, 0.005);
+    energy.setCurrent(ENERGY_LORA_SLEEP, 0.02);
+    /*24 cycles of 2 s awake and 1 h asleep, each wake a new account restored from the copy*/
+    for (int cycle = 0; cycle < 24; cycle++) {
+        EnergyAccount wake;
+        if (cycle == 0) {
+            wake = energy;
+        } else {
+            memcpy(&wake, rtc, sizeof(wake));
+            wake.resume(HOUR_MS);
+        }
+        wake.setOn(ENERGY_ESP32_SLEEP, false, 0);
+        wake.setOn(ENERGY_ESP32_ACTIVE, true, 0);
+        wake.setOn(ENERGY_ESP32_ACTIVE, false, 2000);
+        wake.setOn(ENERGY_LORA_SLEEP, true, 2000);
+        wake.setOn(ENERGY_ESP32_SLEEP, true, 2000);
+        memcpy(rtc, &wake, sizeof(wake));
+    }
+    memcpy(&energy, rtc, sizeof(energy));
+    energy.resume(HOUR_MS);
+    /*the E5 also sleeps through the wakes after the first one, it is not started when nothing is sent*/
+    float expected = 24 * (23.0 * 2000 / HOUR_MS + (0.005 + 0.02)) + 23 * 0.02 * 2000 / HOUR_MS;
+    TEST_ASSERT_FLOAT_WITHIN(0.0001, expected, energy.charge_mAh());
+    /*about 0.04 mA: the projection of a node on battery, not the 23 mA of one awake all the time*/
+    TEST_ASSERT_FLOAT_WITHIN(0.001, expected / (24 * (1 + 2000.0 / HOUR_MS)), energy.averageCurrent_mA());
+    TEST_ASSERT_FLOAT_WITHIN(1, 1000 / energy.averageCurrent_mA() / 24, energy.projectDays(1000));
+}
+
+int main(int argc, char** argv) {
+    (void)argc; (void)argv;
+    UNITY_BEGIN();
+    RUN_TEST(test_continuous_state_counts_while_on);
+    RUN_TEST(test_bursts_add_to_the_charge);
+    RUN_TEST(test_resume_counts_the_sleep_in_the_states_left_on);
+    RUN_TEST(test_resume_restarts_the_time_base);
+    RUN_TEST(test_copy_kept_across_sleep_cycles);
+    return UNITY_END();
+}
@@ -0,0 +1,238 @@
+/*
+  Tests and benchmarks of the hex payload codec (pio test -e native)
+
+  The decode benchmark compares hexDecode with the loop receivePacket used before it: per byte, two
+  comparison chains and a look ahead for the closing quote, three characters per byte ("01 02 ... 3F \"")
+
+  The encode benchmark compares hexEncode with the code it replaced in the driver: the AT+MSGHEX command was
+  built in a 556 bytes buffer with one sprintf(cmd+strlen(cmd),"%02x") per payload byte, then printed.
+  The payload is a 51 bytes CayenneLPP frame, the largest one SF10-SF12 allow in EU868
+*/
+#include <Arduino.h>
+#include <unity.h>
+#include <chrono>
+#include "LoRa-E5-Hex.h"
+
+#define BENCH_ROUNDS 20000
+#define DECODE_BYTES 64   /*DOWNLINK_LENGTH_MAX of the driver*/
+#define OLD_CMD_LENGTH 556
+
+/*port that keeps what is written and counts the calls*/
+class CapturePort : public Print {
+   public:
+    CapturePort(void) { clear(); }
+    void clear(void) { length = 0; writes = 0; text[0] = '\0'; }
+    size_t write(uint8_t ch) { return write(&ch, 1); }
+    size_t write(const uint8_t* buffer, size_t size) {
+        if (size > sizeof(text) - 1 - length) { size = sizeof(text) - 1 - length; }
+        memcpy(&text[length], buffer, size);
+        length += size;
+        text[length] = '\0';
+        writes++;
+        return size;
+    }
+    using Print::write;
+    char text[1024];
+    size_t length;
+    unsigned int writes;
+};
+
+/*CayenneLPP: channel, type, value. Temperatures (0x67), humidities (0x68), analog inputs (0x02) and a
+  barometer (0x73) up to 51 bytes*/
+static const unsigned char lpp_frame[51] = {
+    0x01, 0x67, 0x00, 0xE1, 0x02, 0x68, 0x62, 0x03, 0x02, 0x02, 0xBC, 0x04, 0x02, 0x01, 0x2C,
+    0x05, 0x67, 0x01, 0x0A, 0x06, 0x68, 0x50, 0x07, 0x02, 0x01, 0x9A, 0x08, 0x73, 0x27, 0x7F,
+    0x09, 0x02, 0x00, 0x64, 0x0A, 0x67, 0xFF, 0xD7, 0x0B, 0x02, 0x7F, 0xFF, 0x0C, 0x02, 0x80,
+    0x00, 0x0D, 0x68, 0x00, 0x0E, 0x00};
+
+static CapturePort port;
+
+/*the AT+MSGHEX command as the driver built it before hexEncode*/
+static void old_encode(Print& out, const unsigned char* buffer, unsigned int length) {
+    char cmd[OLD_CMD_LENGTH];
+    strcpy(cmd, "AT+MSGHEX=\"");
+    for (unsigned int i = 0; i < length; i++) { sprintf(cmd + strlen(cmd), "%02x", buffer[i]); }
+    strcat(cmd, "\"\r\n");
+    out.print(cmd);
+}
+
+static void new_encode(Print& out, const unsigned char* buffer, unsigned int length) {
+    out.print("AT+MSGHEX=\"");
+    hexEncode(out, buffer, length);
+    out.print("\"\r\n");
+}
+
+static double ns_per_call(void (*encode)(Print&, const unsigned char*, unsigned int)) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int r = 0; r < BENCH_ROUNDS; r++) {
+        port.clear();
+        encode(port, lpp_frame, sizeof(lpp_frame));
+    }
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / BENCH_ROUNDS;
+}
+
+/*the decoder of receivePacket before hexDecode. It relies on the quote-CR-LF after the payload*/
+static short old_decode(const char* ptr, unsigned char* buffer, short length) {
+    short number = 0;
+    for (short i = 0;; i++) {
+        char temp[3] = {0, 0};
+        unsigned char tmp = '?', result = 0;
+        temp[0] = *(ptr + i * 3);
+        temp[1] = *(ptr + i * 3 + 1);
+        for (unsigned char j = 0; j < 2; j++) {
+            if ((temp[j] >= '0') && (temp[j] <= '9'))
+                tmp = temp[j] - '0';
+            else if ((temp[j] >= 'A') && (temp[j] <= 'F'))
+                tmp = temp[j] - 'A' + 10;
+            else if ((temp[j] >= 'a') && (temp[j] <= 'f'))
+                tmp = temp[j] - 'a' + 10;
+            result = result * 16 + tmp;
+        }
+        if (i < length) buffer[i] = result;
+        if (*(ptr + i * 3 + 3) == '\"' && *(ptr + i * 3 + 4) == '\r' && *(ptr + i * 3 + 5) == '\n') {
+            number = i + 1;
+            break;
+        }
+    }
+    return number;
+}
+
+/*decodes text from its first character. Returns the bytes stored*/
+static short decode(const char* text, unsigned char* dst, short dst_len) {
+    return hexDecode(text, text + strlen(text), dst, dst_len);
+}
+
+void setUp(void) { port.clear(); }
+void tearDown(void) {}
+
+void test_encode_lowercase_pairs(void) {
+    const unsigned char bytes[] = {0x00, 0x0F, 0xA5, 0xFF};
+    hexEncode(port, bytes, sizeof(bytes));
+    TEST_ASSERT_EQUAL_STRING("000fa5ff", port.text);
+}
+
+void test_encode_nothing(void) {
+    hexEncode(port, lpp_frame, 0);
+    TEST_ASSERT_EQUAL(0, port.length);
+    TEST_ASSERT_EQUAL(0, port.writes);
+}
+
+/*102 digits in chunks of HEX_CHUNK_LENGTH: 32+32+32+6*/
+void test_encode_in_chunks(void) {
+    hexEncode(port, lpp_frame, sizeof(lpp_frame));
+    TEST_ASSERT_EQUAL(2 * sizeof(lpp_frame), port.length);
+    TEST_ASSERT_EQUAL((2 * sizeof(lpp_frame) + HEX_CHUNK_LENGTH - 1) / HEX_CHUNK_LENGTH, port.writes);
+}
+
+/*the module gets the same command*/
+void test_encode_same_command_as_sprintf(void) {
+    static char expected[sizeof(port.text)];
+    old_encode(port, lpp_frame, sizeof(lpp_frame));
+    strcpy(expected, port.text);
+    port.clear();
+    new_encode(port, lpp_frame, sizeof(lpp_frame));
+    TEST_ASSERT_EQUAL_STRING(expected, port.text);
+}
+
+void test_benchmark_encode_51_bytes(void) {
+    char message[128];
+    double old_ns = ns_per_call(old_encode);
+    double new_ns = ns_per_call(new_encode);
+    snprintf(message, sizeof(message), "encode 51 bytes: sprintf %.0f ns, hexEncode %.0f ns (x%.1f)", old_ns, new_ns,
+             old_ns / new_ns);
+    TEST_MESSAGE(message);
+}
+
+void test_decode_downlink_line(void) {
+    const char* line = "+MSG: PORT: 1; RX: \"68656C6c6F\"\r\n";
+    unsigned char dst[8];
+    short n = decode(strstr(line, "RX: \"") + 5, dst, sizeof(dst));
+    TEST_ASSERT_EQUAL(5, n);
+    TEST_ASSERT_EQUAL_MEMORY("hello", dst, 5);
+}
+
+void test_decode_skips_spaces(void) {
+    const unsigned char expected[] = {0x01, 0x02, 0x0A};
+    unsigned char dst[8];
+    TEST_ASSERT_EQUAL(3, decode("01 02 0A\"", dst, sizeof(dst)));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(expected, dst, 3);
+}
+
+/*a half byte at the end of the data is not stored, and nothing after src_end is read*/
+void test_decode_stops_at_the_end_of_the_data(void) {
+    const char text[] = "0102A3";
+    unsigned char dst[8];
+    TEST_ASSERT_EQUAL(2, hexDecode(text, text + 5, dst, sizeof(dst)));
+    TEST_ASSERT_EQUAL(0, hexDecode(text, text, dst, sizeof(dst)));
+}
+
+void test_decode_stops_when_the_buffer_is_full(void) {
+    unsigned char dst[4] = {0, 0, 0, 0xEE};
+    TEST_ASSERT_EQUAL(3, decode("AABBCCDDEE\"", dst, 3));
+    TEST_ASSERT_EQUAL(0xCC, dst[2]);
+    TEST_ASSERT_EQUAL(0xEE, dst[3]);
+}
+
+void test_decode_stops_at_a_character_that_is_not_hex(void) {
+    unsigned char dst[8];
+    TEST_ASSERT_EQUAL(1, decode("12G4\"", dst, sizeof(dst)));
+    TEST_ASSERT_EQUAL(1, decode("121", dst, sizeof(dst)));
+    TEST_ASSERT_EQUAL(0, decode("\"", dst, sizeof(dst)));
+    TEST_ASSERT_EQUAL(0, hexDecode(NULL, NULL, dst, sizeof(dst)));
+    TEST_ASSERT_EQUAL(0, decode("12", NULL, 1));
+}
+
+/*every byte value, encoded by hexEncode, comes back*/
+void test_decode_what_was_encoded(void) {
+    unsigned char bytes[256], dst[256];
+    for (int i = 0; i < 256; i++) { bytes[i] = (unsigned char)i; }
+    hexEncode(port, bytes, sizeof(bytes));
+    TEST_ASSERT_EQUAL(256, hexDecode(port.text, port.text + port.length, dst, sizeof(dst)));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(bytes, dst, sizeof(dst));
+}
+
+/*longest downlink in the spaced format the old loop needs: both decode the same bytes*/
+void test_benchmark_decode_64_bytes(void) {
+    char text[3 * DECODE_BYTES + 4], message[128];
+    unsigned char expected[DECODE_BYTES], dst[DECODE_BYTES];
+    unsigned int n = 0;
+    volatile short sink = 0;
+    for (int i = 0; i < DECODE_BYTES; i++) {
+        expected[i] = lpp_frame[i % sizeof(lpp_frame)] ^ (unsigned char)i;
+        n += snprintf(&text[n], sizeof(text) - n, "%02X ", expected[i]);
+    }
+    strcpy(&text[n], "\"\r\n");
+    TEST_ASSERT_EQUAL(DECODE_BYTES, old_decode(text, dst, sizeof(dst)));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(expected, dst, sizeof(dst));
+    TEST_ASSERT_EQUAL(DECODE_BYTES, decode(text, dst, sizeof(dst)));
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(expected, dst, sizeof(dst));
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int r = 0; r < BENCH_ROUNDS; r++) { sink += old_decode(text, dst, sizeof(dst)); }
+    double old_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / BENCH_ROUNDS;
+    start = std::chrono::steady_clock::now();
+    for (int r = 0; r < BENCH_ROUNDS; r++) { sink += hexDecode(text, text + n + 3, dst, sizeof(dst)); }
+    double new_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / BENCH_ROUNDS;
+    (void)sink;
+    snprintf(message, sizeof(message), "decode %d bytes: old loop %.0f ns, hexDecode %.0f ns (%.0f MB/s)", DECODE_BYTES,
+             old_ns, new_ns, DECODE_BYTES * 1000.0 / new_ns);
+    TEST_MESSAGE(message);
+}
+
+int main(int argc, char** argv) {
+    (void)argc; (void)argv;
+    UNITY_BEGIN();
+    RUN_TEST(test_encode_lowercase_pairs);
+    RUN_TEST(test_encode_nothing);
+    RUN_TEST(test_encode_in_chunks);
+    RUN_TEST(test_encode_same_command_as_sprintf);
+    RUN_TEST(test_benchmark_encode_51_bytes);
+    RUN_TEST(test_decode_downlink_line);
+    RUN_TEST(test_decode_skips_spaces);
+    RUN_TEST(test_decode_stops_at_the_end_of_the_data);
+    RUN_TEST(test_decode_stops_when_the_buffer_is_full);
+    RUN_TEST(test_decode_stops_at_a_character_that_is_not_hex);
+    RUN_TEST(test_decode_what_was_encoded);
+    RUN_TEST(test_benchmark_decode_64_bytes);
+    return UNITY_END();
+}
@@ -0,0 +1,153 @@
+/*
+  Tests and benchmark of the streaming response matcher (pio test -e native)
+
+  The benchmark feeds recorded LoRa-E5 transcripts to the matcher and to the scan it replaced in poll():
+  the character is appended to the reception buffer, then strstr looks for "Wait ACK", "ACK Received" and
+  the expected response in the whole buffer. Both must stop at the same character; the time per
+  transcript is printed
+*/
+#include <Arduino.h>
+#include <unity.h>
+#include <chrono>
+#include "LoRa-E5-Matcher.h"
+
+#define BENCH_ROUNDS 2000
+#define RECV_LENGTH  512   /*recv_buf of the driver*/
+
+struct transcript_t {
+    const char* name;
+    const char* ack;   /*expected response*/
+    const char* text;  /*what the module sends*/
+};
+
+static const transcript_t transcripts[] = {
+    {"join", "+JOIN: Network joined",
+     "+JOIN: Start\r\n+JOIN: NORMAL\r\n+JOIN: Join failed\r\n+JOIN: Done\r\n+JOIN: Start\r\n+JOIN: NORMAL\r\n"
+     "+JOIN: Network joined\r\n+JOIN: NetID 000013 DevAddr 26:0B:12:34\r\n+JOIN: Done\r\n"},
+    {"cmsghex", "Done",
+     "+CMSGHEX: Start\r\n+CMSGHEX: Wait ACK\r\n+CMSGHEX: ACK Received\r\n"
+     "+CMSGHEX: PORT: 20; RX: \"0102030405060708090A0B0C0D0E0F101112131415161718191A1B1C1D1E1F20\"\r\n"
+     "+CMSGHEX: RXWIN1, RSSI -106, SNR 3.5\r\n+CMSGHEX: Done\r\n"},
+    {"msghex", "Done",
+     "+MSGHEX: Start\r\n+MSGHEX: FPENDING\r\n+MSGHEX: Link 20, 1\r\n+MSGHEX: RXWIN2, RSSI -112, SNR -4.0\r\n"
+     "+MSGHEX: Done\r\n"},
+};
+
+static LoRaE5Matcher matcher;
+
+static void build(const char* ack) {
+    matcher.reset();
+    matcher.addPattern("Wait ACK");
+    matcher.addPattern("ACK Received");
+    matcher.addPattern(ack);
+    matcher.build();
+}
+
+/*index of the character that completes ack, -1 if it never comes*/
+static int match_automaton(const char* text) {
+    matcher.restart();
+    for (int i = 0; text[i] != '\0'; i++) {
+        if (matcher.feed(text[i]) & (1 << 2)) { return i; }
+    }
+    return -1;
+}
+
+static int match_strstr(const char* text, const char* ack, char* recv_buf) {
+    unsigned int index = 0;
+    volatile bool wait_ack = false, ack_received = false;
+    recv_buf[0] = '\0';
+    for (int i = 0; (text[i] != '\0') && (index < RECV_LENGTH - 1); i++) {
+        recv_buf[index++] = text[i];
+        recv_buf[index] = '\0';
+        if (strstr(recv_buf, "Wait ACK") != NULL) { wait_ack = true; }
+        if (strstr(recv_buf, "ACK Received") != NULL) { ack_received = true; }
+        if (strstr(recv_buf, ack) != NULL) { return i; }
+    }
+    (void)wait_ack; (void)ack_received;
+    return -1;
+}
+
+void setUp(void) {}
+void tearDown(void) {}
+
+void test_patterns_are_reported_where_they_end(void) {
+    const char* text = "+CMSG: Wait ACK\r\n+CMSG: ACK Received\r\n+CMSG: Done\r\n";
+    uint8_t mask = 0;
+    build("Done");
+    for (int i = 0; text[i] != '\0'; i++) {
+        uint8_t ended = matcher.feed(text[i]);
+        if (ended != MATCHER_NONE) {
+            TEST_ASSERT_EQUAL(0, mask & ended); /*each pattern once in this text*/
+            if (ended & (1 << 0)) { TEST_ASSERT_EQUAL(0, strncmp(&text[i - 7], "Wait ACK", 8)); }
+            if (ended & (1 << 1)) { TEST_ASSERT_EQUAL(0, strncmp(&text[i - 11], "ACK Received", 12)); }
+            if (ended & (1 << 2)) { TEST_ASSERT_EQUAL(0, strncmp(&text[i - 3], "Done", 4)); }
+            mask |= ended;
+        }
+    }
+    TEST_ASSERT_EQUAL(0x07, mask);
+    TEST_ASSERT_EQUAL(0x07, matcher.found());
+}
+
+/*"ab" is a suffix of "aab": the failure links report both, also after a false start "aaab"*/
+void test_overlapping_patterns(void) {
+    const char* text = "aaab";
+    uint8_t last = 0;
+    matcher.reset();
+    TEST_ASSERT_EQUAL(0, matcher.addPattern("aab"));
+    TEST_ASSERT_EQUAL(1, matcher.addPattern("ab"));
+    matcher.build();
+    for (int i = 0; text[i] != '\0'; i++) { last = matcher.feed(text[i]); }
+    TEST_ASSERT_EQUAL(0x03, last);
+}
+
+void test_restart_forgets_the_found_patterns(void) {
+    build("+JOIN: Joined already");
+    for (const char* p = "+JOIN: Joined already"; *p != '\0'; p++) { matcher.feed(*p); }
+    TEST_ASSERT_EQUAL(1 << 2, matcher.found());
+    matcher.restart();
+    TEST_ASSERT_EQUAL(0, matcher.found());
+    for (const char* p = "+JOIN: Joined"; *p != '\0'; p++) { TEST_ASSERT_EQUAL(MATCHER_NONE, matcher.feed(*p)); }
+}
+
+void test_pattern_limit(void) {
+    matcher.reset();
+    for (int i = 0; i < MATCHER_MAX_PATTERNS; i++) { TEST_ASSERT_EQUAL(i, matcher.addPattern("x")); }
+    TEST_ASSERT_EQUAL(-1, matcher.addPattern("x"));
+}
+
+/*same result as strstr on every transcript, and the time of both*/
+void test_benchmark_against_strstr(void) {
+    static char recv_buf[RECV_LENGTH];
+    char message[160];
+    for (unsigned int t = 0; t < sizeof(transcripts) / sizeof(transcripts[0]); t++) {
+        const transcript_t* tr = &transcripts[t];
+        volatile int sink = 0;
+        int expected;
+        build(tr->ack);
+        expected = match_strstr(tr->text, tr->ack, recv_buf);
+        TEST_ASSERT_NOT_EQUAL(-1, expected);
+        TEST_ASSERT_EQUAL(expected, match_automaton(tr->text));
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (int r = 0; r < BENCH_ROUNDS; r++) { sink += match_strstr(tr->text, tr->ack, recv_buf); }
+        double strstr_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        start = std::chrono::steady_clock::now();
+        for (int r = 0; r < BENCH_ROUNDS; r++) { sink += match_automaton(tr->text); }
+        double matcher_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        (void)sink;
+        snprintf(message, sizeof(message), "%s, %d chars: strstr %.0f ns, matcher %.0f ns (x%.1f)", tr->name,
+                 expected + 1, strstr_ns / BENCH_ROUNDS, matcher_ns / BENCH_ROUNDS, strstr_ns / matcher_ns);
+        TEST_MESSAGE(message);
+    }
+}
+
+int main(int argc, char** argv) {
+    (void)argc; (void)argv;
+    UNITY_BEGIN();
+    RUN_TEST(test_patterns_are_reported_where_they_end);
+    RUN_TEST(test_overlapping_patterns);
+    RUN_TEST(test_restart_forgets_the_found_patterns);
+    RUN_TEST(test_pattern_limit);
+    RUN_TEST(test_benchmark_against_strstr);
+    return UNITY_END();
+}
@@ -0,0 +1,416 @@
+#!/usr/bin/env python3
+"""Generates the payload codec of the node from schema.json.
+
+    python3 tools/codec/gen_codec.py
+
+writes, from the same field list:
+  include/payload_codec.h          encoder used by the firmware (src/main.cpp)
+  tools/codec/payload_decoder.py   decoder for the host side: python3 payload_decoder.py <port> <hex>
+  tools/codec/payload_formatter.js decodeUplink() for the payload formatter of the network server
+and prints the bytes and the time on air of each frame against CayenneLPP.
+
+Each numeric field is quantized to code = round((value - min) / step), clamped to [min, max], and
+written in the fewest bits that hold the codes plus an all-ones "no value" code. A bool takes one
+bit. The fields are packed MSB first, without padding between them. A port with "mask_bytes" starts
+with a mask of the fields it carries (bit 0: first field), the others are left out.
+The deadband of a field is the default change that makes it worth reporting (see payload_changed).
+Run it again after any change to schema.json and commit the generated files with it.
+"""
+import json
+import math
+import os
+import sys
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+ROOT = os.path.dirname(os.path.dirname(HERE))
+
+LPP_BYTES = {"analog_input": 4, "temperature": 4, "relative_humidity": 3, "digital_input": 3}
+LORAWAN_OVERHEAD_BYTES = 13  # as lib/LoRa-E5/LoRa-E5-Airtime.h
+
+
+def airtime_ms(payload, sf, bw_khz=125):
+    """LoRaWAN uplink time on air, same formula as lib/LoRa-E5/LoRa-E5-Airtime.h"""
+    length = payload + LORAWAN_OVERHEAD_BYTES
+    t_sym = (2 ** sf) / bw_khz
+    de = 1 if t_sym >= 16 else 0
+    n = 8 + max(math.ceil((8 * length - 4 * sf + 28 + 16) / (4 * (sf - 2 * de))) * 5, 0)
+    return (8 + 4.25 + n) * t_sym
+
+
+def load_schema(path):
+    with open(path) as f:
+        schema = json.load(f)
+    bit = 0
+    for field in schema["fields"]:
+        if field.get("type") == "bool":
+            field["bits"] = 1
+            field["max_code"] = 1
+        else:
+            field["max_code"] = int(round((field["max"] - field["min"]) / field["step"]))
+            field["bits"] = int(math.ceil(math.log2(field["max_code"] + 2)))
+            field.setdefault("deadband", field["step"])  # any change of the code
+        field["offset"] = bit
+        bit += field["bits"]
+    if len(schema["fields"]) > 8:
+        sys.exit("the field mask of a frame holds 8 fields")
+    schema["bits"] = bit
+    schema["bytes"] = (bit + 7) // 8
+    schema["lpp_bytes"] = sum(LPP_BYTES[f["lpp"]] for f in schema["fields"])
+    return schema
+
+
+def frame_bytes(schema, port, samples=1, lpp=False, fields=None):
+    """bytes of a frame, with all the fields or the ones listed (ports with a mask)"""
+    fields = schema["fields"] if fields is None else fields
+    if lpp:
+        size = sum(LPP_BYTES[f["lpp"]] for f in fields)
+    else:
+        size = port.get("mask_bytes", 0) + (sum(f["bits"] for f in fields) + 7) // 8
+    per_sample = port.get("delta_bytes", 0) + size
+    return port.get("age_bytes", 0) + per_sample * (samples if port.get("repeat") else 1)
+
+
+def macro_name(name):
+    """enclosureTemp -> ENCLOSURE_TEMP"""
+    return "".join("_" + c if c.isupper() else c.upper() for c in name)
+
+
+def c_float(value):
+    return repr(float(value)) + "f"
+
+
+def gen_header(schema):
+    out = []
+    w = out.append
+    w("/*")
+    w("  Payload codec of the node")
+    w("")
+    w("  GENERATED by tools/codec/gen_codec.py from tools/codec/schema.json, do not edit")
+    w("*/")
+    w("")
+    w("#ifndef _PAYLOAD_CODEC_H_")
+    w("#define _PAYLOAD_CODEC_H_")
+    w("/*%s" % schema["description"])
+    w("  field           bits  resolution        range           deadband")
+    for f in schema["fields"]:
+        if f.get("type") == "bool":
+            w("  %-15s %4d  -                 0/1             any change" % (f["name"], f["bits"]))
+        else:
+            w("  %-15s %4d  %-6g %-10s %-15s %g" % (f["name"], f["bits"], f["step"], f["unit"],
+                                                   "%g .. %g" % (f["min"], f["max"]), f["deadband"]))
+    w("  %d bits in %d bytes, CayenneLPP: %d bytes. Frames (time on air at SF7/SF10, 125 kHz):"
+      % (schema["bits"], schema["bytes"], schema["lpp_bytes"]))
+    for port in schema["ports"]:
+        fields = schema["fields"][:1] if port.get("mask_bytes") else None  # one field changed
+        packed = frame_bytes(schema, port, fields=fields)
+        lpp = frame_bytes(schema, port, lpp=True, fields=fields)
+        w("  port %-3d %-8s %3d bytes, %5.1f/%6.1f ms   CayenneLPP fields: %3d bytes, %5.1f/%6.1f ms"
+          % (port["port"], port["name"], packed, airtime_ms(packed, 7), airtime_ms(packed, 10),
+             lpp, airtime_ms(lpp, 7), airtime_ms(lpp, 10)))
+    w("*/")
+    w("#include <stdint.h>")
+    w("#include <string.h>")
+    w("#include <math.h>")
+    w("")
+    w("#define PAYLOAD_CODEC_BYTES  %d  /*packed fields of one reading*/" % schema["bytes"])
+    w("#define PAYLOAD_LPP_BYTES    %d  /*the same fields in CayenneLPP*/" % schema["lpp_bytes"])
+    for port in schema["ports"]:
+        w("#define PAYLOAD_PORT_%-8s %d  /*%s*/" % (port["name"], port["port"], port["description"]))
+    for i, f in enumerate(schema["fields"]):
+        w("#define PAYLOAD_FIELD_%-14s 0x%02X" % (macro_name(f["name"]), 1 << i))
+    w("#define PAYLOAD_FIELDS_ALL           0x%02X" % ((1 << len(schema["fields"])) - 1))
+    w("#define PAYLOAD_FIELD_COUNT          %d" % len(schema["fields"]))
+    w("")
+    w("/*resolution of the fields, in field order (1 for a bool)*/")
+    w("static const float payload_steps[PAYLOAD_FIELD_COUNT] = {%s};"
+      % ", ".join(c_float(f.get("step", 1)) for f in schema["fields"]))
+    w("/*default deadbands, in field order (unused for a bool)*/")
+    w("static const float payload_deadbands[PAYLOAD_FIELD_COUNT] = {%s};"
+      % ", ".join(c_float(f.get("deadband", 0)) for f in schema["fields"]))
+    w("")
+    w("struct payload_fields_t {")
+    for f in schema["fields"]:
+        ctype = "bool " if f.get("type") == "bool" else "float"
+        unit = "" if f.get("type") == "bool" else " [%s]" % f["unit"]
+        w("   %s %s; /*%s%s*/" % (ctype, f["name"], f["description"], unit))
+    w("   };")
+    w("")
+    w("/*code of a value, all ones if it is NaN*/")
+    w("static inline uint32_t payload_quantize(float value, float min, float step, uint32_t max_code, uint8_t bits) {")
+    w("    if (isnan(value)) { return ((uint32_t)1 << bits) - 1; }")
+    w("    float code = roundf((value - min) / step);")
+    w("    if (code < 0) { return 0; }")
+    w("    return (code > max_code) ? max_code : (uint32_t)code;")
+    w("}")
+    w("")
+    w("/*writes the bits low bits of value at bit *pos, MSB first*/")
+    w("static inline void payload_put_bits(uint8_t* out, uint16_t* pos, uint32_t value, uint8_t bits) {")
+    w("    while (bits > 0) {")
+    w("        bits--;")
+    w("        if ((value >> bits) & 1) { out[*pos / 8] |= 0x80 >> (*pos % 8); }")
+    w("        (*pos)++;")
+    w("    }")
+    w("}")
+    w("")
+    w("/*packs the fields in mask (PAYLOAD_FIELD_...) in at most PAYLOAD_CODEC_BYTES bytes of out. Returns the bytes used*/")
+    w("static inline uint8_t payload_encode_mask(const payload_fields_t* fields, uint8_t mask, uint8_t* out) {")
+    w("    uint16_t pos = 0;")
+    w("    memset(out, 0, PAYLOAD_CODEC_BYTES);")
+    for f in schema["fields"]:
+        flag = "PAYLOAD_FIELD_" + macro_name(f["name"])
+        if f.get("type") == "bool":
+            w("    if (mask & %s) { payload_put_bits(out, &pos, fields->%s ? 1 : 0, 1); }" % (flag, f["name"]))
+        else:
+            w("    if (mask & %s) { payload_put_bits(out, &pos, payload_quantize(fields->%s, %s, %s, %d, %d), %d); }"
+              % (flag, f["name"], c_float(f["min"]), c_float(f["step"]), f["max_code"], f["bits"], f["bits"]))
+    w("    return (pos + 7) / 8;")
+    w("}")
+    w("")
+    w("/*packs all the fields in PAYLOAD_CODEC_BYTES bytes of out. Returns PAYLOAD_CODEC_BYTES*/")
+    w("static inline uint8_t payload_encode(const payload_fields_t* fields, uint8_t* out) {")
+    w("    return payload_encode_mask(fields, PAYLOAD_FIELDS_ALL, out);")
+    w("}")
+    w("")
+    w("/*true if a value moved by its deadband or more from the reference, or one of them is NaN and not the other*/")
+    w("static inline bool payload_moved(float value, float reference, float deadband) {")
+    w("    if (isnan(value) || isnan(reference)) { return isnan(value) != isnan(reference); }")
+    w("    return fabsf(value - reference) >= deadband;")
+    w("}")
+    w("")
+    w("/*mask of the fields of now that moved past their deadband from ref. deadbands in field order, see payload_deadbands*/")
+    w("static inline uint8_t payload_changed(const payload_fields_t* now, const payload_fields_t* ref, const float* deadbands) {")
+    w("    uint8_t mask = 0;")
+    for i, f in enumerate(schema["fields"]):
+        flag = "PAYLOAD_FIELD_" + macro_name(f["name"])
+        if f.get("type") == "bool":
+            w("    if (now->%s != ref->%s) { mask |= %s; }" % (f["name"], f["name"], flag))
+        else:
+            w("    if (payload_moved(now->%s, ref->%s, deadbands[%d])) { mask |= %s; }"
+              % (f["name"], f["name"], i, flag))
+    w("    return mask;")
+    w("}")
+    w("")
+    w("/*copies the fields in mask from src to dst*/")
+    w("static inline void payload_merge(payload_fields_t* dst, const payload_fields_t* src, uint8_t mask) {")
+    for f in schema["fields"]:
+        w("    if (mask & PAYLOAD_FIELD_%s) { dst->%s = src->%s; }" % (macro_name(f["name"]), f["name"], f["name"]))
+    w("}")
+    w("")
+    w("#endif")
+    return "\n".join(out) + "\n"
+
+
+def field_table(schema, indent):
+    rows = []
+    for f in schema["fields"]:
+        if f.get("type") == "bool":
+            rows.append('%s{"name": "%s", "bits": 1, "bool": True},' % (indent, f["name"]))
+        else:
+            rows.append('%s{"name": "%s", "bits": %d, "min": %r, "step": %r},'
+                        % (indent, f["name"], f["bits"], float(f["min"]), float(f["step"])))
+    return "\n".join(rows)
+
+
+def gen_python(schema):
+    ports = ",\n".join('    %d: {"name": "%s", "mask_bytes": %d, "age_bytes": %d, "delta_bytes": %d, "repeat": %s}'
+                       % (p["port"], p["name"], p.get("mask_bytes", 0), p.get("age_bytes", 0),
+                          p.get("delta_bytes", 0), "True" if p.get("repeat") else "False") for p in schema["ports"])
+    return '''#!/usr/bin/env python3
+"""Decoder of the node uplinks.
+
+GENERATED by tools/codec/gen_codec.py from tools/codec/schema.json, do not edit.
+
+    python3 payload_decoder.py <port> <payload hex>
+"""
+import json
+import sys
+
+FIELDS = [
+%(fields)s
+]
+ALL_FIELDS = (1 << len(FIELDS)) - 1
+PORTS = {
+%(ports)s
+}
+
+
+def field_bytes(mask):
+    """bytes taken by the fields in mask"""
+    return (sum(f["bits"] for i, f in enumerate(FIELDS) if mask >> i & 1) + 7) // 8
+
+
+def decode_fields(data, mask=ALL_FIELDS):
+    """values of the packed fields in mask, None for the no value code"""
+    value = int.from_bytes(data[:field_bytes(mask)], "big")
+    pos = field_bytes(mask) * 8
+    out = {}
+    for i, field in enumerate(FIELDS):
+        if not mask >> i & 1:
+            continue
+        pos -= field["bits"]
+        code = (value >> pos) & ((1 << field["bits"]) - 1)
+        if field.get("bool"):
+            out[field["name"]] = bool(code)
+        elif code == (1 << field["bits"]) - 1:
+            out[field["name"]] = None
+        else:
+            out[field["name"]] = round(field["min"] + code * field["step"], 6)
+    return out
+
+
+def decode(port, data):
+    """readings of an uplink, each with its age in seconds when the frame carries one"""
+    layout = PORTS.get(port)
+    if layout is None:
+        raise ValueError("unknown port %%d" %% port)
+    pos = layout["mask_bytes"]
+    mask = int.from_bytes(data[:pos], "big") if pos else ALL_FIELDS
+    age = int.from_bytes(data[pos:pos + layout["age_bytes"]], "big") if layout["age_bytes"] else None
+    pos += layout["age_bytes"]
+    readings = []
+    while pos + layout["delta_bytes"] + field_bytes(mask) <= len(data):
+        delta = int.from_bytes(data[pos:pos + layout["delta_bytes"]], "big")
+        pos += layout["delta_bytes"]
+        reading = decode_fields(data[pos:], mask)
+        pos += field_bytes(mask)
+        if age is not None:
+            reading["age"] = None if age == 0xFFFFFFFF else age - delta
+        readings.append(reading)
+        if not layout["repeat"]:
+            break
+    return {"frame": layout["name"], "readings": readings}
+
+
+if __name__ == "__main__":
+    if len(sys.argv) != 3:
+        sys.exit(__doc__)
+    print(json.dumps(decode(int(sys.argv[1]), bytes.fromhex(sys.argv[2])), indent=2))
+''' % {"fields": field_table(schema, "    "), "ports": ports}
+
+
+def gen_js(schema):
+    fields = []
+    for f in schema["fields"]:
+        if f.get("type") == "bool":
+            fields.append('  { name: "%s", bits: 1, bool: true },' % f["name"])
+        else:
+            fields.append('  { name: "%s", bits: %d, min: %r, step: %r },'
+                          % (f["name"], f["bits"], float(f["min"]), float(f["step"])))
+    ports = "\n".join('  %d: { name: "%s", maskBytes: %d, ageBytes: %d, deltaBytes: %d, repeat: %s },'
+                      % (p["port"], p["name"], p.get("mask_bytes", 0), p.get("age_bytes", 0),
+                         p.get("delta_bytes", 0), "true" if p.get("repeat") else "false") for p in schema["ports"])
+    return '''// Payload formatter of the node uplinks (The Things Stack: Uplink, Custom Javascript formatter)
+//
+// GENERATED by tools/codec/gen_codec.py from tools/codec/schema.json, do not edit.
+
+var FIELDS = [
+%(fields)s
+];
+var ALL_FIELDS = Math.pow(2, FIELDS.length) - 1;
+var PORTS = {
+%(ports)s
+};
+
+function readUint(bytes, pos, length) {
+  var value = 0;
+  for (var i = 0; i < length; i++) {
+    value = value * 256 + bytes[pos + i];
+  }
+  return value;
+}
+
+// bytes taken by the fields in mask
+function fieldBytes(mask) {
+  var bits = 0;
+  for (var i = 0; i < FIELDS.length; i++) {
+    if ((mask >> i) & 1) {
+      bits += FIELDS[i].bits;
+    }
+  }
+  return Math.ceil(bits / 8);
+}
+
+function decodeFields(bytes, pos, mask) {
+  var out = {};
+  var bit = pos * 8;
+  for (var i = 0; i < FIELDS.length; i++) {
+    var field = FIELDS[i];
+    if (!((mask >> i) & 1)) {
+      continue;
+    }
+    var code = 0;
+    for (var b = 0; b < field.bits; b++, bit++) {
+      code = code * 2 + ((bytes[bit >> 3] >> (7 - (bit & 7))) & 1);
+    }
+    if (field.bool) {
+      out[field.name] = code === 1;
+    } else if (code === Math.pow(2, field.bits) - 1) {
+      out[field.name] = null;
+    } else {
+      out[field.name] = Math.round((field.min + code * field.step) * 1e6) / 1e6;
+    }
+  }
+  return out;
+}
+
+function decodeUplink(input) {
+  var layout = PORTS[input.fPort];
+  if (!layout) {
+    return { errors: ["unknown port " + input.fPort] };
+  }
+  var bytes = input.bytes;
+  var pos = layout.maskBytes;
+  var mask = pos ? readUint(bytes, 0, pos) : ALL_FIELDS;
+  var age = layout.ageBytes ? readUint(bytes, pos, layout.ageBytes) : null;
+  pos += layout.ageBytes;
+  var readings = [];
+  while (pos + layout.deltaBytes + fieldBytes(mask) <= bytes.length) {
+    var delta = readUint(bytes, pos, layout.deltaBytes);
+    pos += layout.deltaBytes;
+    var reading = decodeFields(bytes, pos, mask);
+    pos += fieldBytes(mask);
+    if (age !== null) {
+      reading.age = (age === 0xFFFFFFFF) ? null : age - delta;
+    }
+    readings.push(reading);
+    if (!layout.repeat) {
+      break;
+    }
+  }
+  return { data: { frame: layout.name, readings: readings } };
+}
+''' % {"fields": "\n".join(fields), "ports": ports}
+
+
+def report(schema):
+    print("%d fields in %d bits, %d bytes (CayenneLPP: %d bytes)"
+          % (len(schema["fields"]), schema["bits"], schema["bytes"], schema["lpp_bytes"]))
+    print("%-8s %8s %8s   time on air [ms] packed / CayenneLPP" % ("frame", "packed", "LPP"))
+    for port in schema["ports"]:
+        for samples in ((1, 8) if port.get("repeat") else (1,)):
+            fields = schema["fields"][:1] if port.get("mask_bytes") else None  # one field changed
+            packed = frame_bytes(schema, port, samples, fields=fields)
+            lpp = frame_bytes(schema, port, samples, lpp=True, fields=fields)
+            name = port["name"] + ("x%d" % samples if port.get("repeat") else "")
+            times = "  ".join("SF%d %6.1f/%6.1f" % (sf, airtime_ms(packed, sf), airtime_ms(lpp, sf))
+                              for sf in (7, 9, 12))
+            print("%-8s %8d %8d   %s" % (name, packed, lpp, times))
+
+
+def main():
+    schema = load_schema(os.path.join(HERE, "schema.json"))
+    outputs = {
+        os.path.join(ROOT, "include", "payload_codec.h"): gen_header(schema),
+        os.path.join(HERE, "payload_decoder.py"): gen_python(schema),
+        os.path.join(HERE, "payload_formatter.js"): gen_js(schema),
+    }
+    for path, text in outputs.items():
+        with open(path, "w") as f:
+            f.write(text)
+        print("wrote " + os.path.relpath(path, ROOT))
+    report(schema)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
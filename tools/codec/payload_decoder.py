@@ -0,0 +1,79 @@
+#!/usr/bin/env python3
+"""Decoder of the node uplinks.
+
+GENERATED by tools/codec/gen_codec.py from tools/codec/schema.json, do not edit.
+
+    python3 payload_decoder.py <port> <payload hex>
+"""
+import json
+import sys
+
+FIELDS = [
+    {"name": "oxygen", "bits": 11, "min": 0.0, "step": 0.01},
+    {"name": "gas", "bits": 13, "min": 0.0, "step": 0.1},
+    {"name": "temperature", "bits": 10, "min": -10.0, "step": 0.1},
+    {"name": "battery", "bits": 8, "min": 0.0, "step": 0.5},
+    {"name": "enclosureTemp", "bits": 10, "min": -20.0, "step": 0.1},
+    {"name": "enclosureHum", "bits": 8, "min": 0.0, "step": 0.5},
+    {"name": "vusb", "bits": 1, "bool": True},
+]
+ALL_FIELDS = (1 << len(FIELDS)) - 1
+PORTS = {
+    11: {"name": "READING", "mask_bytes": 0, "age_bytes": 0, "delta_bytes": 0, "repeat": False},
+    9: {"name": "STORED", "mask_bytes": 0, "age_bytes": 4, "delta_bytes": 0, "repeat": False},
+    10: {"name": "BATCH", "mask_bytes": 0, "age_bytes": 4, "delta_bytes": 2, "repeat": True},
+    12: {"name": "CHANGES", "mask_bytes": 1, "age_bytes": 0, "delta_bytes": 0, "repeat": False}
+}
+
+
+def field_bytes(mask):
+    """bytes taken by the fields in mask"""
+    return (sum(f["bits"] for i, f in enumerate(FIELDS) if mask >> i & 1) + 7) // 8
+
+
+def decode_fields(data, mask=ALL_FIELDS):
+    """values of the packed fields in mask, None for the no value code"""
+    value = int.from_bytes(data[:field_bytes(mask)], "big")
+    pos = field_bytes(mask) * 8
+    out = {}
+    for i, field in enumerate(FIELDS):
+        if not mask >> i & 1:
+            continue
+        pos -= field["bits"]
+        code = (value >> pos) & ((1 << field["bits"]) - 1)
+        if field.get("bool"):
+            out[field["name"]] = bool(code)
+        elif code == (1 << field["bits"]) - 1:
+            out[field["name"]] = None
+        else:
+            out[field["name"]] = round(field["min"] + code * field["step"], 6)
+    return out
+
+
+def decode(port, data):
+    """readings of an uplink, each with its age in seconds when the frame carries one"""
+    layout = PORTS.get(port)
+    if layout is None:
+        raise ValueError("unknown port %d" % port)
+    pos = layout["mask_bytes"]
+    mask = int.from_bytes(data[:pos], "big") if pos else ALL_FIELDS
+    age = int.from_bytes(data[pos:pos + layout["age_bytes"]], "big") if layout["age_bytes"] else None
+    pos += layout["age_bytes"]
+    readings = []
+    while pos + layout["delta_bytes"] + field_bytes(mask) <= len(data):
+        delta = int.from_bytes(data[pos:pos + layout["delta_bytes"]], "big")
+        pos += layout["delta_bytes"]
+        reading = decode_fields(data[pos:], mask)
+        pos += field_bytes(mask)
+        if age is not None:
+            reading["age"] = None if age == 0xFFFFFFFF else age - delta
+        readings.append(reading)
+        if not layout["repeat"]:
+            break
+    return {"frame": layout["name"], "readings": readings}
+
+
+if __name__ == "__main__":
+    if len(sys.argv) != 3:
+        sys.exit(__doc__)
+    print(json.dumps(decode(int(sys.argv[1]), bytes.fromhex(sys.argv[2])), indent=2))
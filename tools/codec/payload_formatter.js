@@ -0,0 +1,89 @@
+// Payload formatter of the node uplinks (The Things Stack: Uplink, Custom Javascript formatter)
+//
+// GENERATED by tools/codec/gen_codec.py from tools/codec/schema.json, do not edit.
+
+var FIELDS = [
+  { name: "oxygen", bits: 11, min: 0.0, step: 0.01 },
+  { name: "gas", bits: 13, min: 0.0, step: 0.1 },
+  { name: "temperature", bits: 10, min: -10.0, step: 0.1 },
+  { name: "battery", bits: 8, min: 0.0, step: 0.5 },
+  { name: "enclosureTemp", bits: 10, min: -20.0, step: 0.1 },
+  { name: "enclosureHum", bits: 8, min: 0.0, step: 0.5 },
+  { name: "vusb", bits: 1, bool: true },
+];
+var ALL_FIELDS = Math.pow(2, FIELDS.length) - 1;
+var PORTS = {
+  11: { name: "READING", maskBytes: 0, ageBytes: 0, deltaBytes: 0, repeat: false },
+  9: { name: "STORED", maskBytes: 0, ageBytes: 4, deltaBytes: 0, repeat: false },
+  10: { name: "BATCH", maskBytes: 0, ageBytes: 4, deltaBytes: 2, repeat: true },
+  12: { name: "CHANGES", maskBytes: 1, ageBytes: 0, deltaBytes: 0, repeat: false },
+};
+
+function readUint(bytes, pos, length) {
+  var value = 0;
+  for (var i = 0; i < length; i++) {
+    value = value * 256 + bytes[pos + i];
+  }
+  return value;
+}
+
+// bytes taken by the fields in mask
+function fieldBytes(mask) {
+  var bits = 0;
+  for (var i = 0; i < FIELDS.length; i++) {
+    if ((mask >> i) & 1) {
+      bits += FIELDS[i].bits;
+    }
+  }
+  return Math.ceil(bits / 8);
+}
+
+function decodeFields(bytes, pos, mask) {
+  var out = {};
+  var bit = pos * 8;
+  for (var i = 0; i < FIELDS.length; i++) {
+    var field = FIELDS[i];
+    if (!((mask >> i) & 1)) {
+      continue;
+    }
+    var code = 0;
+    for (var b = 0; b < field.bits; b++, bit++) {
+      code = code * 2 + ((bytes[bit >> 3] >> (7 - (bit & 7))) & 1);
+    }
+    if (field.bool) {
+      out[field.name] = code === 1;
+    } else if (code === Math.pow(2, field.bits) - 1) {
+      out[field.name] = null;
+    } else {
+      out[field.name] = Math.round((field.min + code * field.step) * 1e6) / 1e6;
+    }
+  }
+  return out;
+}
+
+function decodeUplink(input) {
+  var layout = PORTS[input.fPort];
+  if (!layout) {
+    return { errors: ["unknown port " + input.fPort] };
+  }
+  var bytes = input.bytes;
+  var pos = layout.maskBytes;
+  var mask = pos ? readUint(bytes, 0, pos) : ALL_FIELDS;
+  var age = layout.ageBytes ? readUint(bytes, pos, layout.ageBytes) : null;
+  pos += layout.ageBytes;
+  var readings = [];
+  while (pos + layout.deltaBytes + fieldBytes(mask) <= bytes.length) {
+    var delta = readUint(bytes, pos, layout.deltaBytes);
+    pos += layout.deltaBytes;
+    var reading = decodeFields(bytes, pos, mask);
+    pos += fieldBytes(mask);
+    if (age !== null) {
+      reading.age = (age === 0xFFFFFFFF) ? null : age - delta;
+    }
+    readings.push(reading);
+    if (!layout.repeat) {
+      break;
+    }
+  }
+  return { data: { frame: layout.name, readings: readings } };
+}